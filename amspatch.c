@@ -65,17 +65,21 @@ static uint32_t GetAMSTrapBFunction (uint32_t idx) {
     return GetLong(TrapBFunctions + 6 * idx);
 }
 
+//! Get address of the frame of AMS, i.e. OO_SYSTEM_FRAME when no localization is installed.
+static uint32_t GetAMSFrame (void) {
+    if (AMS_Frame == 0) {
+        AMS_Frame = GetLong(GetAMSVector(0xA8) + 10);
+    }
+    return AMS_Frame;
+}
+
 //! Get attribute in OO_SYSTEM_FRAME.
 static uint32_t GetAMSAttribute (uint32_t attr) {
     uint32_t temp;
     uint32_t temp2;
     int32_t limit;
     
-    if (AMS_Frame == 0) {
-        temp = GetAMSVector(0xA8);
-        AMS_Frame = GetLong(temp + 10);
-    }
-    Seek(AMS_Frame + 0x0E);
+    Seek(GetAMSFrame() + 0x0E);
     limit = ReadLong();
     while (limit >= 0) {
         temp = ReadLong();
@@ -88,11 +92,234 @@ static uint32_t GetAMSAttribute (uint32_t attr) {
     return UINT32_C(0xFFFFFFFF);
 }
 
+//! Build the cross-reference index of the basecode on first use. The entry points are the exception vectors and the ROM_CALLs.
+static int GetAMSXrefs (void) {
+    uint32_t *entries;
+    uint32_t i, n = 0;
+    int ret;
+
+    if (Xrefs != NULL) {
+        return 0;
+    }
+    entries = (uint32_t *)malloc((0x100 / 4 + TIOS_entries) * sizeof(uint32_t));
+    if (!entries) {
+        printf("\n    ERROR : not enough memory.\n");
+        return 1;
+    }
+    for (i = 4; i < 0x100; i += 4) {
+        entries[n++] = GetAMSVector(i);
+    }
+    for (i = 0; i < TIOS_entries; i++) {
+        entries[n++] = rom_call_addr(i);
+    }
+    ret = BuildXrefIndex(ROM_base + UINT32_C(0x12000), BasecodeEnd() - BASECODE_TAIL_SIZE, entries, n);
+    free(entries);
+    return ret;
+}
+
+//! Get the index of the ROM_CALL at given address, or 0xFFFFFFFF if there is none.
+static uint32_t GetAMSrom_callIndex (uint32_t absaddr) {
+    uint32_t i;
+
+    for (i = 0; i < TIOS_entries; i++) {
+        if (rom_call_addr(i) == absaddr) {
+            return i;
+        }
+    }
+    return UINT32_C(0xFFFFFFFF);
+}
+
+//! Make the ROM_CALL, and the calls and jumps to it in the basecode, use a new implementation at newaddr.
+//  Unless the new implementation falls back to the old one (keepold), the old entry point jumps to the new one,
+//  for the references which cannot be retargeted.
+static void RedirectAMSrom_call (uint32_t idx, uint32_t newaddr, int keepold) {
+    uint32_t i, old, retargeted = 0;
+
+    old = rom_call_addr(idx);
+    SetAMSrom_call(idx, newaddr);
+    if (!keepold) {
+        Seek(old);
+        WriteShort(0x4EF9);
+        WriteLong(newaddr);
+    }
+    if (!GetAMSXrefs()) {
+        for (i = FindXref(old); i < NbXrefs && Xrefs[i].target == old; i++) {
+            if (Xrefs[i].kind == XREF_CALL || Xrefs[i].kind == XREF_JUMP) {
+                retargeted += RetargetXref(&Xrefs[i], newaddr);
+            }
+        }
+    }
+    printf("    ROM_CALL %03" PRIX32 " moved from %06" PRIX32 " to %06" PRIX32 ", %" PRIu32 " internal references retargeted\n", idx, old, newaddr, retargeted);
+}
+
+//! Find the RAM variable which points to OO_SYSTEM_FRAME, i.e. the head of the chain of system frames, where language
+//  localizations hook themselves. It is initialized by a move.l #AMS_Frame,(xxx) instruction. Return 0 if not found.
+static uint32_t GetAMSSystemFramePointer (void) {
+    uint32_t i, frame, var, result = 0;
+    uint16_t op;
+
+    frame = GetAMSFrame();
+    if (GetAMSXrefs()) {
+        return 0;
+    }
+    for (i = FindXref(frame); i < NbXrefs && Xrefs[i].target == frame; i++) {
+        op = M68kShort(Xrefs[i].site);
+        if (op == 0x21FC) {
+            var = (uint32_t)(int32_t)(int16_t)M68kShort(Xrefs[i].site + 6);
+        }
+        else if (op == 0x23FC) {
+            var = M68kLong(Xrefs[i].site + 6);
+        }
+        else {
+            continue;
+        }
+        if (result != 0 && result != var) {
+            return 0;
+        }
+        result = var;
+    }
+    return result;
+}
+
+//! Recognize the scaling of a handle by 4 in dn at absaddr, as done by the inline copies of HeapDeref.
+//  Return the length of the instruction(s), 0 if none, and store their duration in cycles.
+static uint32_t GetHeapDerefScaling (uint32_t absaddr, uint32_t n, uint32_t *cycles) {
+    uint16_t op;
+
+    if (absaddr < M68kCodeStart || !XrefIsVisited(absaddr)) {
+        return 0;
+    }
+    op = M68kShort(absaddr);
+    if (op == (0xC0FC | (n << 9)) && M68kShort(absaddr + 2) == 4) {
+        *cycles = 44; // mulu.w #4,dn
+        return 4;
+    }
+    if (op == (0xE588 | n) || op == (0xE580 | n)) {
+        *cycles = 12; // lsl.l #2,dn / asl.l #2,dn
+        return 2;
+    }
+    if (op == (0xD080 | (n << 9) | n) && M68kShort(absaddr + 2) == op) {
+        *cycles = 16; // add.l dn,dn; add.l dn,dn
+        return 4;
+    }
+    return 0;
+}
+
+//! Rewrite the inline copies of HeapDeref, i.e. the sequences
+//      <scaling of dn>; movea.l (heapptr),am; movea.l 0(am,dn.l),ak
+//  (the scaling may also come after the movea.l), to the AMS 1.xx-style code of the rewritten HeapDeref:
+//      lsl.w #2,dn; movea.l (heapptr).w,am; movea.l 0(am,dn.w),ak
+//  padded with NOPs. Like the rewritten HeapDeref, this assumes that handles are lower than 0x2000.
+//  It also leaves a different value in dn, so the sequences after which dn is not provably dead are left alone.
+static void RewriteInlineHeapDerefs (uint32_t heapptr) {
+    uint32_t i, site, start, end, n, m, k, plen, slen, scycles, oldcycles, newcycles, newlen, pad, saved;
+    uint32_t converted = 0, live = 0, minsaved = UINT32_C(0xFFFFFFFF), maxsaved = 0, totalsaved = 0;
+    uint16_t op, ext;
+
+    if (GetAMSXrefs()) {
+        return;
+    }
+
+    for (i = FindXref(heapptr); i < NbXrefs && Xrefs[i].target == heapptr; i++) {
+        site = Xrefs[i].site;
+        op = M68kShort(site);
+        if ((op & 0xF1FE) != 0x2078) {
+            continue;
+        }
+        m = (op >> 9) & 7;
+        plen = (op & 1) ? 6 : 4;
+
+        // The dereference follows the movea.l, possibly after the scaling; otherwise, the scaling precedes the movea.l.
+        for (slen = 0; slen <= 4; slen += 2) {
+            op = M68kShort(site + plen + slen);
+            ext = M68kShort(site + plen + slen + 2);
+            if ((op & 0xF1FF) == (0x2070 | m) && (ext & 0x8FFF) == 0x0800) {
+                break;
+            }
+        }
+        if (slen > 4) {
+            continue;
+        }
+        n = (ext >> 12) & 7;
+        k = (op >> 9) & 7;
+        end = site + plen + slen + 4;
+        if (slen != 0) {
+            start = site;
+            if (GetHeapDerefScaling(site + plen, n, &scycles) != slen) {
+                continue;
+            }
+        }
+        else {
+            slen = GetHeapDerefScaling(site - 4, n, &scycles);
+            if (slen != 4) {
+                slen = GetHeapDerefScaling(site - 2, n, &scycles);
+                if (slen != 2) {
+                    continue;
+                }
+            }
+            start = site - slen;
+        }
+
+        // No jumps into the middle of the sequence, and dn must not be used afterwards.
+        for (pad = start + 2; pad < end; pad += 2) {
+            if (XrefIsVisited(pad) && IsXrefJumpTarget(pad)) {
+                break;
+            }
+        }
+        if (pad < end) {
+            continue;
+        }
+        if (!M68kDnIsDead(end, n)) {
+            live++;
+            continue;
+        }
+
+        Seek(start);
+        WriteShort(0xE548 | n);
+        if (heapptr < 0x8000) {
+            WriteShort(0x2078 | (m << 9));
+            WriteShort(heapptr);
+            newcycles = 10 + 16 + 18;
+            newlen = 10;
+        }
+        else {
+            WriteShort(0x2079 | (m << 9));
+            WriteLong(heapptr);
+            newcycles = 10 + 20 + 18;
+            newlen = 12;
+        }
+        WriteShort(0x2070 | (k << 9) | m);
+        WriteShort(n << 12);
+        // At most 4 bytes of padding: NOPs are faster than a bra.s.
+        for (pad = end - start - newlen; pad > 0; pad -= 2) {
+            WriteShort(0x4E71);
+            newcycles += 4;
+        }
+
+        oldcycles = scycles + (plen == 4 ? 16 : 20) + 18;
+        saved = oldcycles - newcycles;
+        converted++;
+        totalsaved += saved;
+        if (saved < minsaved) {
+            minsaved = saved;
+        }
+        if (saved > maxsaved) {
+            maxsaved = saved;
+        }
+    }
+
+    printf("Rewrote %" PRIu32 " inline HeapDeref sequences (%" PRIu32 " left alone: index register used afterwards)\n", converted, live);
+    if (converted) {
+        printf("    %" PRIu32 " to %" PRIu32 " cycles saved per site, %" PRIu32 " in total\n", minsaved, maxsaved, totalsaved);
+    }
+}
+
 
 //! Kill the protections set by TI.
 static void UnlockAMS(void) {
     uint32_t temp, temp2;
 
+    BeginSection("1a");
     // 1a) Hard-code HW2/3Patch: disable RAM execution protection.
     {
         temp = rom_call_addr(EX_stoBCD);
@@ -104,6 +331,7 @@ static void UnlockAMS(void) {
     }
 
 
+    BeginSection("1b");
     // 1b) Disable Flash execution protection:
     //         * on HW2+, by setting a higher value in port 700012;
     //         * on HW1, by turning reads from three stealth I/O ranges to writes to those ranges.
@@ -128,6 +356,7 @@ static void UnlockAMS(void) {
     }
 
 
+    BeginSection("1c");
     // 1c) Hard-code a change equivalent to MaxMem and XPand: don't call the subroutine EM_GetArchiveMemoryBeginning
     //     calls before returning, after rounding up the result of OO_GetEndOfAllFlashApps, that both MaxMem and XPand modify.
     {
@@ -142,6 +371,7 @@ static void UnlockAMS(void) {
     }
 
 
+    BeginSection("1d");
     // 1d) Hard-code Flashappy, for seamless install of unsigned FlashApps (e.g. some versions of GTC).
     {
         Seek(ROM_base + UINT32_C(0x20000));
@@ -162,6 +392,7 @@ static void UnlockAMS(void) {
     }
 
 
+    BeginSection("1e");
     // 1e) Disable artificial limitation of the size of ASM programs on AMS 2.xx
     //     (TI made the check ineffective in 3.xx, without removing it...).
     {
@@ -184,6 +415,7 @@ static void UnlockAMS(void) {
     }
 
 
+    BeginSection("1f");
     // 1f) Remove "Invalid Program Reference" artificial limitation.
     {
         Seek(ROM_base + UINT32_C(0x20000));
@@ -207,13 +439,17 @@ static void OptimizeAMS(void) {
     uint32_t offset, limit;
     uint32_t temp, temp2, temp3, temp4, temp5;
 
-    // 2a) Rewrite HeapDeref
+    BeginSection("2a");
+    // 2a) Rewrite HeapDeref, and optionally its inline copies.
     {
         temp = rom_call_addr(HeapDeref);
         temp2 = GetShort(temp + 0x0A);
         if (temp2 == 0) {
             temp2 = GetShort(temp + 0x0C);
         }
+        if (enabled_changes & AMS_REWRITE_INLINE_HEAPDEREF_FLAG) {
+            RewriteInlineHeapDerefs(temp2);
+        }
         printf("Optimizing HeapDeref at %06" PRIX32 "\n", temp);
         Seek(temp);
         WriteLong(UINT32_C(0x302F0004));
@@ -231,6 +467,7 @@ static void OptimizeAMS(void) {
     }
 
 
+    BeginSection("2b");
     // 2b) Hard-code OO_GetAttr(OO_SYSTEM_FRAME, OO_(S|L|H)FONT) into the subroutine of DrawStr/DrawChar/DrawClipChar.
     if (enabled_changes & AMS_HARDCODE_FONTS_FLAG)
     {
@@ -264,6 +501,7 @@ static void OptimizeAMS(void) {
     }
 
 
+    BeginSection("2c");
     // 2c) Hard-code OO_GetAttr(OO_SYSTEM_FRAME, OO_SFONT) in rewritten sf_width.
     if (enabled_changes & AMS_HARDCODE_FONTS_FLAG)
     {
@@ -283,59 +521,94 @@ static void OptimizeAMS(void) {
     }
 
 
+    BeginSection("2d");
     // 2d) Hard-code English language in XR_stringPtr.
     // WARNING, language localizations won't work properly after this...
-    if (enabled_changes & AMS_HARDCODE_ENGLISH_LANGUAGE_FLAG)
+    //     Alternatively, use the English strings of the AMS frame only while no localization hooks itself on
+    //     OO_SYSTEM_FRAME: the RAM pointer to the system frame tells whether one does, for the price of a cmpi.l.
+    if (enabled_changes & (AMS_HARDCODE_ENGLISH_LANGUAGE_FLAG | AMS_FAST_XR_STRINGPTR_FLAG))
     {
         temp = rom_call_addr(XR_stringPtr);
-        temp2 = GetLong(AMS_Frame + 0x04);
+        temp2 = GetLong(GetAMSFrame() + 0x04);
         limit = GetLong(temp2 + 0x0E);
         temp3 = rom_call_addr(EV_runningApp);
         temp4 = rom_call_addr(HeapTable);
         temp5 = rom_call_addr(OO_CondGetAttr);
+        offset = 0;
 
-
-        printf("Optimizing XR_stringPtr at %06" PRIX32 "\n", temp);
-        Seek(temp);
-        WriteLong(UINT32_C(0x302F0006)); // WriteLong(0x202F0004);
-        WriteShort(0x0C40); // WriteShort(0x0C80); 
-        WriteShort(limit); // WriteLong(limit);
-        WriteShort(0x620E);
-        WriteShort(0x41F9);
-        WriteLong(temp2);
-        WriteShort(0xE548);
-        WriteLong(UINT32_C(0x20700012)); // WriteLong(0x2070812);
-        WriteShort(0x4E75);
-        
-        WriteShort(0x42A7);
-        WriteShort(0x4857);
-        WriteLong(UINT32_C(0x06400800));
-        WriteShort(0x3F00);
-        WriteShort(0x4267);
-        if (temp3 < 0x8000) {
-            WriteShort(0x3238);
-            WriteShort(temp3);
-        }
-        else {
-            WriteShort(0x3239);
-            WriteLong(temp3);
-        }
-        if (temp4 < 0x8000) {
-            WriteShort(0x41F8);
-            WriteShort(temp4);
+        if (!(enabled_changes & AMS_HARDCODE_ENGLISH_LANGUAGE_FLAG)) {
+            // The checking version is larger than XR_stringPtr, it goes to free ROM space.
+            offset = GetAMSSystemFramePointer();
+            temp = 0;
+            if (offset != 0) {
+                temp = AllocROMSpace(84, 2);
+            }
+            else {
+                printf("Unexpected data, skipping the optimization of XR_stringPtr !\n");
+            }
         }
-        else {
+
+        if (temp != 0) {
+            printf("Optimizing XR_stringPtr at %06" PRIX32 "\n", temp);
+            Seek(temp);
+            WriteLong(UINT32_C(0x302F0006)); // WriteLong(0x202F0004);
+            if (offset != 0) {
+                if (offset < 0x8000) {
+                    WriteShort(0x0CB8);
+                    WriteLong(AMS_Frame);
+                    WriteShort(offset);
+                }
+                else {
+                    WriteShort(0x0CB9);
+                    WriteLong(AMS_Frame);
+                    WriteLong(offset);
+                }
+                WriteShort(0x6614);
+            }
+            WriteShort(0x0C40); // WriteShort(0x0C80); 
+            WriteShort(limit); // WriteLong(limit);
+            WriteShort(0x620E);
             WriteShort(0x41F9);
-            WriteLong(temp4);
+            WriteLong(temp2);
+            WriteShort(0xE548);
+            WriteLong(UINT32_C(0x20700012)); // WriteLong(0x2070812);
+            WriteShort(0x4E75);
+        
+            WriteShort(0x42A7);
+            WriteShort(0x4857);
+            WriteLong(UINT32_C(0x06400800));
+            WriteShort(0x3F00);
+            WriteShort(0x4267);
+            if (temp3 < 0x8000) {
+                WriteShort(0x3238);
+                WriteShort(temp3);
+            }
+            else {
+                WriteShort(0x3239);
+                WriteLong(temp3);
+            }
+            if (temp4 < 0x8000) {
+                WriteShort(0x41F8);
+                WriteShort(temp4);
+            }
+            else {
+                WriteShort(0x41F9);
+                WriteLong(temp4);
+            }
+            WriteShort(0xE549);
+            WriteLong(UINT32_C(0x20701000));
+            WriteLong(UINT32_C(0x2F280014));
+            WriteShort(0x4EB9);
+            WriteLong(temp5);
+            WriteLong(UINT32_C(0x4FEF000C));
+            WriteShort(0x205F);
+            WriteShort(0x4E75);
+
+            if (offset != 0) {
+                FreeROMSpace(Tell(), temp + 84);
+                RedirectAMSrom_call(XR_stringPtr, temp, 0);
+            }
         }
-        WriteShort(0xE549);
-        WriteLong(UINT32_C(0x20701000));
-        WriteLong(UINT32_C(0x2F280014));
-        WriteShort(0x4EB9);
-        WriteLong(temp5);
-        WriteLong(UINT32_C(0x4FEF000C));
-        WriteShort(0x205F);
-        WriteShort(0x4E75);
     }
 }
 
@@ -344,12 +617,14 @@ static void OptimizeAMS(void) {
 static void FixAMS(void) {
     uint32_t temp, temp2, temp3, temp4;
     
+    BeginSection("3a");
     // 3a) Idea by Martial Demolins (Folco): on trap #3, wire a new routine that does a UniOS/PreOS/PedroM-style HeapDeref.
     //     Pristine AMS copies have OSenqueue wired, but that won't work at all.
+    temp2 = AllocROMSpace(14, 2);
+    if (temp2 != 0)
     {
-        printf("Replacing buggy trap #3 by UniOS/PreOS/PedroM-style HeapDeref\n");
+        printf("Replacing buggy trap #3 by UniOS/PreOS/PedroM-style HeapDeref at %06" PRIX32 "\n", temp2);
         temp = rom_call_addr(HeapTable);
-        temp2 = ROM_base + 0x13100;
         Seek(temp2);
         WriteShort(0xD0C8);
         WriteShort(0xD0C8);
@@ -363,9 +638,11 @@ static void FixAMS(void) {
         }
         WriteShort(0x2050);
         WriteShort(0x4E73);
+        FreeROMSpace(Tell(), temp2 + 14);
         SetAMSVector(0x8C, temp2);
     }
 
+    BeginSection("3b");
     // 3b) Fix bug #53 of http://www.technicalc.org/buglist/bugs.pdf , worked around in TIGCC & GCC4TI:
     //     OSContrastUp and OSContrastDn destroy the contents of registers d3 and d4, which they are not allowed to do.
     {
@@ -393,6 +670,7 @@ static void FixAMS(void) {
         }
     }
 
+    BeginSection("3c");
     // 3c) Fix the bug that can occur when changing batteries (HW3Patch fixes it).
     {
         temp = GetAMSVector(0xAC);
@@ -408,6 +686,7 @@ static void FixAMS(void) {
         printf("Fixing bug that can occur when changing batteries at %06" PRIX32 "\n", temp2);
     }
 
+    BeginSection("3d");
     // 3d) Revert 0^0 to pre-3.10 behavior (1 with a warning instead of undef), by RANDY Compton
     if ((enabled_changes & AMS_REVERT_ZERO_POWER_ZERO_FLAG) && AMS_Major == 3 && AMS_Minor == 10) {
         temp = rom_call_addr(push_zstr);
@@ -443,458 +722,4250 @@ static void FixAMS(void) {
 }
 
 
-//! Shrink two AMS versions that are just slightly too large and deprive users from 64 KB of archive memory available on older versions...
-static void ShrinkAMS(void) {
-    uint8_t buffer[256];
-    uint32_t temp;
-    uint32_t src;
-    uint32_t dest;
+// Data at the end of AMS 2.08 for 89, which can be moved elsewhere.
+static const MovableBlock AMS208_89_Blocks[] = {
+    {UINT32_C(0x33FEE0), 10, {UINT32_C(0x237362), 0}, {{0, 0}, {0, 0}}}, // BITMAP( 5, 5) referenced by GD_Eraser.
+    {UINT32_C(0x33FEEA), 10, {UINT32_C(0x237368), 0}, {{0, 0}, {0, 0}}}, // BITMAP( 5, 5) referenced by GD_Eraser.
+    {UINT32_C(0x33FEF4), 26, {UINT32_C(0x2A8B06), 0}, {{0, 0}, {0, 0}}}, // BITMAP( B, B) referenced by GT_WinCursor.
+    {UINT32_C(0x33FF0E),  8, {UINT32_C(0x2A8B1C), 0}, {{0, 0}, {0, 0}}}, // BITMAP( 3, 3) referenced by GT_WinCursor.
+    {UINT32_C(0x33FF16), 10, {UINT32_C(0x2A8B32), 0}, {{0, 0}, {0, 0}}}, // BITMAP( 5, 3) referenced by GT_WinCursor.
+    {UINT32_C(0x33FF20), 10, {UINT32_C(0x2A8B48), 0}, {{0, 0}, {0, 0}}}, // BITMAP( 5, 3) referenced by GT_WinCursor.
+    // BITMAP( 5, 5) referenced by a pointer in an array.
+    // It is the same value as the first BITMAP referenced by GD_Eraser, so MoveBlocks folds it away.
+    {UINT32_C(0x33FF2A), 10, {UINT32_C(0x2B97E8), 0}, {{0, 0}, {0, 0}}},
+    {UINT32_C(0x33FF34), 10, {UINT32_C(0x2B97EC), 0}, {{0, 0}, {0, 0}}}, // BITMAP( 5, 5) referenced by a pointer in an array.
+    {UINT32_C(0x33FF3E), 10, {UINT32_C(0x2B97F0), UINT32_C(0x2A8AEE)}, {{0, 0}, {0, 0}}}, // BITMAP( 5, 5) referenced by a pointer in an array and GT_WinCursor.
+    {UINT32_C(0x33FF48), 10, {UINT32_C(0x2B97F8), 0}, {{0, 0}, {0, 0}}}, // BITMAP( 5, 5) referenced by a pointer in an array.
+    {UINT32_C(0x33FF52), 10, {UINT32_C(0x2B97F4), 0}, {{0, 0}, {0, 0}}}, // BITMAP( 5, 5) referenced by a pointer in an array.
+    {UINT32_C(0x33FF5C), 68, {UINT32_C(0x2A8B5C), 0}, {{0, 0}, {0, 0}}}, // BITMAP(15,15) referenced by GT_WinCursor.
+    {UINT32_C(0x33FFA0), 12, {UINT32_C(0x2A8B76), 0}, {{0, 0}, {0, 0}}}, // BITMAP( 7, 7) referenced by GT_WinCursor.
+    {UINT32_C(0x33FFAC), 16, {UINT32_C(0x2B97FC), 0}, {{0, 0}, {0, 0}}}, // BITMAP( 6, B) referenced by a pointer in an array.
+    {UINT32_C(0x33FFBC), 16, {UINT32_C(0x2B9800), 0}, {{0, 0}, {0, 0}}}, // BITMAP( 6, B) referenced by a pointer in an array.
+    {UINT32_C(0x33FFCC), 16, {UINT32_C(0x2B9804), 0}, {{0, 0}, {0, 0}}}, // BITMAP( 6, B) referenced by a pointer in an array.
+    {UINT32_C(0x33FFDC), 16, {UINT32_C(0x2B9808), 0}, {{0, 0}, {0, 0}}}, // BITMAP( 6, B) referenced by a pointer in an array.
+    {UINT32_C(0x33FFEC), 16, {UINT32_C(0x2B980C), 0}, {{0, 0}, {0, 0}}}, // BITMAP( 6, B) referenced by a pointer in an array.
+    {UINT32_C(0x33FFFC),  8, {0, 0}, {{0, 0}, {0, 0}}}, // BITMAP( 3, 3) without any absolute references... 3x3 O / box
+    {UINT32_C(0x340004),  8, {0, 0}, {{0, 0}, {0, 0}}}, // BITMAP( 3, 3) without any absolute references... 3x3 +
+    {UINT32_C(0x34000C),  8, {0, 0}, {{0, 0}, {0, 0}}}, // BITMAP( 3, 3) without any absolute references... a dot in the middle
+    {UINT32_C(0x340014),  8, {0, 0}, {{0, 0}, {0, 0}}}, // BITMAP( 3, 3) without any absolute references... 3x3 X
+    // 34001C: basecode checksum, followed by the end signature.
+};
+
+// Data at the end of AMS 2.09 for 89, which can be moved elsewhere.
+static const MovableBlock AMS209_89_Blocks[] = {
+    {UINT32_C(0x33FFB0),  90, {UINT32_C(0x2F5DD2), 0}, {{ 0,  0}, {  0,  0}}}, // TITABLED menu.
+    {UINT32_C(0x34000A), 126, {UINT32_C(0x2F7FE8), 0}, {{16, 38}, {  0,  0}}}, // Table formats dialog. Needs patching.
+    {UINT32_C(0x340088), 150, {UINT32_C(0x2F870A), 0}, {{40, 86}, { 52, 118}}}, // Table setup dialog. Needs patching.
+    // "WARNING - Graph screen size unknown, so Graph <-> Table setting not supported" dialog. Does not need patching.
+    {UINT32_C(0x34011E),  38, {UINT32_C(0x2FA8D8), 0}, {{ 0,  0}, {  0,  0}}},
+    {UINT32_C(0x340144), 128, {UINT32_C(0x224312), 0}, {{ 0,  0}, {  0,  0}}}, // TITEXTED menu.
+    {UINT32_C(0x3401C4),  10, {UINT32_C(0x237362), 0}, {{ 0,  0}, {  0,  0}}}, // BITMAP( 5, 5) referenced by GD_Eraser.
+    {UINT32_C(0x3401CE),  10, {UINT32_C(0x237368), 0}, {{ 0,  0}, {  0,  0}}}, // BITMAP( 5, 5) referenced by GD_Eraser.
+    {UINT32_C(0x3401D8),  26, {UINT32_C(0x2A8CCE), 0}, {{ 0,  0}, {  0,  0}}}, // BITMAP( B, B) referenced by GT_WinCursor.
+    {UINT32_C(0x3401F2),   8, {UINT32_C(0x2A8CE4), 0}, {{ 0,  0}, {  0,  0}}}, // BITMAP( 3, 3) referenced by GT_WinCursor.
+    {UINT32_C(0x3401FA),  10, {UINT32_C(0x2A8CFA), 0}, {{ 0,  0}, {  0,  0}}}, // BITMAP( 5, 3) referenced by GT_WinCursor.
+    {UINT32_C(0x340204),  10, {UINT32_C(0x2A8D10), 0}, {{ 0,  0}, {  0,  0}}}, // BITMAP( 5, 3) referenced by GT_WinCursor.
+    // BITMAP( 5, 5) referenced by a pointer in an array.
+    // It is the same value as the first BITMAP referenced by GD_Eraser, so MoveBlocks folds it away.
+    {UINT32_C(0x34020E),  10, {UINT32_C(0x2B99B0), 0}, {{ 0,  0}, {  0,  0}}},
+    {UINT32_C(0x340218),  10, {UINT32_C(0x2B99B4), 0}, {{ 0,  0}, {  0,  0}}}, // BITMAP( 5, 5) referenced by a pointer in an array.
+    {UINT32_C(0x340222),  10, {UINT32_C(0x2B99B8), UINT32_C(0x2A8CB6)}, {{ 0,  0}, {  0,  0}}}, // BITMAP( 5, 5) referenced by a pointer in an array and GT_WinCursor.
+    {UINT32_C(0x34022C),  10, {UINT32_C(0x2B99C0), 0}, {{ 0,  0}, {  0,  0}}}, // BITMAP( 5, 5) referenced by a pointer in an array.
+    {UINT32_C(0x340236),  10, {UINT32_C(0x2B99BC), 0}, {{ 0,  0}, {  0,  0}}}, // BITMAP( 5, 5) referenced by a pointer in an array.
+    {UINT32_C(0x340240),  68, {UINT32_C(0x2A8D24), 0}, {{ 0,  0}, {  0,  0}}}, // BITMAP(15,15) referenced by GT_WinCursor.
+    {UINT32_C(0x340284),  12, {UINT32_C(0x2A8D3E), 0}, {{ 0,  0}, {  0,  0}}}, // BITMAP( 7, 7) referenced by GT_WinCursor.
+    {UINT32_C(0x340290),  16, {UINT32_C(0x2B99C4), 0}, {{ 0,  0}, {  0,  0}}}, // BITMAP( 6, B) referenced by a pointer in an array.
+    {UINT32_C(0x3402A0),  16, {UINT32_C(0x2B99C8), 0}, {{ 0,  0}, {  0,  0}}}, // BITMAP( 6, B) referenced by a pointer in an array.
+    {UINT32_C(0x3402B0),  16, {UINT32_C(0x2B99CC), 0}, {{ 0,  0}, {  0,  0}}}, // BITMAP( 6, B) referenced by a pointer in an array.
+    {UINT32_C(0x3402C0),  16, {UINT32_C(0x2B99D0), 0}, {{ 0,  0}, {  0,  0}}}, // BITMAP( 6, B) referenced by a pointer in an array.
+    {UINT32_C(0x3402D0),  16, {UINT32_C(0x2B99D4), 0}, {{ 0,  0}, {  0,  0}}}, // BITMAP( 6, B) referenced by a pointer in an array.
+    {UINT32_C(0x3402E0),   8, {0, 0}, {{ 0,  0}, {  0,  0}}}, // BITMAP( 3, 3) without any absolute references... 3x3 O / box
+    {UINT32_C(0x3402E8),   8, {0, 0}, {{ 0,  0}, {  0,  0}}}, // BITMAP( 3, 3) without any absolute references... 3x3 +
+    {UINT32_C(0x3402F0),   8, {0, 0}, {{ 0,  0}, {  0,  0}}}, // BITMAP( 3, 3) without any absolute references... a dot in the middle
+    {UINT32_C(0x3402F8),   8, {0, 0}, {{ 0,  0}, {  0,  0}}}, // BITMAP( 3, 3) without any absolute references... 3x3 X
+    // 340300: basecode checksum, followed by the end signature.
+};
+
+#define NB_BLOCKS(blocks) (sizeof(blocks) / sizeof(blocks[0]))
 
-    // 4a) Shrink AMS 2.08 and 2.09 for 89.
+
+//! Get the list of data blocks at the end of this AMS version which can be moved elsewhere.
+static const MovableBlock * GetAMSMovableBlocks (uint32_t *n) {
     if (I == 11 && CalculatorType == TI89) {
-        src  = UINT32_C(0x33FEE0);
-        dest = UINT32_C(0x214000);
-        temp = dest;
-
-        printf("Shrinking AMS 2.08 for 89, to make it fit into the same number of sectors as earlier AMS 2.xx versions...");
-        // 33FEE0: 10 bytes: BITMAP( 5, 5) referenced by GD_Eraser.
-        GetNBytes(buffer, 10, src);
-        PutNBytes(buffer, 10, dest);
-        PutLong(dest, UINT32_C(0x237362));
-        src += 10, dest += 10;
-        // 33FEEA: 10 bytes: BITMAP( 5, 5) referenced by GD_Eraser.
-        GetNBytes(buffer, 10, src);
-        PutNBytes(buffer, 10, dest);
-        PutLong(dest, UINT32_C(0x237368));
-        src += 10, dest += 10;
-        // 33FEF4: 26 bytes: BITMAP( B, B) referenced by GT_WinCursor.
-        GetNBytes(buffer, 26, src);
-        PutNBytes(buffer, 26, dest);
-        PutLong(dest, UINT32_C(0x2A8B06));
-        src += 26, dest += 26;
-        // 33FF0E:  8 bytes: BITMAP( 3, 3) referenced by GT_WinCursor.
-        GetNBytes(buffer, 8, src);
-        PutNBytes(buffer, 8, dest);
-        PutLong(dest, UINT32_C(0x2A8B1C));
-        src += 8, dest += 8;
-        // 33FF16: 10 bytes: BITMAP( 5, 3) referenced by GT_WinCursor.
-        GetNBytes(buffer, 10, src);
-        PutNBytes(buffer, 10, dest);
-        PutLong(dest, UINT32_C(0x2A8B32));
-        src += 10, dest += 10;
-        // 33FF20: 10 bytes: BITMAP( 5, 3) referenced by GT_WinCursor.
-        GetNBytes(buffer, 10, src);
-        PutNBytes(buffer, 10, dest);
-        PutLong(dest, UINT32_C(0x2A8B48));
-        src += 10, dest += 10;
-        // 33FF2A: 10 bytes: BITMAP( 5, 5) referenced by a pointer in an array.
-        // It is the same value as the first BITMAP referenced by GD_Eraser, let's optimize it away.
-        //GetNBytes(buffer, 10, src);
-        //PutNBytes(buffer, 10, dest);
-        //PutLong(dest, UINT32_C(0x2B97E8));
-        PutLong(temp, UINT32_C(0x2B97E8));
-        //src += 10, dest += 10;
-        src += 10;
-        // 33FF34: 10 bytes: BITMAP( 5, 5) referenced by a pointer in an array.
-        GetNBytes(buffer, 10, src);
-        PutNBytes(buffer, 10, dest);
-        PutLong(dest, UINT32_C(0x2B97EC));
-        src += 10, dest += 10;
-        // 33FF3E: 10 bytes: BITMAP( 5, 5) referenced by a pointer in an array and GT_WinCursor.
-        GetNBytes(buffer, 10, src);
-        PutNBytes(buffer, 10, dest);
-        PutLong(dest, UINT32_C(0x2B97F0));
-        PutLong(dest, UINT32_C(0x2A8AEE));
-        src += 10, dest += 10;
-        // 33FF48: 10 bytes: BITMAP( 5, 5) referenced by a pointer in an array.
-        GetNBytes(buffer, 10, src);
-        PutNBytes(buffer, 10, dest);
-        PutLong(dest, UINT32_C(0x2B97F8));
-        src += 10, dest += 10;
-        // 33FF52: 10 bytes: BITMAP( 5, 5) referenced by a pointer in an array.
-        GetNBytes(buffer, 10, src);
-        PutNBytes(buffer, 10, dest);
-        PutLong(dest, UINT32_C(0x2B97F4));
-        src += 10, dest += 10;
-        // 33FF5C: 68 bytes: BITMAP(15,15) referenced by GT_WinCursor.
-        GetNBytes(buffer, 68, src);
-        PutNBytes(buffer, 68, dest);
-        PutLong(dest, UINT32_C(0x2A8B5C));
-        src += 68, dest += 68;
-        // 33FFA0: 12 bytes: BITMAP( 7, 7) referenced by GT_WinCursor.
-        GetNBytes(buffer, 12, src);
-        PutNBytes(buffer, 12, dest);
-        PutLong(dest, UINT32_C(0x2A8B76));
-        src += 12, dest += 12;
-        // 33FFAC: 16 bytes: BITMAP( 6, B) referenced by a pointer in an array.
-        GetNBytes(buffer, 16, src);
-        PutNBytes(buffer, 16, dest);
-        PutLong(dest, UINT32_C(0x2B97FC));
-        src += 16, dest += 16;
-        // 33FFBC: 16 bytes: BITMAP( 6, B) referenced by a pointer in an array.
-        GetNBytes(buffer, 16, src);
-        PutNBytes(buffer, 16, dest);
-        PutLong(dest, UINT32_C(0x2B9800));
-        src += 16, dest += 16;
-        // 33FFCC: 16 bytes: BITMAP( 6, B) referenced by a pointer in an array.
-        GetNBytes(buffer, 16, src);
-        PutNBytes(buffer, 16, dest);
-        PutLong(dest, UINT32_C(0x2B9804));
-        src += 16, dest += 16;
-        // 33FFDC: 16 bytes: BITMAP( 6, B) referenced by a pointer in an array.
-        GetNBytes(buffer, 16, src);
-        PutNBytes(buffer, 16, dest);
-        PutLong(dest, UINT32_C(0x2B9808));
-        src += 16, dest += 16;
-        // 33FFEC: 16 bytes: BITMAP( 6, B) referenced by a pointer in an array.
-        GetNBytes(buffer, 16, src);
-        PutNBytes(buffer, 16, dest);
-        PutLong(dest, UINT32_C(0x2B980C));
-        src += 16, dest += 16;
-        // 33FFFC:  8 bytes: BITMAP( 3, 3) without any absolute references... 3x3 O / box
-        GetNBytes(buffer, 8, src);
-        PutNBytes(buffer, 8, dest);
-        src += 8, dest += 8;
-        // 340004:  8 bytes: BITMAP( 3, 3) without any absolute references... 3x3 +
-        GetNBytes(buffer, 8, src);
-        PutNBytes(buffer, 8, dest);
-        src += 8, dest += 8;
-        // 34000C:  8 bytes: BITMAP( 3, 3) without any absolute references... a dot in the middle
-        GetNBytes(buffer, 8, src);
-        PutNBytes(buffer, 8, dest);
-        src += 8, dest += 8;
-        // 340014:  8 bytes: BITMAP( 3, 3) without any absolute references... 3x3 X
-        GetNBytes(buffer, 8, src);
-        PutNBytes(buffer, 8, dest);
-        src += 8, dest += 8;
-
-        // 34001C:  4 bytes: basecode checksum.
-        temp = GetLong(UINT32_C(0x34001C));
-        PutLong(temp, UINT32_C(0x33FEE0));
-        // 340020: 67 bytes: end signature.
-        GetNBytes(buffer, 67, UINT32_C(0x340020));
-        PutNBytes(buffer, 67, UINT32_C(0x33FEE4)); // 33FF27
-
-        // Decrease length of field 8000.
-        SizeShrunk = src - UINT32_C(0x33FEE0);
-        temp = GetLong(UINT32_C(0x212002));
-        temp -= SizeShrunk;
-        PutLong(temp, UINT32_C(0x212002));
-        // Decrease length of field 8070 as well (spotted by RabbitSign).
-        temp -= 126;
-        PutLong(temp, UINT32_C(0x212080));
-        printf(" shrunk by %" PRIu32 " bytes.\n", SizeShrunk);
+        *n = NB_BLOCKS(AMS208_89_Blocks);
+        return AMS208_89_Blocks;
     }
     else if (I == 12 && CalculatorType == TI89) {
-        src  = UINT32_C(0x33FFB0);
-        dest = UINT32_C(0x214000);
-
-        printf("Shrinking AMS 2.09 for 89, to make it fit into the same number of sectors as earlier AMS 2.xx versions...");
-        // 33FFB0: 90 bytes: TITABLED menu.
-        GetNBytes(buffer, 90, src);
-        PutNBytes(buffer, 90, dest);
-        PutLong(dest, UINT32_C(0x2F5DD2));
-        src += 90, dest += 90;
-
-        // 34000A: 126 bytes: Table formats dialog. Needs patching.
-        GetNBytes(buffer, 126, src);
-        PutNBytes(buffer, 126, dest);
-        PutLong(dest + 38, dest + 16);
-        PutLong(dest, UINT32_C(0x2F7FE8));
-        src += 126, dest += 126;
-
-        // 340088: 150 bytes: Table setup dialog. Needs patching.
-        GetNBytes(buffer, 150, src);
-        PutNBytes(buffer, 150, dest);
-        PutLong(dest + 86, dest + 40);
-        PutLong(dest + 118, dest + 52);
-        PutLong(dest, UINT32_C(0x2F870A));
-        src += 150, dest += 150;
-
-        // 34011E: 38 bytes: "WARNING - Graph screen size unknown, so Graph <-> Table setting not supported" dialog. Does not need patching.
-        GetNBytes(buffer, 38, src);
-        PutNBytes(buffer, 38, dest);
-        PutLong(dest, UINT32_C(0x2FA8D8));
-        src += 38, dest += 38;
-
-        // 340144: 128 bytes: TITEXTED menu.
-        GetNBytes(buffer, 128, src);
-        PutNBytes(buffer, 128, dest);
-        PutLong(dest, UINT32_C(0x224312));
-        src += 128, dest += 128;
-
-        // 3401C4: 10 bytes: BITMAP( 5, 5) referenced by GD_Eraser.
-        temp = dest;
-        GetNBytes(buffer, 10, src);
-        PutNBytes(buffer, 10, dest);
-        PutLong(dest, UINT32_C(0x237362));
-        src += 10, dest += 10;
-        // 3401CE: 10 bytes: BITMAP( 5, 5) referenced by GD_Eraser.
-        GetNBytes(buffer, 10, src);
-        PutNBytes(buffer, 10, dest);
-        PutLong(dest, UINT32_C(0x237368));
-        src += 10, dest += 10;
-        // 3401D8: 26 bytes: BITMAP( B, B) referenced by GT_WinCursor.
-        GetNBytes(buffer, 26, src);
-        PutNBytes(buffer, 26, dest);
-        PutLong(dest, UINT32_C(0x2A8CCE));
-        src += 26, dest += 26;
-        // 3401F2:  8 bytes: BITMAP( 3, 3) referenced by GT_WinCursor.
-        GetNBytes(buffer, 8, src);
-        PutNBytes(buffer, 8, dest);
-        PutLong(dest, UINT32_C(0x2A8CE4));
-        src += 8, dest += 8;
-        // 3401FA: 10 bytes: BITMAP( 5, 3) referenced by GT_WinCursor.
-        GetNBytes(buffer, 10, src);
-        PutNBytes(buffer, 10, dest);
-        PutLong(dest, UINT32_C(0x2A8CFA));
-        src += 10, dest += 10;
-        // 340204: 10 bytes: BITMAP( 5, 3) referenced by GT_WinCursor.
-        GetNBytes(buffer, 10, src);
-        PutNBytes(buffer, 10, dest);
-        PutLong(dest, UINT32_C(0x2A8D10));
-        src += 10, dest += 10;
-        // 34020E: 10 bytes: BITMAP( 5, 5) referenced by a pointer in an array.
-        // It is the same value as the first BITMAP referenced by GD_Eraser, let's optimize it away.
-        //GetNBytes(buffer, 10, src);
-        //PutNBytes(buffer, 10, dest);
-        //PutLong(dest, UINT32_C(0x2B97E8));
-        PutLong(temp, UINT32_C(0x2B99B0));
-        //src += 10, dest += 10;
-        src += 10;
-        // 340218: 10 bytes: BITMAP( 5, 5) referenced by a pointer in an array.
-        GetNBytes(buffer, 10, src);
-        PutNBytes(buffer, 10, dest);
-        PutLong(dest, UINT32_C(0x2B99B4));
-        src += 10, dest += 10;
-        // 340222: 10 bytes: BITMAP( 5, 5) referenced by a pointer in an array and GT_WinCursor.
-        GetNBytes(buffer, 10, src);
-        PutNBytes(buffer, 10, dest);
-        PutLong(dest, UINT32_C(0x2B99B8));
-        PutLong(dest, UINT32_C(0x2A8CB6));
-        src += 10, dest += 10;
-        // 34022C: 10 bytes: BITMAP( 5, 5) referenced by a pointer in an array.
-        GetNBytes(buffer, 10, src);
-        PutNBytes(buffer, 10, dest);
-        PutLong(dest, UINT32_C(0x2B99C0));
-        src += 10, dest += 10;
-        // 340236: 10 bytes: BITMAP( 5, 5) referenced by a pointer in an array.
-        GetNBytes(buffer, 10, src);
-        PutNBytes(buffer, 10, dest);
-        PutLong(dest, UINT32_C(0x2B99BC));
-        src += 10, dest += 10;
-        // 340240: 68 bytes: BITMAP(15,15) referenced by GT_WinCursor.
-        GetNBytes(buffer, 68, src);
-        PutNBytes(buffer, 68, dest);
-        PutLong(dest, UINT32_C(0x2A8D24));
-        src += 68, dest += 68;
-        // 340284: 12 bytes: BITMAP( 7, 7) referenced by GT_WinCursor.
-        GetNBytes(buffer, 12, src);
-        PutNBytes(buffer, 12, dest);
-        PutLong(dest, UINT32_C(0x2A8D3E));
-        src += 12, dest += 12;
-        // 340290: 16 bytes: BITMAP( 6, B) referenced by a pointer in an array.
-        GetNBytes(buffer, 16, src);
-        PutNBytes(buffer, 16, dest);
-        PutLong(dest, UINT32_C(0x2B99C4));
-        src += 16, dest += 16;
-        // 3402A0: 16 bytes: BITMAP( 6, B) referenced by a pointer in an array.
-        GetNBytes(buffer, 16, src);
-        PutNBytes(buffer, 16, dest);
-        PutLong(dest, UINT32_C(0x2B99C8));
-        src += 16, dest += 16;
-        // 3402B0: 16 bytes: BITMAP( 6, B) referenced by a pointer in an array.
-        GetNBytes(buffer, 16, src);
-        PutNBytes(buffer, 16, dest);
-        PutLong(dest, UINT32_C(0x2B99CC));
-        src += 16, dest += 16;
-        // 3402C0: 16 bytes: BITMAP( 6, B) referenced by a pointer in an array.
-        GetNBytes(buffer, 16, src);
-        PutNBytes(buffer, 16, dest);
-        PutLong(dest, UINT32_C(0x2B99D0));
-        src += 16, dest += 16;
-        // 3402D0: 16 bytes: BITMAP( 6, B) referenced by a pointer in an array.
-        GetNBytes(buffer, 16, src);
-        PutNBytes(buffer, 16, dest);
-        PutLong(dest, UINT32_C(0x2B99D4));
-        src += 16, dest += 16;
-        // 3402E0:  8 bytes: BITMAP( 3, 3) without any absolute references... 3x3 O / box
-        GetNBytes(buffer, 8, src);
-        PutNBytes(buffer, 8, dest);
-        src += 8, dest += 8;
-        // 3402E8:  8 bytes: BITMAP( 3, 3) without any absolute references... 3x3 +
-        GetNBytes(buffer, 8, src);
-        PutNBytes(buffer, 8, dest);
-        src += 8, dest += 8;
-        // 3402F0:  8 bytes: BITMAP( 3, 3) without any absolute references... a dot in the middle
-        GetNBytes(buffer, 8, src);
-        PutNBytes(buffer, 8, dest);
-        src += 8, dest += 8;
-        // 3402F8:  8 bytes: BITMAP( 3, 3) without any absolute references... 3x3 X
-        GetNBytes(buffer, 8, src);
-        PutNBytes(buffer, 8, dest);
-        src += 8, dest += 8;
-
-        // 340300:  4 bytes: basecode checksum.
-        temp = GetLong(UINT32_C(0x340300));
-        PutLong(temp, UINT32_C(0x33FFB0));
-        // 340304: 67 bytes: end signature.
-        GetNBytes(buffer, 67, UINT32_C(0x340304));
-        PutNBytes(buffer, 67, UINT32_C(0x33FFB4)); // 33FFF7
-
-        // Decrease length of field 8000.
-        SizeShrunk = src - UINT32_C(0x33FFB0);
-        temp = GetLong(UINT32_C(0x212002));
-        temp -= SizeShrunk;
-        PutLong(temp, UINT32_C(0x212002));
-        // Decrease length of field 8070 as well (spotted by RabbitSign).
-        temp -= 126;
-        PutLong(temp, UINT32_C(0x212080));
-        printf(" shrunk by %" PRIu32 " bytes.\n", SizeShrunk);
+        *n = NB_BLOCKS(AMS209_89_Blocks);
+        return AMS209_89_Blocks;
     }
+    *n = 0;
+    return NULL;
 }
 
 
-//! Add functionality to AMS.
-static void ExpandAMS(void) {
-    uint32_t temp, temp2, temp3, temp4, temp5, temp6;
-
-    // 5a) Reintegrate OSVRegisterTimer/OSVFreeTimer functionality.
-    {
-        printf("Reintegrating OSVRegisterTimer/OSVFreeTimer functionality\n");
-        // Add a new AI5 handler and modify the original one.
-        temp = GetAMSVector(0x74);
-        Seek(temp);
-        temp2 = ReadLong();
-        temp3 = SearchShort(0x4E73);
-        temp4 = GetLong(temp3 - 6);
-        Seek(temp3 - 6);
-        WriteShort(0x4E75);
-        temp5 = GetAMSTrap9Item(3);
-        temp6 = ROM_base + 0x13110;
-        Seek(temp6);
-        WriteLong(temp2);
-        WriteShort(0x4EB9);
-        WriteLong(temp + 4);
-        WriteShort(0x45F8);
-        WriteShort(temp5);
-        WriteShort(0x76FF);
-        WriteShort(0xB69A);
-        WriteShort(0x6718);
-        WriteShort(0x5392);
-        WriteShort(0x6614);
-        WriteLong(UINT32_C(0x24EAFFFC));
-        WriteShort(0x205A);
-        WriteShort(0x4E90);
-        WriteShort(0xB4FC);
-        WriteShort(temp5 + 24);
-        WriteShort(0x6DEA);
-        WriteLong(temp4);
-        WriteShort(0x4E73);
-        WriteShort(0x508A);
-        WriteShort(0x60F0);
-        SetAMSVector(0x74, temp6);
+//! Shrink AMS versions that are just slightly too large and deprive users from 64 KB of archive memory available on older versions...
+static void ShrinkAMS(void) {
+    const MovableBlock *blocks;
+    uint32_t n, first, size;
+    uint32_t dest;
 
-        // Rewrite the timer-related reset (init) code entirely.
-        // It's easy enough to end up with code smaller than TI's code, despite the new code providing more functionality...
-        temp = rom_call_addr(FiftyMsecTick);
-        temp2 = GetAMSTrap9Item(4);
-        temp6 = rom_call_addr(OSRegisterTimer);
-        Seek(temp6);
-        temp6 = SearchBackwardsShort(0x48E7);
-        WriteShort(0x7000);
-        if (temp < 0x8000) {
-            WriteShort(0x21C0);
-            WriteShort(temp);
-        }
-        else {
-            WriteShort(0x23C0);
-            WriteLong(temp);
-        }
-        WriteShort(0x41F8);
-        WriteShort(temp2 + 0xA);
-        WriteShort(0x43F8);
-        temp3 = 8;
-        if (AMS_Major == 2) {
-            if (AMS_Minor == 5) {
-                temp3 = 7;
-            }
+    BeginSection("4a");
+    // 4a) Shrink AMS 2.08 and 2.09 for 89: move as few blocks as needed from the end of the basecode to free ROM space.
+    blocks = GetAMSMovableBlocks(&n);
+    if (blocks != NULL) {
+        first = PlanSectors(blocks, n, &size);
+        if (first == n) {
+            return;
         }
-        else {
-            if (CalculatorType == TI89T) {
-                temp3 = 9;
-            }
+        dest = AllocROMSpace(size, 2);
+        if (dest == 0) {
+            return;
         }
-        WriteShort(temp5 - 2 * temp3);
-        WriteByte(0x74);
-        WriteByte(temp3 - 1);
-        WriteShort(0x72FF);
-        WriteShort(0x20C1);
-        WriteShort(0x20C0);
-        WriteShort(0x32C0);
-        WriteLong(UINT32_C(0x51CAFFF8));
-        WriteShort(0x22C1);
-        WriteShort(0x22C0);
-        WriteShort(0x22C0);
-        WriteShort(0x22C1);
-        WriteShort(0x22C0);
-        WriteShort(0x22C0);
-        WriteShort(0x4E75);
-
-        // OSVRegisterTimer.
-        temp6 = ROM_base + 0x13140;
-        Seek(temp6);
-        WriteShort(0x7000);
-        WriteLong(UINT32_C(0x322F0004));
-        WriteShort(0x5341);
-        WriteShort(0x74FF);
-        WriteLong(UINT32_C(0x0C410002));
-        WriteShort(0x641C);
-        WriteShort(0x41F8);
-        WriteShort(temp5);
-        WriteLong(UINT32_C(0xC2FC000C));
-        WriteShort(0xD1C1);
-        WriteShort(0xB490);
-        WriteShort(0x660E);
-        WriteLong(UINT32_C(0x242F0006));
-        WriteShort(0x20C2);
-        WriteShort(0x20C2);
-        WriteLong(UINT32_C(0x20AF000A));
-        WriteShort(0x5240);
-        WriteShort(0x4E75);
-        SetAMSrom_call(OSVRegisterTimer, temp6);
 
-        // OSVFreeTimer.
-        temp6 = ROM_base + 0x13170;
-        Seek(temp6);
-        WriteShort(0x7000);
-        WriteLong(UINT32_C(0x322F0004));
-        WriteShort(0x5341);
-        WriteShort(0x74FF);
-        WriteLong(UINT32_C(0x0C410002));
-        WriteShort(0x6412);
-        WriteShort(0x41F8);
-        WriteShort(temp5);
-        WriteLong(UINT32_C(0xC3FC000C));
-        WriteShort(0xD1C1);
-        WriteShort(0x20C2);
-        WriteShort(0x4298);
-        WriteShort(0x4290);
-        WriteShort(0x5240);
-        WriteShort(0x4E75);
-        SetAMSrom_call(OSVFreeTimer, temp6);
+        printf("Shrinking AMS 2.%02" PRIu8 " for 89, to make it fit into the same number of sectors as earlier AMS 2.xx versions...", AMS_Minor);
+        MoveBlocks(blocks, first, n, dest);
+        MoveBasecodeTail(blocks[first].addr);
+        printf(" shrunk by %" PRIu32 " bytes.\n", SizeShrunk);
     }
 }
 
 
-void PatchAMS(void) {
-    UnlockAMS();
+// Upper bound of the size of the fast DrawChar and DrawStr.
+#define FAST_DRAW_CODE_SIZE 1024
 
-    OptimizeAMS();
+// A fixed-width font whose glyphs are pre-shifted: for each character and each of the 8 pixel shifts, one word per row,
+// so that drawing a character boils down to ORing (or EORing...) aligned words into video memory.
+typedef struct {
+    const char *name;
+    uint16_t font;      // Value of CurFont.
+    uint16_t attr;      // Font attribute in OO_SYSTEM_FRAME.
+    uint8_t  width;
+    uint8_t  height;
+    uint8_t  align;     // Left shift which puts the leftmost pixel of the glyph data in bit 7.
+    uint16_t first;     // First pre-shifted character.
+    uint16_t count;     // Number of pre-shifted characters, 0 if the font is not pre-shifted.
+    uint32_t data;      // Glyph data in AMS, height bytes per character.
+    uint32_t table;
+} PreshiftedFont;
 
-    FixAMS();
+//! Get the size of the pre-shifted table of count characters.
+static uint32_t PreshiftedFontSize (const PreshiftedFont *f, uint32_t count) {
+    return count * 8 * f->height * 2;
+}
 
-    ShrinkAMS();
+//! Check the glyph data of a fixed-width font, and find out how it is aligned in its bytes. Return 0 if it is unexpected.
+static int CheckPreshiftedFont (PreshiftedFont *f) {
+    uint8_t glyphs[256 * 10];
+    uint32_t i, bits = 0, space = 0, letter = 0;
+    uint8_t unused = (uint8_t)(0xFF >> f->width);
 
-    ExpandAMS();
+    f->data = GetAMSAttribute(f->attr);
+    if (f->data == UINT32_C(0xFFFFFFFF)) {
+        return 0;
+    }
+    GetNBytes(glyphs, 256 * f->height, f->data);
+    for (i = 0; i < 256 * f->height; i++) {
+        bits |= glyphs[i];
+    }
+    for (i = 0; i < f->height; i++) {
+        space |= glyphs[' ' * f->height + i];
+        letter |= glyphs['A' * f->height + i];
+    }
+    if (space != 0 || letter == 0) {
+        return 0;
+    }
+    // The glyphs are either in the leftmost or in the rightmost width bits of each byte.
+    if ((bits & unused) == 0) {
+        f->align = 0;
+    }
+    else if ((bits & (uint8_t)(unused << f->width)) == 0) {
+        f->align = 8 - f->width;
+    }
+    else {
+        return 0;
+    }
+    return 1;
+}
+
+//! Write the pre-shifted table of a font.
+static void WritePreshiftedFont (const PreshiftedFont *f) {
+    uint8_t glyphs[256 * 10];
+    const uint8_t *glyph;
+    uint32_t c, s, r;
+
+    GetNBytes(glyphs, f->count * f->height, f->data + f->first * f->height);
+    Seek(f->table);
+    for (c = 0; c < f->count; c++) {
+        glyph = glyphs + c * f->height;
+        for (s = 0; s < 8; s++) {
+            for (r = 0; r < f->height; r++) {
+                WriteShort((uint16_t)((((uint32_t)glyph[r] << f->align) & 0xFF) << (8 - s)));
+            }
+        }
+    }
+}
+
+//! Write a Bcc.w to target at Tell().
+static void WriteBranch (uint16_t opcode, uint32_t target) {
+    WriteShort(opcode);
+    WriteShort((uint16_t)(target - Tell()));
+}
+
+//! Make the Bcc.s at site branch to Tell().
+static void FixShortBranch (uint32_t site) {
+    uint32_t pos = Tell();
+    PutByte((uint8_t)(pos - site - 2), site + 1);
+    Seek(pos);
+}
+
+//! Make the Bcc.w at site branch to Tell().
+static void FixWordBranch (uint32_t site) {
+    uint32_t pos = Tell();
+    PutShort((uint16_t)(pos - site - 2), site + 2);
+    Seek(pos);
+}
+
+//! Write a row loop of the fast DrawChar at Tell(), ending with RTS. The glyph row is in d0, a1 points to video memory.
+static void WriteDrawCharLoop (const uint16_t *ops, uint32_t n) {
+    uint32_t loop = Tell();
+    uint32_t i;
+
+    WriteShort(0x3018);
+    for (i = 0; i < n; i++) {
+        WriteShort(ops[i]);
+    }
+    WriteLong(UINT32_C(0x43E9001E));
+    WriteBranch(0x51CA, loop);
+    WriteShort(0x4E75);
+}
+
+//! Write the part of the fast DrawChar specific to a font at Tell(), for a validated attribute in 10(sp).
+//  The slower cases (characters out of the table, clipping, other ports) branch to fallback.
+static void WriteFastDrawCharFont (const PreshiftedFont *f, uint32_t ss, uint32_t fallback) {
+    // Rows of the even (word) and odd (byte) cases, for A_NORMAL, A_XOR, A_REPLACE.
+    static const uint16_t even_normal[]  = {0x8151};
+    static const uint16_t even_xor[]     = {0xB151};
+    static const uint16_t even_replace[] = {0xC351, 0x8151};
+    static const uint16_t odd_normal[]   = {0x8129, 0x0001, 0xE048, 0x8111};
+    static const uint16_t odd_xor[]      = {0xB129, 0x0001, 0xE048, 0xB111};
+    static const uint16_t odd_replace[]  = {0xC329, 0x0001, 0x8129, 0x0001, 0xE048, 0x4841, 0xC311, 0x4841, 0x8111};
+    uint32_t odd, site, site2;
+
+    // Character in the table ?
+    WriteShort(0x7400);
+    WriteLong(UINT32_C(0x142F0009));
+    if (f->first != 0) {
+        WriteShort(0x0442);
+        WriteShort(f->first);
+    }
+    WriteShort(0x0C42);
+    WriteShort(f->count - 1);
+    WriteBranch(0x6200, fallback);
+    // 0 <= y <= YMax - height + 1 ?
+    WriteShort(0x7000);
+    WriteShort(0x1038);
+    WriteShort(ss + 5);
+    WriteLong(UINT32_C(0x322F0006));
+    WriteBranch(0x6B00, fallback);
+    WriteShort(0x0641);
+    WriteShort(f->height - 1);
+    WriteShort(0xB240);
+    WriteBranch(0x6200, fallback);
+    // 30-byte wide port, 0 <= x <= 240 - width ?
+    WriteLong(UINT32_C(0x0C3800EF));
+    WriteShort(ss + 4);
+    WriteBranch(0x6600, fallback);
+    WriteLong(UINT32_C(0x302F0004));
+    WriteShort(0x0C40);
+    WriteShort(240 - f->width);
+    WriteBranch(0x6200, fallback);
+
+    // a1 = ScrAddr + 30 * y + x / 8
+    WriteLong(UINT32_C(0x322F0006));
+    WriteShort(0xD241);
+    WriteShort(0x3241);
+    WriteShort(0xE949);
+    WriteShort(0x9249);
+    WriteShort(0x2278);
+    WriteShort(ss);
+    WriteShort(0xD2C1);
+    WriteShort(0x3200);
+    WriteShort(0xE649);
+    WriteShort(0xD2C1);
+    // d1 = ~(cell mask >> shift)
+    WriteLong(UINT32_C(0x02400007));
+    WriteShort(0x323C);
+    WriteShort((uint16_t)(((0xFF << (8 - f->width)) & 0xFF) << 8));
+    WriteShort(0xE069);
+    WriteShort(0x4641);
+    // a0 = table + character * 16 * height + shift * 2 * height
+    if (f->height == 8) {
+        WriteShort(0xEF4A);
+        WriteShort(0xE948);
+    }
+    else {
+        WriteShort(0xC4FC);
+        WriteShort(16 * f->height);
+        WriteShort(0xC0FC);
+        WriteShort(2 * f->height);
+    }
+    WriteShort(0x41F9);
+    WriteLong(f->table);
+    WriteShort(0xD1C2);
+    WriteShort(0xD0C0);
+
+    // Dispatch on the parity of the address and on the attribute.
+    WriteShort(0x7400 | (f->height - 1));
+    WriteShort(0x3009);
+    WriteLong(UINT32_C(0x08000000));
+    odd = Tell();
+    WriteShort(0x6600);
+    WriteLong(UINT32_C(0x302F000A));
+    WriteShort(0x5540);
+    site = Tell();
+    WriteShort(0x6700);
+    site2 = Tell();
+    WriteShort(0x6A00);
+    WriteDrawCharLoop(even_normal, NB_BLOCKS(even_normal));
+    FixShortBranch(site);
+    WriteDrawCharLoop(even_xor, NB_BLOCKS(even_xor));
+    FixShortBranch(site2);
+    WriteDrawCharLoop(even_replace, NB_BLOCKS(even_replace));
+
+    FixShortBranch(odd);
+    WriteLong(UINT32_C(0x302F000A));
+    WriteShort(0x5540);
+    site = Tell();
+    WriteShort(0x6700);
+    site2 = Tell();
+    WriteShort(0x6A00);
+    WriteDrawCharLoop(odd_normal, NB_BLOCKS(odd_normal));
+    FixShortBranch(site);
+    WriteDrawCharLoop(odd_xor, NB_BLOCKS(odd_xor));
+    FixShortBranch(site2);
+    // The mask of the byte at (a1) goes to the upper word of d1.
+    WriteShort(0x3001);
+    WriteShort(0xE048);
+    WriteShort(0x4841);
+    WriteShort(0x3200);
+    WriteShort(0x4841);
+    WriteDrawCharLoop(odd_replace, NB_BLOCKS(odd_replace));
+}
+
+//! Write the fast DrawChar at addr, return its entry point.
+static uint32_t WriteFastDrawChar (uint32_t addr, const PreshiftedFont *fonts, uint32_t n, uint32_t ss) {
+    uint32_t fallback, entry, entry2, i;
+    uint32_t sites[2];
+    uint32_t original = rom_call_addr(DrawChar);
+
+    fallback = addr;
+    Seek(addr);
+    WriteShort(0x4EF9);
+    WriteLong(original);
+
+    // A_NORMAL, A_XOR or A_REPLACE ?
+    entry = Tell();
+    WriteLong(UINT32_C(0x302F000A));
+    WriteLong(UINT32_C(0x0C400004));
+    WriteBranch(0x6200, fallback);
+    WriteShort(0x7216);
+    WriteShort(0x0101);
+    WriteBranch(0x6700, fallback);
+    // Pre-shifted font ?
+    WriteShort(0x3038);
+    WriteShort(ss + 6);
+    for (i = 0; i < n; i++) {
+        WriteShort(0x0C40);
+        WriteShort(fonts[i].font);
+        sites[i] = Tell();
+        WriteLong(UINT32_C(0x67000000));
+    }
+    WriteBranch(0x6000, fallback);
+    for (i = 0; i < n; i++) {
+        entry2 = Tell();
+        PutShort((uint16_t)(entry2 - sites[i] - 2), sites[i] + 2);
+        Seek(entry2);
+        WriteFastDrawCharFont(&fonts[i], ss, fallback);
+    }
+    return entry;
+}
+
+//! Write the fast DrawStr at addr, which draws the characters one by one with the fast DrawChar, return its entry point.
+static uint32_t WriteFastDrawStr (uint32_t addr, const PreshiftedFont *fonts, uint32_t n, uint32_t ss, uint32_t drawchar) {
+    uint32_t fallback, entry, loop, done, i;
+    uint32_t sites[2];
+    uint32_t original = rom_call_addr(DrawStr);
+
+    fallback = addr;
+    Seek(addr);
+    WriteShort(0x4EF9);
+    WriteLong(original);
+
+    // A_NORMAL, A_XOR or A_REPLACE, and a pre-shifted font ?
+    entry = Tell();
+    WriteLong(UINT32_C(0x302F000C));
+    WriteLong(UINT32_C(0x0C400004));
+    WriteBranch(0x6200, fallback);
+    WriteShort(0x7216);
+    WriteShort(0x0101);
+    WriteBranch(0x6700, fallback);
+    WriteShort(0x3038);
+    WriteShort(ss + 6);
+    for (i = 0; i < n; i++) {
+        WriteShort(0x7200 | fonts[i].width);
+        WriteShort(0x0C40);
+        WriteShort(fonts[i].font);
+        sites[i] = Tell();
+        WriteShort(0x6700);
+    }
+    WriteBranch(0x6000, fallback);
+    for (i = 0; i < n; i++) {
+        FixShortBranch(sites[i]);
+    }
+
+    WriteLong(UINT32_C(0x48E71C20));
+    WriteShort(0x3A01);
+    WriteLong(UINT32_C(0x362F0014));
+    WriteLong(UINT32_C(0x246F0018));
+    loop = Tell();
+    WriteShort(0x7800);
+    WriteShort(0x181A);
+    done = Tell();
+    WriteShort(0x6700);
+    WriteLong(UINT32_C(0x3F2F001C));
+    WriteShort(0x3F04);
+    WriteLong(UINT32_C(0x3F2F001A));
+    WriteShort(0x3F03);
+    WriteBranch(0x6100, drawchar);
+    WriteShort(0x508F);
+    WriteShort(0xD645);
+    WriteShort((uint16_t)(0x6000 | ((loop - Tell() - 2) & 0xFF)));
+    FixShortBranch(done);
+    WriteLong(UINT32_C(0x4CDF0438));
+    WriteShort(0x4E75);
+    return entry;
+}
+
+//! Find the SCR_STATE structure, which holds the current port, font, attribute, pen position and clipping
+//  rectangle: FontGetSys reads the font from it, PortSet writes the port to it. Return 0 if not found.
+static uint32_t GetAMSScrState (void) {
+    uint32_t temp, temp2, ss = 0;
+    uint16_t op;
+
+    temp = rom_call_addr(FontGetSys);
+    if (GetShort(temp) == 0x7000) {
+        temp += 2;
+    }
+    op = GetShort(temp);
+    if (op == 0x1038) {
+        ss = GetShort(temp + 2) - 7;
+    }
+    else if (op == 0x3038) {
+        ss = GetShort(temp + 2) - 6;
+    }
+    temp2 = rom_call_addr(PortSet);
+    if (   ss == 0 || GetShort(temp + 4) != 0x4E75
+        || GetLong(temp2) != UINT32_C(0x21EF0004) || GetShort(temp2 + 4) != ss) {
+        return 0;
+    }
+    return ss;
+}
+
+//! Pre-shift the glyphs of the fixed-width fonts, and replace DrawChar and DrawStr by versions which use them.
+static void PreshiftAMSFonts(void) {
+    PreshiftedFont fonts[2] = {
+        {"F_6x8",  1, 0x301, 6,  8, 0, 0, 0, 0, 0},
+        {"F_8x10", 2, 0x302, 8, 10, 0, 0, 0, 0, 0}
+    };
+    uint32_t ss, budget, full, ascii, start, code, drawchar, drawstr, i, n;
+    uint32_t temp;
+
+    BeginSection("2e");
+    // 2e) Pre-shift the glyphs of F_6x8 and F_8x10 in the unused end of the last Flash sector of the basecode.
+    //     Like the hard-coded fonts, this ignores fonts redefined through OO_SYSTEM_FRAME.
+    //     The new DrawChar handles fully visible characters drawn with A_NORMAL, A_XOR or A_REPLACE in the usual
+    //     30-byte wide ports, everything else goes to the original DrawChar; DrawStr uses the new DrawChar.
+    ss = GetAMSScrState();
+    if (ss == 0) {
+        printf("Unexpected data, skipping the pre-shifting of fonts !\n");
+        return;
+    }
+
+    // All characters if there is enough space, else only the ASCII ones.
+    budget = BasecodeSlack();
+    printf("Pre-shifting fonts for calculator type %" PRIu8 ", %" PRIu32 " bytes left in the last Flash sector:\n", CalculatorType, budget);
+    budget = budget > FAST_DRAW_CODE_SIZE + 1 ? budget - FAST_DRAW_CODE_SIZE - 1 : 0;
+    n = 0;
+    for (i = 0; i < 2; i++) {
+        if (!CheckPreshiftedFont(&fonts[i])) {
+            printf("    %s: unexpected glyph data, drawn by the original code.\n", fonts[i].name);
+            continue;
+        }
+        full = PreshiftedFontSize(&fonts[i], 256);
+        ascii = PreshiftedFontSize(&fonts[i], 0x80 - 0x20);
+        if (full <= budget) {
+            fonts[i].first = 0;
+            fonts[i].count = 256;
+            printf("    %s: %" PRIu32 " bytes, all characters pre-shifted.\n", fonts[i].name, full);
+        }
+        else if (ascii <= budget) {
+            fonts[i].first = 0x20;
+            fonts[i].count = 0x80 - 0x20;
+            printf("    %s: %" PRIu32 " bytes needed, only the ASCII characters pre-shifted (%" PRIu32 " bytes),\n"
+                   "        the others are drawn by the original code.\n", fonts[i].name, full, ascii);
+        }
+        else {
+            printf("    %s: %" PRIu32 " bytes needed (%" PRIu32 " for ASCII), not enough space, drawn by the original code.\n",
+                   fonts[i].name, full, ascii);
+            continue;
+        }
+        budget -= PreshiftedFontSize(&fonts[i], fonts[i].count);
+        fonts[n++] = fonts[i];
+    }
+    if (n == 0) {
+        return;
+    }
+
+    temp = FAST_DRAW_CODE_SIZE + 1;
+    for (i = 0; i < n; i++) {
+        temp += PreshiftedFontSize(&fonts[i], fonts[i].count);
+    }
+    start = GrowBasecode(temp);
+    Seek(start);
+    if (start & 1) {
+        WriteByte(0xFF);
+    }
+    for (i = 0; i < n; i++) {
+        fonts[i].table = Tell();
+        WritePreshiftedFont(&fonts[i]);
+    }
+    code = Tell();
+    drawchar = WriteFastDrawChar(code, fonts, n, ss);
+    drawstr = WriteFastDrawStr(Tell(), fonts, n, ss, drawchar);
+    // Give back the unused part of the space reserved for the code.
+    MoveBasecodeTail((Tell() + 1) & ~UINT32_C(1));
+    printf("    %" PRIu32 " bytes of glyph tables at %06" PRIX32 ", %" PRIu32 " bytes of code at %06" PRIX32 ".\n",
+           code - start, start, Tell() - code, code);
+    RedirectAMSrom_call(DrawChar, drawchar, 1);
+    RedirectAMSrom_call(DrawStr, drawstr, 1);
+}
+
+
+// Upper bound of the size of the memory routines.
+#define FAST_MEMORY_CODE_SIZE 768
+
+//! Write the head of a loop running dn times (32 bits, not 0) at Tell(): a DBcc on the low word, nested in a DBF
+//  on the high word. Return the address of the outer loop, the body starts 2 bytes further.
+static uint32_t WriteCountedLoopHead (uint32_t n) {
+    uint32_t outer;
+
+    WriteShort(0x5380 | n);
+    WriteShort(0x4840 | n);
+    outer = Tell();
+    WriteShort(0x4840 | n);
+    return outer;
+}
+
+//! Write the end of a loop started by WriteCountedLoopHead. With another DBcc than DBF, the loop also ends when the
+//  condition is true, through a bne.s at *exitsite which the caller fixes.
+static void WriteCountedLoopTail (uint32_t n, uint32_t outer, uint16_t dbcc, uint32_t *exitsite) {
+    WriteBranch(dbcc | n, outer + 2);
+    if (exitsite != NULL) {
+        *exitsite = Tell();
+        WriteShort(0x6600);
+    }
+    WriteShort(0x4840 | n);
+    WriteBranch(0x51C8 | n, outer);
+}
+
+//! Write the handling of the last d0 & 15 bytes at Tell(), with the given moves of a longword, a word and a byte.
+static void WriteTailBytes (uint16_t movel, uint16_t movew, uint16_t moveb) {
+    WriteLong(UINT32_C(0x08000003));
+    WriteShort(0x6704);
+    WriteShort(movel);
+    WriteShort(movel);
+    WriteLong(UINT32_C(0x08000002));
+    WriteShort(0x6702);
+    WriteShort(movel);
+    WriteLong(UINT32_C(0x08000001));
+    WriteShort(0x6702);
+    WriteShort(movew);
+    WriteLong(UINT32_C(0x08000000));
+    WriteShort(0x6702);
+    WriteShort(moveb);
+}
+
+//! Write the copy of d0 bytes from a1 to a0 at Tell(), upwards with (a1)+,(a0)+ or downwards with -(a1),-(a0) from
+//  the ends of the buffers. Longwords are used when both addresses have the same parity, and upwards copies of 512
+//  bytes or more use MOVEM bursts of 48 bytes. Destroys d0-d2/a0-a1.
+static void WriteCopyLoops (int backward) {
+    uint16_t movel = backward ? 0x2121 : 0x20D9;
+    uint16_t movew = backward ? 0x3121 : 0x30D9;
+    uint16_t moveb = backward ? 0x1121 : 0x10D9;
+    uint32_t bytes, bytes2, even, longs, longs2, big, tail, outer, done, done2;
+
+    // Fewer than 16 bytes, or different parities: bytes.
+    WriteShort(0x7210);
+    WriteShort(0xB081);
+    bytes = Tell();
+    WriteLong(UINT32_C(0x65000000));
+    WriteShort(0x3208);
+    WriteShort(0x3409);
+    WriteShort(0xB541);
+    WriteShort(0xE249);
+    bytes2 = Tell();
+    WriteLong(UINT32_C(0x65000000));
+    WriteShort(0xE24A);
+    even = Tell();
+    WriteShort(0x6400);
+    WriteShort(moveb);
+    WriteShort(0x5380);
+    FixShortBranch(even);
+
+    if (!backward) {
+        // d3-d7/a2-a6 are saved, d1 = len / 48 fits in a word for any RAM buffer.
+        WriteShort(0x0C80);
+        WriteLong(512);
+        longs = Tell();
+        WriteShort(0x6500);
+        WriteShort(0x2200);
+        WriteLong(UINT32_C(0x82FC0030));
+        longs2 = Tell();
+        WriteShort(0x6900);
+        WriteLong(UINT32_C(0x48E71F3E));
+        WriteShort(0x5341);
+        big = Tell();
+        WriteLong(UINT32_C(0x4CD97CFD));
+        WriteLong(UINT32_C(0x48D07CFD));
+        WriteLong(UINT32_C(0x41E80030));
+        WriteBranch(0x51C9, big);
+        WriteLong(UINT32_C(0x4CDF7CF8));
+        WriteShort(0x4241);
+        WriteShort(0x4841);
+        WriteShort(0x2001);
+        FixShortBranch(longs);
+        FixShortBranch(longs2);
+    }
+
+    // Longwords, 16 bytes per iteration, then the last 0 to 15 bytes.
+    WriteShort(0x2200);
+    WriteShort(0xE889);
+    tail = Tell();
+    WriteShort(0x6700);
+    outer = WriteCountedLoopHead(1);
+    WriteShort(movel);
+    WriteShort(movel);
+    WriteShort(movel);
+    WriteShort(movel);
+    WriteCountedLoopTail(1, outer, 0x51C8, NULL);
+    FixShortBranch(tail);
+    WriteTailBytes(movel, movew, moveb);
+    done = Tell();
+    WriteShort(0x6000);
+
+    FixWordBranch(bytes);
+    FixWordBranch(bytes2);
+    WriteShort(0x2200);
+    done2 = Tell();
+    WriteShort(0x6700);
+    outer = WriteCountedLoopHead(1);
+    WriteShort(moveb);
+    WriteCountedLoopTail(1, outer, 0x51C8, NULL);
+    FixShortBranch(done);
+    FixShortBranch(done2);
+}
+
+//! Write memcpy at addr. Store in *core the address of the copy itself, for memmove.
+static uint32_t WriteFastMemcpy (uint32_t addr, uint32_t *core) {
+    Seek(addr);
+    WriteLong(UINT32_C(0x206F0004));
+    WriteLong(UINT32_C(0x226F0008));
+    WriteLong(UINT32_C(0x202F000C));
+    *core = Tell();
+    WriteCopyLoops(0);
+    WriteLong(UINT32_C(0x206F0004));
+    WriteShort(0x4E75);
+    return addr;
+}
+
+//! Write memmove at addr: non-overlapping buffers, or a destination below the source, go to the copy of memcpy.
+static uint32_t WriteFastMemmove (uint32_t addr, uint32_t core) {
+    Seek(addr);
+    WriteLong(UINT32_C(0x206F0004));
+    WriteLong(UINT32_C(0x226F0008));
+    WriteLong(UINT32_C(0x202F000C));
+    WriteShort(0xB1C9);
+    WriteBranch(0x6300, core);
+    WriteShort(0x2209);
+    WriteShort(0xD280);
+    WriteShort(0xB1C1);
+    WriteBranch(0x6400, core);
+    WriteShort(0x2241);
+    WriteShort(0xD1C0);
+    WriteCopyLoops(1);
+    WriteLong(UINT32_C(0x206F0004));
+    WriteShort(0x4E75);
+    return addr;
+}
+
+//! Write memset at addr.
+static uint32_t WriteFastMemset (uint32_t addr) {
+    uint32_t bytes, even, longs, longs2, big, tail, outer, done, done2;
+
+    Seek(addr);
+    WriteLong(UINT32_C(0x206F0004));
+    WriteLong(UINT32_C(0x122F0009));
+    WriteLong(UINT32_C(0x202F000A));
+    WriteShort(0x7410);
+    WriteShort(0xB082);
+    bytes = Tell();
+    WriteLong(UINT32_C(0x65000000));
+    // Fill byte in the 4 bytes of d1, even address.
+    WriteShort(0x1401);
+    WriteShort(0xE149);
+    WriteShort(0x1202);
+    WriteShort(0x3401);
+    WriteShort(0x4841);
+    WriteShort(0x3202);
+    WriteShort(0x3408);
+    WriteShort(0xE24A);
+    even = Tell();
+    WriteShort(0x6400);
+    WriteShort(0x10C1);
+    WriteShort(0x5380);
+    FixShortBranch(even);
+
+    // MOVEM bursts of 48 bytes from 12 registers, d2 = len / 48.
+    WriteShort(0x0C80);
+    WriteLong(512);
+    longs = Tell();
+    WriteShort(0x6500);
+    WriteShort(0x2400);
+    WriteLong(UINT32_C(0x84FC0030));
+    longs2 = Tell();
+    WriteShort(0x6900);
+    WriteLong(UINT32_C(0x48E71F3E));
+    WriteShort(0x2001);
+    WriteShort(0x2601);
+    WriteShort(0x2801);
+    WriteShort(0x2A01);
+    WriteShort(0x2C01);
+    WriteShort(0x2E01);
+    WriteShort(0x2441);
+    WriteShort(0x2641);
+    WriteShort(0x2841);
+    WriteShort(0x2A41);
+    WriteShort(0x2C41);
+    WriteShort(0x5342);
+    big = Tell();
+    WriteLong(UINT32_C(0x48D07CFB));
+    WriteLong(UINT32_C(0x41E80030));
+    WriteBranch(0x51CA, big);
+    WriteLong(UINT32_C(0x4CDF7CF8));
+    WriteShort(0x4242);
+    WriteShort(0x4842);
+    WriteShort(0x2002);
+    FixShortBranch(longs);
+    FixShortBranch(longs2);
+
+    WriteShort(0x2400);
+    WriteShort(0xE88A);
+    tail = Tell();
+    WriteShort(0x6700);
+    outer = WriteCountedLoopHead(2);
+    WriteShort(0x20C1);
+    WriteShort(0x20C1);
+    WriteShort(0x20C1);
+    WriteShort(0x20C1);
+    WriteCountedLoopTail(2, outer, 0x51C8, NULL);
+    FixShortBranch(tail);
+    WriteTailBytes(0x20C1, 0x30C1, 0x10C1);
+    done = Tell();
+    WriteShort(0x6000);
+
+    FixWordBranch(bytes);
+    WriteShort(0x2400);
+    done2 = Tell();
+    WriteShort(0x6700);
+    outer = WriteCountedLoopHead(2);
+    WriteShort(0x10C1);
+    WriteCountedLoopTail(2, outer, 0x51C8, NULL);
+    FixShortBranch(done);
+    FixShortBranch(done2);
+    WriteLong(UINT32_C(0x206F0004));
+    WriteShort(0x4E75);
+    return addr;
+}
+
+//! Write memcmp at addr. It returns the difference between the first differing bytes, as unsigned chars.
+static uint32_t WriteFastMemcmp (uint32_t addr) {
+    uint32_t bytes, bytes2, bytes3, even, found, found2, backup, equal, outer;
+
+    Seek(addr);
+    WriteLong(UINT32_C(0x206F0004));
+    WriteLong(UINT32_C(0x226F0008));
+    WriteLong(UINT32_C(0x222F000C));
+    WriteShort(0x7010);
+    WriteShort(0xB280);
+    bytes = Tell();
+    WriteShort(0x6500);
+    WriteShort(0x3008);
+    WriteShort(0x3409);
+    WriteShort(0xB540);
+    WriteShort(0xE248);
+    bytes2 = Tell();
+    WriteShort(0x6500);
+    WriteShort(0xE24A);
+    even = Tell();
+    WriteShort(0x6400);
+    WriteShort(0xB109);
+    found = Tell();
+    WriteShort(0x6600);
+    WriteShort(0x5381);
+    FixShortBranch(even);
+
+    // Longwords; on a difference, go back and find it with the byte loop.
+    WriteShort(0x2401);
+    WriteShort(0xE48A);
+    outer = WriteCountedLoopHead(2);
+    WriteShort(0xB189);
+    WriteCountedLoopTail(2, outer, 0x56C8, &backup);
+    WriteShort(0x7003);
+    WriteShort(0xC280);
+    bytes3 = Tell();
+    WriteShort(0x6000);
+    FixShortBranch(backup);
+    WriteShort(0x5988);
+    WriteShort(0x5989);
+    WriteShort(0x7204);
+
+    FixShortBranch(bytes);
+    FixShortBranch(bytes2);
+    FixShortBranch(bytes3);
+    WriteShort(0x2401);
+    equal = Tell();
+    WriteShort(0x6700);
+    outer = WriteCountedLoopHead(2);
+    WriteShort(0xB109);
+    WriteCountedLoopTail(2, outer, 0x56C8, &found2);
+    FixShortBranch(equal);
+    WriteShort(0x7000);
+    WriteShort(0x4E75);
+    FixShortBranch(found);
+    FixShortBranch(found2);
+    WriteShort(0x7000);
+    WriteShort(0x7200);
+    WriteShort(0x1020);
+    WriteShort(0x1221);
+    WriteShort(0x9041);
+    WriteShort(0x4E75);
+    return addr;
+}
+
+
+enum {MEM_COPY, MEM_MOVE, MEM_SET, MEM_CMP};
+
+typedef struct {
+    const char *name;
+    uint32_t idx;
+    uint32_t kind;
+    uint32_t old;
+    uint32_t new;
+} MemoryRoutine;
+
+// The simulated routines work in [MEM_TEST_AREA, MEM_TEST_AREA + MEM_TEST_SIZE) of the simulated RAM.
+#define MEM_TEST_AREA  UINT32_C(0x10000)
+#define MEM_TEST_SIZE  UINT32_C(0x20000)
+#define MEM_TEST_INSNS UINT32_C(1000000)
+
+static const uint32_t MemoryTimingSizes[] = {4, 16, 64, 256, 1024, 4096};
+
+//! Call a memory routine in the simulator. For memset, src is the fill value.
+static int SimMemoryRoutine (M68kCpu *cpu, const MemoryRoutine *r, uint32_t entry, uint32_t dst, uint32_t src, uint32_t len) {
+    SimReset(cpu);
+    SimPush(cpu, len, 4);
+    SimPush(cpu, src, (r->kind == MEM_SET) ? 2 : 4);
+    SimPush(cpu, dst, 4);
+    return SimCall(cpu, entry, MEM_TEST_INSNS);
+}
+
+//! Fill the simulated test area with pseudo-random bytes.
+static void FillMemoryTestArea (uint32_t *seed) {
+    uint32_t i;
+
+    for (i = 0; i < MEM_TEST_SIZE; i++) {
+        *seed = *seed * UINT32_C(1103515245) + 12345;
+        SimRAM[MEM_TEST_AREA + i] = (uint8_t)(*seed >> 16);
+    }
+}
+
+//! Check that the routine at entry behaves as r->name for various sizes, alignments and overlaps. Return 0 if it does.
+static int CheckMemoryRoutine (const MemoryRoutine *r, uint32_t entry) {
+    static const uint32_t sizes[] = {0, 1, 2, 3, 4, 5, 7, 8, 15, 16, 17, 18, 31, 32, 33, 47, 48, 49, 63, 64, 65, 100,
+                                     255, 256, 257, 511, 512, 513, 560, 1000, 4099};
+    static const int32_t deltas[] = {-49, -4, -3, -1, 0, 1, 2, 3, 4, 49};
+    uint8_t *expected, *area;
+    uint32_t i, c, ncases, dst, src, len, pos, seed = 1;
+    int32_t want, got;
+    M68kCpu cpu;
+    int ret = 0;
+
+    expected = (uint8_t *)malloc(MEM_TEST_SIZE);
+    if (expected == NULL) {
+        printf("\n    ERROR : not enough memory.\n");
+        return 1;
+    }
+    area = SimRAM + MEM_TEST_AREA;
+    ncases = 4 + ((r->kind == MEM_MOVE) ? NB_BLOCKS(deltas) : 0);
+    for (i = 0; i < NB_BLOCKS(sizes) && !ret; i++) {
+        len = sizes[i];
+        for (c = 0; c < ncases && !ret; c++) {
+            FillMemoryTestArea(&seed);
+            src = MEM_TEST_AREA + (c & 1);
+            dst = MEM_TEST_AREA + MEM_TEST_SIZE / 2 + ((c >> 1) & 1);
+            if (c >= 4) {
+                src = MEM_TEST_AREA + 0x1000;
+                dst = src + deltas[c - 4];
+            }
+            want = 0;
+            if (r->kind == MEM_SET) {
+                src = 0x1200 | (seed & 0xFF);
+            }
+            else if (r->kind == MEM_CMP) {
+                memcpy(SimRAM + dst, SimRAM + src, len);
+                if (len != 0 && (c & 2)) {
+                    pos = seed % len;
+                    SimRAM[dst + pos] ^= (uint8_t)(1 + (seed >> 24) % 255);
+                    want = (int32_t)SimRAM[dst + pos] - (int32_t)SimRAM[src + pos];
+                }
+            }
+            memcpy(expected, area, MEM_TEST_SIZE);
+            if (r->kind == MEM_COPY || r->kind == MEM_MOVE) {
+                memmove(expected + (dst - MEM_TEST_AREA), expected + (src - MEM_TEST_AREA), len);
+            }
+            else if (r->kind == MEM_SET) {
+                memset(expected + (dst - MEM_TEST_AREA), (int)(src & 0xFF), len);
+            }
+
+            if (SimMemoryRoutine(&cpu, r, entry, dst, src, len) != SIM_OK) {
+                printf("    %s at %06" PRIX32 ": %s at %06" PRIX32 ".\n", r->name, entry, SimErrorString(cpu.error), cpu.opaddr);
+                ret = 1;
+            }
+            else if (r->kind == MEM_CMP) {
+                got = (int16_t)cpu.d[0];
+                if (!SameBytes(area, expected, MEM_TEST_SIZE) || (got < 0) != (want < 0) || (got == 0) != (want == 0)) {
+                    ret = 1;
+                }
+            }
+            else if (!SameBytes(area, expected, MEM_TEST_SIZE) || cpu.a[0] != dst) {
+                ret = 1;
+            }
+        }
+    }
+    if (ret && cpu.error == SIM_OK) {
+        printf("    %s at %06" PRIX32 ": wrong result for %" PRIu32 " bytes from %06" PRIX32 " to %06" PRIX32 ".\n",
+               r->name, entry, len, src, dst);
+    }
+    free(expected);
+    return ret;
+}
+
+//! Time the routine at entry on MemoryTimingSizes bytes, with even addresses, or with an odd destination.
+//  memmove copies downwards, to an overlapping destination. memcmp compares identical buffers. Return 0 on success.
+static int TimeMemoryRoutine (const MemoryRoutine *r, uint32_t entry, int odd, uint32_t *cycles) {
+    uint32_t i, seed = 1;
+    uint32_t src = MEM_TEST_AREA;
+    uint32_t dst = MEM_TEST_AREA + MEM_TEST_SIZE / 2 + odd;
+    M68kCpu cpu;
+
+    if (r->kind == MEM_MOVE) {
+        dst = src + 8 + odd;
+    }
+    else if (r->kind == MEM_SET) {
+        src = 0xA5;
+    }
+    for (i = 0; i < NB_BLOCKS(MemoryTimingSizes); i++) {
+        FillMemoryTestArea(&seed);
+        if (r->kind == MEM_CMP) {
+            memcpy(SimRAM + dst, SimRAM + src, MemoryTimingSizes[i]);
+        }
+        if (SimMemoryRoutine(&cpu, r, entry, dst, src, MemoryTimingSizes[i]) != SIM_OK) {
+            return 1;
+        }
+        cycles[i] = cpu.cycles;
+    }
+    return 0;
+}
+
+static void PrintMemoryTimings (const char *name, const char *what, const uint32_t *cycles) {
+    uint32_t i;
+
+    printf("    %-8s%-10s", name, what);
+    for (i = 0; i < NB_BLOCKS(MemoryTimingSizes); i++) {
+        printf("%8" PRIu32, cycles[i]);
+    }
+    printf("\n");
+}
+
+//! Replace memcpy, memmove, memset and memcmp by versions which work on longwords, checked and timed against the
+//  original ones in the 68000 interpreter.
+static void OptimizeAMSMemoryRoutines(void) {
+    MemoryRoutine routines[4] = {
+        {"memcpy",  AMS_memcpy,  MEM_COPY, 0, 0},
+        {"memmove", AMS_memmove, MEM_MOVE, 0, 0},
+        {"memset",  AMS_memset,  MEM_SET,  0, 0},
+        {"memcmp",  memcmp,      MEM_CMP,  0, 0}
+    };
+    uint32_t oldcycles[2][NB_BLOCKS(MemoryTimingSizes)], newcycles[2][NB_BLOCKS(MemoryTimingSizes)];
+    uint32_t start, end, core, i;
+    int accepted[4], odd;
+
+    // 2f) The memory routines of AMS copy, fill and compare byte per byte. The new ones are written to free ROM space,
+    //     then every routine, old and new, runs in the 68000 interpreter on various sizes, alignments and overlaps:
+    //     a new routine is only used if the old one behaves as expected, i.e. the ROM_CALL is what it should be,
+    //     and if the new one gives the same results.
+    start = AllocROMSpace(FAST_MEMORY_CODE_SIZE, 2);
+    if (start == 0) {
+        printf("Not enough free ROM space, skipping the optimization of memory routines !\n");
+        return;
+    }
+    for (i = 0; i < 4; i++) {
+        routines[i].old = rom_call_addr(routines[i].idx);
+    }
+    routines[0].new = WriteFastMemcpy(start, &core);
+    routines[1].new = WriteFastMemmove(Tell(), core);
+    routines[2].new = WriteFastMemset(Tell());
+    routines[3].new = WriteFastMemcmp(Tell());
+    end = Tell();
+    FreeROMSpace(end, start + FAST_MEMORY_CODE_SIZE);
+
+    if (SimInit(ROM_base + UINT32_C(0x12000), BasecodeEnd())) {
+        FreeROMSpace(start, end);
+        return;
+    }
+    printf("Optimizing memory routines, %" PRIu32 " bytes at %06" PRIX32 ", nominal cycles for", end - start, start);
+    for (i = 0; i < NB_BLOCKS(MemoryTimingSizes); i++) {
+        printf(" %" PRIu32, MemoryTimingSizes[i]);
+    }
+    printf(" bytes:\n");
+    for (i = 0; i < 4; i++) {
+        accepted[i] = 0;
+        if (CheckMemoryRoutine(&routines[i], routines[i].old)) {
+            printf("Unexpected data, skipping the optimization of %s !\n", routines[i].name);
+            continue;
+        }
+        if (CheckMemoryRoutine(&routines[i], routines[i].new)) {
+            printf("\n    ERROR : the new %s is wrong, keeping the original one.\n", routines[i].name);
+            continue;
+        }
+        for (odd = 0; odd < 2; odd++) {
+            if (TimeMemoryRoutine(&routines[i], routines[i].old, odd, oldcycles[odd]) || TimeMemoryRoutine(&routines[i], routines[i].new, odd, newcycles[odd])) {
+                break;
+            }
+        }
+        if (odd < 2) {
+            printf("\n    ERROR : timing %s failed, keeping the original one.\n", routines[i].name);
+            continue;
+        }
+        PrintMemoryTimings(routines[i].name, "AMS", oldcycles[0]);
+        PrintMemoryTimings("", "new", newcycles[0]);
+        PrintMemoryTimings("", "AMS, odd", oldcycles[1]);
+        PrintMemoryTimings("", "new, odd", newcycles[1]);
+        accepted[i] = 1;
+    }
+    SimExit();
+
+    // Give the ROM space of the rejected routines back, except that of memcpy while memmove branches into it.
+    for (i = 0; i < 4; i++) {
+        if (accepted[i]) {
+            RedirectAMSrom_call(routines[i].idx, routines[i].new, 0);
+        }
+        else if (i != 0 || !accepted[1]) {
+            FreeROMSpace(routines[i].new, i < 3 ? routines[i + 1].new : end);
+        }
+    }
+}
+
+
+// Upper bound of the size of the graphics routines.
+#define FAST_GRAPHICS_CODE_SIZE 576
+
+//! Write a loop of the fast ScrRectFill over rows at least two words wide, at Tell(). a0 points to the first word
+//  of the first row, d2 is the number of rows - 1, d3 and d4 are the masks of the first and last words, d5 the offset
+//  in the 14 unrolled middle words where the row starts, d7 the value written by move.w d7,(a1)+.
+static void WriteRectFillLoop (uint16_t left, uint16_t middle, uint16_t right) {
+    uint32_t row = Tell();
+    uint32_t i;
+
+    WriteShort(0x2248);
+    WriteShort(left);
+    WriteLong(UINT32_C(0x4EFB5002));
+    for (i = 0; i < 14; i++) {
+        WriteShort(middle);
+    }
+    WriteShort(right);
+    WriteLong(UINT32_C(0x41E8001E));
+    WriteBranch(0x51CA, row);
+}
+
+//! Write a loop of the fast ScrRectFill over rows within a single word, masked by d3, at Tell().
+static void WriteRectFillNarrowLoop (uint16_t op) {
+    uint32_t row = Tell();
+
+    WriteShort(op);
+    WriteLong(UINT32_C(0x41E8001E));
+    WriteBranch(0x51CA, row);
+}
+
+//! Write ScrRectFill at addr. It handles A_REVERSE, A_NORMAL and A_XOR with word masks, other attributes go to
+//  fallback. Ports are 30 bytes per row on all models: on the 89 and 89 Titanium, LCD_MEM is 240 pixels wide too,
+//  only 160 of them are visible.
+static uint32_t WriteFastScrRectFill (uint32_t addr, uint32_t ss, uint32_t fallback) {
+    uint32_t empty, empty2, wide, nnormal, nxor, wnormal, wxor, done[5], i;
+
+    Seek(addr);
+    WriteLong(UINT32_C(0x302F000C));
+    WriteLong(UINT32_C(0x0C400002));
+    WriteBranch(0x6200, fallback);
+    WriteLong(UINT32_C(0x48E71F00));
+    WriteLong(UINT32_C(0x206F0018));
+    WriteLong(UINT32_C(0x226F001C));
+    WriteShort(0x7200);
+    WriteShort(0x7400);
+    WriteShort(0x7600);
+    WriteShort(0x7800);
+    WriteShort(0x7A00);
+    // Intersection of the rectangle, of the clipping rectangle and of the port, in d1-d4.
+    WriteShort(0x1218);
+    WriteShort(0x1A19);
+    WriteShort(0xB245);
+    WriteShort(0x6402);
+    WriteShort(0x3205);
+    WriteShort(0x1418);
+    WriteShort(0x1A19);
+    WriteShort(0xB445);
+    WriteShort(0x6402);
+    WriteShort(0x3405);
+    WriteShort(0x1618);
+    WriteShort(0x1A19);
+    WriteShort(0xB645);
+    WriteShort(0x6302);
+    WriteShort(0x3605);
+    WriteShort(0x1A38);
+    WriteShort(ss + 4);
+    WriteShort(0xB645);
+    WriteShort(0x6302);
+    WriteShort(0x3605);
+    WriteShort(0x1810);
+    WriteShort(0x1A11);
+    WriteShort(0xB845);
+    WriteShort(0x6302);
+    WriteShort(0x3805);
+    WriteShort(0x1A38);
+    WriteShort(ss + 5);
+    WriteShort(0xB845);
+    WriteShort(0x6302);
+    WriteShort(0x3805);
+    WriteShort(0xB641);
+    empty = Tell();
+    WriteLong(UINT32_C(0x65000000));
+    WriteShort(0x9842);
+    empty2 = Tell();
+    WriteLong(UINT32_C(0x65000000));
+    // a0 = ScrAddr + 30 * y0 + 2 * (x0 / 16), d6 = 2 * (x1 / 16 - x0 / 16)
+    WriteShort(0x2078);
+    WriteShort(ss);
+    WriteShort(0x3A02);
+    WriteShort(0xEB4A);
+    WriteShort(0xDA45);
+    WriteShort(0x9445);
+    WriteShort(0xD0C2);
+    WriteShort(0x3A01);
+    WriteShort(0xE84D);
+    WriteShort(0xDA45);
+    WriteShort(0xD0C5);
+    WriteShort(0x3C03);
+    WriteShort(0xE84E);
+    WriteShort(0xDC46);
+    WriteShort(0x9C45);
+    // Masks of the first and last words.
+    WriteShort(0x700F);
+    WriteShort(0xC240);
+    WriteShort(0xC640);
+    WriteShort(0x7AFF);
+    WriteShort(0xE26D);
+    WriteLong(UINT32_C(0x3E3C7FFF));
+    WriteShort(0xE66F);
+    WriteShort(0x4647);
+    WriteShort(0x3404);
+    WriteShort(0x3605);
+    WriteShort(0x3807);
+
+    // Dispatch on the width and on the attribute: A_REVERSE (0), A_NORMAL (1), A_XOR (2).
+    WriteLong(UINT32_C(0x302F0020));
+    WriteShort(0x4A46);
+    wide = Tell();
+    WriteShort(0x6600);
+    WriteShort(0xC644);
+    WriteShort(0x5340);
+    nnormal = Tell();
+    WriteShort(0x6700);
+    nxor = Tell();
+    WriteShort(0x6A00);
+    WriteShort(0x4643);
+    WriteRectFillNarrowLoop(0xC750);
+    done[0] = Tell();
+    WriteLong(UINT32_C(0x60000000));
+    FixShortBranch(nnormal);
+    WriteRectFillNarrowLoop(0x8750);
+    done[1] = Tell();
+    WriteLong(UINT32_C(0x60000000));
+    FixShortBranch(nxor);
+    WriteRectFillNarrowLoop(0xB750);
+    done[2] = Tell();
+    WriteLong(UINT32_C(0x60000000));
+
+    FixShortBranch(wide);
+    WriteShort(0x7A1E);
+    WriteShort(0x9A46);
+    WriteShort(0x5340);
+    wnormal = Tell();
+    WriteShort(0x6700);
+    wxor = Tell();
+    WriteShort(0x6A00);
+    WriteShort(0x4643);
+    WriteShort(0x4644);
+    WriteShort(0x7E00);
+    WriteRectFillLoop(0xC759, 0x32C7, 0xC951);
+    done[3] = Tell();
+    WriteLong(UINT32_C(0x60000000));
+    FixShortBranch(wnormal);
+    WriteShort(0x7EFF);
+    WriteRectFillLoop(0x8759, 0x32C7, 0x8951);
+    done[4] = Tell();
+    WriteLong(UINT32_C(0x60000000));
+    FixShortBranch(wxor);
+    WriteRectFillLoop(0xB759, 0x4659, 0xB951);
+
+    for (i = 0; i < 5; i++) {
+        FixWordBranch(done[i]);
+    }
+    FixWordBranch(empty);
+    FixWordBranch(empty2);
+    WriteLong(UINT32_C(0x4CDF00F8));
+    WriteShort(0x4E75);
+    return addr;
+}
+
+//! Write ScreenClear at addr: ScrRectFill of the whole port with A_REVERSE, then the pen goes to (0,0).
+static uint32_t WriteFastScreenClear (uint32_t addr, uint32_t ss, uint32_t scrrectfill) {
+    Seek(addr);
+    WriteShort(0x598F);
+    WriteShort(0x4257);
+    WriteShort(0x1F78);
+    WriteShort(ss + 4);
+    WriteShort(0x0002);
+    WriteShort(0x1F78);
+    WriteShort(ss + 5);
+    WriteShort(0x0003);
+    WriteShort(0x4267);
+    WriteLong(UINT32_C(0x486F0002));
+    WriteLong(UINT32_C(0x486F0006));
+    WriteBranch(0x6100, scrrectfill);
+    WriteLong(UINT32_C(0x4FEF000E));
+    WriteShort(0x42B8);
+    WriteShort(ss + 10);
+    WriteShort(0x4E75);
+    return addr;
+}
+
+//! Write DrawLine at addr: horizontal lines drawn with A_REVERSE, A_NORMAL or A_XOR, whose ends are in 0..255,
+//  are a ScrRectFill clipped by the clipping rectangle of the port; the other lines go to fallback.
+static uint32_t WriteFastDrawLine (uint32_t addr, uint32_t ss, uint32_t scrrectfill, uint32_t fallback) {
+    Seek(addr);
+    WriteLong(UINT32_C(0x302F0006));
+    WriteLong(UINT32_C(0xB06F000A));
+    WriteBranch(0x6600, fallback);
+    WriteLong(UINT32_C(0x322F000C));
+    WriteLong(UINT32_C(0x0C410002));
+    WriteBranch(0x6200, fallback);
+    WriteLong(UINT32_C(0x0C4000FF));
+    WriteBranch(0x6200, fallback);
+    WriteLong(UINT32_C(0x322F0004));
+    WriteLong(UINT32_C(0x342F0008));
+    WriteShort(0xB441);
+    WriteShort(0x6C02);
+    WriteShort(0xC342);
+    WriteLong(UINT32_C(0x0C4100FF));
+    WriteBranch(0x6200, fallback);
+    WriteLong(UINT32_C(0x0C4200FF));
+    WriteBranch(0x6200, fallback);
+    // SCR_RECT {x0, y, x1, y} on the stack.
+    WriteShort(0x598F);
+    WriteShort(0x1E81);
+    WriteLong(UINT32_C(0x1F400001));
+    WriteLong(UINT32_C(0x1F420002));
+    WriteLong(UINT32_C(0x1F400003));
+    WriteLong(UINT32_C(0x3F2F0010));
+    WriteShort(0x4878);
+    WriteShort(ss + 14);
+    WriteLong(UINT32_C(0x486F0006));
+    WriteBranch(0x6100, scrrectfill);
+    WriteLong(UINT32_C(0x4FEF000E));
+    WriteShort(0x4E75);
+    return addr;
+}
+
+
+enum {GFX_RECT_FILL, GFX_CLEAR, GFX_LINE};
+
+typedef struct {
+    const char *name;
+    uint32_t idx;
+    uint32_t kind;
+    uint32_t old;
+    uint32_t new;
+} GraphicsRoutine;
+
+// The simulated port is LCD_MEM, the rectangles passed by pointer are at GFX_TEST_ARGS.
+#define GFX_TEST_LCD      UINT32_C(0x4C00)
+#define GFX_TEST_LCD_SIZE (30 * 128)
+#define GFX_TEST_ARGS     UINT32_C(0x30000)
+#define GFX_TEST_INSNS    UINT32_C(1000000)
+// Size of the part of SCR_STATE compared after the calls: ScrAddr, XMax, YMax, CurFont, CurAttr, CurX, CurY, CurClip.
+#define SCR_STATE_SIZE    (18)
+
+//! Fill the simulated LCD with pseudo-random bytes, and set up the port as PortSet and SetCurClip would.
+static void SetupGraphicsTest (uint32_t ss, uint32_t *seed, uint8_t xmax, uint8_t ymax) {
+    uint8_t state[SCR_STATE_SIZE] = {0, 0, GFX_TEST_LCD >> 8, GFX_TEST_LCD & 0xFF, 0, 0, 0, 1, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0};
+    uint32_t i;
+
+    for (i = 0; i < GFX_TEST_LCD_SIZE; i++) {
+        *seed = *seed * UINT32_C(1103515245) + 12345;
+        SimRAM[GFX_TEST_LCD + i] = (uint8_t)(*seed >> 16);
+    }
+    state[4] = xmax;
+    state[5] = ymax;
+    state[11] = (uint8_t)(*seed >> 8) % xmax;
+    state[13] = (uint8_t)(*seed >> 24) % ymax;
+    state[16] = xmax;
+    state[17] = ymax;
+    memcpy(SimRAM + ss, state, SCR_STATE_SIZE);
+}
+
+//! Call a graphics routine in the simulator. args are the rectangle, the clipping rectangle and the attribute for
+//  ScrRectFill, x0, y0, x1, y1 and the attribute for DrawLine.
+static int SimGraphicsRoutine (M68kCpu *cpu, const GraphicsRoutine *r, uint32_t entry, const int16_t *args) {
+    int i;
+
+    SimReset(cpu);
+    if (r->kind == GFX_RECT_FILL) {
+        for (i = 0; i < 8; i++) {
+            SimRAM[GFX_TEST_ARGS + i] = (uint8_t)args[i];
+        }
+        SimPush(cpu, (uint16_t)args[8], 2);
+        SimPush(cpu, GFX_TEST_ARGS + 4, 4);
+        SimPush(cpu, GFX_TEST_ARGS, 4);
+    }
+    else if (r->kind == GFX_LINE) {
+        for (i = 4; i >= 0; i--) {
+            SimPush(cpu, (uint16_t)args[i], 2);
+        }
+    }
+    return SimCall(cpu, entry, GFX_TEST_INSNS);
+}
+
+//! Random coordinate, mostly in 0..max, sometimes out of the port.
+static int16_t RandomCoordinate (uint32_t *seed, uint32_t max) {
+    *seed = *seed * UINT32_C(1103515245) + 12345;
+    if ((*seed >> 28) < 12) {
+        return (int16_t)((*seed >> 8) % (max + 1));
+    }
+    return (int16_t)((int32_t)((*seed >> 8) % (max + 41)) - 20);
+}
+
+//! Check that the new routine draws exactly as the old one in ports of the size of the LCD of the model and of
+//  240x128 pixels, for random rectangles, lines and attributes. Return 0 if it does.
+static int CheckGraphicsRoutine (const GraphicsRoutine *r, uint32_t ss) {
+    uint8_t before[GFX_TEST_LCD_SIZE + SCR_STATE_SIZE], after[GFX_TEST_LCD_SIZE + SCR_STATE_SIZE];
+    uint32_t i, j, xmax, ymax, seed = 1;
+    int16_t args[9];
+    M68kCpu cpu;
+
+    for (i = 0; i < 400; i++) {
+        xmax = 239;
+        ymax = 127;
+        if ((i & 1) && (CalculatorType == TI89 || CalculatorType == TI89T)) {
+            xmax = 159;
+            ymax = 99;
+        }
+        SetupGraphicsTest(ss, &seed, (uint8_t)xmax, (uint8_t)ymax);
+        for (j = 0; j < 4; j++) {
+            args[2 * j] = RandomCoordinate(&seed, xmax);
+            args[2 * j + 1] = RandomCoordinate(&seed, ymax);
+        }
+        args[8] = (int16_t)(seed >> 8) % 4;
+        if (r->kind == GFX_RECT_FILL) {
+            // Both rectangles are ordered and made of bytes, the clipping rectangle is within the port.
+            for (j = 0; j < 8; j++) {
+                if (args[j] < 0) {
+                    args[j] = -args[j];
+                }
+                if (j >= 4) {
+                    args[j] = (int16_t)(args[j] % (((j & 1) ? ymax : xmax) + 1));
+                }
+                else if (args[j] > 255) {
+                    args[j] = 255;
+                }
+            }
+            for (j = 0; j < 8; j++) {
+                if ((j & 2) && args[j - 2] > args[j]) {
+                    int16_t temp = args[j - 2];
+                    args[j - 2] = args[j];
+                    args[j] = temp;
+                }
+            }
+        }
+        else if (r->kind == GFX_LINE) {
+            args[4] = args[8];
+            if (i & 2) {
+                args[3] = args[1];
+            }
+            // Clipping rectangle smaller than the port.
+            SimRAM[ss + 14] = 3;
+            SimRAM[ss + 15] = 2;
+            SimRAM[ss + 16] = (uint8_t)(xmax - 5);
+            SimRAM[ss + 17] = (uint8_t)(ymax - 1);
+        }
+        memcpy(before, SimRAM + GFX_TEST_LCD, GFX_TEST_LCD_SIZE);
+        memcpy(before + GFX_TEST_LCD_SIZE, SimRAM + ss, SCR_STATE_SIZE);
+        if (SimGraphicsRoutine(&cpu, r, r->old, args) != SIM_OK) {
+            printf("    %s at %06" PRIX32 ": %s at %06" PRIX32 ".\n", r->name, r->old, SimErrorString(cpu.error), cpu.opaddr);
+            return 1;
+        }
+        memcpy(after, SimRAM + GFX_TEST_LCD, GFX_TEST_LCD_SIZE);
+        memcpy(after + GFX_TEST_LCD_SIZE, SimRAM + ss, SCR_STATE_SIZE);
+        memcpy(SimRAM + GFX_TEST_LCD, before, GFX_TEST_LCD_SIZE);
+        memcpy(SimRAM + ss, before + GFX_TEST_LCD_SIZE, SCR_STATE_SIZE);
+        if (   SimGraphicsRoutine(&cpu, r, r->new, args) != SIM_OK
+            || !SameBytes(after, SimRAM + GFX_TEST_LCD, GFX_TEST_LCD_SIZE)
+            || !SameBytes(after + GFX_TEST_LCD_SIZE, SimRAM + ss, SCR_STATE_SIZE)) {
+            printf("    %s: different results for %d,%d,%d,%d %d,%d,%d,%d %d in a %" PRIu32 "x%" PRIu32 " port.\n", r->name,
+                   args[0], args[1], args[2], args[3], args[4], args[5], args[6], args[7], args[8], xmax + 1, ymax + 1);
+            return 1;
+        }
+        if (r->kind == GFX_CLEAR && i >= 8) {
+            break;
+        }
+    }
+    return 0;
+}
+
+//! Time the old and new routines on a typical call.
+static int TimeGraphicsRoutine (const GraphicsRoutine *r, uint32_t ss, const int16_t *args, const char *what) {
+    uint32_t oldcycles, seed = 1;
+    uint8_t ymax = (CalculatorType == TI89 || CalculatorType == TI89T) ? 99 : 127;
+    uint8_t xmax = (CalculatorType == TI89 || CalculatorType == TI89T) ? 159 : 239;
+    M68kCpu cpu;
+
+    SetupGraphicsTest(ss, &seed, xmax, ymax);
+    if (SimGraphicsRoutine(&cpu, r, r->old, args) != SIM_OK) {
+        return 1;
+    }
+    oldcycles = cpu.cycles;
+    SetupGraphicsTest(ss, &seed, xmax, ymax);
+    if (SimGraphicsRoutine(&cpu, r, r->new, args) != SIM_OK) {
+        return 1;
+    }
+    printf("    %-12s%-24s%8" PRIu32 "%8" PRIu32 "\n", r->name, what, oldcycles, cpu.cycles);
+    return 0;
+}
+
+//! Replace ScrRectFill, ScreenClear and DrawLine by versions which work on words, checked and timed against the
+//  original ones in the 68000 interpreter.
+static void OptimizeAMSGraphics(void) {
+    GraphicsRoutine routines[3] = {
+        {"ScrRectFill", ScrRectFill, GFX_RECT_FILL, 0, 0},
+        {"ScreenClear", ScreenClear, GFX_CLEAR,     0, 0},
+        {"DrawLine",    DrawLine,    GFX_LINE,      0, 0}
+    };
+    static const int16_t small[9]  = {13, 17, 20, 24, 0, 0, 239, 127, 1};
+    static const int16_t medium[9] = {30, 20, 129, 49, 0, 0, 239, 127, 2};
+    static const int16_t whole[9]  = {0, 0, 239, 127, 0, 0, 239, 127, 0};
+    static const int16_t line[5]   = {10, 50, 150, 50, 1};
+    uint32_t ss, start, end, i;
+    int accepted[3];
+
+    // 2g) ScrRectFill fills rows word by word with masks at both ends, the middle words being stored by an unrolled
+    //     sequence entered at the right place; ScreenClear and horizontal lines drawn by DrawLine use it.
+    //     As for the memory routines, the old and new routines run in the 68000 interpreter, on the simulated LCD
+    //     memory, and a routine is only replaced if both draw exactly the same things.
+    //     LCD_save and LCD_restore are not ROM_CALLs, but memcpy calls: see ams-fast-memory-routines.
+    //     BitmapGet and BitmapPut are left as they are: they shift every source byte of a row anyway, and the clipping
+    //     and the attributes of BitmapPut would make a new routine several times larger than ScrRectFill.
+    ss = GetAMSScrState();
+    // The new routines read the port with absolute short addressing.
+    start = (ss != 0 && ss < 0x8000) ? AllocROMSpace(FAST_GRAPHICS_CODE_SIZE, 2) : 0;
+    if (start == 0) {
+        printf("Unexpected data or not enough free ROM space, skipping the optimization of graphics routines !\n");
+        return;
+    }
+    for (i = 0; i < 3; i++) {
+        routines[i].old = rom_call_addr(routines[i].idx);
+    }
+    routines[0].new = WriteFastScrRectFill(start, ss, routines[0].old);
+    routines[1].new = WriteFastScreenClear(Tell(), ss, routines[0].new);
+    routines[2].new = WriteFastDrawLine(Tell(), ss, routines[0].new, routines[2].old);
+    end = Tell();
+    FreeROMSpace(end, start + FAST_GRAPHICS_CODE_SIZE);
+
+    if (SimInit(ROM_base + UINT32_C(0x12000), BasecodeEnd())) {
+        FreeROMSpace(start, end);
+        return;
+    }
+    printf("Optimizing graphics routines, %" PRIu32 " bytes at %06" PRIX32 ", nominal cycles of AMS and new routines:\n", end - start, start);
+    for (i = 0; i < 3; i++) {
+        accepted[i] = 0;
+        // ScreenClear and DrawLine use the new ScrRectFill.
+        if (i > 0 && !accepted[0]) {
+            continue;
+        }
+        if (CheckGraphicsRoutine(&routines[i], ss)) {
+            printf("Unexpected data, skipping the optimization of %s !\n", routines[i].name);
+            continue;
+        }
+        accepted[i] = 1;
+    }
+    if (accepted[0]) {
+        TimeGraphicsRoutine(&routines[0], ss, small, "8x8, A_NORMAL");
+        TimeGraphicsRoutine(&routines[0], ss, medium, "100x30, A_XOR");
+        TimeGraphicsRoutine(&routines[0], ss, whole, "240x128, A_REVERSE");
+    }
+    if (accepted[1]) {
+        TimeGraphicsRoutine(&routines[1], ss, whole, "");
+    }
+    if (accepted[2]) {
+        TimeGraphicsRoutine(&routines[2], ss, line, "141 pixels, A_NORMAL");
+    }
+    SimExit();
+
+    // Give the ROM space of the rejected routines back: ScreenClear and DrawLine are only accepted with ScrRectFill.
+    for (i = 0; i < 3; i++) {
+        if (accepted[i]) {
+            RedirectAMSrom_call(routines[i].idx, routines[i].new, 1);
+        }
+        else {
+            FreeROMSpace(routines[i].new, i < 2 ? routines[i + 1].new : end);
+        }
+    }
+}
+
+
+// Classes of estack tags in the table of the fast next_expression_index: 1 to 0x3F is the size of a tag followed by
+// fixed-size data, TAG_ARITY + n a tag followed by n expressions.
+#define TAG_FALLBACK  (0x00)
+#define TAG_ARITY     (0x40)
+#define TAG_LIST      (0x80)  // Expressions up to END_TAG.
+#define TAG_INTEGER   (0x81)  // Size byte, then the bytes of the number.
+#define TAG_NAME      (0x82)  // Characters up to a zero byte, the tag being the terminating zero.
+#define TAG_STRING    (0x83)  // Terminating zero, then characters up to a zero byte.
+#define END_TAG       (0xE5)
+#define LIST_TAG      (0xD9)
+#define ADD_TAG       (0x8B)
+#define POSINT_TAG    (0x1F)
+// Upper bound of the size of the code of next_expression_index, followed by its 256-byte table.
+#define FAST_ESTACK_CODE_SIZE (144)
+
+//! Write the table-driven next_expression_index at addr, return the address of its table. Expressions still to skip
+//  are counted in d1; when a list starts, d1 is pushed and the elements are skipped up to END_TAG. Tags of class
+//  TAG_FALLBACK are skipped by the original routine.
+static uint32_t WriteFastNextExpressionIndex (uint32_t addr, uint32_t old) {
+    uint32_t table, loop, next, arity, special, list, check, element, integer, name, fallback;
+
+    Seek(addr);
+    WriteLong(UINT32_C(0x206F0004));
+    table = Tell();
+    WriteLong(UINT32_C(0x43FA0000));
+    WriteShort(0x42A7);
+    WriteShort(0x7201);
+    loop = Tell();
+    WriteShort(0x7000);
+    WriteShort(0x1010);
+    WriteLong(UINT32_C(0x10310000));
+    special = Tell();
+    WriteShort(0x6B00);
+    fallback = Tell();
+    WriteShort(0x6700);
+    WriteLong(UINT32_C(0x0C000040));
+    arity = Tell();
+    WriteShort(0x6400);
+    WriteShort(0x90C0);
+    next = Tell();
+    WriteShort(0x5341);
+    WriteBranch(0x6600, loop);
+    WriteShort(0x4A97);
+    check = Tell();
+    WriteShort(0x6600);
+    WriteShort(0x588F);
+    WriteShort(0x4E75);
+
+    FixShortBranch(arity);
+    WriteShort(0x5388);
+    WriteShort(0xD240);
+    WriteLong(UINT32_C(0x04410041));
+    WriteBranch(0x6000, loop);
+
+    FixShortBranch(special);
+    WriteLong(UINT32_C(0x04000081));
+    list = Tell();
+    WriteShort(0x6B00);
+    integer = Tell();
+    WriteShort(0x6700);
+    WriteShort(0x5300);
+    name = Tell();
+    WriteShort(0x6700);
+    WriteShort(0x5388);
+    FixShortBranch(name);
+    name = Tell();
+    WriteShort(0x4A20);
+    WriteShort(0x66FC);
+    WriteShort(0x5388);
+    WriteBranch(0x6000, next);
+    FixShortBranch(integer);
+    WriteShort(0x1020);
+    WriteShort(0x90C0);
+    WriteShort(0x5388);
+    WriteBranch(0x6000, next);
+
+    FixShortBranch(list);
+    WriteShort(0x5388);
+    WriteShort(0x2F01);
+    FixShortBranch(check);
+    WriteLong(UINT32_C(0x0C100000) | END_TAG);
+    element = Tell();
+    WriteShort(0x6600);
+    WriteShort(0x5388);
+    WriteShort(0x221F);
+    WriteBranch(0x6000, next);
+    FixShortBranch(element);
+    WriteShort(0x7201);
+    WriteBranch(0x6000, loop);
+
+    FixShortBranch(fallback);
+    WriteLong(UINT32_C(0x48E74040));
+    WriteShort(0x4850);
+    WriteShort(0x4EB9);
+    WriteLong(old);
+    WriteShort(0x588F);
+    WriteLong(UINT32_C(0x4CDF0202));
+    WriteBranch(0x6000, next);
+
+    next = Tell();
+    PutShort((uint16_t)(next - table - 2), table + 2);
+    return next;
+}
+
+// The expressions are built so that they end at the end of the test area, the rest of the area being filled with
+// pseudo-random bytes.
+#define ESTACK_TEST_AREA  UINT32_C(0x20000)
+#define ESTACK_TEST_SIZE  UINT32_C(0x4000)
+#define ESTACK_TEST_INSNS UINT32_C(2000000)
+
+//! Pseudo-random number in 0..n-1.
+static uint32_t EstackRandom (uint32_t *seed, uint32_t n) {
+    *seed = *seed * UINT32_C(1103515245) + 12345;
+    return (*seed >> 8) % n;
+}
+
+//! Run next_expression_index at entry on the expression of len bytes ending at the end of the test area, preceded by
+//  pseudo-random bytes. Return the number of bytes skipped, or 0 if the call failed or went out of the test area.
+static uint32_t SimNextExpressionIndex (uint32_t entry, const uint8_t *expr, uint32_t len, uint32_t *seed, uint32_t *cycles) {
+    uint32_t ptr = ESTACK_TEST_AREA + ESTACK_TEST_SIZE - 1;
+    uint32_t i, result;
+    M68kCpu cpu;
+
+    for (i = 0; i < ESTACK_TEST_SIZE - len; i++) {
+        SimRAM[ESTACK_TEST_AREA + i] = (uint8_t)EstackRandom(seed, 256);
+    }
+    memcpy(SimRAM + ESTACK_TEST_AREA + ESTACK_TEST_SIZE - len, expr, len);
+    SimReset(&cpu);
+    SimPush(&cpu, ptr, 4);
+    if (SimCall(&cpu, entry, ESTACK_TEST_INSNS) != SIM_OK) {
+        return 0;
+    }
+    if (cycles != NULL) {
+        *cycles = cpu.cycles;
+    }
+    result = cpu.a[0];
+    if (result >= ptr || result < ESTACK_TEST_AREA - 1) {
+        return 0;
+    }
+    return ptr - result;
+}
+
+//! Append an expression of tag to expr, or of a random tag of known class in table if tag is 256. Its subexpressions
+//  have depth - 1 levels at most, and random tags of known class. Return 1 if it does not fit in size bytes.
+static int GenerateExpression (const uint8_t *table, uint32_t tag, uint8_t *expr, uint32_t *len, uint32_t size, uint32_t depth, uint32_t *seed) {
+    uint32_t class, i, n;
+
+    // Look for a tag of known class, without subexpressions at depth 0.
+    for (i = 0; tag > 255; i++) {
+        tag = EstackRandom(seed, 256);
+        class = table[tag];
+        if (class == TAG_FALLBACK || (depth == 0 && class >= TAG_ARITY && class <= TAG_LIST)) {
+            tag = 256;
+        }
+        if (i == 4096) {
+            return 1;
+        }
+    }
+    class = table[tag];
+    if (*len + 64 > size) {
+        return 1;
+    }
+    if (class < TAG_ARITY) {
+        for (i = 1; i < class; i++) {
+            expr[(*len)++] = (uint8_t)EstackRandom(seed, 256);
+        }
+    }
+    else if (class <= TAG_LIST) {
+        n = class - TAG_ARITY;
+        if (class == TAG_LIST) {
+            expr[(*len)++] = END_TAG;
+            n = EstackRandom(seed, 5);
+        }
+        for (i = 0; i < n; i++) {
+            if (GenerateExpression(table, 256, expr, len, size, depth - 1, seed)) {
+                return 1;
+            }
+        }
+    }
+    else if (class == TAG_INTEGER) {
+        n = EstackRandom(seed, 9);
+        for (i = 0; i < n; i++) {
+            expr[(*len)++] = (uint8_t)EstackRandom(seed, 256);
+        }
+        expr[(*len)++] = (uint8_t)n;
+    }
+    else {
+        expr[(*len)++] = 0;
+        n = EstackRandom(seed, 9);
+        for (i = 0; i < n; i++) {
+            expr[(*len)++] = (uint8_t)(1 + EstackRandom(seed, 255));
+        }
+        if (class == TAG_STRING) {
+            expr[(*len)++] = 0;
+        }
+    }
+    expr[(*len)++] = (uint8_t)tag;
+    return 0;
+}
+
+//! Find the class of tag from the behaviour of the original next_expression_index at old. In pass 0, look for classes
+//  without subexpressions; in pass 1, for the other classes, with subexpressions made of the tags classified in pass 0.
+//  A string is tried after the tags with one argument, which it looks like when the argument is a variable name.
+static uint8_t ClassifyTag (uint32_t old, uint8_t *table, uint32_t tag, int pass, uint32_t *seed) {
+    static const uint8_t classes[2][5] = {
+        {TAG_INTEGER, TAG_NAME, TAG_FALLBACK, TAG_FALLBACK, TAG_FALLBACK},
+        {TAG_ARITY + 1, TAG_ARITY + 2, TAG_ARITY + 3, TAG_LIST, TAG_STRING}
+    };
+    uint8_t expr[256];
+    uint32_t size, len, i, j;
+
+    if (pass == 0) {
+        // Fixed size, whatever precedes the tag.
+        expr[0] = (uint8_t)tag;
+        size = SimNextExpressionIndex(old, expr, 1, seed, NULL);
+        for (i = 0; i < 8 && size != 0 && size < TAG_ARITY; i++) {
+            if (SimNextExpressionIndex(old, expr, 1, seed, NULL) != size) {
+                break;
+            }
+        }
+        if (i == 8) {
+            return (uint8_t)size;
+        }
+    }
+    for (j = 0; j < 5 && classes[pass][j] != TAG_FALLBACK; j++) {
+        table[tag] = classes[pass][j];
+        for (i = 0; i < 8; i++) {
+            len = 0;
+            if (   GenerateExpression(table, tag, expr, &len, sizeof(expr), 1, seed)
+                || SimNextExpressionIndex(old, expr, len, seed, NULL) != len) {
+                break;
+            }
+        }
+        table[tag] = TAG_FALLBACK;
+        if (i == 8) {
+            return classes[pass][j];
+        }
+    }
+    return TAG_FALLBACK;
+}
+
+//! Compare the original and new routines on n random expressions of given depth, rooted at tag, or at any tag of known
+//  class if tag is 256. Return 0 if both skip each expression exactly.
+static int CheckNextExpressionIndex (uint32_t old, uint32_t new, const uint8_t *table, uint32_t tag, uint32_t depth, uint32_t n, uint32_t *seed) {
+    static uint8_t expr[ESTACK_TEST_SIZE / 2];
+    uint32_t i, len, state;
+
+    for (i = 0; i < n; i++) {
+        len = 0;
+        if (GenerateExpression(table, tag, expr, &len, sizeof(expr), depth, seed)) {
+            continue;
+        }
+        state = *seed;
+        if (SimNextExpressionIndex(old, expr, len, seed, NULL) != len) {
+            return 1;
+        }
+        *seed = state;
+        if (SimNextExpressionIndex(new, expr, len, seed, NULL) != len) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//! Replace next_expression_index by a table-driven version. The class of each tag is found by running the original
+//  routine on expressions of each class in the 68000 interpreter; then both routines are compared on random
+//  expressions rooted at each tag, and tags on which they differ are left to the original routine.
+static void OptimizeAMSEstackTraversal(void) {
+    static const uint32_t sizes[3] = {1, 2, 4};
+    static uint8_t expr[ESTACK_TEST_SIZE / 2];
+    uint8_t table[256];
+    uint32_t old, new, start, tableaddr, tag, seed = 1, known = 0, i, len, oldcycles, newcycles;
+    int pass;
+
+    // 2h) next_expression_index is called in tight loops by most of the CAS and by list operations. The new one is
+    //     iterative and looks the class of each tag up in a 256-byte table, in the spirit of the routines that Samuel
+    //     Stearley wrote for Hail. Other estack traversal routines call next_expression_index, their calls are
+    //     retargeted to the new routine.
+    old = rom_call_addr(next_expression_index);
+    start = AllocROMSpace(FAST_ESTACK_CODE_SIZE + 256, 2);
+    if (start == 0) {
+        printf("Not enough free ROM space, skipping the optimization of next_expression_index !\n");
+        return;
+    }
+    tableaddr = WriteFastNextExpressionIndex(start, old);
+    new = start;
+    if (tableaddr + 256 > start + FAST_ESTACK_CODE_SIZE + 256) {
+        printf("\n    ERROR : the new next_expression_index is larger than FAST_ESTACK_CODE_SIZE, skipping it.\n");
+        FreeROMSpace(start, start + FAST_ESTACK_CODE_SIZE + 256);
+        return;
+    }
+    FreeROMSpace(tableaddr + 256, start + FAST_ESTACK_CODE_SIZE + 256);
+
+    if (SimInit(ROM_base + UINT32_C(0x12000), BasecodeEnd())) {
+        FreeROMSpace(start, tableaddr + 256);
+        return;
+    }
+    memset(table, TAG_FALLBACK, sizeof(table));
+    for (pass = 0; pass < 2; pass++) {
+        for (tag = 0; tag < 256; tag++) {
+            if (table[tag] == TAG_FALLBACK) {
+                table[tag] = ClassifyTag(old, table, tag, pass, &seed);
+            }
+        }
+    }
+    if (table[POSINT_TAG] != TAG_INTEGER || table[LIST_TAG] != TAG_LIST || table[ADD_TAG] != TAG_ARITY + 2) {
+        SimExit();
+        printf("Unexpected data, skipping the optimization of next_expression_index !\n");
+        FreeROMSpace(start, tableaddr + 256);
+        return;
+    }
+
+    // The table in the simulated ROM is changed along with the local copy.
+    memcpy(SimROM + tableaddr - SimROMStart, table, sizeof(table));
+    for (tag = 0; tag < 256; tag++) {
+        if (table[tag] != TAG_FALLBACK && CheckNextExpressionIndex(old, new, table, tag, 2, 32, &seed)) {
+            table[tag] = TAG_FALLBACK;
+            SimROM[tableaddr + tag - SimROMStart] = TAG_FALLBACK;
+        }
+    }
+    for (tag = 0; tag < 256; tag++) {
+        known += (table[tag] != TAG_FALLBACK);
+    }
+    if (CheckNextExpressionIndex(old, new, table, 256, 6, 256, &seed)) {
+        SimExit();
+        printf("Unexpected data, skipping the optimization of next_expression_index !\n");
+        FreeROMSpace(start, tableaddr + 256);
+        return;
+    }
+    PutNBytes(table, sizeof(table), tableaddr);
+
+    printf("Optimizing next_expression_index, %" PRIu32 " bytes at %06" PRIX32 ", %" PRIu32 " tags in the table, nominal cycles of AMS and new routines:\n", tableaddr + 256 - start, start, known);
+    for (i = 0; i < NB_BLOCKS(sizes); i++) {
+        // Lists of 10, 20 and 40 random expressions of depth 1, 2 and 4.
+        len = 0;
+        expr[len++] = END_TAG;
+        for (tag = 0; tag < 10 * sizes[i]; tag++) {
+            if (GenerateExpression(table, 256, expr, &len, sizeof(expr), sizes[i], &seed)) {
+                break;
+            }
+        }
+        expr[len++] = LIST_TAG;
+        if (   SimNextExpressionIndex(old, expr, len, &seed, &oldcycles) == len
+            && SimNextExpressionIndex(new, expr, len, &seed, &newcycles) == len) {
+            printf("    list of %4" PRIu32 " bytes%12" PRIu32 "%8" PRIu32 "\n", len, oldcycles, newcycles);
+        }
+    }
+    SimExit();
+
+    RedirectAMSrom_call(next_expression_index, new, 1);
+}
+
+
+// OO_SYSTEM_FRAME: handles are below it, frame pointers above it.
+#define OO_SYSTEM_FRAME  UINT32_C(0x10000)
+#define OO_TEST_VALUE    UINT32_C(0x30000)
+#define OO_TEST_INSNS    UINT32_C(1000000)
+// Upper bound of the size of each of the new OO_CondGetAttr and OO_GetAttr.
+#define FAST_OO_GETATTR_CODE_SIZE (112)
+
+//! Compare attributes as unsigned numbers, for qsort.
+static int CompareAttributes (const void *a, const void *b) {
+    uint32_t x = ((const uint32_t *)a)[0];
+    uint32_t y = ((const uint32_t *)b)[0];
+    return (x > y) - (x < y);
+}
+
+//! Write the lookup of OO_CondGetAttr (cond != 0) or OO_GetAttr at addr. OO_SYSTEM_FRAME, while no localization is
+//  hooked to the RAM variable var, and AMS_Frame itself are searched by dichotomy in the sorted (attribute, value)
+//  pairs at table; the other frames, and the attributes which AMS_Frame does not hold, go to fallback.
+static uint32_t WriteFastOOGetAttr (uint32_t addr, int cond, uint32_t var, uint32_t table, uint32_t n, uint32_t fallback) {
+    uint32_t fast, loop, lower, found;
+
+    Seek(addr);
+    WriteLong(UINT32_C(0x202F0004));
+    WriteShort(0xB0BC);
+    WriteLong(AMS_Frame);
+    fast = Tell();
+    WriteShort(0x6700);
+    WriteShort(0xB0BC);
+    WriteLong(OO_SYSTEM_FRAME);
+    WriteBranch(0x6600, fallback);
+    if (var < 0x8000) {
+        WriteShort(0x0CB8);
+        WriteLong(AMS_Frame);
+        WriteShort(var);
+    }
+    else {
+        WriteShort(0x0CB9);
+        WriteLong(AMS_Frame);
+        WriteLong(var);
+    }
+    WriteBranch(0x6600, fallback);
+    FixShortBranch(fast);
+    WriteLong(UINT32_C(0x222F0008));
+    WriteShort(0x41F9);
+    WriteLong(table);
+    WriteLong(UINT32_C(0x43E80000) | (n * 8));
+    loop = Tell();
+    WriteShort(0x2009);
+    WriteShort(0x9088);
+    WriteBranch(0x6700, fallback);
+    WriteShort(0xE288);
+    WriteLong(UINT32_C(0x0240FFF8));
+    WriteLong(UINT32_C(0xB2B00800));
+    found = Tell();
+    WriteShort(0x6700);
+    lower = Tell();
+    WriteShort(0x6500);
+    WriteLong(UINT32_C(0x41F00808));
+    WriteBranch(0x6000, loop);
+    FixShortBranch(lower);
+    WriteLong(UINT32_C(0x43F00800));
+    WriteBranch(0x6000, loop);
+    FixShortBranch(found);
+    if (cond) {
+        WriteLong(UINT32_C(0x226F000C));
+        WriteLong(UINT32_C(0x22B00804));
+        WriteShort(0x7001);
+    }
+    else {
+        WriteLong(UINT32_C(0x20300804));
+        WriteShort(0x2040);
+    }
+    WriteShort(0x4E75);
+    return addr;
+}
+
+//! Call OO_CondGetAttr (cond != 0) or OO_GetAttr at entry on frame and attr in the simulator, with the system frame
+//  pointer at var. Return 1 and store the value if the attribute is found, 0 if not, -1 if the call failed.
+static int SimOOGetAttr (uint32_t entry, int cond, uint32_t var, uint32_t frame, uint32_t attr, uint32_t *value, uint32_t *cycles) {
+    M68kCpu cpu;
+
+    SimReset(&cpu);
+    SimWrite(&cpu, var, 4, AMS_Frame);
+    SimWrite(&cpu, OO_TEST_VALUE, 4, 0);
+    if (cond) {
+        SimPush(&cpu, OO_TEST_VALUE, 4);
+    }
+    SimPush(&cpu, attr, 4);
+    SimPush(&cpu, frame, 4);
+    if (SimCall(&cpu, entry, OO_TEST_INSNS) != SIM_OK) {
+        return -1;
+    }
+    *cycles = cpu.cycles;
+    if (cond) {
+        *value = SimRead(&cpu, OO_TEST_VALUE, 4);
+        return (cpu.d[0] & 0xFFFF) != 0;
+    }
+    // OO_GetAttr returns a pointer.
+    *value = cpu.a[0];
+    return 1;
+}
+
+//! Make OO_CondGetAttr and OO_GetAttr look attributes of the system frame up by dichotomy in a sorted copy of the
+//  (attribute, value) pairs of AMS_Frame, instead of walking the frame. Each routine is only replaced if, in the
+//  68000 interpreter, the original finds every attribute of AMS_Frame and the new one gives the same results.
+static void OptimizeAMSFrameLookup(void) {
+    static const struct {
+        const char *name;
+        uint32_t idx;
+        int cond;
+    } routines[2] = {{"OO_CondGetAttr", OO_CondGetAttr, 1}, {"OO_GetAttr", OO_GetAttr, 0}};
+    uint32_t *pairs;
+    uint32_t frame, var, n, i, j, k, table, code, old, new, value, value2, cycles, cycles2, total, total2, frames[2];
+    int found, found2, accepted = 0;
+
+    // 2i) The system frame is a list of (attribute, value) pairs, walked from the start by every OO_GetAttr, e.g. for
+    //     fonts, strings and application attributes. The new lookup is done in O(log n) when the frame is
+    //     AMS_Frame, or OO_SYSTEM_FRAME while no localization is hooked.
+    frame = GetAMSFrame();
+    var = GetAMSSystemFramePointer();
+    n = GetLong(frame + 0x0E) + 1;
+    if (var == 0 || var >= SIM_RAM_SIZE || n == 0 || n >= 4096) {
+        printf("Unexpected data, skipping the optimization of OO_GetAttr !\n");
+        return;
+    }
+    pairs = (uint32_t *)malloc(n * 8);
+    if (pairs == NULL) {
+        printf("\n    ERROR : not enough memory.\n");
+        return;
+    }
+    // The walk finds the first pair of a given attribute: drop the later ones.
+    Seek(frame + 0x12);
+    for (i = 0, k = 0; i < n; i++) {
+        pairs[2 * k] = ReadLong();
+        pairs[2 * k + 1] = ReadLong();
+        for (j = 0; j < k && pairs[2 * j] != pairs[2 * k]; j++);
+        k += (j == k);
+    }
+    n = k;
+    qsort(pairs, n, 8, CompareAttributes);
+
+    table = AllocROMSpace(n * 8 + 2 * FAST_OO_GETATTR_CODE_SIZE, 2);
+    if (table == 0) {
+        free(pairs);
+        printf("Not enough free ROM space, skipping the optimization of OO_GetAttr !\n");
+        return;
+    }
+    Seek(table);
+    for (i = 0; i < 2 * n; i++) {
+        WriteLong(pairs[i]);
+    }
+    code = Tell();
+    frames[0] = frame;
+    frames[1] = OO_SYSTEM_FRAME;
+    printf("Optimizing OO_GetAttr, %" PRIu32 " attributes at %06" PRIX32 ", average nominal cycles of AMS and new routines:\n", n, table);
+    for (i = 0; i < 2; i++) {
+        old = rom_call_addr(routines[i].idx);
+        new = WriteFastOOGetAttr(code, routines[i].cond, var, table, n, old);
+        code = Tell();
+        if (SimInit(ROM_base + UINT32_C(0x12000), BasecodeEnd())) {
+            code = new;
+            break;
+        }
+        // Every attribute of AMS_Frame, through both ways of designating it. For OO_CondGetAttr, also the attributes
+        // next to them, which may be held by its prototypes or missing.
+        total = total2 = 0;
+        for (j = 0; j < n * 4; j++) {
+            k = pairs[2 * (j >> 2)] + ((j >> 1) & 1);
+            if ((j & 2) && !routines[i].cond) {
+                continue;
+            }
+            found = SimOOGetAttr(old, routines[i].cond, var, frames[j & 1], k, &value, &cycles);
+            found2 = SimOOGetAttr(new, routines[i].cond, var, frames[j & 1], k, &value2, &cycles2);
+            if (   found < 0 || found2 != found || (found && value2 != value)
+                || (!(j & 2) && (!found || value != pairs[2 * (j >> 2) + 1]))) {
+                break;
+            }
+            if (!(j & 2)) {
+                total += cycles;
+                total2 += cycles2;
+            }
+        }
+        SimExit();
+        if (j < n * 4) {
+            printf("Unexpected data, skipping the optimization of %s !\n", routines[i].name);
+            code = new;
+            continue;
+        }
+        printf("    %-16s%8" PRIu32 "%8" PRIu32 "\n", routines[i].name, total / (n * 2), total2 / (n * 2));
+        RedirectAMSrom_call(routines[i].idx, new, 1);
+        accepted++;
+    }
+    // Without any new routine, the table is not used either.
+    FreeROMSpace(accepted ? code : table, table + n * 8 + 2 * FAST_OO_GETATTR_CODE_SIZE);
+    free(pairs);
+}
+
+
+// Handle of the folder list, i.e. of the home folder, a block of a count of allocated entries, a count of used entries,
+// and SYM_ENTRYs of 14 bytes: name (8 bytes, padded with zeros), compat, flags, handle.
+#define FOLDER_LIST_HANDLE (8)
+#define SYM_ENTRY_SIZE     (14)
+// Upper bound of the size of the new FindSymInFolder.
+#define FAST_SYMFIND_CODE_SIZE (240)
+#define SYM_TEST_NAMES   UINT32_C(0x30000)
+#define SYM_TEST_HEAP    UINT32_C(0x31000)
+#define SYM_TEST_INSNS   UINT32_C(1000000)
+
+//! Write FindSymInFolder at addr. Both names are packed into two longwords, each folder is searched by dichotomy with
+//  longword compares. Names which are tokens, or longer than 8 characters, and symbols which are not found go to
+//  fallback: the folder may not be sorted. So do names held by two neighbouring entries, i.e. twins, as the dichotomy
+//  may not find the one the original picks.
+static uint32_t WriteFastFindSymInFolder (uint32_t addr, uint32_t heaptable, uint32_t fallback) {
+    uint32_t pack, pack2, search, search2, fail, fail2, fail3, fail4, loop, lower, found, notfound, pfail, pfail2, pfail3;
+    uint32_t first, first2, last, last2, twin, twin2;
+
+    Seek(addr);
+    WriteLong(UINT32_C(0x48E71E20));
+    WriteLong(UINT32_C(0x206F001C));
+    pack = Tell();
+    WriteLong(UINT32_C(0x61000000));
+    fail = Tell();
+    WriteShort(0x6600);
+    WriteShort(0x7008);
+    search = Tell();
+    WriteLong(UINT32_C(0x61000000));
+    fail2 = Tell();
+    WriteShort(0x6700);
+    WriteLong(UINT32_C(0x3C28000C));
+    WriteLong(UINT32_C(0x206F0018));
+    pack2 = Tell();
+    WriteLong(UINT32_C(0x61000000));
+    fail3 = Tell();
+    WriteShort(0x6600);
+    WriteShort(0x7000);
+    WriteShort(0x3006);
+    search2 = Tell();
+    WriteLong(UINT32_C(0x61000000));
+    fail4 = Tell();
+    WriteShort(0x6700);
+    WriteShort(0x4846);
+    WriteShort(0x3C00);
+    WriteShort(0x2006);
+    WriteLong(UINT32_C(0x4CDF0478));
+    WriteShort(0x4E75);
+    FixShortBranch(fail);
+    FixShortBranch(fail2);
+    FixShortBranch(fail3);
+    FixShortBranch(fail4);
+    WriteLong(UINT32_C(0x4CDF0478));
+    WriteShort(0x4EF9);
+    WriteLong(fallback);
+
+    // Pack the name ending at a0 into d1:d2, set Z on success.
+    FixWordBranch(pack);
+    FixWordBranch(pack2);
+    WriteShort(0x4A10);
+    pfail = Tell();
+    WriteShort(0x6600);
+    WriteShort(0x2248);
+    WriteShort(0x4A21);
+    WriteShort(0x66FC);
+    WriteShort(0x2008);
+    WriteShort(0x9089);
+    WriteShort(0x5380);
+    pfail2 = Tell();
+    WriteShort(0x6700);
+    WriteLong(UINT32_C(0x0C400008));
+    pfail3 = Tell();
+    WriteShort(0x6200);
+    WriteShort(0x42A7);
+    WriteShort(0x42A7);
+    WriteShort(0x204F);
+    WriteShort(0x5289);
+    WriteShort(0x5340);
+    WriteShort(0x10D9);
+    WriteLong(UINT32_C(0x51C8FFFC));
+    WriteShort(0x221F);
+    WriteShort(0x241F);
+    WriteShort(0x7000);
+    WriteShort(0x4E75);
+    FixShortBranch(pfail);
+    FixShortBranch(pfail2);
+    FixShortBranch(pfail3);
+    WriteShort(0x7001);
+    WriteShort(0x4E75);
+
+    // Search the name d1:d2 in the folder of handle d0.w, return in d0.l the offset of its entry, pointed to by a0,
+    // or 0.
+    FixWordBranch(search);
+    FixWordBranch(search2);
+    if (heaptable < 0x8000) {
+        WriteShort(0x41F8);
+        WriteShort(heaptable);
+    }
+    else {
+        WriteShort(0x41F9);
+        WriteLong(heaptable);
+    }
+    WriteShort(0xE548);
+    WriteLong(UINT32_C(0x24700000));
+    WriteShort(0x7600);
+    WriteLong(UINT32_C(0x382A0002));
+    WriteShort(0x588A);
+    loop = Tell();
+    WriteShort(0xB843);
+    notfound = Tell();
+    WriteShort(0x6300);
+    WriteShort(0x3A03);
+    WriteShort(0xDA44);
+    WriteShort(0xE24D);
+    WriteShort(0x3005);
+    WriteShort(0xE748);
+    WriteShort(0x9045);
+    WriteShort(0xD040);
+    WriteLong(UINT32_C(0x41F20000));
+    WriteShort(0xB290);
+    WriteShort(0x6606);
+    WriteLong(UINT32_C(0xB4A80004));
+    found = Tell();
+    WriteShort(0x6700);
+    lower = Tell();
+    WriteShort(0x6500);
+    WriteShort(0x3605);
+    WriteShort(0x5243);
+    WriteBranch(0x6000, loop);
+    FixShortBranch(lower);
+    WriteShort(0x3805);
+    WriteBranch(0x6000, loop);
+    // A twin before or after the entry found, in a0 at offset d0.w from a2, is not found.
+    FixShortBranch(found);
+    WriteShort(0x4A40);
+    first = Tell();
+    WriteShort(0x6700);
+    WriteLong(UINT32_C(0xB2A8FFF2));
+    first2 = Tell();
+    WriteShort(0x6600);
+    WriteLong(UINT32_C(0xB4A8FFF6));
+    twin = Tell();
+    WriteShort(0x6700);
+    FixShortBranch(first);
+    FixShortBranch(first2);
+    WriteShort(0x3605);
+    WriteShort(0x5243);
+    WriteLong(UINT32_C(0xB66AFFFE));
+    last = Tell();
+    WriteShort(0x6400);
+    WriteLong(UINT32_C(0xB2A8000E));
+    last2 = Tell();
+    WriteShort(0x6600);
+    WriteLong(UINT32_C(0xB4A80012));
+    twin2 = Tell();
+    WriteShort(0x6700);
+    FixShortBranch(last);
+    FixShortBranch(last2);
+    WriteShort(0x5840);
+    WriteShort(0x48C0);
+    WriteShort(0x4E75);
+    FixShortBranch(notfound);
+    FixShortBranch(twin);
+    FixShortBranch(twin2);
+    WriteShort(0x7000);
+    WriteShort(0x4E75);
+    return addr;
+}
+
+//! Compare names padded to 8 bytes, for qsort.
+static int CompareSymNames (const void *a, const void *b) {
+    const uint8_t *x = (const uint8_t *)a;
+    const uint8_t *y = (const uint8_t *)b;
+    uint32_t i;
+
+    for (i = 0; i < 8 && x[i] == y[i]; i++);
+    return (i == 8) ? 0 : (int)x[i] - (int)y[i];
+}
+
+//! Fill names with n distinct random names of 1 to 8 lowercase letters, sorted, padded with zeros. The first one is
+//  name if not NULL.
+static void GenerateSymNames (uint8_t (*names)[8], uint32_t n, const char *name, uint32_t *seed) {
+    uint32_t i, j, len;
+
+    for (i = 0; i < n; i++) {
+        memset(names[i], 0, 8);
+        if (i == 0 && name != NULL) {
+            memcpy(names[i], name, strlen(name));
+            continue;
+        }
+        *seed = *seed * UINT32_C(1103515245) + 12345;
+        len = 1 + (*seed >> 8) % 8;
+        for (j = 0; j < len; j++) {
+            *seed = *seed * UINT32_C(1103515245) + 12345;
+            names[i][j] = (uint8_t)('a' + (*seed >> 8) % 26);
+        }
+        for (j = 0; j < i && CompareSymNames(names[j], names[i]); j++);
+        i -= (j < i);
+    }
+    qsort(names, n, 8, CompareSymNames);
+}
+
+//! Write a folder block of handle h at block in the simulated RAM, holding the sorted names, with handles from first.
+static uint32_t WriteTestFolder (uint32_t heaptable, uint32_t h, uint32_t block, uint8_t (*names)[8], uint32_t n, uint32_t first) {
+    uint8_t *p = SimRAM + block;
+    uint32_t i;
+
+    p[0] = (uint8_t)(n >> 8);
+    p[1] = (uint8_t)n;
+    p[2] = (uint8_t)(n >> 8);
+    p[3] = (uint8_t)n;
+    for (i = 0; i < n; i++, p += SYM_ENTRY_SIZE) {
+        memcpy(p + 4, names[i], 8);
+        memset(p + 12, 0, 4);
+        p[16] = (uint8_t)((first + i) >> 8);
+        p[17] = (uint8_t)(first + i);
+    }
+    SimRAM[heaptable + 4 * h] = (uint8_t)(block >> 24);
+    SimRAM[heaptable + 4 * h + 1] = (uint8_t)(block >> 16);
+    SimRAM[heaptable + 4 * h + 2] = (uint8_t)(block >> 8);
+    SimRAM[heaptable + 4 * h + 3] = (uint8_t)block;
+    return (block + 4 + n * SYM_ENTRY_SIZE + 3) & ~UINT32_C(3);
+}
+
+//! Call FindSymInFolder at entry on the tokenized names in the simulator. Return the HSym, or 0xFFFFFFFF if the call
+//  failed.
+static uint32_t SimFindSymInFolder (uint32_t entry, const uint8_t *sym, const uint8_t *folder, uint32_t *cycles) {
+    uint32_t i, ptr = SYM_TEST_NAMES;
+    M68kCpu cpu;
+
+    SimReset(&cpu);
+    // Folder name, then symbol name, both tokenized: zero, characters, zero.
+    for (i = 0; i < 2; i++) {
+        const uint8_t *name = (i == 0) ? folder : sym;
+        uint32_t len;
+
+        for (len = 0; len < 8 && name[len] != 0; len++);
+        SimRAM[ptr] = 0;
+        memcpy(SimRAM + ptr + 1, name, len);
+        ptr += len + 1;
+        SimRAM[ptr] = 0;
+        SimPush(&cpu, ptr, 4);
+        ptr++;
+    }
+    if (SimCall(&cpu, entry, SYM_TEST_INSNS) != SIM_OK) {
+        return UINT32_C(0xFFFFFFFF);
+    }
+    *cycles = cpu.cycles;
+    return cpu.d[0];
+}
+
+//! Replace FindSymInFolder by a version which packs names into longwords and searches sorted folders by dichotomy.
+//  It is only installed if, on simulated folders of 8 to 512 symbols, the original finds every symbol at the expected
+//  place and the new one gives the same results; the average lookup times are reported against the folder size.
+static void OptimizeAMSSymFind(void) {
+    static const uint32_t sizes[4] = {8, 32, 128, 512};
+    static const char *foldernames[3] = {"alpha", "main", "zeta"};
+    static uint8_t names[3][512][8];
+    uint8_t homenames[3][8], absent[8];
+    uint32_t heaptable, old, new, end, block, seed = 1, i, j, k, f, expected, result, result2, cycles, cycles2, total, total2, count;
+
+    // 2j) Symbols are looked up by FindSymInFolder, e.g. from SymFind and SymFindPtr, which scan folders linearly with
+    //     string compares. The new one only takes names of 1 to 8 characters (not tokens), and hands what it does
+    //     not find to the original routine, so that an unsorted folder is still searched.
+    heaptable = rom_call_addr(HeapTable);
+    old = rom_call_addr(FindSymInFolder);
+    if (heaptable == 0 || heaptable + 4 * 16 > SYM_TEST_NAMES) {
+        printf("Unexpected data, skipping the optimization of FindSymInFolder !\n");
+        return;
+    }
+    new = AllocROMSpace(FAST_SYMFIND_CODE_SIZE, 2);
+    if (new == 0) {
+        printf("Not enough free ROM space, skipping the optimization of FindSymInFolder !\n");
+        return;
+    }
+    WriteFastFindSymInFolder(new, heaptable, old);
+    end = Tell();
+    FreeROMSpace(end, new + FAST_SYMFIND_CODE_SIZE);
+
+    if (SimInit(ROM_base + UINT32_C(0x12000), BasecodeEnd())) {
+        FreeROMSpace(new, end);
+        return;
+    }
+    printf("Optimizing FindSymInFolder, %" PRIu32 " bytes at %06" PRIX32 ", average nominal cycles of AMS and new routines:\n", end - new, new);
+    for (i = 0; i < NB_BLOCKS(sizes); i++) {
+        // The home folder holds the three folders, of handles 9 to 11, whose symbols have handles from 16.
+        for (f = 0; f < 3; f++) {
+            memset(homenames[f], 0, 8);
+            memcpy(homenames[f], foldernames[f], strlen(foldernames[f]));
+            GenerateSymNames(names[f], sizes[i], NULL, &seed);
+        }
+        block = WriteTestFolder(heaptable, FOLDER_LIST_HANDLE, SYM_TEST_HEAP, homenames, 3, 9);
+        for (f = 0; f < 3; f++) {
+            block = WriteTestFolder(heaptable, 9 + f, block, names[f], sizes[i], 16);
+        }
+        total = total2 = count = 0;
+        for (j = 0; j < 3 * 64; j++) {
+            f = j % 3;
+            k = (j / 3) % sizes[i];
+            expected = ((9 + f) << 16) | (4 + k * SYM_ENTRY_SIZE);
+            result = SimFindSymInFolder(old, names[f][k], homenames[f], &cycles);
+            result2 = SimFindSymInFolder(new, names[f][k], homenames[f], &cycles2);
+            if (result != expected || result2 != expected) {
+                break;
+            }
+            total += cycles;
+            total2 += cycles2;
+            count++;
+            // Missing symbol, missing folder.
+            memcpy(absent, names[f][k], 8);
+            absent[0] = (uint8_t)(absent[0] ^ 0x20);
+            if (   SimFindSymInFolder(old, absent, homenames[f], &cycles) != SimFindSymInFolder(new, absent, homenames[f], &cycles2)
+                || SimFindSymInFolder(old, names[f][k], absent, &cycles) != SimFindSymInFolder(new, names[f][k], absent, &cycles2)) {
+                break;
+            }
+        }
+        if (j < 3 * 64) {
+            break;
+        }
+        printf("    %3" PRIu32 " symbols%12" PRIu32 "%8" PRIu32 "\n", sizes[i], total / count, total2 / count);
+    }
+    // Twins, i.e. two entries of the same name, such as an archived variable and its copy in RAM: first, in the
+    // middle and last of a folder. The new routine hands them to the original one, so both must give the same entry.
+    if (i == NB_BLOCKS(sizes)) {
+        for (f = 0; f < 3; f++) {
+            GenerateSymNames(names[f], 32, NULL, &seed);
+            k = f * 15;
+            memcpy(names[f][k + 1], names[f][k], 8);
+        }
+        block = WriteTestFolder(heaptable, FOLDER_LIST_HANDLE, SYM_TEST_HEAP, homenames, 3, 9);
+        for (f = 0; f < 3; f++) {
+            block = WriteTestFolder(heaptable, 9 + f, block, names[f], 32, 16);
+        }
+        for (f = 0; f < 3; f++) {
+            result = SimFindSymInFolder(old, names[f][f * 15], homenames[f], &cycles);
+            result2 = SimFindSymInFolder(new, names[f][f * 15], homenames[f], &cycles2);
+            if (result == UINT32_C(0xFFFFFFFF) || result2 != result) {
+                i = 0;
+            }
+        }
+    }
+    SimExit();
+    if (i < NB_BLOCKS(sizes)) {
+        printf("Unexpected data, skipping the optimization of FindSymInFolder !\n");
+        FreeROMSpace(new, end);
+        return;
+    }
+
+    RedirectAMSrom_call(FindSymInFolder, new, 1);
+}
+
+
+// Copy loops rewritten by the block-moving patch, and fill loops of the reset path: a move or clr with (Ax)+ as
+// destination, followed by
+enum {
+    COPY_LOOP_DBF,      // dbf dn,loop: dn.w + 1 elements.
+    COPY_LOOP_BRA_DBF,  // The same, entered by a bra.s to the dbf: dn.w elements.
+    COPY_LOOP_SUBQ_L,   // subq.l #1,dn / bne.s loop: dn.l elements.
+    COPY_LOOP_SUBQ_W    // subq.w #1,dn / bne.s loop: dn.w elements.
+};
+
+// Instruction in the loop.
+enum {
+    LOOP_BODY_COPY,     // move.x (Ay)+,(Ax)+
+    LOOP_BODY_CLR,      // clr.x (Ax)+
+    LOOP_BODY_FILL      // move.x Dy,(Ax)+, ay is the number of the data register.
+};
+
+typedef struct {
+    uint32_t site;    // Start of the loop, i.e. of the bra.s for COPY_LOOP_BRA_DBF.
+    uint32_t length;  // 6 bytes, 8 for COPY_LOOP_BRA_DBF.
+    uint32_t kind;
+    uint32_t body;
+    uint32_t size;    // Size of the elements: 1, 2 or 4.
+    uint32_t ax, ay, dn;
+    uint32_t helper;
+} CopyLoop;
+
+// Upper bound of the size of the helper of a copy loop.
+#define COPY_LOOP_HELPER_SIZE (144)
+#define COPY_LOOP_BURST       (32)
+#define COPY_LOOP_MAX         (32)
+#define COPY_TEST_STUB        UINT32_C(0x1000)
+#define COPY_TEST_AREA        UINT32_C(0x8000)
+#define COPY_TEST_SIZE        UINT32_C(0x10000)
+#define COPY_TEST_INSNS       UINT32_C(2000000)
+
+//! Recognize the end of a loop whose single instruction, of one word, is at absaddr in the snapshot of the code. The
+//  instructions of the loop must not be jumped to from elsewhere, so that the loop can be replaced by a jsr to a
+//  helper. Return 1 if found.
+static int MatchLoopEnd (uint32_t absaddr, CopyLoop *loop) {
+    uint16_t op2, op3;
+
+    if (absaddr < M68kCodeStart || absaddr + 6 > M68kCodeEnd) {
+        return 0;
+    }
+    op2 = M68kShort(absaddr + 2);
+    op3 = M68kShort(absaddr + 4);
+    loop->dn = op2 & 7;
+    loop->site = absaddr;
+    loop->length = 6;
+    if ((op2 & 0xFFF8) == 0x51C8 && op3 == 0xFFFC) {
+        loop->kind = COPY_LOOP_DBF;
+        if (absaddr >= M68kCodeStart + 2 && M68kShort(absaddr - 2) == 0x6002 && XrefIsVisited(absaddr - 2)) {
+            loop->kind = COPY_LOOP_BRA_DBF;
+            loop->site -= 2;
+            loop->length = 8;
+            if (CountXrefs(absaddr + 2, XREF_JUMP) != 1) {
+                return 0;
+            }
+        }
+        else if (IsXrefJumpTarget(absaddr + 2)) {
+            return 0;
+        }
+    }
+    else if (((op2 & 0xFFF8) == 0x5380 || (op2 & 0xFFF8) == 0x5340) && op3 == 0x66FA) {
+        loop->kind = ((op2 & 0xFFF8) == 0x5380) ? COPY_LOOP_SUBQ_L : COPY_LOOP_SUBQ_W;
+        if (IsXrefJumpTarget(absaddr + 2) || IsXrefJumpTarget(absaddr + 4)) {
+            return 0;
+        }
+    }
+    else {
+        return 0;
+    }
+    return CountXrefs(absaddr, XREF_JUMP) == 1;
+}
+
+//! Recognize a copy loop whose move is at absaddr in the snapshot of the code. Return 1 if found.
+static int MatchCopyLoop (uint32_t absaddr, CopyLoop *loop) {
+    static const uint8_t sizes[4] = {0, 1, 4, 2};
+    uint16_t op;
+
+    if (absaddr < M68kCodeStart || absaddr + 2 > M68kCodeEnd) {
+        return 0;
+    }
+    op = M68kShort(absaddr);
+    if ((op & 0xC1F8) != 0x00D8 || (op & 0x3000) == 0 || (op & 0x0E00) == 0x0E00 || (op & 7) == 7) {
+        return 0;
+    }
+    loop->body = LOOP_BODY_COPY;
+    loop->size = sizes[(op >> 12) & 3];
+    loop->ax = (op >> 9) & 7;
+    loop->ay = op & 7;
+    return MatchLoopEnd(absaddr, loop);
+}
+
+//! Recognize a loop which fills memory with clr.x (Ax)+ or move.x Dy,(Ax)+ at absaddr in the snapshot of the code.
+//  Return 1 if found.
+static int MatchFillLoop (uint32_t absaddr, CopyLoop *loop) {
+    static const uint8_t sizes[4] = {0, 1, 4, 2};
+    uint16_t op;
+
+    if (absaddr < M68kCodeStart || absaddr + 2 > M68kCodeEnd) {
+        return 0;
+    }
+    op = M68kShort(absaddr);
+    if ((op & 0xFF38) == 0x4218 && (op & 0x00C0) != 0x00C0 && (op & 7) != 7) {
+        loop->body = LOOP_BODY_CLR;
+        loop->size = 1 << ((op >> 6) & 3);
+        loop->ax = op & 7;
+        loop->ay = 0;
+    }
+    else if ((op & 0xC1F8) == 0x00C0 && (op & 0x3000) != 0 && (op & 0x0E00) != 0x0E00) {
+        loop->body = LOOP_BODY_FILL;
+        loop->size = sizes[(op >> 12) & 3];
+        loop->ax = (op >> 9) & 7;
+        loop->ay = op & 7;
+    }
+    else {
+        return 0;
+    }
+    return MatchLoopEnd(absaddr, loop) && (loop->body != LOOP_BODY_FILL || loop->dn != loop->ay);
+}
+
+//! Find the loops recognized by match in the code reachable from the entry points, following calls to the given
+//  depth. Calls to the memory ROM_CALLs are not followed: ams-fast-memory-routines replaces them. Return the number of
+//  loops found.
+static uint32_t FindLoops (const uint32_t *entries, uint32_t nbentries, uint32_t depth, int (*match)(uint32_t, CopyLoop *), CopyLoop *loops, uint32_t maxloops) {
+    static const uint32_t memory[4] = {AMS_memcpy, AMS_memmove, AMS_memset, memcmp};
+    uint32_t *work, *visited;
+    uint32_t nbwork = 0, nbloops = 0, nbvisited = 0, addr, level, i, j;
+    M68kInsn insn;
+
+    // Work items are pairs (address, call depth); visited addresses are kept in a list, the code is small.
+    work = (uint32_t *)malloc(2 * 4096 * sizeof(uint32_t));
+    visited = (uint32_t *)malloc(16384 * sizeof(uint32_t));
+    if (work == NULL || visited == NULL) {
+        free(work);
+        free(visited);
+        printf("\n    ERROR : not enough memory.\n");
+        return 0;
+    }
+    for (i = 0; i < nbentries; i++) {
+        work[nbwork++] = entries[i];
+        work[nbwork++] = 0;
+    }
+    while (nbwork > 0) {
+        level = work[--nbwork];
+        addr = work[--nbwork];
+        for (;;) {
+            for (j = 0; j < nbvisited && visited[j] != addr; j++);
+            if (   j < nbvisited || nbvisited == 16384 || addr < M68kCodeStart || addr + 2 > M68kCodeEnd
+                || (addr & 1) || !XrefIsVisited(addr)) {
+                break;
+            }
+            visited[nbvisited++] = addr;
+            M68kDecode(addr, &insn);
+            if (nbloops < maxloops && match(addr, &loops[nbloops])) {
+                for (j = 0; j < nbloops && loops[j].site != loops[nbloops].site; j++);
+                nbloops += (j == nbloops);
+            }
+            for (i = 0; i < insn.nbrefs && nbwork + 2 <= 2 * 4096; i++) {
+                if (insn.refs[i].kind == XREF_JUMP || (insn.refs[i].kind == XREF_CALL && level < depth)) {
+                    for (j = 0; j < 4 && insn.refs[i].target != rom_call_addr(memory[j]); j++);
+                    if (j == 4) {
+                        work[nbwork++] = insn.refs[i].target;
+                        work[nbwork++] = level + (insn.refs[i].kind == XREF_CALL);
+                    }
+                }
+            }
+            if (insn.flow == M68K_BRANCH || insn.flow == M68K_RETURN || insn.flow == M68K_STOP || insn.flow == M68K_ILLEGAL) {
+                break;
+            }
+            addr += insn.length;
+        }
+    }
+    free(work);
+    free(visited);
+    return nbloops;
+}
+
+//! Write the helper of a copy loop at addr. Unless the elements are bytes at addresses of different parities, or the
+//  destination is less than COPY_LOOP_BURST bytes above the source, in which case the original loop runs, the data is
+//  moved by MOVEM bursts, then longwords. The registers and the flags end up as after the original loop.
+static uint32_t WriteCopyLoopHelper (uint32_t addr, const CopyLoop *loop) {
+    uint32_t regs[10], nbregs = 0, pre = 0, post = 0, burst, longs, slow[4], nbslow = 0, da, db, r, i;
+    uint32_t ax = loop->ax, ay = loop->ay, dn = loop->dn;
+
+    // Two data registers for the counts, eight registers for the bursts.
+    for (r = 0; r < 15 && nbregs < 10; r++) {
+        if (r != dn && r != 8 + ax && r != 8 + ay) {
+            regs[nbregs++] = r;
+            pre |= 0x8000 >> r;
+            post |= 1 << r;
+        }
+    }
+    da = regs[0];
+    db = regs[1];
+
+    Seek(addr);
+    WriteShort(0x40E7);
+    WriteShort(0x48E7);
+    WriteShort(pre);
+    if (loop->size == 1) {
+        WriteShort(0x3008 | (da << 9) | ax);
+        WriteShort(0x3008 | (db << 9) | ay);
+        WriteShort(0x8040 | (da << 9) | db);
+        WriteLong(UINT32_C(0x08000000) | (da << 16));
+        slow[nbslow++] = Tell();
+        WriteLong(UINT32_C(0x66000000));
+    }
+    WriteShort(0x2008 | (da << 9) | ax);
+    WriteShort(0x9088 | (da << 9) | ay);
+    WriteShort(0x7000 | (db << 9) | COPY_LOOP_BURST);
+    WriteShort(0xB080 | (da << 9) | db);
+    slow[nbslow++] = Tell();
+    WriteLong(UINT32_C(0x65000000));
+    WriteShort(0x7000 | (da << 9));
+    WriteShort(((loop->kind == COPY_LOOP_SUBQ_L) ? 0x2000 : 0x3000) | (da << 9) | dn);
+    if (loop->kind == COPY_LOOP_DBF) {
+        WriteShort(0x5280 | da);
+    }
+    else {
+        slow[nbslow++] = Tell();
+        WriteLong(UINT32_C(0x67000000));
+    }
+    if (loop->size == 2) {
+        WriteShort(0xD080 | (da << 9) | da);
+    }
+    else if (loop->size == 4) {
+        WriteShort(0xE588 | da);
+    }
+
+    // Bursts of 32 bytes, then longwords, words and bytes.
+    WriteShort(0x2000 | (db << 9) | da);
+    WriteShort(0xEA88 | db);
+    longs = Tell();
+    WriteShort(0x6700);
+    burst = Tell();
+    WriteShort(0x4CD8 | ay);
+    WriteShort(post & ~((1 << da) | (1 << db)));
+    WriteShort(0x48D0 | ax);
+    WriteShort(post & ~((1 << da) | (1 << db)));
+    WriteLong(UINT32_C(0x41E80000) | (ax << 25) | (ax << 16) | COPY_LOOP_BURST);
+    WriteShort(0x5380 | db);
+    WriteBranch(0x6600, burst);
+    FixShortBranch(longs);
+    WriteShort(0x3000 | (db << 9) | da);
+    WriteLong(UINT32_C(0x0240001C) | (db << 16));
+    WriteShort(0xE448 | db);
+    WriteShort(0x6002);
+    WriteShort(0x20D8 | (ax << 9) | ay);
+    WriteLong(UINT32_C(0x51C8FFFC) | (db << 16));
+    if (loop->size < 4) {
+        WriteLong(UINT32_C(0x08000001) | (da << 16));
+        WriteShort(0x6702);
+        WriteShort(0x30D8 | (ax << 9) | ay);
+    }
+    if (loop->size < 2) {
+        WriteLong(UINT32_C(0x08000000) | (da << 16));
+        WriteShort(0x6702);
+        WriteShort(0x10D8 | (ax << 9) | ay);
+    }
+
+    // Final count and flags: those of the last move for dbf, of the last subq otherwise, which sub dn,dn gives.
+    if (loop->kind == COPY_LOOP_DBF || loop->kind == COPY_LOOP_BRA_DBF) {
+        WriteShort(0x303C | (dn << 9));
+        WriteShort(0xFFFF);
+    }
+    WriteShort(0x4CDF);
+    WriteShort(post);
+    WriteShort(0x44DF);
+    if (loop->kind == COPY_LOOP_DBF || loop->kind == COPY_LOOP_BRA_DBF) {
+        WriteShort(((loop->size == 1) ? 0x4A28 : (loop->size == 2) ? 0x4A68 : 0x4AA8) | ax);
+        WriteShort((uint16_t)-(int32_t)loop->size);
+    }
+    else {
+        WriteShort(((loop->kind == COPY_LOOP_SUBQ_L) ? 0x9080 : 0x9040) | (dn << 9) | dn);
+    }
+    WriteShort(0x4E75);
+
+    // The original loop, with the original flags.
+    for (i = 0; i < nbslow; i++) {
+        FixWordBranch(slow[i]);
+    }
+    WriteShort(0x4CDF);
+    WriteShort(post);
+    WriteShort(0x44DF);
+    for (i = 0; i < loop->length; i += 2) {
+        WriteShort(M68kShort(loop->site + i));
+    }
+    WriteShort(0x4E75);
+    return addr;
+}
+
+//! Write the helper of a fill loop at addr, as WriteCopyLoopHelper does for copy loops: the value is spread over eight
+//  registers stored by MOVEM bursts, then longwords. Bytes at odd addresses go through the original loop.
+static uint32_t WriteFillLoopHelper (uint32_t addr, const CopyLoop *loop) {
+    uint32_t regs[10], nbregs = 0, pre = 0, post = 0, burst, longs, slow[3], nbslow = 0, da, db, vr, r, i;
+    uint32_t ax = loop->ax, dy = loop->ay, dn = loop->dn;
+
+    // Two data registers for the counts, eight registers holding the value for the bursts, the first one of which
+    // is a data register too.
+    for (r = 0; r < 15 && nbregs < 10; r++) {
+        if (r != dn && r != 8 + ax && (loop->body == LOOP_BODY_CLR || r != dy)) {
+            regs[nbregs++] = r;
+            pre |= 0x8000 >> r;
+            post |= 1 << r;
+        }
+    }
+    da = regs[0];
+    db = regs[1];
+    vr = regs[2];
+
+    Seek(addr);
+    WriteShort(0x40E7);
+    WriteShort(0x48E7);
+    WriteShort(pre);
+    if (loop->size == 1) {
+        WriteShort(0x3008 | (da << 9) | ax);
+        WriteLong(UINT32_C(0x08000000) | (da << 16));
+        slow[nbslow++] = Tell();
+        WriteLong(UINT32_C(0x66000000));
+    }
+    WriteShort(0x7000 | (da << 9));
+    WriteShort(((loop->kind == COPY_LOOP_SUBQ_L) ? 0x2000 : 0x3000) | (da << 9) | dn);
+    if (loop->kind == COPY_LOOP_DBF) {
+        WriteShort(0x5280 | da);
+    }
+    else {
+        slow[nbslow++] = Tell();
+        WriteLong(UINT32_C(0x67000000));
+    }
+    if (loop->size == 2) {
+        WriteShort(0xD080 | (da << 9) | da);
+    }
+    else if (loop->size == 4) {
+        WriteShort(0xE588 | da);
+    }
+
+    // The value, in all eight registers of the bursts.
+    if (loop->body == LOOP_BODY_CLR) {
+        WriteShort(0x7000 | (vr << 9));
+    }
+    else if (loop->size == 4) {
+        WriteShort(0x2000 | (vr << 9) | dy);
+    }
+    else {
+        if (loop->size == 1) {
+            WriteShort(0x1000 | (vr << 9) | dy);
+            WriteShort(0xE148 | vr);
+        }
+        WriteShort(((loop->size == 1) ? 0x1000 : 0x3000) | (vr << 9) | dy);
+        WriteShort(0x3000 | (db << 9) | vr);
+        WriteShort(0x4840 | vr);
+        WriteShort(0x3000 | (vr << 9) | db);
+    }
+    for (i = 3; i < 10; i++) {
+        WriteShort(((regs[i] < 8) ? 0x2000 : 0x2040) | ((regs[i] & 7) << 9) | vr);
+    }
+
+    // Bursts of 32 bytes, then longwords, words and bytes.
+    WriteShort(0x2000 | (db << 9) | da);
+    WriteShort(0xEA88 | db);
+    longs = Tell();
+    WriteShort(0x6700);
+    burst = Tell();
+    WriteShort(0x48D0 | ax);
+    WriteShort(post & ~((1 << da) | (1 << db)));
+    WriteLong(UINT32_C(0x41E80000) | (ax << 25) | (ax << 16) | COPY_LOOP_BURST);
+    WriteShort(0x5380 | db);
+    WriteBranch(0x6600, burst);
+    FixShortBranch(longs);
+    WriteShort(0x3000 | (db << 9) | da);
+    WriteLong(UINT32_C(0x0240001C) | (db << 16));
+    WriteShort(0xE448 | db);
+    WriteShort(0x6002);
+    WriteShort(0x20C0 | (ax << 9) | vr);
+    WriteLong(UINT32_C(0x51C8FFFC) | (db << 16));
+    if (loop->size < 4) {
+        WriteLong(UINT32_C(0x08000001) | (da << 16));
+        WriteShort(0x6702);
+        WriteShort(0x30C0 | (ax << 9) | vr);
+    }
+    if (loop->size < 2) {
+        WriteLong(UINT32_C(0x08000000) | (da << 16));
+        WriteShort(0x6702);
+        WriteShort(0x10C0 | (ax << 9) | vr);
+    }
+
+    // Final count and flags, as in WriteCopyLoopHelper.
+    if (loop->kind == COPY_LOOP_DBF || loop->kind == COPY_LOOP_BRA_DBF) {
+        WriteShort(0x303C | (dn << 9));
+        WriteShort(0xFFFF);
+    }
+    WriteShort(0x4CDF);
+    WriteShort(post);
+    WriteShort(0x44DF);
+    if (loop->kind == COPY_LOOP_DBF || loop->kind == COPY_LOOP_BRA_DBF) {
+        WriteShort(((loop->size == 1) ? 0x4A28 : (loop->size == 2) ? 0x4A68 : 0x4AA8) | ax);
+        WriteShort((uint16_t)-(int32_t)loop->size);
+    }
+    else {
+        WriteShort(((loop->kind == COPY_LOOP_SUBQ_L) ? 0x9080 : 0x9040) | (dn << 9) | dn);
+    }
+    WriteShort(0x4E75);
+
+    // The original loop, with the original flags.
+    for (i = 0; i < nbslow; i++) {
+        FixWordBranch(slow[i]);
+    }
+    WriteShort(0x4CDF);
+    WriteShort(post);
+    WriteShort(0x44DF);
+    for (i = 0; i < loop->length; i += 2) {
+        WriteShort(M68kShort(loop->site + i));
+    }
+    WriteShort(0x4E75);
+    return addr;
+}
+
+//! Run the original copy loop, copied to the simulated RAM, or its helper, on the given registers and on the test
+//  area. Return the simulation status.
+static int SimCopyLoop (const CopyLoop *loop, int helper, const uint32_t *regs, M68kCpu *cpu) {
+    uint32_t i;
+
+    if (!helper) {
+        for (i = 0; i < loop->length; i += 2) {
+            SimRAM[COPY_TEST_STUB + i] = (uint8_t)(M68kShort(loop->site + i) >> 8);
+            SimRAM[COPY_TEST_STUB + i + 1] = (uint8_t)M68kShort(loop->site + i);
+        }
+        SimRAM[COPY_TEST_STUB + i] = 0x4E;
+        SimRAM[COPY_TEST_STUB + i + 1] = 0x75;
+    }
+    SimReset(cpu);
+    for (i = 0; i < 8; i++) {
+        cpu->d[i] = regs[i];
+    }
+    for (i = 0; i < 7; i++) {
+        cpu->a[i] = regs[8 + i];
+    }
+    cpu->x = regs[15] & 1;
+    cpu->n = (regs[15] >> 1) & 1;
+    cpu->z = (regs[15] >> 2) & 1;
+    cpu->v = (regs[15] >> 3) & 1;
+    cpu->c = (regs[15] >> 4) & 1;
+    return SimCall(cpu, helper ? loop->helper : COPY_TEST_STUB, COPY_TEST_INSNS);
+}
+
+//! Random registers for a copy or fill loop: pointers in the test area, with overlaps for copies, and element counts
+//  up to maxcount. The test area is filled with random bytes.
+static void RandomCopyLoopRegisters (const CopyLoop *loop, uint32_t *regs, uint32_t *seed, uint32_t maxcount) {
+    uint32_t i, count, even = (loop->size > 1) ? ~UINT32_C(1) : ~UINT32_C(0);
+
+    for (i = 0; i < 16; i++) {
+        *seed = *seed * UINT32_C(1103515245) + 12345;
+        regs[i] = *seed ^ (*seed << 13);
+    }
+    for (i = 0; i < COPY_TEST_SIZE; i++) {
+        *seed = *seed * UINT32_C(1103515245) + 12345;
+        SimRAM[COPY_TEST_AREA + i] = (uint8_t)(*seed >> 16);
+    }
+    *seed = *seed * UINT32_C(1103515245) + 12345;
+    count = (*seed >> 8) % (maxcount + 1);
+    if (loop->kind == COPY_LOOP_SUBQ_L) {
+        regs[loop->dn] = count + (count == 0);
+    }
+    else {
+        regs[loop->dn] = (regs[loop->dn] & UINT32_C(0xFFFF0000)) | count;
+    }
+    *seed = *seed * UINT32_C(1103515245) + 12345;
+    if (loop->body != LOOP_BODY_COPY) {
+        regs[8 + loop->ax] = (COPY_TEST_AREA + (*seed >> 8) % (COPY_TEST_SIZE / 2)) & even;
+        return;
+    }
+    regs[8 + loop->ay] = (COPY_TEST_AREA + COPY_TEST_SIZE / 4 + (*seed >> 8) % (COPY_TEST_SIZE / 4)) & even;
+    *seed = *seed * UINT32_C(1103515245) + 12345;
+    regs[8 + loop->ax] = (regs[8 + loop->ay] + (*seed >> 8) % 96 - 48) & even;
+    if ((*seed >> 28) < 8) {
+        regs[8 + loop->ax] = (COPY_TEST_AREA + (*seed >> 12) % (COPY_TEST_SIZE / 4)) & even;
+    }
+    if (loop->ax == loop->ay) {
+        regs[8 + loop->ax] = regs[8 + loop->ay];
+    }
+}
+
+//! Compare the helper of a copy loop with the original loop in the 68000 interpreter, on random registers, counts
+//  and overlaps. Return 0 if the memory, the registers and the flags are the same after both.
+static int CheckCopyLoop (const CopyLoop *loop) {
+    static uint8_t before[COPY_TEST_SIZE], after[COPY_TEST_SIZE];
+    uint32_t regs[16], i, seed = 1;
+    M68kCpu cpu, cpu2;
+
+    for (i = 0; i < 256; i++) {
+        RandomCopyLoopRegisters(loop, regs, &seed, (i < 128) ? 64 : 4096 / loop->size - 1);
+        memcpy(before, SimRAM + COPY_TEST_AREA, COPY_TEST_SIZE);
+        if (SimCopyLoop(loop, 0, regs, &cpu) != SIM_OK) {
+            return 1;
+        }
+        memcpy(after, SimRAM + COPY_TEST_AREA, COPY_TEST_SIZE);
+        memcpy(SimRAM + COPY_TEST_AREA, before, COPY_TEST_SIZE);
+        if (   SimCopyLoop(loop, 1, regs, &cpu2) != SIM_OK
+            || !SameBytes(after, SimRAM + COPY_TEST_AREA, COPY_TEST_SIZE)
+            || !SameBytes((const uint8_t *)cpu.d, (const uint8_t *)cpu2.d, sizeof(cpu.d))
+            || !SameBytes((const uint8_t *)cpu.a, (const uint8_t *)cpu2.a, sizeof(cpu.a))
+            || cpu.x != cpu2.x || cpu.n != cpu2.n || cpu.z != cpu2.z || cpu.v != cpu2.v || cpu.c != cpu2.c) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//! Time the original copy or fill loop and its helper on the given number of bytes, at most half the test area, which
+//  do not overlap. odd puts the destination at an odd address.
+static int TimeCopyLoop (const CopyLoop *loop, uint32_t bytes, int odd, uint32_t *oldcycles, uint32_t *newcycles) {
+    uint32_t regs[16], seed = 1;
+    M68kCpu cpu;
+
+    RandomCopyLoopRegisters(loop, regs, &seed, 0);
+    regs[loop->dn] = (regs[loop->dn] & UINT32_C(0xFFFF0000)) | (bytes / loop->size - (loop->kind == COPY_LOOP_DBF));
+    if (loop->kind == COPY_LOOP_SUBQ_L) {
+        regs[loop->dn] = bytes / loop->size;
+    }
+    if (loop->body == LOOP_BODY_COPY) {
+        regs[8 + loop->ay] = COPY_TEST_AREA + COPY_TEST_SIZE / 2;
+    }
+    regs[8 + loop->ax] = COPY_TEST_AREA + (odd != 0);
+    if (SimCopyLoop(loop, 0, regs, &cpu) != SIM_OK) {
+        return 1;
+    }
+    *oldcycles = cpu.cycles;
+    if (SimCopyLoop(loop, 1, regs, &cpu) != SIM_OK) {
+        return 1;
+    }
+    *newcycles = cpu.cycles;
+    return 0;
+}
+
+//! Replace the element-by-element copy loops of heap compaction and of the garbage collection of the archive memory
+//  by calls to helpers which move the data by MOVEM bursts.
+static void OptimizeAMSBlockMoves(void) {
+    static const char *names[4] = {"", "move.b", "move.w", "move.l"};
+    CopyLoop loops[COPY_LOOP_MAX];
+    uint32_t entries[2], nbloops, start, addr, i, j, oldcycles, newcycles, oldtotal = 0, newtotal = 0, replaced = 0;
+
+    // 2k) The long stalls of HeapCompress and EM_GC come from moving blocks. The copy loops reachable from both, at
+    //     most two calls deep, are found with the decoder; each one is replaced by a jsr to a helper of its own,
+    //     which keeps the registers and flags of the original loop. Calls to memcpy and memmove are left to
+    //     ams-fast-memory-routines, and inline copies of HeapDeref to ams-rewrite-inline-heapderef.
+    if (GetAMSXrefs()) {
+        return;
+    }
+    entries[0] = rom_call_addr(HeapCompress);
+    entries[1] = rom_call_addr(EM_GC);
+    nbloops = FindLoops(entries, 2, 2, MatchCopyLoop, loops, COPY_LOOP_MAX);
+    if (nbloops == 0) {
+        printf("No copy loop found, skipping the optimization of block moves !\n");
+        return;
+    }
+    start = AllocROMSpace(nbloops * COPY_LOOP_HELPER_SIZE, 2);
+    if (start == 0) {
+        printf("Not enough free ROM space, skipping the optimization of block moves !\n");
+        return;
+    }
+    addr = start;
+    for (i = 0; i < nbloops; i++) {
+        // The loop must not have been modified since the cross-reference index was built.
+        for (j = 0; j < loops[i].length && GetShort(loops[i].site + j) == M68kShort(loops[i].site + j); j += 2);
+        loops[i].helper = 0;
+        if (j == loops[i].length) {
+            loops[i].helper = WriteCopyLoopHelper(addr, &loops[i]);
+            addr = Tell();
+        }
+    }
+    FreeROMSpace(addr, start + nbloops * COPY_LOOP_HELPER_SIZE);
+
+    if (SimInit(ROM_base + UINT32_C(0x12000), BasecodeEnd())) {
+        return;
+    }
+    printf("Optimizing %" PRIu32 " copy loops, %" PRIu32 " bytes at %06" PRIX32 ", nominal cycles per 4 KB of AMS and new loops:\n", nbloops, addr - start, start);
+    for (i = 0; i < nbloops; i++) {
+        if (loops[i].helper == 0 || CheckCopyLoop(&loops[i]) || TimeCopyLoop(&loops[i], 4096, 0, &oldcycles, &newcycles)) {
+            printf("Unexpected data, skipping the copy loop at %06" PRIX32 " !\n", loops[i].site);
+            loops[i].helper = 0;
+            continue;
+        }
+        printf("    %s loop at %06" PRIX32 "%10" PRIu32 "%8" PRIu32 "\n", names[(loops[i].size == 4) ? 3 : loops[i].size], loops[i].site, oldcycles, newcycles);
+        oldtotal += oldcycles;
+        newtotal += newcycles;
+    }
+    SimExit();
+
+    for (i = 0; i < nbloops; i++) {
+        if (loops[i].helper != 0) {
+            Seek(loops[i].site);
+            WriteShort(0x4EB9);
+            WriteLong(loops[i].helper);
+            if (loops[i].length == 8) {
+                WriteShort(0x4E71);
+            }
+            replaced++;
+        }
+    }
+    printf("    %" PRIu32 " loops replaced, %" PRIu32 " cycles instead of %" PRIu32 " for 4 KB through each\n", replaced, newtotal, oldtotal);
+}
+
+
+// Reset path: the loops are found up to two calls deep from the reset vector. Loops which write memory less than
+// BOOT_STACK_BAND bytes below a stack top are left as they are, since the helpers use the stack.
+#define BOOT_LOOP_DEPTH          (2)
+#define BOOT_STACK_BAND          UINT32_C(0x400)
+#define BOOT_STACK_MAX           (8)
+#define BOOT_CLEARED_HELPER_SIZE (16)
+#define BOOT_RUN_MAX             UINT32_C(64)
+
+// Stack tops seen on the reset path: the initial SSP, and the values loaded into a7.
+static uint32_t BootStackTops[BOOT_STACK_MAX];
+static uint32_t NbBootStackTops;
+
+//! Recognize the copy and fill loops of the reset path, for FindLoops. The values loaded into a7 on the way are kept
+//  in BootStackTops.
+static int MatchBootLoop (uint32_t absaddr, CopyLoop *loop) {
+    uint16_t op = M68kShort(absaddr);
+
+    if (NbBootStackTops < BOOT_STACK_MAX) {
+        if (op == 0x4FF8) {
+            BootStackTops[NbBootStackTops++] = (uint32_t)(int32_t)(int16_t)M68kShort(absaddr + 2);
+        }
+        else if (op == 0x4FF9 || op == 0x2E7C) {
+            BootStackTops[NbBootStackTops++] = M68kLong(absaddr + 2);
+        }
+    }
+    return MatchCopyLoop(absaddr, loop) || MatchFillLoop(absaddr, loop);
+}
+
+//! Find the values loaded by moveq, move #imm, movea #imm and lea into registers right before a loop, in instructions
+//  which nothing else jumps to. Return the mask of the registers found, bit n for dn and bit 8 + n for an; the bits of
+//  the registers whose low word only is known are set in *wordonly.
+static uint32_t GetLoopConstants (const CopyLoop *loop, uint32_t *values, uint32_t *wordonly) {
+    uint32_t known = 0, addr = loop->site, prev = 0, r, value, i, k;
+    uint16_t op;
+    M68kInsn insn;
+
+    *wordonly = 0;
+    for (i = 0; i < 4; i++) {
+        if (   CountXrefs(addr, XREF_CALL) != 0
+            || CountXrefs(addr, XREF_JUMP) > (uint32_t)(addr == loop->site && loop->kind != COPY_LOOP_BRA_DBF)) {
+            break;
+        }
+        for (k = 2; k <= 6; k += 2) {
+            prev = addr - k;
+            if (prev >= M68kCodeStart && XrefIsVisited(prev)) {
+                M68kDecode(prev, &insn);
+                if (insn.length == k && insn.flow == M68K_NORMAL) {
+                    break;
+                }
+            }
+        }
+        if (k > 6) {
+            break;
+        }
+        op = M68kShort(prev);
+        r = (op >> 9) & 7;
+        if ((op & 0xF1FF) == 0x41F8 || (op & 0xF1FF) == 0x307C) {
+            r += 8;
+            value = (uint32_t)(int32_t)(int16_t)M68kShort(prev + 2);
+        }
+        else if ((op & 0xF1FF) == 0x41F9 || (op & 0xF1FF) == 0x207C) {
+            r += 8;
+            value = M68kLong(prev + 2);
+        }
+        else if ((op & 0xF100) == 0x7000) {
+            value = (uint32_t)(int32_t)(int8_t)op;
+        }
+        else if ((op & 0xF1FF) == 0x303C || (op & 0xF1FF) == 0x203C) {
+            value = ((op & 0xF1FF) == 0x303C) ? M68kShort(prev + 2) : M68kLong(prev + 2);
+            if (!((known >> r) & 1) && (op & 0xF1FF) == 0x303C) {
+                *wordonly |= 1 << r;
+            }
+        }
+        else {
+            break;
+        }
+        if (!((known >> r) & 1)) {
+            known |= 1 << r;
+            values[r] = value;
+        }
+        addr = prev;
+    }
+    return known;
+}
+
+//! Get the range of RAM written by a loop of the reset path, from the registers loaded before it. Return 0 if it is
+//  not known.
+static int GetBootLoopRange (const CopyLoop *loop, const uint32_t *values, uint32_t known, uint32_t wordonly, uint32_t *start, uint32_t *end) {
+    uint32_t count = values[loop->dn];
+
+    if (!((known >> (8 + loop->ax)) & 1) || !((known >> loop->dn) & 1)) {
+        return 0;
+    }
+    if (loop->kind == COPY_LOOP_DBF) {
+        count = (count & 0xFFFF) + 1;
+    }
+    else if (loop->kind == COPY_LOOP_BRA_DBF) {
+        count &= 0xFFFF;
+    }
+    else if (loop->kind == COPY_LOOP_SUBQ_W) {
+        count = ((count - 1) & 0xFFFF) + 1;
+    }
+    else if ((wordonly >> loop->dn) & 1) {
+        return 0;
+    }
+    *start = values[8 + loop->ax] & UINT32_C(0xFFFFFF);
+    if (   count == 0 || *start >= SIM_RAM_SIZE || count > (SIM_RAM_SIZE - *start) / loop->size
+        || (loop->size > 1 && (*start & 1))) {
+        return 0;
+    }
+    *end = *start + count * loop->size;
+    return 1;
+}
+
+//! Check that only instructions which write registers, and which nothing else jumps to, run from from to to.
+static int IsRegisterRun (uint32_t from, uint32_t to) {
+    uint16_t op;
+    M68kInsn insn;
+
+    if (to < from || to - from > BOOT_RUN_MAX) {
+        return 0;
+    }
+    while (from < to) {
+        if (!XrefIsVisited(from) || IsXrefJumpTarget(from) || CountXrefs(from, XREF_CALL) != 0) {
+            return 0;
+        }
+        M68kDecode(from, &insn);
+        op = insn.opcode;
+        if (   insn.flow != M68K_NORMAL
+            || !(   (op & 0xF100) == 0x7000 || (op & 0xF1C0) == 0x41C0
+                 || ((op & 0xC000) == 0 && (op & 0x3000) != 0 && ((op >> 6) & 7) <= 1))) {
+            return 0;
+        }
+        from += insn.length;
+    }
+    return from == to;
+}
+
+//! Write at addr what is left of a loop which clears memory already cleared: the final registers and flags.
+static uint32_t WriteClearedLoopHelper (uint32_t addr, const CopyLoop *loop, uint32_t end) {
+    Seek(addr);
+    WriteShort(0x207C | (loop->ax << 9));
+    WriteLong(end);
+    if (loop->kind == COPY_LOOP_DBF || loop->kind == COPY_LOOP_BRA_DBF) {
+        WriteShort(0x303C | (loop->dn << 9));
+        WriteShort(0xFFFF);
+        WriteShort(0xB040 | (loop->dn << 9) | loop->dn);
+    }
+    else {
+        WriteShort(((loop->kind == COPY_LOOP_SUBQ_L) ? 0x9080 : 0x9040) | (loop->dn << 9) | loop->dn);
+    }
+    WriteShort(0x4E75);
+    return addr;
+}
+
+//! Compare a loop which clears [start, end), already cleared, run in place with the registers loaded before it, with
+//  its replacement. Store the cycles of both, return 0 if the memory, the registers and the flags are the same.
+static int CheckClearedLoop (const CopyLoop *loop, const uint32_t *values, uint32_t known, uint32_t start, uint32_t end, uint32_t *oldcycles, uint32_t *newcycles) {
+    static uint8_t before[SIM_RAM_SIZE], after[SIM_RAM_SIZE];
+    uint32_t seed = 1, sp, i, ret = loop->site + loop->length - SimROMStart;
+    uint8_t saved[2];
+    M68kCpu cpu, cpu2;
+
+    // The stack must not be in the range, the original loop returns by an RTS put after it in the simulated ROM.
+    if (start >= 0x100) {
+        sp = (start - 16) & ~UINT32_C(1);
+    }
+    else if (end <= SIM_RAM_SIZE - 0x100) {
+        sp = SIM_RAM_SIZE - 16;
+    }
+    else {
+        return 1;
+    }
+    for (i = 0; i < SIM_RAM_SIZE; i++) {
+        seed = seed * UINT32_C(1103515245) + 12345;
+        before[i] = (i >= start && i < end) ? 0 : (uint8_t)(seed >> 16);
+    }
+    SimReset(&cpu);
+    for (i = 0; i < 15; i++) {
+        seed = seed * UINT32_C(1103515245) + 12345;
+        ((i < 8) ? cpu.d : cpu.a)[i & 7] = ((known >> i) & 1) ? values[i] : seed;
+    }
+    cpu.x = 1;
+    cpu.a[7] = sp;
+    cpu2 = cpu;
+    saved[0] = SimROM[ret];
+    saved[1] = SimROM[ret + 1];
+    SimROM[ret] = 0x4E;
+    SimROM[ret + 1] = 0x75;
+    memcpy(SimRAM, before, SIM_RAM_SIZE);
+    i = SimCall(&cpu, loop->site, COPY_TEST_INSNS);
+    SimROM[ret] = saved[0];
+    SimROM[ret + 1] = saved[1];
+    if (i != SIM_OK) {
+        return 1;
+    }
+    memcpy(after, SimRAM, SIM_RAM_SIZE);
+    memcpy(SimRAM, before, SIM_RAM_SIZE);
+    if (   SimCall(&cpu2, loop->helper, COPY_TEST_INSNS) != SIM_OK
+        || !SameBytes(after, SimRAM, SIM_RAM_SIZE)
+        || !SameBytes((const uint8_t *)cpu.d, (const uint8_t *)cpu2.d, sizeof(cpu.d))
+        || !SameBytes((const uint8_t *)cpu.a, (const uint8_t *)cpu2.a, sizeof(cpu.a))
+        || cpu.x != cpu2.x || cpu.n != cpu2.n || cpu.z != cpu2.z || cpu.v != cpu2.v || cpu.c != cpu2.c) {
+        return 1;
+    }
+    *oldcycles = cpu.cycles;
+    *newcycles = cpu2.cycles;
+    return 0;
+}
+
+//! Replace the loops which clear and copy RAM on the reset path by calls to helpers which use MOVEM bursts, and drop
+//  the passes over RAM already cleared.
+static void OptimizeAMSBoot(void) {
+    static const char *bodies[3] = {"copy", "clear", "fill"};
+    CopyLoop loops[COPY_LOOP_MAX];
+    uint32_t starts[COPY_LOOP_MAX], ends[COPY_LOOP_MAX], values[16], known[COPY_LOOP_MAX];
+    uint8_t zero[COPY_LOOP_MAX], redundant[COPY_LOOP_MAX], safe[COPY_LOOP_MAX];
+    uint32_t entry, nbloops, start, addr, wordonly, bytes, timed, i, j, oldcycles, newcycles;
+    uint32_t oldtotal = 0, newtotal = 0, replaced = 0;
+
+    // 2l) The reset code clears and initializes RAM with loops storing an element at a time. The loops which write a
+    //     range of RAM given by the registers loaded right before them are replaced by jsr to helpers of their own,
+    //     unless the range is near a stack top; a clear of a range which a previous clear, in the same straight run
+    //     of register loads, has already zeroed only sets the registers and flags.
+    if (GetAMSXrefs()) {
+        return;
+    }
+    BootStackTops[0] = GetAMSVector(0);
+    NbBootStackTops = 1;
+    entry = GetAMSVector(4);
+    nbloops = FindLoops(&entry, 1, BOOT_LOOP_DEPTH, MatchBootLoop, loops, COPY_LOOP_MAX);
+    for (i = 0; i < nbloops; i++) {
+        safe[i] = 0;
+        zero[i] = 0;
+        redundant[i] = 0;
+        known[i] = GetLoopConstants(&loops[i], values, &wordonly);
+        if (!GetBootLoopRange(&loops[i], values, known[i], wordonly, &starts[i], &ends[i])) {
+            continue;
+        }
+        zero[i] =    loops[i].body == LOOP_BODY_CLR
+                  || (   loops[i].body == LOOP_BODY_FILL && ((known[i] >> loops[i].ay) & 1)
+                      && (values[loops[i].ay] & (UINT32_C(0xFFFFFFFF) >> (32 - 8 * loops[i].size))) == 0
+                      && (loops[i].size < 4 || !((wordonly >> loops[i].ay) & 1)));
+        // The loop must not have been modified since the cross-reference index was built.
+        for (j = 0; j < loops[i].length && GetShort(loops[i].site + j) == M68kShort(loops[i].site + j); j += 2);
+        safe[i] = (j == loops[i].length);
+        for (j = 0; j < NbBootStackTops; j++) {
+            if (starts[i] < BootStackTops[j] && ends[i] > BootStackTops[j] - BOOT_STACK_BAND) {
+                safe[i] = 0;
+            }
+        }
+    }
+    for (i = 0; i < nbloops; i++) {
+        for (j = 0; j < nbloops; j++) {
+            if (   safe[i] && zero[i] && zero[j] && j != i && starts[j] <= starts[i] && ends[i] <= ends[j]
+                && IsRegisterRun(loops[j].site + loops[j].length, loops[i].site)) {
+                redundant[i] = 1;
+            }
+        }
+    }
+    for (i = 0, j = 0; i < nbloops; i++) {
+        j += safe[i];
+    }
+    if (j == 0) {
+        printf("No RAM initialization loop of known range found on the reset path, skipping the optimization of the boot !\n");
+        return;
+    }
+    start = AllocROMSpace(j * COPY_LOOP_HELPER_SIZE, 2);
+    if (start == 0) {
+        printf("Not enough free ROM space, skipping the optimization of the boot !\n");
+        return;
+    }
+    addr = start;
+    for (i = 0; i < nbloops; i++) {
+        loops[i].helper = 0;
+        if (safe[i]) {
+            if (redundant[i]) {
+                loops[i].helper = WriteClearedLoopHelper(addr, &loops[i], ends[i]);
+            }
+            else if (loops[i].body == LOOP_BODY_COPY) {
+                loops[i].helper = WriteCopyLoopHelper(addr, &loops[i]);
+            }
+            else {
+                loops[i].helper = WriteFillLoopHelper(addr, &loops[i]);
+            }
+            addr = Tell();
+        }
+    }
+    FreeROMSpace(addr, start + j * COPY_LOOP_HELPER_SIZE);
+
+    if (SimInit(ROM_base + UINT32_C(0x12000), BasecodeEnd())) {
+        return;
+    }
+    printf("Optimizing the RAM initialization of the reset path for calculator type %" PRIu8 ", %" PRIu32 " bytes at %06" PRIX32 ", nominal cycles of AMS and new loops:\n", CalculatorType, addr - start, start);
+    for (i = 0; i < nbloops; i++) {
+        if (loops[i].helper == 0) {
+            printf("    %s loop at %06" PRIX32 " left as is\n", bodies[loops[i].body], loops[i].site);
+            continue;
+        }
+        bytes = ends[i] - starts[i];
+        timed = (bytes < COPY_TEST_SIZE / 2) ? bytes : COPY_TEST_SIZE / 2;
+        GetLoopConstants(&loops[i], values, &wordonly);
+        if (redundant[i]) {
+            if (CheckClearedLoop(&loops[i], values, known[i], starts[i], ends[i], &oldcycles, &newcycles)) {
+                loops[i].helper = 0;
+            }
+        }
+        else if (CheckCopyLoop(&loops[i]) || TimeCopyLoop(&loops[i], timed, starts[i] & 1, &oldcycles, &newcycles)) {
+            loops[i].helper = 0;
+        }
+        else {
+            // Both are linear in the number of bytes beyond half the test area.
+            oldcycles = (uint32_t)((uint64_t)oldcycles * bytes / timed);
+            newcycles = (uint32_t)((uint64_t)newcycles * bytes / timed);
+        }
+        if (loops[i].helper == 0) {
+            printf("Unexpected data, skipping the %s loop at %06" PRIX32 " !\n", bodies[loops[i].body], loops[i].site);
+            continue;
+        }
+        printf("    %s loop at %06" PRIX32 " over %06" PRIX32 "-%06" PRIX32 "%s%10" PRIu32 "%10" PRIu32 "\n", bodies[loops[i].body], loops[i].site, starts[i], ends[i], redundant[i] ? " (already cleared)" : "", oldcycles, newcycles);
+        oldtotal += oldcycles;
+        newtotal += newcycles;
+    }
+    SimExit();
+
+    for (i = 0; i < nbloops; i++) {
+        if (loops[i].helper != 0) {
+            Seek(loops[i].site);
+            WriteShort(0x4EB9);
+            WriteLong(loops[i].helper);
+            if (loops[i].length == 8) {
+                WriteShort(0x4E71);
+            }
+            replaced++;
+        }
+    }
+    printf("    %" PRIu32 " loops replaced, %" PRIu32 " cycles instead of %" PRIu32 " in the replaced boot loops on calculator type %" PRIu8 "\n", replaced, newtotal, oldtotal, CalculatorType);
+}
+
+
+//! Add functionality to AMS.
+static void ExpandAMS(void) {
+    uint32_t temp, temp2, temp3, temp4, temp5, temp6, temp7, temp8;
+
+    BeginSection("5a");
+    // 5a) Reintegrate OSVRegisterTimer/OSVFreeTimer functionality.
+    temp6 = AllocROMSpace(48, 2);
+    temp7 = AllocROMSpace(46, 2);
+    temp8 = AllocROMSpace(36, 2);
+    if (temp6 != 0 && temp7 != 0 && temp8 != 0)
+    {
+        printf("Reintegrating OSVRegisterTimer/OSVFreeTimer functionality at %06" PRIX32 ", %06" PRIX32 ", %06" PRIX32 "\n", temp6, temp7, temp8);
+        // Add a new AI5 handler and modify the original one.
+        temp = GetAMSVector(0x74);
+        Seek(temp);
+        temp2 = ReadLong();
+        temp3 = SearchShort(0x4E73);
+        temp4 = GetLong(temp3 - 6);
+        Seek(temp3 - 6);
+        WriteShort(0x4E75);
+        temp5 = GetAMSTrap9Item(3);
+        Seek(temp6);
+        WriteLong(temp2);
+        WriteShort(0x4EB9);
+        WriteLong(temp + 4);
+        WriteShort(0x45F8);
+        WriteShort(temp5);
+        WriteShort(0x76FF);
+        WriteShort(0xB69A);
+        WriteShort(0x6718);
+        WriteShort(0x5392);
+        WriteShort(0x6614);
+        WriteLong(UINT32_C(0x24EAFFFC));
+        WriteShort(0x205A);
+        WriteShort(0x4E90);
+        WriteShort(0xB4FC);
+        WriteShort(temp5 + 24);
+        WriteShort(0x6DEA);
+        WriteLong(temp4);
+        WriteShort(0x4E73);
+        WriteShort(0x508A);
+        WriteShort(0x60F0);
+        FreeROMSpace(Tell(), temp6 + 48);
+        SetAMSVector(0x74, temp6);
+
+        // Rewrite the timer-related reset (init) code entirely.
+        // It's easy enough to end up with code smaller than TI's code, despite the new code providing more functionality...
+        temp = rom_call_addr(FiftyMsecTick);
+        temp2 = GetAMSTrap9Item(4);
+        temp6 = rom_call_addr(OSRegisterTimer);
+        Seek(temp6);
+        temp6 = SearchBackwardsShort(0x48E7);
+        WriteShort(0x7000);
+        if (temp < 0x8000) {
+            WriteShort(0x21C0);
+            WriteShort(temp);
+        }
+        else {
+            WriteShort(0x23C0);
+            WriteLong(temp);
+        }
+        WriteShort(0x41F8);
+        WriteShort(temp2 + 0xA);
+        WriteShort(0x43F8);
+        temp3 = 8;
+        if (AMS_Major == 2) {
+            if (AMS_Minor == 5) {
+                temp3 = 7;
+            }
+        }
+        else {
+            if (CalculatorType == TI89T) {
+                temp3 = 9;
+            }
+        }
+        WriteShort(temp5 - 2 * temp3);
+        WriteByte(0x74);
+        WriteByte(temp3 - 1);
+        WriteShort(0x72FF);
+        WriteShort(0x20C1);
+        WriteShort(0x20C0);
+        WriteShort(0x32C0);
+        WriteLong(UINT32_C(0x51CAFFF8));
+        WriteShort(0x22C1);
+        WriteShort(0x22C0);
+        WriteShort(0x22C0);
+        WriteShort(0x22C1);
+        WriteShort(0x22C0);
+        WriteShort(0x22C0);
+        WriteShort(0x4E75);
+
+        // OSVRegisterTimer.
+        temp6 = temp7;
+        Seek(temp6);
+        WriteShort(0x7000);
+        WriteLong(UINT32_C(0x322F0004));
+        WriteShort(0x5341);
+        WriteShort(0x74FF);
+        WriteLong(UINT32_C(0x0C410002));
+        WriteShort(0x641C);
+        WriteShort(0x41F8);
+        WriteShort(temp5);
+        WriteLong(UINT32_C(0xC2FC000C));
+        WriteShort(0xD1C1);
+        WriteShort(0xB490);
+        WriteShort(0x660E);
+        WriteLong(UINT32_C(0x242F0006));
+        WriteShort(0x20C2);
+        WriteShort(0x20C2);
+        WriteLong(UINT32_C(0x20AF000A));
+        WriteShort(0x5240);
+        WriteShort(0x4E75);
+        FreeROMSpace(Tell(), temp6 + 46);
+        SetAMSrom_call(OSVRegisterTimer, temp6);
+
+        // OSVFreeTimer.
+        temp6 = temp8;
+        Seek(temp6);
+        WriteShort(0x7000);
+        WriteLong(UINT32_C(0x322F0004));
+        WriteShort(0x5341);
+        WriteShort(0x74FF);
+        WriteLong(UINT32_C(0x0C410002));
+        WriteShort(0x6412);
+        WriteShort(0x41F8);
+        WriteShort(temp5);
+        WriteLong(UINT32_C(0xC3FC000C));
+        WriteShort(0xD1C1);
+        WriteShort(0x20C2);
+        WriteShort(0x4298);
+        WriteShort(0x4290);
+        WriteShort(0x5240);
+        WriteShort(0x4E75);
+        FreeROMSpace(Tell(), temp6 + 36);
+        SetAMSrom_call(OSVFreeTimer, temp6);
+    }
+    else {
+        if (temp6 != 0) FreeROMSpace(temp6, temp6 + 48);
+        if (temp7 != 0) FreeROMSpace(temp7, temp7 + 46);
+        if (temp8 != 0) FreeROMSpace(temp8, temp8 + 36);
+    }
+}
+
+
+// RAM taken by the instrumentation: the top INSTRUMENT_RAM_SIZE bytes of the supervisor stack area, given up by
+// ReserveInstrumentRAM, so that no stack frame can reach it. The AI5 profiler keeps there a header of four longwords
+// (magic, start of the sampled range, shift << 16 | number of buckets, number of samples), followed by word buckets,
+// saturating at 0xFFFF. The last bucket counts the samples outside the basecode. The call counters follow: for each
+// counted ROM_CALL, its index (word) and the number of calls (longword).
+#define PROFILE_MAGIC           UINT32_C(0x50524F46)
+#define PROFILE_BUCKETS         (1024)
+#define PROFILE_RAM_SIZE        (16 + 2 * PROFILE_BUCKETS)
+#define PROFILE_HANDLER_SIZE    (80)
+#define CALLCOUNT_RAM_SIZE      (6 * NB_BLOCKS(CountedROMCalls))
+#define CALLCOUNT_TRAMPOLINE    (20)
+#define INSTRUMENT_RAM_SIZE     (PROFILE_RAM_SIZE + CALLCOUNT_RAM_SIZE)
+
+// Start of the instrumentation RAM, i.e. the new initial SSP, once reserved.
+static uint32_t InstrumentRAM;
+
+// The ROM_CALLs whose calls are counted by ams-count-calls.
+static const NamedROMCall CountedROMCalls[] = {
+    NAMED_ROM_CALL(memcmp),
+    NAMED_ROM_CALL(AMS_memcpy),
+    NAMED_ROM_CALL(AMS_memmove),
+    NAMED_ROM_CALL(AMS_memset),
+    NAMED_ROM_CALL(DrawChar),
+    NAMED_ROM_CALL(DrawClipChar),
+    NAMED_ROM_CALL(DrawLine),
+    NAMED_ROM_CALL(DrawStr),
+    NAMED_ROM_CALL(EM_GC),
+    NAMED_ROM_CALL(FindSymInFolder),
+    NAMED_ROM_CALL(FontGetSys),
+    NAMED_ROM_CALL(HeapCompress),
+    NAMED_ROM_CALL(HeapDeref),
+    NAMED_ROM_CALL(next_expression_index),
+    NAMED_ROM_CALL(OO_CondGetAttr),
+    NAMED_ROM_CALL(OO_Deref),
+    NAMED_ROM_CALL(OO_GetAttr),
+    NAMED_ROM_CALL(PortSet),
+    NAMED_ROM_CALL(push_zstr),
+    NAMED_ROM_CALL(ScreenClear),
+    NAMED_ROM_CALL(ScrRectFill),
+    NAMED_ROM_CALL(XR_stringPtr)
+};
+
+//! Reserve the instrumentation RAM at the top of the supervisor stack area, by lowering the initial SSP, and the same
+//  value loaded into a7 by lea (xxx).w, lea (xxx).l or movea.l #xxx in the decoded code, by INSTRUMENT_RAM_SIZE. Other
+//  references to the initial SSP would not know of the new one, so they make it fail. Return the address of the RAM,
+//  or 0 on failure.
+static uint32_t ReserveInstrumentRAM (void) {
+    uint32_t sites[BOOT_STACK_MAX];
+    uint32_t ssp, addr, n = 0, i, j;
+    uint16_t op;
+
+    if (InstrumentRAM != 0) {
+        return InstrumentRAM;
+    }
+    if (GetAMSXrefs()) {
+        return 0;
+    }
+    // The handlers address the RAM with absolute short addressing.
+    ssp = GetAMSVector(0);
+    if (ssp >= 0x8000 || ssp < UINT32_C(0x400) + 2 * INSTRUMENT_RAM_SIZE) {
+        return 0;
+    }
+    for (addr = M68kCodeStart; addr + 6 <= M68kCodeEnd; addr += 2) {
+        op = M68kShort(addr);
+        if (   XrefIsVisited(addr)
+            && (   (op == 0x4FF8 && (uint32_t)(int32_t)(int16_t)M68kShort(addr + 2) == ssp)
+                || ((op == 0x4FF9 || op == 0x2E7C) && M68kLong(addr + 2) == ssp))) {
+            // The instruction must not have been modified since the cross-reference index was built.
+            if (n == BOOT_STACK_MAX || GetShort(addr) != op || GetShort(addr + 2) != M68kShort(addr + 2)) {
+                return 0;
+            }
+            sites[n++] = addr;
+        }
+    }
+    for (i = FindXref(ssp); i < NbXrefs && Xrefs[i].target == ssp; i++) {
+        for (j = 0; j < n && sites[j] != Xrefs[i].site; j++);
+        if (j == n) {
+            return 0;
+        }
+    }
+
+    InstrumentRAM = ssp - INSTRUMENT_RAM_SIZE;
+    SetAMSVector(0, InstrumentRAM);
+    for (i = 0; i < n; i++) {
+        if (M68kShort(sites[i]) == 0x4FF8) {
+            PutShort((uint16_t)InstrumentRAM, sites[i] + 2);
+        }
+        else {
+            PutLong(InstrumentRAM, sites[i] + 2);
+        }
+    }
+    printf("Reserving %" PRIu32 " bytes of RAM at %04" PRIX32 " for the instrumentation: initial SSP lowered from %04" PRIX32 ", %" PRIu32 " loads of a7 changed\n",
+           ssp - InstrumentRAM, InstrumentRAM, ssp, n);
+    return InstrumentRAM;
+}
+
+//! Write at addr the AI5 handler of the profiler, which samples the interrupted PC into the RAM at ram and goes on
+//  with old.
+static uint32_t WriteProfileHandler (uint32_t addr, uint32_t ram, uint32_t start, uint32_t shift, uint32_t old) {
+    uint32_t site, i;
+
+    Seek(addr);
+    WriteLong(UINT32_C(0x48E78080));
+    WriteShort(0x41F8);
+    WriteShort(ram);
+    WriteShort(0x20FC);
+    WriteLong(PROFILE_MAGIC);
+    WriteShort(0x20FC);
+    WriteLong(start);
+    WriteShort(0x20FC);
+    WriteLong((shift << 16) | PROFILE_BUCKETS);
+    WriteShort(0x5298);
+    // The PC is above the SR in the exception frame.
+    WriteLong(UINT32_C(0x202F000A));
+    WriteShort(0x0480);
+    WriteLong(start);
+    WriteShort(0x0C80);
+    WriteLong((uint32_t)(PROFILE_BUCKETS - 1) << shift);
+    site = Tell();
+    WriteShort(0x6500);
+    WriteShort(0x203C);
+    WriteLong((uint32_t)(PROFILE_BUCKETS - 1) << shift);
+    FixShortBranch(site);
+    for (i = shift; i > 0; i -= (i > 8) ? 8 : i) {
+        WriteShort(0xE088 | (((i > 8) ? 0 : (i & 7)) << 9));
+    }
+    WriteShort(0xD080);
+    WriteLong(UINT32_C(0x52700800));
+    WriteShort(0x6604);
+    WriteLong(UINT32_C(0x53700800));
+    WriteLong(UINT32_C(0x4CDF0101));
+    WriteShort(0x4EF9);
+    WriteLong(old);
+    return addr;
+}
+
+//! Run the profiler's handler at entry in the simulator, up to the jump to old, on an interrupted pc, with the stack
+//  right below the RAM at ram. Return the number of the bucket incremented, PROFILE_BUCKETS if none was (saturation),
+//  or 0xFFFFFFFF if the handler did not behave as expected.
+static uint32_t SimProfileHandler (uint32_t entry, uint32_t ram, uint32_t old, uint32_t pc, uint32_t *cycles) {
+    static uint16_t before[PROFILE_BUCKETS];
+    uint32_t i, sp, total, bucket = PROFILE_BUCKETS, value;
+    M68kCpu cpu, cpu2;
+
+    SimReset(&cpu);
+    cpu.a[7] = ram;
+    for (i = 0; i < 15; i++) {
+        ((i < 8) ? cpu.d : cpu.a)[i & 7] = UINT32_C(0x12345678) * (i + 1);
+    }
+    SimPush(&cpu, pc, 4);
+    SimPush(&cpu, 0x2000, 2);
+    cpu2 = cpu;
+    sp = cpu.a[7];
+    total = SimRead(&cpu, ram + 12, 4);
+    for (i = 0; i < PROFILE_BUCKETS; i++) {
+        before[i] = (uint16_t)SimRead(&cpu, ram + 16 + 2 * i, 2);
+    }
+    cpu.pc = entry;
+    for (i = 0; i < 64 && cpu.pc != old && !cpu.error; i++) {
+        SimStep(&cpu);
+    }
+    if (   cpu.pc != old || cpu.error || cpu.a[7] != sp
+        || !SameBytes((const uint8_t *)cpu.d, (const uint8_t *)cpu2.d, sizeof(cpu.d))
+        || !SameBytes((const uint8_t *)cpu.a, (const uint8_t *)cpu2.a, sizeof(cpu.a))
+        || SimRead(&cpu, ram, 4) != PROFILE_MAGIC || SimRead(&cpu, ram + 12, 4) != total + 1) {
+        return UINT32_C(0xFFFFFFFF);
+    }
+    *cycles = cpu.cycles;
+    for (i = 0; i < PROFILE_BUCKETS; i++) {
+        value = SimRead(&cpu, ram + 16 + 2 * i, 2);
+        if (value != before[i]) {
+            if (value != before[i] + 1u || bucket != PROFILE_BUCKETS) {
+                return UINT32_C(0xFFFFFFFF);
+            }
+            bucket = i;
+        }
+    }
+    return bucket;
+}
+
+//! Make a profiling build: hook AUTO_INT_5 with a handler which samples the interrupted PC into a histogram of the
+//  basecode in RAM, for DecodeAMSRAM.
+static void InstrumentAMSProfiler(void) {
+    static const uint32_t offsets[4] = {0, 0x1234, 0x5678, 0xFFFE};
+    uint32_t start = ROM_base + UINT32_C(0x12000), end = BasecodeEnd(), shift, old, addr, ram, bucket, pc, i;
+    uint32_t cycles = 0;
+
+    // 6a) AUTO_INT_5 is the 20 Hz timer, whatever the load of the CPU: its frequent samples of the interrupted PC
+    //     show where AMS spends its time on real workloads. The handler chains to the final one, i.e. the one of
+    //     OSVRegisterTimer if ExpandAMS installed it.
+    for (shift = 1; ((end - start - 1) >> shift) >= PROFILE_BUCKETS - 1; shift++);
+    old = GetAMSVector(0x74);
+    ram = ReserveInstrumentRAM();
+    if (ram == 0) {
+        printf("Unexpected data, no RAM can be reserved at the top of the stack, skipping the profiler !\n");
+        return;
+    }
+    addr = AllocROMSpace(PROFILE_HANDLER_SIZE, 2);
+    if (addr == 0) {
+        printf("Not enough free ROM space, skipping the profiler !\n");
+        return;
+    }
+    WriteProfileHandler(addr, ram, start, shift, old);
+    FreeROMSpace(Tell(), addr + PROFILE_HANDLER_SIZE);
+
+    if (SimInit(start, end)) {
+        FreeROMSpace(addr, addr + PROFILE_HANDLER_SIZE);
+        return;
+    }
+    for (i = 0; i < 9; i++) {
+        pc = (i < 4) ? start + ((uint32_t)(((uint64_t)(end - start) * offsets[i]) >> 16) & ~UINT32_C(1)) : (i == 4) ? start - 2 : (i == 5) ? start + ((uint32_t)(PROFILE_BUCKETS - 1) << shift) : (i == 6) ? 0x1234 : UINT32_C(0x600000);
+        bucket = (i < 4) ? (pc - start) >> shift : PROFILE_BUCKETS - 1;
+        // The last run checks that a full bucket saturates.
+        if (i == 8) {
+            pc = start;
+            bucket = PROFILE_BUCKETS;
+            SimRAM[ram + 16] = 0xFF;
+            SimRAM[ram + 17] = 0xFF;
+        }
+        if (SimProfileHandler(addr, ram, old, pc, &cycles) != bucket) {
+            break;
+        }
+    }
+    SimExit();
+    if (i != 9) {
+        printf("Unexpected data, skipping the profiler !\n");
+        FreeROMSpace(addr, addr + PROFILE_HANDLER_SIZE);
+        return;
+    }
+    SetAMSVector(0x74, addr);
+    printf("Profiling AUTO_INT_5 at %06" PRIX32 ", %" PRIu32 " cycles per sample: %u buckets of %" PRIu32 " bytes from %06" PRIX32 " at %04" PRIX32 " in RAM\n", addr, cycles, PROFILE_BUCKETS, UINT32_C(1) << shift, start, ram);
+}
+
+
+//! Write at addr the trampoline of a counted ROM_CALL, which counts the call in entry and goes on with target, keeping
+//  the flags.
+static uint32_t WriteCountTrampoline (uint32_t addr, uint32_t idx, uint32_t entry, uint32_t target) {
+    Seek(addr);
+    WriteShort(0x40E7);
+    WriteShort(0x31FC);
+    WriteShort(idx);
+    WriteShort(entry);
+    WriteShort(0x52B8);
+    WriteShort(entry + 2);
+    WriteShort(0x44DF);
+    WriteShort(0x4EF9);
+    WriteLong(target);
+    return addr;
+}
+
+//! Run a trampoline in the simulator up to the jump to target, with the stack right below the instrumentation RAM.
+//  Return 0 if it counted the call in entry, and kept the registers and flags.
+static int CheckCountTrampoline (uint32_t addr, uint32_t idx, uint32_t entry, uint32_t target) {
+    uint32_t i, sp, n, flags;
+    M68kCpu cpu, cpu2;
+
+    for (flags = 0; flags < 32; flags += 7) {
+        SimReset(&cpu);
+        cpu.a[7] = InstrumentRAM;
+        for (i = 0; i < 15; i++) {
+            ((i < 8) ? cpu.d : cpu.a)[i & 7] = UINT32_C(0x9E3779B9) * (i + flags + 1);
+        }
+        cpu.x = flags & 1;
+        cpu.n = (flags >> 1) & 1;
+        cpu.z = (flags >> 2) & 1;
+        cpu.v = (flags >> 3) & 1;
+        cpu.c = (flags >> 4) & 1;
+        SimPush(&cpu, SIM_RETURN, 4);
+        cpu2 = cpu;
+        sp = cpu.a[7];
+        n = SimRead(&cpu, entry + 2, 4);
+        cpu.pc = addr;
+        for (i = 0; i < 16 && cpu.pc != target && !cpu.error; i++) {
+            SimStep(&cpu);
+        }
+        if (   cpu.pc != target || cpu.error || cpu.a[7] != sp
+            || !SameBytes((const uint8_t *)cpu.d, (const uint8_t *)cpu2.d, sizeof(cpu.d))
+            || !SameBytes((const uint8_t *)cpu.a, (const uint8_t *)cpu2.a, sizeof(cpu.a))
+            || cpu.x != cpu2.x || cpu.n != cpu2.n || cpu.z != cpu2.z || cpu.v != cpu2.v || cpu.c != cpu2.c
+            || SimRead(&cpu, entry, 2) != idx || SimRead(&cpu, entry + 2, 4) != n + 1) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//! Make an instrumented build which counts the calls to the ROM_CALLs of CountedROMCalls, through the jump table and
+//  from the basecode, for DecodeAMSRAM.
+static void InstrumentAMSCallCounts(void) {
+    uint32_t n = NB_BLOCKS(CountedROMCalls);
+    uint32_t start, ram, addr, orig, target, entry, retargeted, i, j;
+
+    // 6b) Each counted ROM_CALL gets a trampoline of its own, which the jump table points to. The calls from the
+    //     basecode are found through the cross-reference index, at the original entry points read from the snapshot
+    //     of the jump table; they are retargeted only if they still point to the original or the current routine.
+    if (GetAMSXrefs()) {
+        return;
+    }
+    ram = ReserveInstrumentRAM();
+    if (ram == 0) {
+        printf("Unexpected data, no RAM can be reserved at the top of the stack, skipping the counting of calls !\n");
+        return;
+    }
+    ram += PROFILE_RAM_SIZE;
+    start = AllocROMSpace(n * CALLCOUNT_TRAMPOLINE, 2);
+    if (start == 0) {
+        printf("Not enough free ROM space, skipping the counting of calls !\n");
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        WriteCountTrampoline(start + i * CALLCOUNT_TRAMPOLINE, CountedROMCalls[i].idx, ram + 6 * i, rom_call_addr(CountedROMCalls[i].idx));
+    }
+    if (SimInit(ROM_base + UINT32_C(0x12000), BasecodeEnd())) {
+        FreeROMSpace(start, start + n * CALLCOUNT_TRAMPOLINE);
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        if (CheckCountTrampoline(start + i * CALLCOUNT_TRAMPOLINE, CountedROMCalls[i].idx, ram + 6 * i, rom_call_addr(CountedROMCalls[i].idx))) {
+            break;
+        }
+    }
+    SimExit();
+    if (i != n) {
+        printf("Unexpected data, skipping the counting of calls !\n");
+        FreeROMSpace(start, start + n * CALLCOUNT_TRAMPOLINE);
+        return;
+    }
+
+    printf("Counting the calls to %" PRIu32 " ROM_CALLs, trampolines at %06" PRIX32 ", counters at %04" PRIX32 " in RAM:\n", n, start, ram);
+    for (i = 0; i < n; i++) {
+        addr = start + i * CALLCOUNT_TRAMPOLINE;
+        target = rom_call_addr(CountedROMCalls[i].idx);
+        entry = jmp_tbl + 4 * CountedROMCalls[i].idx;
+        orig = (entry >= M68kCodeStart && entry + 4 <= M68kCodeEnd) ? M68kLong(entry) : target;
+        SetAMSrom_call(CountedROMCalls[i].idx, addr);
+        retargeted = 0;
+        for (j = FindXref(orig); j < NbXrefs && Xrefs[j].target == orig; j++) {
+            if (   (Xrefs[j].kind == XREF_CALL || Xrefs[j].kind == XREF_JUMP)
+                && (GetXrefTarget(&Xrefs[j]) == orig || GetXrefTarget(&Xrefs[j]) == target)) {
+                retargeted += RetargetXref(&Xrefs[j], addr);
+            }
+        }
+        printf("    %-24s ROM_CALL %03" PRIX32 " at %06" PRIX32 ", %" PRIu32 " internal references counted\n", CountedROMCalls[i].name, CountedROMCalls[i].idx, target, retargeted);
+    }
+}
+
+
+void PatchAMS(void) {
+    uint32_t temp;
+
+    // Stamp the image with the patchset, for IdentifyAMS.
+    temp = AllocROMSpace(sizeof(PATCHDESC), 2);
+    if (temp != 0) {
+        PutNBytes((uint8_t *)PATCHDESC, sizeof(PATCHDESC), temp);
+    }
+
+    // The sections of the first three steps read the pristine image, their writes are checked and applied together.
+    BeginPhase();
+
+    UnlockAMS();
+
+    OptimizeAMS();
+
+    FixAMS();
+
+    ApplyPhase();
+    // The sections above may have indexed the pristine code.
+    FreeXrefIndex();
+
+    ShrinkAMS();
+
+    // Uses what is left of the last Flash sector after shrinking.
+    if (enabled_changes & AMS_PRESHIFT_FONTS_FLAG) {
+        PreshiftAMSFonts();
+    }
+
+    BeginPhase();
+
+    ExpandAMS();
+
+    ApplyPhase();
+
+    // The new code below is checked by simulation, against the code written before it.
+    EndSections();
+
+    // Uses the free ROM space left by the other changes.
+    if (enabled_changes & AMS_FAST_MEMORY_ROUTINES_FLAG) {
+        OptimizeAMSMemoryRoutines();
+    }
+    if (enabled_changes & AMS_FAST_GRAPHICS_FLAG) {
+        OptimizeAMSGraphics();
+    }
+    if (enabled_changes & AMS_FAST_ESTACK_TRAVERSAL_FLAG) {
+        OptimizeAMSEstackTraversal();
+    }
+    if (enabled_changes & AMS_FAST_FRAME_LOOKUP_FLAG) {
+        OptimizeAMSFrameLookup();
+    }
+    if (enabled_changes & AMS_FAST_SYMFIND_FLAG) {
+        OptimizeAMSSymFind();
+    }
+    if (enabled_changes & AMS_FAST_BLOCK_MOVES_FLAG) {
+        OptimizeAMSBlockMoves();
+    }
+    if (enabled_changes & AMS_FAST_BOOT_FLAG) {
+        OptimizeAMSBoot();
+    }
+
+    // Instrumentation, of the final code.
+    if (enabled_changes & AMS_PROFILE_FLAG) {
+        InstrumentAMSProfiler();
+    }
+    if (enabled_changes & AMS_COUNT_CALLS_FLAG) {
+        InstrumentAMSCallCounts();
+    }
+}
+
+
+// The stamps written by PatchAMS start with this.
+#define PATCH_STAMP_PREFIX  "amspatch-"
+
+//! Classify the input file from the patch sites of this patchset, reading a few hundred bytes of the input file:
+//  the stamp written by PatchAMS in the free ROM space, the HeapDeref prologue of 2a, the trap #3 handler of 3a, the
+//  AUTO_INT_5 handler of 5a and the port 700012 value of 1b. Without them, vectors or ROM_CALLs which point into the
+//  free ROM space betray another patcher: pristine images leave it filled with 0xFF.
+int IdentifyAMS(void) {
+    uint8_t gap[0x5000];
+    char stamp[48];
+    uint32_t base, gapstart, gapend, filesize, entries, addr, i, j;
+    uint32_t found = 0, foreign = 0;
+
+    // The same variables as SetupAMSVariables, locally: nothing has been checked yet.
+    fseek(input, 0, SEEK_END);
+    filesize = ftell(input);
+    addr = InputLong(HEAD + 0x88 + 0xC8);
+    base = (addr & UINT32_C(0xE00000)) + UINT32_C(0x12000);
+    gapstart = base + UINT32_C(0x1000);
+    gapend = base + UINT32_C(0x6000);
+#define INPUT_OFFSET(absaddr) ((absaddr) - base + HEAD)
+#define IN_INPUT(absaddr)     ((absaddr) >= base && INPUT_OFFSET(absaddr) + 8 <= filesize)
+#define IN_GAP(absaddr)       ((absaddr) >= gapstart && (absaddr) < gapend)
+    if (!IN_INPUT(addr) || !IN_INPUT(gapend)) {
+        printf("\tINFO: the ROM_CALL table is out of the file, unknown modification.\n");
+        return AMS_MODIFIED_UNKNOWN;
+    }
+
+    stamp[0] = 0;
+    fseek(input, INPUT_OFFSET(gapstart), SEEK_SET);
+    if (fread(gap, 1, sizeof(gap), input) == sizeof(gap)) {
+        for (i = 0; i + sizeof(PATCH_STAMP_PREFIX) - 1 <= sizeof(gap) && stamp[0] == 0; i += 2) {
+            if (!strncmp((const char *)gap + i, PATCH_STAMP_PREFIX, sizeof(PATCH_STAMP_PREFIX) - 1)) {
+                for (j = 0; j < sizeof(stamp) - 1 && i + j < sizeof(gap) && gap[i + j] >= ' ' && gap[i + j] < 0x7F; j++) {
+                    stamp[j] = gap[i + j];
+                }
+                stamp[j] = 0;
+            }
+        }
+    }
+
+    // 2a) HeapDeref.
+    entries = InputLong(INPUT_OFFSET(addr - 4));
+    if (HeapDeref < entries) {
+        i = InputLong(INPUT_OFFSET(addr + 4 * HeapDeref));
+        if (IN_INPUT(i) && InputLong(INPUT_OFFSET(i)) == UINT32_C(0x302F0004) && InputShort(INPUT_OFFSET(i) + 4) == 0xE548) {
+            found++;
+        }
+    }
+    // Other ROM_CALLs in the free ROM space.
+    for (i = 0; i < entries && i < 0x1000; i++) {
+        foreign += IN_GAP(InputLong(INPUT_OFFSET(addr + 4 * i)));
+    }
+
+    // 3a) Trap #3.
+    i = InputLong(HEAD + 0x88 + 0x8C);
+    if (IN_INPUT(i) && InputLong(INPUT_OFFSET(i)) == UINT32_C(0xD0C8D0C8)) {
+        found++;
+    }
+    else {
+        foreign += IN_GAP(i);
+    }
+
+    // 5a) AUTO_INT_5: the first instruction of the original handler, then a call to the rest of it.
+    i = InputLong(HEAD + 0x88 + 0x74);
+    if (IN_GAP(i) && InputShort(INPUT_OFFSET(i) + 4) == 0x4EB9) {
+        found++;
+    }
+    else {
+        foreign += IN_GAP(i);
+    }
+
+    // 1b) move.w #$3F,$700012 early in the reset code.
+    for (i = base + 0x188; i < base + 0x1188; i += 2) {
+        if (InputLong(INPUT_OFFSET(i)) == UINT32_C(0x00700012)) {
+            found += (InputShort(INPUT_OFFSET(i) - 2) == 0x003F);
+            break;
+        }
+    }
+#undef INPUT_OFFSET
+#undef IN_INPUT
+#undef IN_GAP
+
+    if (stamp[0] != 0) {
+        printf("\tINFO: patched by %s, %" PRIu32 " of 4 patch sites found.\n", stamp, found);
+        return strcmp(stamp, PATCHDESC) ? AMS_PATCHED_OTHER : AMS_PATCHED_SAME;
+    }
+    if (found != 0) {
+        printf("\tINFO: patched by an unstamped version of this patchset, %" PRIu32 " of 4 patch sites found.\n", found);
+        return AMS_PATCHED_OTHER;
+    }
+    if (foreign != 0) {
+        printf("\tINFO: %" PRIu32 " vectors or ROM_CALLs point into the free ROM space, unknown modification.\n", foreign);
+        return AMS_MODIFIED_UNKNOWN;
+    }
+    printf("\tINFO: no patch site modified, pristine image.\n");
+    return AMS_PRISTINE;
+}
+
+
+void AnalyzeAMS(void) {
+    const MovableBlock *blocks;
+    uint32_t n, size;
+
+    printf("    Flash sector occupancy of AMS %" PRIu8 ".%02" PRIu8 " for calculator type %" PRIu8 ":\n", AMS_Major, AMS_Minor, CalculatorType);
+    PrintSectorOccupancy();
+    blocks = GetAMSMovableBlocks(&n);
+    PlanSectors(blocks, n, &size);
+
+    printf("    Identical data objects:\n");
+    FindDuplicateData();
+
+    if (!GetAMSXrefs()) {
+        uint32_t top[10] = {0}, topcount[10] = {0};
+        uint32_t i, j, k, count;
+
+        printf("    Code cross-references: %" PRIu32 " instructions decoded, %" PRIu32 " references.\n", NbDecodedInsns, NbXrefs);
+        for (i = 0; i < NbXrefs; i = j) {
+            count = 0;
+            for (j = i; j < NbXrefs && Xrefs[j].target == Xrefs[i].target; j++) {
+                count += (Xrefs[j].kind == XREF_CALL);
+            }
+            for (k = 10; k > 0 && topcount[k - 1] < count; k--) {
+                if (k < 10) {
+                    top[k] = top[k - 1];
+                    topcount[k] = topcount[k - 1];
+                }
+            }
+            if (k < 10) {
+                top[k] = Xrefs[i].target;
+                topcount[k] = count;
+            }
+        }
+        printf("    Most called routines:\n");
+        for (k = 0; k < 10 && topcount[k] != 0; k++) {
+            i = GetAMSrom_callIndex(top[k]);
+            if (i != UINT32_C(0xFFFFFFFF)) {
+                printf("\t%06" PRIX32 " (ROM_CALL %03" PRIX32 "): %" PRIu32 " call sites\n", top[k], i, topcount[k]);
+            }
+            else {
+                printf("\t%06" PRIX32 ": %" PRIu32 " call sites\n", top[k], topcount[k]);
+            }
+        }
+        FreeXrefIndex();
+    }
+}
+
+
+//! Get a big-endian value of size bytes from a RAM dump.
+static uint32_t GetRAMValue (const uint8_t *ram, uint32_t addr, uint32_t size) {
+    uint32_t value = 0, i;
+
+    for (i = 0; i < size; i++) {
+        value = (value << 8) | ram[addr + i];
+    }
+    return value;
+}
+
+//! Check whether there are call counters at addr in a RAM dump: every counter either counted calls to its ROM_CALL, or
+//  was never used, and at least one counted calls.
+static int IsCallCountRAM (const uint8_t *ram, uint32_t addr) {
+    uint32_t i, idx, count, used = 0;
+
+    for (i = 0; i < NB_BLOCKS(CountedROMCalls); i++) {
+        idx = GetRAMValue(ram, addr + 6 * i, 2);
+        count = GetRAMValue(ram, addr + 6 * i + 2, 4);
+        if (idx == CountedROMCalls[i].idx && count != 0) {
+            used++;
+        }
+        else if (idx != 0 || count != 0) {
+            return 0;
+        }
+    }
+    return used != 0;
+}
+
+//! Find the instrumentation RAM in a RAM dump, whose address depends on the build, by the header of the profile or by
+//  the call counters. Return its address, or 0 if there is none.
+static uint32_t FindInstrumentRAM (const uint8_t *ram, uint32_t size) {
+    uint32_t addr;
+
+    for (addr = UINT32_C(0x400); addr + INSTRUMENT_RAM_SIZE <= size && addr + INSTRUMENT_RAM_SIZE <= 0x8000; addr += 2) {
+        if (   (   GetRAMValue(ram, addr, 4) == PROFILE_MAGIC
+                && GetRAMValue(ram, addr + 8, 2) < 32 && GetRAMValue(ram, addr + 10, 2) == PROFILE_BUCKETS)
+            || IsCallCountRAM(ram, addr + PROFILE_RAM_SIZE)) {
+            return addr;
+        }
+    }
+    return 0;
+}
+
+//! Print the profile in a RAM dump, by symbol if there is a map, by bucket otherwise.
+static void DecodeAMSProfile (const uint8_t *ram, uint32_t size, const Symbol *syms, uint32_t nbsyms) {
+    uint32_t top[20] = {0}, topcount[20] = {0};
+    uint32_t *counts, base, start, shift, nbbuckets, total, outside, nbitems, addr, lo, hi, mid, i, k;
+
+    base = FindInstrumentRAM(ram, size);
+    if (base == 0 || GetRAMValue(ram, base, 4) != PROFILE_MAGIC) {
+        printf("    No profile in the dump.\n");
+        return;
+    }
+    start = GetRAMValue(ram, base + 4, 4);
+    shift = GetRAMValue(ram, base + 8, 2);
+    nbbuckets = GetRAMValue(ram, base + 10, 2);
+    total = GetRAMValue(ram, base + 12, 4);
+    if (total == 0) {
+        printf("    No sample in the profile at %04" PRIX32 ".\n", base);
+        return;
+    }
+    outside = GetRAMValue(ram, base + 16 + 2 * (nbbuckets - 1), 2);
+    printf("    Profile: %" PRIu32 " samples, %" PRIu32 " outside the basecode, buckets of %" PRIu32 " bytes from %06" PRIX32 ".\n", total, outside, UINT32_C(1) << shift, start);
+
+    // The samples of a bucket go to the symbol its middle belongs to, or to the bucket itself without a map.
+    nbitems = (nbsyms != 0) ? nbsyms : nbbuckets - 1;
+    counts = (uint32_t *)calloc(nbitems, sizeof(uint32_t));
+    if (counts == NULL) {
+        printf("\n    ERROR : not enough memory.\n");
+        return;
+    }
+    for (i = 0; i < nbbuckets - 1; i++) {
+        if (nbsyms == 0) {
+            counts[i] = GetRAMValue(ram, base + 16 + 2 * i, 2);
+            continue;
+        }
+        addr = start + (i << shift) + (UINT32_C(1) << shift) / 2;
+        for (lo = 0, hi = nbsyms; hi - lo > 1; ) {
+            mid = (lo + hi) / 2;
+            if (syms[mid].address <= addr) {
+                lo = mid;
+            }
+            else {
+                hi = mid;
+            }
+        }
+        if (syms[lo].address <= addr) {
+            counts[lo] += GetRAMValue(ram, base + 16 + 2 * i, 2);
+        }
+    }
+    for (i = 0; i < nbitems; i++) {
+        for (k = 20; k > 0 && topcount[k - 1] < counts[i]; k--) {
+            if (k < 20) {
+                top[k] = top[k - 1];
+                topcount[k] = topcount[k - 1];
+            }
+        }
+        if (k < 20) {
+            top[k] = i;
+            topcount[k] = counts[i];
+        }
+    }
+    printf("    Hottest %s:\n", (nbsyms != 0) ? "routines" : "buckets");
+    for (k = 0; k < 20 && topcount[k] != 0; k++) {
+        if (nbsyms != 0) {
+            printf("\t%06" PRIX32 " %-32s %8" PRIu32 " samples (%5.2f%%)\n", syms[top[k]].address, syms[top[k]].name, topcount[k], 100.0 * topcount[k] / total);
+        }
+        else {
+            printf("\t%06" PRIX32 "-%06" PRIX32 " %8" PRIu32 " samples (%5.2f%%)\n", start + (top[k] << shift), start + ((top[k] + 1) << shift), topcount[k], 100.0 * topcount[k] / total);
+        }
+    }
+    free(counts);
+}
+
+
+//! Print the call counts in a RAM dump, most called first. The counters must be those of CountedROMCalls.
+static void DecodeAMSCallCounts (const uint8_t *ram, uint32_t size) {
+    uint32_t n = NB_BLOCKS(CountedROMCalls);
+    uint32_t order[NB_BLOCKS(CountedROMCalls)], counts[NB_BLOCKS(CountedROMCalls)];
+    uint32_t base, total = 0, i, k;
+
+    base = FindInstrumentRAM(ram, size);
+    if (base == 0 || !IsCallCountRAM(ram, base + PROFILE_RAM_SIZE)) {
+        printf("    No call counts in the dump.\n");
+        return;
+    }
+    base += PROFILE_RAM_SIZE;
+    for (i = 0; i < n; i++) {
+        counts[i] = GetRAMValue(ram, base + 6 * i + 2, 4);
+        total += counts[i];
+        for (k = i; k > 0 && counts[order[k - 1]] < counts[i]; k--) {
+            order[k] = order[k - 1];
+        }
+        order[k] = i;
+    }
+    if (total == 0) {
+        printf("    No call counts in the dump.\n");
+        return;
+    }
+    printf("    Call counts: %" PRIu32 " calls to %" PRIu32 " ROM_CALLs.\n", total, n);
+    for (k = 0; k < n && counts[order[k]] != 0; k++) {
+        i = order[k];
+        printf("\t%03" PRIX32 " %-24s %10" PRIu32 " calls (%5.2f%%)\n", CountedROMCalls[i].idx, CountedROMCalls[i].name, counts[i], 100.0 * counts[i] / total);
+    }
+}
+
+
+void DecodeAMSRAM(const uint8_t *ram, uint32_t size, const Symbol *syms, uint32_t nbsyms) {
+    DecodeAMSProfile(ram, size, syms, nbsyms);
+    DecodeAMSCallCounts(ram, size);
 }
@@ -0,0 +1,738 @@
+/**
+ * \file m68k.c
+ * \brief 68000 instruction decoder and code cross-reference index, building
+ *        blocks for a computer-based unlocking and optimizing program aimed
+ *        at official TI-68k calculators OS
+ * Copyright (C) 2010 Lionel Debroux (lionel underscore debroux yahoo fr)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 (and only version 2) of the
+ * License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, 5th Floor, Boston, MA 02110-1301, USA
+ */
+
+// This file is included by tiosmod.c, after the basic building blocks.
+
+
+//! What an instruction does to the control flow.
+enum {
+    M68K_NORMAL,   // Execution continues with the next instruction.
+    M68K_CALL,     // BSR, JSR, F-Line calls: execution continues with the next instruction after the callee returns.
+    M68K_BCC,      // Bcc, DBcc: execution continues with the target or the next instruction.
+    M68K_BRANCH,   // BRA, JMP: execution continues with the target only.
+    M68K_RETURN,   // RTS, RTE, RTR.
+    M68K_STOP,     // Line-A (ER_throw): execution does not continue.
+    M68K_ILLEGAL   // Not a valid 68000 instruction.
+};
+
+//! Kinds of references.
+enum {
+    XREF_CALL,     // BSR, JSR
+    XREF_JUMP,     // BRA, Bcc, DBcc, JMP
+    XREF_LEA,      // LEA
+    XREF_PEA,      // PEA
+    XREF_DATA,     // Other absolute or PC-relative effective addresses, immediate addresses.
+    XREF_INDEXED   // d8(PC,Xn): the target is the base of a table.
+};
+
+//! How a reference is encoded in the instruction.
+enum {
+    XMODE_ABSW,    // (xxx).w
+    XMODE_ABSL,    // (xxx).l, #xxx.l
+    XMODE_PC16,    // d16(PC)
+    XMODE_PC8,     // d8(PC,Xn)
+    XMODE_DISP8,   // Bcc.s
+    XMODE_DISP16,  // Bcc.w, DBcc
+    XMODE_DISP32   // F-Line relative call
+};
+
+typedef struct {
+    uint32_t target;
+    uint8_t  kind;
+    uint8_t  mode;
+    uint8_t  offset;  // Offset of the extension word(s) from the start of the instruction.
+} M68kRef;
+
+typedef struct {
+    uint32_t addr;
+    uint16_t opcode;
+    uint8_t  length;
+    uint8_t  flow;
+    uint8_t  nbrefs;
+    M68kRef  refs[2];
+} M68kInsn;
+
+
+// The code being decoded: a snapshot of [M68kCodeStart, M68kCodeEnd).
+static const uint8_t *M68kCode;
+static uint32_t M68kCodeStart;
+static uint32_t M68kCodeEnd;
+
+
+static uint16_t M68kShort (uint32_t absaddr) {
+    if (absaddr < M68kCodeStart || absaddr + 2 > M68kCodeEnd) {
+        return 0x4AFC;
+    }
+    return (uint16_t)((M68kCode[absaddr - M68kCodeStart] << 8) | M68kCode[absaddr - M68kCodeStart + 1]);
+}
+
+static uint32_t M68kLong (uint32_t absaddr) {
+    return ((uint32_t)M68kShort(absaddr) << 16) | M68kShort(absaddr + 2);
+}
+
+static void M68kAddRef (M68kInsn *insn, uint32_t target, uint8_t kind, uint8_t mode, uint8_t offset) {
+    if (insn->nbrefs < 2) {
+        insn->refs[insn->nbrefs].target = target;
+        insn->refs[insn->nbrefs].kind = kind;
+        insn->refs[insn->nbrefs].mode = mode;
+        insn->refs[insn->nbrefs].offset = offset;
+        insn->nbrefs++;
+    }
+}
+
+//! Skip the extension words of an effective address of given operand size, recording absolute and PC-relative references.
+//  Return 0 if the effective address is invalid.
+static int M68kDecodeEA (M68kInsn *insn, uint32_t mode, uint32_t reg, uint32_t size, uint8_t kind) {
+    uint32_t pos = insn->length;
+    uint32_t value;
+
+    switch (mode) {
+        case 0: case 1: case 2: case 3: case 4:
+            return 1;
+        case 5: case 6:
+            insn->length += 2;
+            return 1;
+        default:
+            break;
+    }
+    switch (reg) {
+        case 0:
+            M68kAddRef(insn, (uint32_t)(int32_t)(int16_t)M68kShort(insn->addr + pos), kind, XMODE_ABSW, pos);
+            insn->length += 2;
+            return 1;
+        case 1:
+            M68kAddRef(insn, M68kLong(insn->addr + pos), kind, XMODE_ABSL, pos);
+            insn->length += 4;
+            return 1;
+        case 2:
+            M68kAddRef(insn, insn->addr + pos + (int32_t)(int16_t)M68kShort(insn->addr + pos), kind, XMODE_PC16, pos);
+            insn->length += 2;
+            return 1;
+        case 3:
+            M68kAddRef(insn, insn->addr + pos + (int32_t)(int8_t)(M68kShort(insn->addr + pos) & 0xFF), XREF_INDEXED, XMODE_PC8, pos);
+            insn->length += 2;
+            return 1;
+        case 4:
+            if (size == 4) {
+                // Immediate longwords which point into the code are usually addresses.
+                value = M68kLong(insn->addr + pos);
+                if (value >= M68kCodeStart && value < M68kCodeEnd) {
+                    M68kAddRef(insn, value, XREF_DATA, XMODE_ABSL, pos);
+                }
+                insn->length += 4;
+            }
+            else {
+                insn->length += 2;
+            }
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+//! Decode the 68000 instruction at absaddr (instructions of later 68k processors are reported as illegal).
+static void M68kDecode (uint32_t absaddr, M68kInsn *insn) {
+    uint16_t op = M68kShort(absaddr);
+    uint32_t mode = (op >> 3) & 7;
+    uint32_t reg = op & 7;
+    uint32_t opmode = (op >> 6) & 7;
+    uint32_t size = (op >> 6) & 3;
+    static const uint8_t sizes[4] = {1, 2, 4, 0};
+    static const uint8_t movesizes[4] = {0, 1, 4, 2};
+    int ok = 1;
+    int32_t disp;
+
+    insn->addr = absaddr;
+    insn->opcode = op;
+    insn->length = 2;
+    insn->flow = M68K_NORMAL;
+    insn->nbrefs = 0;
+
+    switch (op >> 12) {
+        case 0x0:
+            if (op & 0x0100) {
+                if (mode == 1) {
+                    insn->length += 2; // MOVEP
+                }
+                else {
+                    ok = M68kDecodeEA(insn, mode, reg, 1, XREF_DATA); // BTST/BCHG/BCLR/BSET Dn,<ea>
+                }
+            }
+            else if ((op & 0x0F00) == 0x0800) {
+                insn->length += 2; // BTST/BCHG/BCLR/BSET #n,<ea>
+                ok = M68kDecodeEA(insn, mode, reg, 1, XREF_DATA);
+            }
+            else if (op == 0x003C || op == 0x007C || op == 0x023C || op == 0x027C || op == 0x0A3C || op == 0x0A7C) {
+                insn->length += 2; // ORI/ANDI/EORI to CCR/SR
+            }
+            else if (size == 3 || (op & 0x0E00) == 0x0E00) {
+                ok = 0;
+            }
+            else {
+                insn->length += (size == 2) ? 4 : 2; // ORI/ANDI/SUBI/ADDI/EORI/CMPI
+                ok = M68kDecodeEA(insn, mode, reg, sizes[size], XREF_DATA);
+            }
+            break;
+
+        case 0x1: case 0x2: case 0x3:
+            // MOVE, MOVEA
+            ok =    M68kDecodeEA(insn, mode, reg, movesizes[op >> 12], XREF_DATA)
+                 && M68kDecodeEA(insn, opmode, (op >> 9) & 7, movesizes[op >> 12], XREF_DATA);
+            break;
+
+        case 0x4:
+            if (op == 0x4AFC || op == 0x4E74) {
+                ok = 0;
+            }
+            else if ((op & 0xFFF0) == 0x4E40 || (op & 0xFFF0) == 0x4E60 || (op & 0xFFF8) == 0x4E58 || op == 0x4E70 || op == 0x4E71 || op == 0x4E76) {
+                // TRAP, MOVE USP, UNLK, RESET, NOP, TRAPV
+            }
+            else if ((op & 0xFFF8) == 0x4E50 || op == 0x4E72) {
+                insn->length += 2; // LINK, STOP
+            }
+            else if (op == 0x4E73 || op == 0x4E75 || op == 0x4E77) {
+                insn->flow = M68K_RETURN;
+            }
+            else if ((op & 0xFFC0) == 0x4E80) {
+                insn->flow = M68K_CALL;
+                ok = mode >= 2 && M68kDecodeEA(insn, mode, reg, 4, XREF_CALL);
+            }
+            else if ((op & 0xFFC0) == 0x4EC0) {
+                insn->flow = M68K_BRANCH;
+                ok = mode >= 2 && M68kDecodeEA(insn, mode, reg, 4, XREF_JUMP);
+            }
+            else if ((op & 0xFB80) == 0x4880 && mode >= 2) {
+                insn->length += 2; // MOVEM
+                ok = M68kDecodeEA(insn, mode, reg, 2, XREF_DATA);
+            }
+            else if ((op & 0xFFB8) == 0x4880 || (op & 0xFFF8) == 0x4840) {
+                // EXT, SWAP
+            }
+            else if ((op & 0xFFC0) == 0x4840) {
+                ok = M68kDecodeEA(insn, mode, reg, 4, XREF_PEA);
+            }
+            else if ((op & 0xF1C0) == 0x41C0) {
+                ok = M68kDecodeEA(insn, mode, reg, 4, XREF_LEA);
+            }
+            else if ((op & 0xF1C0) == 0x4180 || (op & 0xFFC0) == 0x40C0 || (op & 0xFFC0) == 0x44C0 || (op & 0xFFC0) == 0x46C0) {
+                ok = M68kDecodeEA(insn, mode, reg, 2, XREF_DATA); // CHK, MOVE from SR, MOVE to CCR, MOVE to SR
+            }
+            else if ((op & 0xFFC0) == 0x4AC0 || (op & 0xFFC0) == 0x4800) {
+                ok = M68kDecodeEA(insn, mode, reg, 1, XREF_DATA); // TAS, NBCD
+            }
+            else if (size != 3 && ((op & 0xFF00) == 0x4000 || (op & 0xFF00) == 0x4200 || (op & 0xFF00) == 0x4400 || (op & 0xFF00) == 0x4600 || (op & 0xFF00) == 0x4A00)) {
+                ok = M68kDecodeEA(insn, mode, reg, sizes[size], XREF_DATA); // NEGX, CLR, NEG, NOT, TST
+            }
+            else {
+                ok = 0;
+            }
+            break;
+
+        case 0x5:
+            if (size == 3 && mode == 1) {
+                // DBcc
+                insn->flow = M68K_BCC;
+                M68kAddRef(insn, absaddr + 2 + (int32_t)(int16_t)M68kShort(absaddr + 2), XREF_JUMP, XMODE_DISP16, 2);
+                insn->length += 2;
+            }
+            else if (size == 3) {
+                ok = M68kDecodeEA(insn, mode, reg, 1, XREF_DATA); // Scc
+            }
+            else {
+                ok = M68kDecodeEA(insn, mode, reg, sizes[size], XREF_DATA); // ADDQ, SUBQ
+            }
+            break;
+
+        case 0x6:
+            disp = (int8_t)(op & 0xFF);
+            if (disp == 0) {
+                disp = (int16_t)M68kShort(absaddr + 2);
+                insn->length += 2;
+            }
+            else if (disp == -1) {
+                ok = 0;
+                break;
+            }
+            if ((op & 0x0F00) == 0x0100) {
+                insn->flow = M68K_CALL;
+            }
+            else if ((op & 0x0F00) == 0x0000) {
+                insn->flow = M68K_BRANCH;
+            }
+            else {
+                insn->flow = M68K_BCC;
+            }
+            M68kAddRef(insn, absaddr + 2 + disp, (insn->flow == M68K_CALL) ? XREF_CALL : XREF_JUMP,
+                       (insn->length == 2) ? XMODE_DISP8 : XMODE_DISP16, (insn->length == 2) ? 1 : 2);
+            break;
+
+        case 0x7:
+            ok = !(op & 0x0100); // MOVEQ
+            break;
+
+        case 0x8:
+            if (opmode == 3 || opmode == 7) {
+                ok = M68kDecodeEA(insn, mode, reg, 2, XREF_DATA); // DIVU, DIVS
+            }
+            else if ((op & 0x01F0) == 0x0100) {
+                // SBCD
+            }
+            else {
+                ok = M68kDecodeEA(insn, mode, reg, sizes[opmode & 3], XREF_DATA); // OR
+            }
+            break;
+
+        case 0x9: case 0xD:
+            if (opmode == 3 || opmode == 7) {
+                ok = M68kDecodeEA(insn, mode, reg, (opmode == 3) ? 2 : 4, XREF_DATA); // SUBA, ADDA
+            }
+            else if ((op & 0x0130) == 0x0100) {
+                // SUBX, ADDX
+            }
+            else {
+                ok = M68kDecodeEA(insn, mode, reg, sizes[opmode & 3], XREF_DATA); // SUB, ADD
+            }
+            break;
+
+        case 0xB:
+            if (opmode == 3 || opmode == 7) {
+                ok = M68kDecodeEA(insn, mode, reg, (opmode == 3) ? 2 : 4, XREF_DATA); // CMPA
+            }
+            else if (opmode >= 4 && mode == 1) {
+                // CMPM
+            }
+            else {
+                ok = M68kDecodeEA(insn, mode, reg, sizes[opmode & 3], XREF_DATA); // CMP, EOR
+            }
+            break;
+
+        case 0xC:
+            if (opmode == 3 || opmode == 7) {
+                ok = M68kDecodeEA(insn, mode, reg, 2, XREF_DATA); // MULU, MULS
+            }
+            else if ((op & 0x01F0) == 0x0100 || (op & 0x01F8) == 0x0140 || (op & 0x01F8) == 0x0148 || (op & 0x01F8) == 0x0188) {
+                // ABCD, EXG
+            }
+            else {
+                ok = M68kDecodeEA(insn, mode, reg, sizes[opmode & 3], XREF_DATA); // AND
+            }
+            break;
+
+        case 0xE:
+            if (size == 3) {
+                ok = !(op & 0x0800) && M68kDecodeEA(insn, mode, reg, 2, XREF_DATA); // Memory shifts and rotates
+            }
+            break;
+
+        case 0xA:
+            // Line-A: ER_throw.
+            insn->flow = M68K_STOP;
+            break;
+
+        case 0xF:
+            // Line-F: AMS 2.04+ emulates calls through them.
+            insn->flow = M68K_CALL;
+            if (op == 0xFFF0) {
+                M68kAddRef(insn, absaddr + 2 + M68kLong(absaddr + 2), XREF_CALL, XMODE_DISP32, 2);
+                insn->length += 4;
+            }
+            else if (op == 0xFFF2) {
+                insn->length += 2;
+            }
+            else if (op < 0xF800) {
+                ok = 0;
+            }
+            break;
+    }
+
+    if (!ok) {
+        insn->flow = M68K_ILLEGAL;
+        insn->nbrefs = 0;
+    }
+}
+
+//! Size of the extension words of an effective address of given operand size.
+static uint32_t M68kEALength (uint32_t mode, uint32_t reg, uint32_t size) {
+    if (mode < 5) {
+        return 0;
+    }
+    if (mode < 7 || reg != 1) {
+        return (mode == 7 && reg == 4 && size == 4) ? 4 : 2;
+    }
+    return 4;
+}
+
+//! Return nonzero if the effective address, whose extension words start at absaddr, involves data register n.
+static int M68kEAUsesDn (uint32_t absaddr, uint32_t mode, uint32_t reg, uint32_t n) {
+    uint16_t ext;
+
+    if (mode == 0) {
+        return reg == n;
+    }
+    if (mode == 6 || (mode == 7 && reg == 3)) {
+        ext = M68kShort(absaddr);
+        return !(ext & 0x8000) && ((ext >> 12) & 7) == n;
+    }
+    return 0;
+}
+
+//! Conservatively decide whether data register n is dead at absaddr, i.e. fully overwritten before being read
+//  in the next few instructions of straight-line code. d1 and d2 are also dead at RTS, AMS doesn't preserve them.
+//  Only a handful of common instructions are understood, anything else makes the register live.
+static int M68kDnIsDead (uint32_t absaddr, uint32_t n) {
+    uint32_t i, op, size, mode, reg;
+
+    for (i = 0; i < 8; i++) {
+        op = M68kShort(absaddr);
+        mode = (op >> 3) & 7;
+        reg = op & 7;
+        if ((op & 0xF100) == 0x7000) {
+            // MOVEQ
+            if (((op >> 9) & 7) == n) {
+                return 1;
+            }
+            absaddr += 2;
+        }
+        else if (op >= 0x1000 && op < 0x4000) {
+            // MOVE, MOVEA
+            size = (op >> 12) == 1 ? 1 : ((op >> 12) == 2 ? 4 : 2);
+            if (M68kEAUsesDn(absaddr + 2, mode, reg, n)) {
+                return 0;
+            }
+            if (((op >> 6) & 7) == 0 && ((op >> 9) & 7) == n) {
+                return size == 4;
+            }
+            absaddr += 2 + M68kEALength(mode, reg, size);
+            if (M68kEAUsesDn(absaddr, (op >> 6) & 7, (op >> 9) & 7, n)) {
+                return 0;
+            }
+            absaddr += M68kEALength((op >> 6) & 7, (op >> 9) & 7, size);
+        }
+        else if ((op & 0xFFF8) == (0x4280 | n)) {
+            // CLR.L Dn
+            return 1;
+        }
+        else if ((op & 0xF1C0) == 0x41C0 || (op & 0xFFC0) == 0x4840 || ((op & 0xFF00) == 0x4A00 && (op & 0xC0) != 0xC0)) {
+            // LEA, PEA, TST
+            if (M68kEAUsesDn(absaddr + 2, mode, reg, n)) {
+                return 0;
+            }
+            absaddr += 2 + M68kEALength(mode, reg, 2);
+        }
+        else if (op == 0x4E75) {
+            return n == 1 || n == 2;
+        }
+        else {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+
+// The cross-reference index: every reference found in the code reachable from the entry points, sorted by target.
+typedef struct {
+    uint32_t target;
+    uint32_t site;    // Address of the instruction.
+    uint8_t  kind;
+    uint8_t  mode;
+    uint8_t  offset;
+    uint8_t  length;  // Length of the instruction.
+} Xref;
+
+static Xref *Xrefs;
+static uint32_t NbXrefs;
+static uint32_t XrefsAllocated;
+static uint32_t NbDecodedInsns;
+static uint8_t *XrefVisited;  // One bit per word of code.
+
+static int CompareXrefs (const void *a, const void *b) {
+    const Xref *x1 = (const Xref *)a;
+    const Xref *x2 = (const Xref *)b;
+    if (x1->target != x2->target) {
+        return x1->target < x2->target ? -1 : 1;
+    }
+    return x1->site < x2->site ? -1 : (x1->site > x2->site);
+}
+
+static int XrefIsVisited (uint32_t absaddr) {
+    uint32_t i = (absaddr - M68kCodeStart) >> 1;
+    return (XrefVisited[i >> 3] >> (i & 7)) & 1;
+}
+
+static void XrefSetVisited (uint32_t absaddr, int value) {
+    uint32_t i = (absaddr - M68kCodeStart) >> 1;
+    if (value) {
+        XrefVisited[i >> 3] |= (uint8_t)(1 << (i & 7));
+    }
+    else {
+        XrefVisited[i >> 3] &= (uint8_t)~(1 << (i & 7));
+    }
+}
+
+//! Append the references of an instruction to the index, return 0 on failure.
+static int XrefAppend (const M68kInsn *insn) {
+    uint32_t i;
+
+    for (i = 0; i < insn->nbrefs; i++) {
+        if (NbXrefs == XrefsAllocated) {
+            Xref *temp = (Xref *)realloc(Xrefs, 2 * XrefsAllocated * sizeof(Xref));
+            if (!temp) {
+                return 0;
+            }
+            Xrefs = temp;
+            XrefsAllocated *= 2;
+        }
+        Xrefs[NbXrefs].target = insn->refs[i].target;
+        Xrefs[NbXrefs].site = insn->addr;
+        Xrefs[NbXrefs].kind = insn->refs[i].kind;
+        Xrefs[NbXrefs].mode = insn->refs[i].mode;
+        Xrefs[NbXrefs].offset = insn->refs[i].offset;
+        Xrefs[NbXrefs].length = insn->length;
+        NbXrefs++;
+    }
+    return 1;
+}
+
+//! Recursive descent from one entry point.
+//  Entry points are not necessarily code (ROM_CALLs can be data), so a linear run which hits an illegal instruction is rolled back;
+//  if it is the first run of the entry point, the entry point is discarded altogether.
+static int XrefTrace (uint32_t entry, uint32_t **worklist, uint32_t *worklistsize, uint32_t **marked, uint32_t *markedsize) {
+    uint32_t nbwork = 0, nbworkstart, nbmarked, checkpoint, i, run;
+    uint32_t addr;
+    M68kInsn insn;
+
+    (*worklist)[nbwork++] = entry;
+    for (run = 0; nbwork > 0; run++) {
+        addr = (*worklist)[--nbwork];
+        nbworkstart = nbwork;
+        nbmarked = 0;
+        checkpoint = NbXrefs;
+        for (;;) {
+            if (addr < M68kCodeStart || addr + 2 > M68kCodeEnd || (addr & 1)) {
+                insn.flow = M68K_ILLEGAL;
+                break;
+            }
+            if (XrefIsVisited(addr)) {
+                insn.flow = M68K_NORMAL;
+                break;
+            }
+            M68kDecode(addr, &insn);
+            if (insn.flow == M68K_ILLEGAL) {
+                break;
+            }
+            XrefSetVisited(addr, 1);
+            if (nbmarked == *markedsize) {
+                uint32_t *temp = (uint32_t *)realloc(*marked, 2 * *markedsize * sizeof(uint32_t));
+                if (!temp) {
+                    return 0;
+                }
+                *marked = temp;
+                *markedsize *= 2;
+            }
+            (*marked)[nbmarked++] = addr;
+            if (!XrefAppend(&insn)) {
+                return 0;
+            }
+            for (i = 0; i < insn.nbrefs; i++) {
+                if (insn.refs[i].kind == XREF_CALL || insn.refs[i].kind == XREF_JUMP) {
+                    if (nbwork == *worklistsize) {
+                        uint32_t *temp = (uint32_t *)realloc(*worklist, 2 * *worklistsize * sizeof(uint32_t));
+                        if (!temp) {
+                            return 0;
+                        }
+                        *worklist = temp;
+                        *worklistsize *= 2;
+                    }
+                    (*worklist)[nbwork++] = insn.refs[i].target;
+                }
+            }
+            NbDecodedInsns++;
+            if (insn.flow == M68K_BRANCH || insn.flow == M68K_RETURN || insn.flow == M68K_STOP) {
+                break;
+            }
+            addr += insn.length;
+        }
+        if (insn.flow == M68K_ILLEGAL) {
+            for (i = 0; i < nbmarked; i++) {
+                XrefSetVisited((*marked)[i], 0);
+            }
+            NbDecodedInsns -= nbmarked;
+            NbXrefs = checkpoint;
+            nbwork = nbworkstart;
+            if (run == 0) {
+                break;
+            }
+        }
+    }
+    return 1;
+}
+
+//! Drop the cross-reference index and the snapshot of the code, e.g. after modifying the code heavily.
+static void FreeXrefIndex (void) {
+    free((void *)M68kCode);
+    free(XrefVisited);
+    free(Xrefs);
+    M68kCode = NULL;
+    XrefVisited = NULL;
+    Xrefs = NULL;
+    NbXrefs = 0;
+}
+
+//! Decode all code reachable from the given entry points in [start, end), and build the cross-reference index.
+//  The index reflects the code at the time it is built; the snapshot of the code is kept for later decoding.
+static int BuildXrefIndex (uint32_t start, uint32_t end, const uint32_t *entries, uint32_t nbentries) {
+    uint8_t *code;
+    uint32_t *worklist, *marked;
+    uint32_t worklistsize = 1024, markedsize = 1024;
+    uint32_t i;
+    int ok = 1;
+
+    FreeXrefIndex();
+    code = (uint8_t *)malloc(end - start);
+    XrefVisited = (uint8_t *)calloc((end - start) / 16 + 1, 1);
+    Xrefs = (Xref *)malloc(65536 * sizeof(Xref));
+    worklist = (uint32_t *)malloc(worklistsize * sizeof(uint32_t));
+    marked = (uint32_t *)malloc(markedsize * sizeof(uint32_t));
+    if (!code || !XrefVisited || !Xrefs || !worklist || !marked) {
+        ok = 0;
+    }
+    else {
+        GetNBytes(code, end - start, start);
+        M68kCode = code;
+        M68kCodeStart = start;
+        M68kCodeEnd = end;
+        XrefsAllocated = 65536;
+        NbXrefs = 0;
+        NbDecodedInsns = 0;
+        for (i = 0; i < nbentries && ok; i++) {
+            ok = XrefTrace(entries[i], &worklist, &worklistsize, &marked, &markedsize);
+        }
+    }
+    free(worklist);
+    free(marked);
+    if (!ok) {
+        printf("\n    ERROR : not enough memory.\n");
+        free(code);
+        free(XrefVisited);
+        free(Xrefs);
+        M68kCode = NULL;
+        XrefVisited = NULL;
+        Xrefs = NULL;
+        NbXrefs = 0;
+        return 1;
+    }
+    qsort(Xrefs, NbXrefs, sizeof(Xref), CompareXrefs);
+    return 0;
+}
+
+//! Get the index of the first reference to target or beyond, in O(log n). Iterate while Xrefs[i].target == target.
+static uint32_t FindXref (uint32_t target) {
+    uint32_t low = 0, high = NbXrefs, mid;
+
+    while (low < high) {
+        mid = (low + high) / 2;
+        if (Xrefs[mid].target < target) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+//! Count the references of given kind to target.
+static uint32_t CountXrefs (uint32_t target, uint8_t kind) {
+    uint32_t i, count = 0;
+
+    for (i = FindXref(target); i < NbXrefs && Xrefs[i].target == target; i++) {
+        if (Xrefs[i].kind == kind) {
+            count++;
+        }
+    }
+    return count;
+}
+
+//! Return nonzero if some decoded instruction jumps to, or calls, absaddr.
+static int IsXrefJumpTarget (uint32_t absaddr) {
+    uint32_t i;
+
+    for (i = FindXref(absaddr); i < NbXrefs && Xrefs[i].target == absaddr; i++) {
+        if (Xrefs[i].kind == XREF_CALL || Xrefs[i].kind == XREF_JUMP) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//! Get the current target of the reference in the output file, which may have been retargeted since the index was
+//  built, or 0xFFFFFFFF for the encodings RetargetXref does not handle.
+static uint32_t GetXrefTarget (const Xref *xref) {
+    switch (xref->mode) {
+        case XMODE_ABSL:
+            return GetLong(xref->site + xref->offset);
+        case XMODE_ABSW:
+            return (uint32_t)(int32_t)(int16_t)GetShort(xref->site + xref->offset);
+        case XMODE_PC16:
+            return xref->site + xref->offset + (int32_t)(int16_t)GetShort(xref->site + xref->offset);
+        case XMODE_DISP16:
+            return xref->site + 2 + (int32_t)(int16_t)GetShort(xref->site + xref->offset);
+        case XMODE_DISP32:
+            return xref->site + 2 + GetLong(xref->site + xref->offset);
+        default:
+            return UINT32_C(0xFFFFFFFF);
+    }
+}
+
+//! Make the reference point to newtarget in the output file, return 0 if the new target is out of reach of the encoding.
+static int RetargetXref (const Xref *xref, uint32_t newtarget) {
+    int32_t disp;
+
+    switch (xref->mode) {
+        case XMODE_ABSL:
+            PutLong(newtarget, xref->site + xref->offset);
+            return 1;
+        case XMODE_ABSW:
+            if (newtarget >= 0x8000 && newtarget < UINT32_C(0xFFFF8000)) {
+                return 0;
+            }
+            PutShort((uint16_t)newtarget, xref->site + xref->offset);
+            return 1;
+        case XMODE_PC16:
+        case XMODE_DISP16:
+            disp = (int32_t)(newtarget - (xref->site + 2));
+            if (xref->mode == XMODE_PC16) {
+                disp = (int32_t)(newtarget - (xref->site + xref->offset));
+            }
+            if (disp < -32768 || disp > 32767) {
+                return 0;
+            }
+            PutShort((uint16_t)disp, xref->site + xref->offset);
+            return 1;
+        case XMODE_DISP32:
+            PutLong(newtarget - (xref->site + 2), xref->site + xref->offset);
+            return 1;
+        default:
+            return 0;
+    }
+}
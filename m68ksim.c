@@ -0,0 +1,986 @@
+/**
+ * \file m68ksim.c
+ * \brief 68000 interpreter with cycle counting, used to check and time the
+ *        routines of a computer-based unlocking and optimizing program aimed
+ *        at official TI-68k calculators OS
+ * Copyright (C) 2010 Lionel Debroux (lionel underscore debroux yahoo fr)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 (and only version 2) of the
+ * License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, 5th Floor, Boston, MA 02110-1301, USA
+ */
+
+// This file is included by tiosmod.c, after m68k.c.
+// Only what self-contained routines do in user mode is simulated: exceptions, privileged instructions, BCD arithmetic
+// and MOVEP stop the simulation. Cycle counts are the nominal ones of the 68000 user's manual, without wait states;
+// those of DIVU/DIVS are the worst case, and F-Line calls are counted as a JSR (xxx).l.
+
+
+//! Why a simulation stopped.
+enum {
+    SIM_OK,
+    SIM_ILLEGAL,        // Unsupported or invalid instruction.
+    SIM_BUS_ERROR,      // Access out of the simulated RAM and ROM.
+    SIM_ADDRESS_ERROR,  // Word or longword access at an odd address.
+    SIM_ROM_WRITE,      // Write to the ROM.
+    SIM_TIMEOUT         // Too many instructions.
+};
+
+// Simulated RAM, at address 0.
+#define SIM_RAM_SIZE   UINT32_C(0x40000)
+// Return address of the simulated calls: when the PC gets there, the call is over.
+#define SIM_RETURN     UINT32_C(0x00FFFFF0)
+
+typedef struct {
+    uint32_t d[8];
+    uint32_t a[8];
+    uint32_t pc;
+    uint32_t x, n, z, v, c;
+    uint32_t cycles;
+    uint32_t insns;
+    uint32_t opaddr;    // Address of the instruction being executed.
+    int      error;
+} M68kCpu;
+
+// The simulated ROM is a snapshot of [SimROMStart, SimROMEnd) of the output file, taken by SimInit.
+static uint8_t *SimRAM;
+static uint8_t *SimROM;
+static uint32_t SimROMStart;
+static uint32_t SimROMEnd;
+
+
+//! Get a pointer to size bytes of simulated memory at addr, or NULL if the access is invalid.
+static uint8_t * SimPointer (M68kCpu *cpu, uint32_t addr, uint32_t size, int write) {
+    addr &= UINT32_C(0xFFFFFF);
+    if (size > 1 && (addr & 1)) {
+        cpu->error = SIM_ADDRESS_ERROR;
+        return NULL;
+    }
+    if (addr + size <= SIM_RAM_SIZE) {
+        return SimRAM + addr;
+    }
+    if (addr >= SimROMStart && addr + size <= SimROMEnd) {
+        if (write) {
+            cpu->error = SIM_ROM_WRITE;
+            return NULL;
+        }
+        return SimROM + (addr - SimROMStart);
+    }
+    cpu->error = SIM_BUS_ERROR;
+    return NULL;
+}
+
+static uint32_t SimRead (M68kCpu *cpu, uint32_t addr, uint32_t size) {
+    const uint8_t *p = SimPointer(cpu, addr, size, 0);
+
+    if (p == NULL) {
+        return 0;
+    }
+    if (size == 1) {
+        return p[0];
+    }
+    if (size == 2) {
+        return ((uint32_t)p[0] << 8) | p[1];
+    }
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void SimWrite (M68kCpu *cpu, uint32_t addr, uint32_t size, uint32_t value) {
+    uint8_t *p = SimPointer(cpu, addr, size, 1);
+
+    if (p != NULL) {
+        while (size-- > 0) {
+            *p++ = (uint8_t)(value >> (8 * size));
+        }
+    }
+}
+
+static uint32_t SimFetch (M68kCpu *cpu, uint32_t size) {
+    uint32_t value = SimRead(cpu, cpu->pc, size);
+    cpu->pc += size;
+    return value;
+}
+
+static void SimPush (M68kCpu *cpu, uint32_t value, uint32_t size) {
+    cpu->a[7] -= size;
+    SimWrite(cpu, cpu->a[7], size, value);
+}
+
+static uint32_t SimPop (M68kCpu *cpu) {
+    uint32_t value = SimRead(cpu, cpu->a[7], 4);
+    cpu->a[7] += 4;
+    return value;
+}
+
+static uint32_t SimMask (uint32_t size) {
+    return (size == 4) ? UINT32_C(0xFFFFFFFF) : ((UINT32_C(1) << (8 * size)) - 1);
+}
+
+static uint32_t SimMSB (uint32_t size) {
+    return UINT32_C(1) << (8 * size - 1);
+}
+
+static uint32_t SimSignExtend (uint32_t value, uint32_t size) {
+    if (size == 1) {
+        return (uint32_t)(int32_t)(int8_t)value;
+    }
+    if (size == 2) {
+        return (uint32_t)(int32_t)(int16_t)value;
+    }
+    return value;
+}
+
+
+//! A resolved effective address: data register (0), address register (1) or memory (2).
+typedef struct {
+    uint32_t kind;
+    uint32_t reg;
+    uint32_t addr;
+} SimEA;
+
+// Index in the timing tables: modes 0 to 6, then (xxx).w, (xxx).l, d16(PC), d8(PC,Xn), #imm.
+#define SIM_EA_INDEX(mode, reg) (((mode) < 7) ? (mode) : (((reg) < 5) ? 7 + (reg) : 12))
+
+// Effective address calculation times for byte/word and long operands.
+static const uint8_t SimEATimes[13][2] = {
+    {0, 0}, {0, 0}, {4, 8}, {4, 8}, {6, 10}, {8, 12}, {10, 14}, {8, 12}, {12, 16}, {8, 12}, {10, 14}, {4, 8}, {0, 0}
+};
+// Times of the instructions which only use the address: LEA, JMP, MOVEM from and to memory (without the registers).
+static const uint8_t SimLEATimes[13]     = {0, 0, 4, 0, 0, 8, 12, 8, 12, 8, 12, 0, 0};
+static const uint8_t SimJMPTimes[13]     = {0, 0, 8, 0, 0, 10, 14, 10, 12, 10, 14, 0, 0};
+static const uint8_t SimMOVEMRTimes[13]  = {0, 0, 12, 12, 0, 16, 18, 16, 20, 16, 18, 0, 0};
+static const uint8_t SimMOVEMWTimes[13]  = {0, 0, 8, 0, 8, 12, 14, 12, 16, 0, 0, 0, 0};
+
+static uint32_t SimEACycles (uint32_t mode, uint32_t reg, uint32_t size) {
+    return SimEATimes[SIM_EA_INDEX(mode, reg)][size == 4];
+}
+
+static uint32_t SimIndexed (M68kCpu *cpu, uint32_t base) {
+    uint32_t ext = SimFetch(cpu, 2);
+    uint32_t idx = (ext & 0x8000) ? cpu->a[(ext >> 12) & 7] : cpu->d[(ext >> 12) & 7];
+
+    if (!(ext & 0x0800)) {
+        idx = SimSignExtend(idx, 2);
+    }
+    return base + (uint32_t)(int32_t)(int8_t)ext + idx;
+}
+
+//! Compute an effective address, applying post-increments and pre-decrements.
+static void SimResolve (M68kCpu *cpu, uint32_t mode, uint32_t reg, uint32_t size, SimEA *ea) {
+    uint32_t step = (size == 1 && reg == 7) ? 2 : size;
+
+    ea->kind = 2;
+    ea->reg = reg;
+    switch (mode) {
+        case 0: case 1:
+            ea->kind = mode;
+            break;
+        case 2:
+            ea->addr = cpu->a[reg];
+            break;
+        case 3:
+            ea->addr = cpu->a[reg];
+            cpu->a[reg] += step;
+            break;
+        case 4:
+            cpu->a[reg] -= step;
+            ea->addr = cpu->a[reg];
+            break;
+        case 5:
+            ea->addr = cpu->a[reg] + SimSignExtend(SimFetch(cpu, 2), 2);
+            break;
+        case 6:
+            ea->addr = SimIndexed(cpu, cpu->a[reg]);
+            break;
+        default:
+            switch (reg) {
+                case 0:
+                    ea->addr = SimSignExtend(SimFetch(cpu, 2), 2);
+                    break;
+                case 1:
+                    ea->addr = SimFetch(cpu, 4);
+                    break;
+                case 2:
+                    ea->addr = cpu->pc;
+                    ea->addr += SimSignExtend(SimFetch(cpu, 2), 2);
+                    break;
+                case 3:
+                    ea->addr = SimIndexed(cpu, cpu->pc);
+                    break;
+                case 4:
+                    ea->addr = cpu->pc + (size == 1);
+                    cpu->pc += (size == 4) ? 4 : 2;
+                    break;
+                default:
+                    cpu->error = SIM_ILLEGAL;
+                    break;
+            }
+            break;
+    }
+}
+
+static uint32_t SimGet (M68kCpu *cpu, const SimEA *ea, uint32_t size) {
+    if (ea->kind == 0) {
+        return cpu->d[ea->reg] & SimMask(size);
+    }
+    if (ea->kind == 1) {
+        return cpu->a[ea->reg] & SimMask(size);
+    }
+    return SimRead(cpu, ea->addr, size);
+}
+
+static void SimPut (M68kCpu *cpu, const SimEA *ea, uint32_t size, uint32_t value) {
+    uint32_t mask = SimMask(size);
+
+    if (ea->kind == 0) {
+        cpu->d[ea->reg] = (cpu->d[ea->reg] & ~mask) | (value & mask);
+    }
+    else if (ea->kind == 1) {
+        cpu->a[ea->reg] = value;
+    }
+    else {
+        SimWrite(cpu, ea->addr, size, value);
+    }
+}
+
+
+static void SimSetNZ (M68kCpu *cpu, uint32_t value, uint32_t size) {
+    value &= SimMask(size);
+    cpu->n = (value & SimMSB(size)) != 0;
+    cpu->z = (value == 0);
+}
+
+static void SimLogic (M68kCpu *cpu, uint32_t value, uint32_t size) {
+    SimSetNZ(cpu, value, size);
+    cpu->v = 0;
+    cpu->c = 0;
+}
+
+//! dst + src + x. With extend, Z is only ever cleared, as ADDX does.
+static uint32_t SimAdd (M68kCpu *cpu, uint32_t src, uint32_t dst, uint32_t x, uint32_t size, int extend) {
+    uint32_t msb = SimMSB(size);
+    uint32_t res = (dst + src + x) & SimMask(size);
+    uint32_t z = cpu->z;
+
+    cpu->c = cpu->x = (((src & dst) | (~res & (src | dst))) & msb) != 0;
+    cpu->v = ((src ^ res) & (dst ^ res) & msb) != 0;
+    SimSetNZ(cpu, res, size);
+    if (extend) {
+        cpu->z = z && cpu->z;
+    }
+    return res;
+}
+
+//! dst - src - x. Comparisons leave X alone, with extend Z is only ever cleared, as SUBX does.
+static uint32_t SimSub (M68kCpu *cpu, uint32_t src, uint32_t dst, uint32_t x, uint32_t size, int compare, int extend) {
+    uint32_t msb = SimMSB(size);
+    uint32_t res = (dst - src - x) & SimMask(size);
+    uint32_t z = cpu->z;
+
+    cpu->c = (((src & ~dst) | (res & ~dst) | (src & res)) & msb) != 0;
+    if (!compare) {
+        cpu->x = cpu->c;
+    }
+    cpu->v = ((src ^ dst) & (res ^ dst) & msb) != 0;
+    SimSetNZ(cpu, res, size);
+    if (extend) {
+        cpu->z = z && cpu->z;
+    }
+    return res;
+}
+
+static int SimCondition (const M68kCpu *cpu, uint32_t cc) {
+    switch (cc) {
+        case 0:  return 1;
+        case 1:  return 0;
+        case 2:  return !cpu->c && !cpu->z;
+        case 3:  return cpu->c || cpu->z;
+        case 4:  return !cpu->c;
+        case 5:  return cpu->c;
+        case 6:  return !cpu->z;
+        case 7:  return cpu->z;
+        case 8:  return !cpu->v;
+        case 9:  return cpu->v;
+        case 10: return !cpu->n;
+        case 11: return cpu->n;
+        case 12: return cpu->n == cpu->v;
+        case 13: return cpu->n != cpu->v;
+        case 14: return !cpu->z && cpu->n == cpu->v;
+        default: return cpu->z || cpu->n != cpu->v;
+    }
+}
+
+//! Shift or rotate value by count bits. type is 0 for AS, 1 for LS, 2 for ROX, 3 for RO.
+static uint32_t SimShift (M68kCpu *cpu, uint32_t value, uint32_t count, uint32_t size, uint32_t type, int left) {
+    uint32_t msb = SimMSB(size);
+    uint32_t mask = SimMask(size);
+    uint32_t carry, overflow = 0;
+
+    value &= mask;
+    cpu->c = (type == 2) ? cpu->x : 0;
+    while (count-- > 0) {
+        carry = left ? ((value & msb) != 0) : (value & 1);
+        if (left) {
+            value = (value << 1) & mask;
+            if (type == 2) {
+                value |= cpu->x;
+            }
+            else if (type == 3) {
+                value |= carry;
+            }
+            if (type == 0 && ((value & msb) != 0) != carry) {
+                overflow = 1;
+            }
+        }
+        else {
+            value >>= 1;
+            if ((type == 0 && (value & (msb >> 1))) || (type == 2 && cpu->x) || (type == 3 && carry)) {
+                value |= msb;
+            }
+        }
+        cpu->c = carry;
+        if (type != 3) {
+            cpu->x = carry;
+        }
+    }
+    SimSetNZ(cpu, value, size);
+    cpu->v = overflow;
+    return value;
+}
+
+//! ADD, SUB, AND, OR, CMP, EOR between a data register and an effective address. op is the top nibble of the opcode.
+static void SimArith (M68kCpu *cpu, uint32_t opcode, uint32_t size, int todn) {
+    uint32_t mode = (opcode >> 3) & 7, reg = opcode & 7, dn = (opcode >> 9) & 7;
+    uint32_t src, dst, res = 0;
+    uint32_t group = opcode >> 12;
+    SimEA ea;
+
+    SimResolve(cpu, mode, reg, size, &ea);
+    if (todn) {
+        src = SimGet(cpu, &ea, size);
+        dst = cpu->d[dn] & SimMask(size);
+    }
+    else {
+        src = cpu->d[dn] & SimMask(size);
+        dst = SimGet(cpu, &ea, size);
+    }
+    switch (group) {
+        case 0x8: res = dst | src; SimLogic(cpu, res, size); break;
+        case 0x9: res = SimSub(cpu, src, dst, 0, size, 0, 0); break;
+        case 0xB: if (todn) { SimSub(cpu, src, dst, 0, size, 1, 0); } else { res = dst ^ src; SimLogic(cpu, res, size); } break;
+        case 0xC: res = dst & src; SimLogic(cpu, res, size); break;
+        default:  res = SimAdd(cpu, src, dst, 0, size, 0); break;
+    }
+    if (todn) {
+        if (group != 0xB) {
+            cpu->d[dn] = (cpu->d[dn] & ~SimMask(size)) | res;
+        }
+        cpu->cycles += 4 + SimEACycles(mode, reg, size);
+        if (size == 4) {
+            cpu->cycles += (group != 0xB && (mode < 2 || (mode == 7 && reg == 4))) ? 4 : 2;
+        }
+    }
+    else {
+        SimPut(cpu, &ea, size, res);
+        if (ea.kind == 0) {
+            cpu->cycles += (size == 4) ? 8 : 4;
+        }
+        else {
+            cpu->cycles += ((size == 4) ? 12 : 8) + SimEACycles(mode, reg, size);
+        }
+    }
+}
+
+static uint32_t SimBitCount (uint32_t value) {
+    uint32_t n = 0;
+
+    while (value != 0) {
+        n += value & 1;
+        value >>= 1;
+    }
+    return n;
+}
+
+//! Execute one instruction.
+static void SimStep (M68kCpu *cpu) {
+    static const uint32_t sizes[4] = {1, 2, 4, 0};
+    uint32_t op, mode, reg, dn, size, src, dst, res, i, mask, addr, count;
+    SimEA ea, ea2;
+
+    cpu->opaddr = cpu->pc;
+    op = SimFetch(cpu, 2);
+    if (cpu->error) {
+        return;
+    }
+    mode = (op >> 3) & 7;
+    reg = op & 7;
+    dn = (op >> 9) & 7;
+    size = sizes[(op >> 6) & 3];
+
+    switch (op >> 12) {
+        case 0x0:
+            if ((op & 0x0138) == 0x0108) {
+                cpu->error = SIM_ILLEGAL; // MOVEP
+            }
+            else if ((op & 0x0100) || (op & 0x0F00) == 0x0800) {
+                // BTST, BCHG, BCLR, BSET
+                i = (op >> 6) & 3;
+                src = (op & 0x0100) ? cpu->d[dn] : (SimFetch(cpu, 2) & 0xFF);
+                size = (mode == 0) ? 4 : 1;
+                src &= 8 * size - 1;
+                SimResolve(cpu, mode, reg, size, &ea);
+                dst = SimGet(cpu, &ea, size);
+                cpu->z = !((dst >> src) & 1);
+                if (i != 0) {
+                    dst = (i == 1) ? dst ^ (UINT32_C(1) << src) : (i == 2) ? dst & ~(UINT32_C(1) << src) : dst | (UINT32_C(1) << src);
+                    SimPut(cpu, &ea, size, dst);
+                }
+                if (mode == 0) {
+                    cpu->cycles += ((i == 0) ? 6 : (i == 2) ? 10 : 8) + ((op & 0x0100) ? 0 : 4);
+                }
+                else {
+                    cpu->cycles += ((i == 0) ? 4 : 8) + ((op & 0x0100) ? 0 : 4) + SimEACycles(mode, reg, 1);
+                }
+            }
+            else if (size == 0 || dn == 4 || dn == 7 || mode == 1 || (op & 0x3F) == 0x3C) {
+                cpu->error = SIM_ILLEGAL;
+            }
+            else {
+                // ORI, ANDI, SUBI, ADDI, EORI, CMPI
+                src = SimFetch(cpu, (size == 4) ? 4 : 2) & SimMask(size);
+                SimResolve(cpu, mode, reg, size, &ea);
+                dst = SimGet(cpu, &ea, size);
+                switch (dn) {
+                    case 0: res = dst | src; SimLogic(cpu, res, size); break;
+                    case 1: res = dst & src; SimLogic(cpu, res, size); break;
+                    case 2: res = SimSub(cpu, src, dst, 0, size, 0, 0); break;
+                    case 3: res = SimAdd(cpu, src, dst, 0, size, 0); break;
+                    case 5: res = dst ^ src; SimLogic(cpu, res, size); break;
+                    default: res = SimSub(cpu, src, dst, 0, size, 1, 0); break;
+                }
+                if (dn != 6) {
+                    SimPut(cpu, &ea, size, res);
+                }
+                if (mode == 0) {
+                    cpu->cycles += (size != 4) ? 8 : (dn == 1 || dn == 6) ? 14 : 16;
+                }
+                else if (dn == 6) {
+                    cpu->cycles += ((size == 4) ? 12 : 8) + SimEACycles(mode, reg, size);
+                }
+                else {
+                    cpu->cycles += ((size == 4) ? 20 : 12) + SimEACycles(mode, reg, size);
+                }
+            }
+            break;
+
+        case 0x1: case 0x2: case 0x3:
+            // MOVE, MOVEA
+            size = (op >> 12 == 1) ? 1 : (op >> 12 == 2) ? 4 : 2;
+            SimResolve(cpu, mode, reg, size, &ea);
+            src = SimGet(cpu, &ea, size);
+            cpu->cycles += 4 + SimEACycles(mode, reg, size);
+            mode = (op >> 6) & 7;
+            if (mode == 1) {
+                if (size == 1) {
+                    cpu->error = SIM_ILLEGAL;
+                }
+                cpu->a[dn] = SimSignExtend(src, size);
+                break;
+            }
+            if (mode == 7 && dn > 1) {
+                cpu->error = SIM_ILLEGAL;
+                break;
+            }
+            SimResolve(cpu, mode, dn, size, &ea2);
+            SimPut(cpu, &ea2, size, src);
+            SimLogic(cpu, src, size);
+            cpu->cycles += SimEACycles((mode == 4) ? 2 : mode, dn, size);
+            break;
+
+        case 0x4:
+            if (op == 0x4E71) {
+                cpu->cycles += 4;
+            }
+            else if (op == 0x4E75) {
+                cpu->pc = SimPop(cpu);
+                cpu->cycles += 16;
+            }
+            else if ((op & 0xFFF8) == 0x4E50) {
+                // LINK
+                src = SimSignExtend(SimFetch(cpu, 2), 2);
+                SimPush(cpu, cpu->a[reg], 4);
+                cpu->a[reg] = cpu->a[7];
+                cpu->a[7] += src;
+                cpu->cycles += 16;
+            }
+            else if ((op & 0xFFF8) == 0x4E58) {
+                // UNLK
+                cpu->a[7] = cpu->a[reg];
+                cpu->a[reg] = SimPop(cpu);
+                cpu->cycles += 12;
+            }
+            else if ((op & 0xFF80) == 0x4E80 && SimJMPTimes[SIM_EA_INDEX(mode, reg)] != 0) {
+                // JSR, JMP
+                SimResolve(cpu, mode, reg, 4, &ea);
+                cpu->cycles += SimJMPTimes[SIM_EA_INDEX(mode, reg)];
+                if (!(op & 0x0040)) {
+                    SimPush(cpu, cpu->pc, 4);
+                    cpu->cycles += 8;
+                }
+                cpu->pc = ea.addr;
+            }
+            else if ((op & 0xFFF8) == 0x4840) {
+                // SWAP
+                cpu->d[reg] = (cpu->d[reg] << 16) | (cpu->d[reg] >> 16);
+                SimLogic(cpu, cpu->d[reg], 4);
+                cpu->cycles += 4;
+            }
+            else if ((op & 0xFFB8) == 0x4880) {
+                // EXT
+                size = (op & 0x0040) ? 4 : 2;
+                src = SimSignExtend(cpu->d[reg], size >> 1);
+                cpu->d[reg] = (cpu->d[reg] & ~SimMask(size)) | (src & SimMask(size));
+                SimLogic(cpu, src, size);
+                cpu->cycles += 4;
+            }
+            else if ((op & 0xFB80) == 0x4880) {
+                // MOVEM
+                size = (op & 0x0040) ? 4 : 2;
+                mask = SimFetch(cpu, 2);
+                count = SimBitCount(mask);
+                if (op & 0x0400) {
+                    if (SimMOVEMRTimes[SIM_EA_INDEX(mode, reg)] == 0) {
+                        cpu->error = SIM_ILLEGAL;
+                        break;
+                    }
+                    cpu->cycles += SimMOVEMRTimes[SIM_EA_INDEX(mode, reg)] + count * 2 * size;
+                    if (mode == 3) {
+                        addr = cpu->a[reg];
+                    }
+                    else {
+                        SimResolve(cpu, mode, reg, size, &ea);
+                        addr = ea.addr;
+                    }
+                    for (i = 0; i < 16; i++) {
+                        if (mask & (1 << i)) {
+                            src = SimSignExtend(SimRead(cpu, addr, size), size);
+                            if (i < 8) {
+                                cpu->d[i] = src;
+                            }
+                            else {
+                                cpu->a[i - 8] = src;
+                            }
+                            addr += size;
+                        }
+                    }
+                    if (mode == 3) {
+                        cpu->a[reg] = addr;
+                    }
+                }
+                else {
+                    if (SimMOVEMWTimes[SIM_EA_INDEX(mode, reg)] == 0) {
+                        cpu->error = SIM_ILLEGAL;
+                        break;
+                    }
+                    cpu->cycles += SimMOVEMWTimes[SIM_EA_INDEX(mode, reg)] + count * 2 * size;
+                    if (mode == 4) {
+                        addr = cpu->a[reg];
+                        for (i = 0; i < 16; i++) {
+                            if (mask & (1 << i)) {
+                                addr -= size;
+                                SimWrite(cpu, addr, size, (i < 8) ? cpu->a[7 - i] : cpu->d[15 - i]);
+                            }
+                        }
+                        cpu->a[reg] = addr;
+                    }
+                    else {
+                        SimResolve(cpu, mode, reg, size, &ea);
+                        addr = ea.addr;
+                        for (i = 0; i < 16; i++) {
+                            if (mask & (1 << i)) {
+                                SimWrite(cpu, addr, size, (i < 8) ? cpu->d[i] : cpu->a[i - 8]);
+                                addr += size;
+                            }
+                        }
+                    }
+                }
+            }
+            else if ((op & 0xFFC0) == 0x4840 && SimLEATimes[SIM_EA_INDEX(mode, reg)] != 0) {
+                // PEA
+                SimResolve(cpu, mode, reg, 4, &ea);
+                SimPush(cpu, ea.addr, 4);
+                cpu->cycles += SimLEATimes[SIM_EA_INDEX(mode, reg)] + 8;
+            }
+            else if ((op & 0xF1C0) == 0x41C0 && SimLEATimes[SIM_EA_INDEX(mode, reg)] != 0) {
+                // LEA
+                SimResolve(cpu, mode, reg, 4, &ea);
+                cpu->a[dn] = ea.addr;
+                cpu->cycles += SimLEATimes[SIM_EA_INDEX(mode, reg)];
+            }
+            else if ((op & 0xFFC0) == 0x40C0 && mode != 1) {
+                // MOVE from SR: user mode, no interrupt mask.
+                SimResolve(cpu, mode, reg, 2, &ea);
+                SimPut(cpu, &ea, 2, (cpu->x << 4) | (cpu->n << 3) | (cpu->z << 2) | (cpu->v << 1) | cpu->c);
+                cpu->cycles += (mode == 0) ? 6 : 8 + SimEACycles(mode, reg, 2);
+            }
+            else if ((op & 0xFFC0) == 0x44C0 && mode != 1) {
+                // MOVE to CCR
+                SimResolve(cpu, mode, reg, 2, &ea);
+                src = SimGet(cpu, &ea, 2);
+                cpu->x = (src >> 4) & 1;
+                cpu->n = (src >> 3) & 1;
+                cpu->z = (src >> 2) & 1;
+                cpu->v = (src >> 1) & 1;
+                cpu->c = src & 1;
+                cpu->cycles += 12 + SimEACycles(mode, reg, 2);
+            }
+            else if (size != 0 && mode != 1 && ((op & 0xF900) == 0x4000 || (op & 0xFF00) == 0x4600 || (op & 0xFF00) == 0x4A00)) {
+                // NEGX, CLR, NEG, NOT, TST
+                SimResolve(cpu, mode, reg, size, &ea);
+                src = SimGet(cpu, &ea, size);
+                switch ((op >> 8) & 0xF) {
+                    case 0x0: res = SimSub(cpu, src, 0, cpu->x, size, 0, 1); break;
+                    case 0x2: res = 0; SimLogic(cpu, 0, size); break;
+                    case 0x4: res = SimSub(cpu, src, 0, 0, size, 0, 0); break;
+                    case 0x6: res = ~src; SimLogic(cpu, res, size); break;
+                    default:  res = src; SimLogic(cpu, src, size); break;
+                }
+                if ((op & 0xFF00) == 0x4A00) {
+                    cpu->cycles += 4 + SimEACycles(mode, reg, size);
+                }
+                else {
+                    SimPut(cpu, &ea, size, res);
+                    if (mode == 0) {
+                        cpu->cycles += (size == 4) ? 6 : 4;
+                    }
+                    else {
+                        cpu->cycles += ((size == 4) ? 12 : 8) + SimEACycles(mode, reg, size);
+                    }
+                }
+            }
+            else {
+                cpu->error = SIM_ILLEGAL;
+            }
+            break;
+
+        case 0x5:
+            if (size == 0 && mode == 1) {
+                // DBcc
+                addr = cpu->pc;
+                addr += SimSignExtend(SimFetch(cpu, 2), 2);
+                if (SimCondition(cpu, (op >> 8) & 0xF)) {
+                    cpu->cycles += 12;
+                }
+                else {
+                    res = (cpu->d[reg] - 1) & 0xFFFF;
+                    cpu->d[reg] = (cpu->d[reg] & UINT32_C(0xFFFF0000)) | res;
+                    if (res != 0xFFFF) {
+                        cpu->pc = addr;
+                        cpu->cycles += 10;
+                    }
+                    else {
+                        cpu->cycles += 14;
+                    }
+                }
+            }
+            else if (size == 0) {
+                // Scc
+                SimResolve(cpu, mode, reg, 1, &ea);
+                res = SimCondition(cpu, (op >> 8) & 0xF);
+                SimPut(cpu, &ea, 1, res ? 0xFF : 0x00);
+                cpu->cycles += (mode == 0) ? (res ? 6 : 4) : 8 + SimEACycles(mode, reg, 1);
+            }
+            else if (mode == 1) {
+                // ADDQ, SUBQ to an address register: whole register, no flags.
+                if (size == 1) {
+                    cpu->error = SIM_ILLEGAL;
+                    break;
+                }
+                src = dn ? dn : 8;
+                cpu->a[reg] = (op & 0x0100) ? cpu->a[reg] - src : cpu->a[reg] + src;
+                cpu->cycles += 8;
+            }
+            else {
+                // ADDQ, SUBQ
+                src = dn ? dn : 8;
+                SimResolve(cpu, mode, reg, size, &ea);
+                dst = SimGet(cpu, &ea, size);
+                res = (op & 0x0100) ? SimSub(cpu, src, dst, 0, size, 0, 0) : SimAdd(cpu, src, dst, 0, size, 0);
+                SimPut(cpu, &ea, size, res);
+                if (mode == 0) {
+                    cpu->cycles += (size == 4) ? 8 : 4;
+                }
+                else {
+                    cpu->cycles += ((size == 4) ? 12 : 8) + SimEACycles(mode, reg, size);
+                }
+            }
+            break;
+
+        case 0x6:
+            // BRA, BSR, Bcc
+            addr = cpu->pc + SimSignExtend(op & 0xFF, 1);
+            if ((op & 0xFF) == 0) {
+                addr = cpu->pc;
+                addr += SimSignExtend(SimFetch(cpu, 2), 2);
+            }
+            if (((op >> 8) & 0xF) == 1) {
+                SimPush(cpu, cpu->pc, 4);
+                cpu->pc = addr;
+                cpu->cycles += 18;
+            }
+            else if (SimCondition(cpu, (op >> 8) & 0xF)) {
+                cpu->pc = addr;
+                cpu->cycles += 10;
+            }
+            else {
+                cpu->cycles += ((op & 0xFF) == 0) ? 12 : 8;
+            }
+            break;
+
+        case 0x7:
+            // MOVEQ
+            if (op & 0x0100) {
+                cpu->error = SIM_ILLEGAL;
+                break;
+            }
+            cpu->d[dn] = SimSignExtend(op & 0xFF, 1);
+            SimLogic(cpu, cpu->d[dn], 4);
+            cpu->cycles += 4;
+            break;
+
+        case 0x8: case 0xC:
+            if ((op & 0x00C0) == 0x00C0) {
+                // DIVU, DIVS, MULU, MULS
+                SimResolve(cpu, mode, reg, 2, &ea);
+                src = SimGet(cpu, &ea, 2);
+                cpu->cycles += SimEACycles(mode, reg, 2);
+                cpu->c = 0;
+                if (op >> 12 == 0xC) {
+                    if (op & 0x0100) {
+                        res = (uint32_t)((int32_t)(int16_t)cpu->d[dn] * (int32_t)(int16_t)src);
+                        cpu->cycles += 38 + 2 * SimBitCount((src ^ (src << 1)) & 0xFFFF);
+                    }
+                    else {
+                        res = (cpu->d[dn] & 0xFFFF) * src;
+                        cpu->cycles += 38 + 2 * SimBitCount(src);
+                    }
+                    cpu->d[dn] = res;
+                    SimLogic(cpu, res, 4);
+                    break;
+                }
+                if (src == 0) {
+                    cpu->error = SIM_ILLEGAL;
+                    break;
+                }
+                if ((op & 0x0100) && cpu->d[dn] == UINT32_C(0x80000000) && src == 0xFFFF) {
+                    cpu->cycles += 158;
+                    cpu->v = 1;
+                }
+                else if (op & 0x0100) {
+                    int32_t q = (int32_t)cpu->d[dn] / (int32_t)(int16_t)src;
+                    int32_t r = (int32_t)cpu->d[dn] % (int32_t)(int16_t)src;
+                    cpu->cycles += 158;
+                    cpu->v = (q < -32768 || q > 32767);
+                    res = ((uint32_t)r << 16) | ((uint32_t)q & 0xFFFF);
+                }
+                else {
+                    uint32_t q = cpu->d[dn] / src;
+                    uint32_t r = cpu->d[dn] % src;
+                    cpu->cycles += 140;
+                    cpu->v = (q > 0xFFFF);
+                    res = (r << 16) | (q & 0xFFFF);
+                }
+                if (!cpu->v) {
+                    cpu->d[dn] = res;
+                    SimSetNZ(cpu, res, 2);
+                }
+            }
+            else if ((op & 0x01F0) == 0x0100) {
+                cpu->error = SIM_ILLEGAL; // SBCD, ABCD
+            }
+            else if (op >> 12 == 0xC && ((op & 0x01F8) == 0x0140 || (op & 0x01F8) == 0x0148 || (op & 0x01F8) == 0x0188)) {
+                // EXG
+                uint32_t *rx = ((op & 0x01F8) == 0x0148) ? &cpu->a[dn] : &cpu->d[dn];
+                uint32_t *ry = ((op & 0x01F8) == 0x0140) ? &cpu->d[reg] : &cpu->a[reg];
+                res = *rx;
+                *rx = *ry;
+                *ry = res;
+                cpu->cycles += 6;
+            }
+            else if (mode == 1 || ((op & 0x0100) && mode == 0)) {
+                cpu->error = SIM_ILLEGAL;
+            }
+            else {
+                SimArith(cpu, op, size, !(op & 0x0100)); // OR, AND
+            }
+            break;
+
+        case 0x9: case 0xD:
+            if ((op & 0x00C0) == 0x00C0) {
+                // SUBA, ADDA
+                size = (op & 0x0100) ? 4 : 2;
+                SimResolve(cpu, mode, reg, size, &ea);
+                src = SimSignExtend(SimGet(cpu, &ea, size), size);
+                cpu->a[dn] = (op >> 12 == 0xD) ? cpu->a[dn] + src : cpu->a[dn] - src;
+                cpu->cycles += ((size == 2) ? 8 : (mode < 2 || (mode == 7 && reg == 4)) ? 8 : 6) + SimEACycles(mode, reg, size);
+            }
+            else if ((op & 0x0130) == 0x0100) {
+                // SUBX, ADDX
+                if (op & 0x0008) {
+                    SimResolve(cpu, 4, reg, size, &ea);
+                    src = SimGet(cpu, &ea, size);
+                    SimResolve(cpu, 4, dn, size, &ea2);
+                    cpu->cycles += (size == 4) ? 30 : 18;
+                }
+                else {
+                    SimResolve(cpu, 0, reg, size, &ea);
+                    src = SimGet(cpu, &ea, size);
+                    SimResolve(cpu, 0, dn, size, &ea2);
+                    cpu->cycles += (size == 4) ? 8 : 4;
+                }
+                dst = SimGet(cpu, &ea2, size);
+                res = (op >> 12 == 0xD) ? SimAdd(cpu, src, dst, cpu->x, size, 1) : SimSub(cpu, src, dst, cpu->x, size, 0, 1);
+                SimPut(cpu, &ea2, size, res);
+            }
+            else if ((op & 0x0100) && mode < 2) {
+                cpu->error = SIM_ILLEGAL;
+            }
+            else {
+                SimArith(cpu, op, size, !(op & 0x0100)); // SUB, ADD
+            }
+            break;
+
+        case 0xB:
+            if ((op & 0x00C0) == 0x00C0) {
+                // CMPA
+                size = (op & 0x0100) ? 4 : 2;
+                SimResolve(cpu, mode, reg, size, &ea);
+                src = SimSignExtend(SimGet(cpu, &ea, size), size);
+                SimSub(cpu, src, cpu->a[dn], 0, 4, 1, 0);
+                cpu->cycles += 6 + SimEACycles(mode, reg, size);
+            }
+            else if ((op & 0x0100) && mode == 1) {
+                // CMPM
+                SimResolve(cpu, 3, reg, size, &ea);
+                src = SimGet(cpu, &ea, size);
+                SimResolve(cpu, 3, dn, size, &ea2);
+                dst = SimGet(cpu, &ea2, size);
+                SimSub(cpu, src, dst, 0, size, 1, 0);
+                cpu->cycles += (size == 4) ? 20 : 12;
+            }
+            else if (!(op & 0x0100) && size == 1 && mode == 1) {
+                cpu->error = SIM_ILLEGAL;
+            }
+            else {
+                SimArith(cpu, op, size, !(op & 0x0100)); // CMP, EOR
+            }
+            break;
+
+        case 0xE:
+            if (size == 0) {
+                // Memory shifts and rotates, by one bit.
+                if ((op & 0x0800) || mode < 2) {
+                    cpu->error = SIM_ILLEGAL;
+                    break;
+                }
+                SimResolve(cpu, mode, reg, 2, &ea);
+                res = SimShift(cpu, SimGet(cpu, &ea, 2), 1, 2, (op >> 9) & 3, (op & 0x0100) != 0);
+                SimPut(cpu, &ea, 2, res);
+                cpu->cycles += 8 + SimEACycles(mode, reg, 2);
+            }
+            else {
+                count = (op & 0x0020) ? (cpu->d[dn] & 63) : (dn ? dn : 8);
+                res = SimShift(cpu, cpu->d[reg], count, size, (op >> 3) & 3, (op & 0x0100) != 0);
+                cpu->d[reg] = (cpu->d[reg] & ~SimMask(size)) | res;
+                cpu->cycles += ((size == 4) ? 8 : 6) + 2 * count;
+            }
+            break;
+
+        case 0xF:
+            // F-Line calls, as emulated by AMS 2.04 and later.
+            if (op == 0xFFF0) {
+                addr = cpu->pc;
+                addr += SimFetch(cpu, 4);
+            }
+            else if (op >= 0xF800 && op < 0xFFF0) {
+                addr = SimRead(cpu, jmp_tbl + 4 * (op - 0xF800), 4);
+            }
+            else {
+                cpu->error = SIM_ILLEGAL;
+                break;
+            }
+            SimPush(cpu, cpu->pc, 4);
+            cpu->pc = addr;
+            cpu->cycles += 20;
+            break;
+
+        default:
+            // Line-A (ER_throw).
+            cpu->error = SIM_ILLEGAL;
+            break;
+    }
+}
+
+
+//! Allocate the simulated RAM, and take a snapshot of [start, end) of the output file as simulated ROM.
+static int SimInit (uint32_t start, uint32_t end) {
+    SimRAM = (uint8_t *)calloc(1, SIM_RAM_SIZE);
+    SimROM = (uint8_t *)malloc(end - start);
+    if (SimRAM == NULL || SimROM == NULL) {
+        free(SimRAM);
+        free(SimROM);
+        SimRAM = SimROM = NULL;
+        printf("\n    ERROR : not enough memory.\n");
+        return 1;
+    }
+    GetNBytes(SimROM, end - start, start);
+    SimROMStart = start;
+    SimROMEnd = end;
+    return 0;
+}
+
+static void SimExit (void) {
+    free(SimRAM);
+    free(SimROM);
+    SimRAM = SimROM = NULL;
+}
+
+//! Prepare the CPU for a call: clear the registers, point the stack to the end of the simulated RAM.
+static void SimReset (M68kCpu *cpu) {
+    memset(cpu, 0, sizeof(*cpu));
+    cpu->a[7] = SIM_RAM_SIZE - 16;
+}
+
+//! Call the routine at entry, with the arguments pushed by SimPush, and return SIM_OK when it returns.
+//  cpu->cycles is the duration of the routine, including the RTS.
+static int SimCall (M68kCpu *cpu, uint32_t entry, uint32_t maxinsns) {
+    SimPush(cpu, SIM_RETURN, 4);
+    cpu->pc = entry;
+    cpu->cycles = 0;
+    cpu->insns = 0;
+    while (cpu->pc != SIM_RETURN && !cpu->error) {
+        if (cpu->insns++ >= maxinsns) {
+            cpu->error = SIM_TIMEOUT;
+            break;
+        }
+        SimStep(cpu);
+    }
+    return cpu->error;
+}
+
+static const char * SimErrorString (int error) {
+    static const char * const strings[] = {
+        "ok", "unsupported instruction", "bus error", "address error", "write to ROM", "timeout"
+    };
+    return strings[error];
+}
@@ -0,0 +1,968 @@
+/**
+ * \file patchvm.c
+ * \brief compiler and interpreter of patch scripts, declarative patchsets for
+ *        a computer-based unlocking and optimizing program aimed at official
+ *        TI-68k calculators OS
+ * Copyright (C) 2010 Lionel Debroux (lionel underscore debroux yahoo fr)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 (and only version 2) of the
+ * License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, 5th Floor, Boston, MA 02110-1301, USA
+ */
+
+// This file is included by tiosmod.c, before main().
+// A patch script is a list of sections, one statement per line, '#' starts a comment:
+//     section NAME        start a section, named like the sections of amspatch.c in the messages and conflict checks;
+//     require EXPR        skip the rest of the section unless EXPR is nonzero, e.g. "AMS_Major == 2 && AMS_Minor == 5";
+//     at EXPR             set the current address;
+//     find PATTERN        move to the next match of PATTERN at or after the current address, in the basecode;
+//     expect PATTERN      check that PATTERN is at the current address;
+//     let $NAME = EXPR    set a variable, kept from section to section;
+//     write ITEMS         write at the current address and move past the written bytes;
+//     print "TEXT"        print TEXT, followed by " at " and the current address.
+// A section is skipped as a whole when a pattern is not found, and when its writes conflict with those of another
+// section. PATTERNs are hexadecimal bytes, "??" matches any byte. ITEMS are hexadecimal bytes, byte(EXPR),
+// short(EXPR), long(EXPR), and rel(EXPR), the 16-bit displacement to EXPR from the current address, as in a BSR.W or
+// a d16(PC) operand.
+// EXPRs are unsigned 32-bit C expressions (without the ?: operator and the division) of numbers, $variables, here
+// (the current address), AMS_Major, AMS_Minor, CalculatorType, TI89, TI92P, V200, TI89T, ROM_base, jmp_tbl and of:
+//     rom_call_addr(NAME or EXPR), GetAMSVector(EXPR), GetAMSTrap9Item(EXPR), GetAMSTrapBFunction(EXPR),
+//     GetByte(EXPR), GetShort(EXPR), GetLong(EXPR), Get68kPCRelativeValue(EXPR), AllocROMSpace(EXPR).
+// && and || do not short-circuit.
+//
+// Scripts are compiled to a bytecode, which can be saved to skip the compilation: "TIOSPBC1", the big-endian length
+// of the code, then the code. Expressions run on a stack; the operands of the instructions follow their opcode,
+// big-endian. A section starts with the length of its code, so that skipping it is a single jump.
+
+
+#define SCRIPT_MAGIC "TIOSPBC1"
+#define SCRIPT_HEADER_SIZE (8 + 4)
+#define SCRIPT_STACK_SIZE 32
+#define MAX_SCRIPT_VARIABLES 64
+#define MAX_PATTERN_SIZE 255
+
+enum {
+    OP_END,         // end of the script
+    OP_SECTION,     // .w length of the section code, NUL-terminated name
+    OP_REQUIRE,     // pop; skip the section if zero
+    OP_AT,          // pop the current address
+    OP_FIND,        // .b n, n bytes, n bytes of mask
+    OP_EXPECT,      // .b n, n bytes, n bytes of mask
+    OP_WRITE,       // .b n, n bytes
+    OP_WRITEB,      // pop, write a byte
+    OP_WRITEW,      // pop, write a short
+    OP_WRITEL,      // pop, write a long
+    OP_WRITEREL,    // pop a target, write the displacement to it
+    OP_LET,         // .b variable, pop into it
+    OP_PRINT,       // NUL-terminated text
+    OP_PUSHB,       // .b value
+    OP_PUSHW,       // .w value
+    OP_PUSHL,       // .l value
+    OP_VAR,         // .b variable
+    OP_GLOBAL,      // .b index in ScriptGlobals
+    OP_ROMCALL,     // the functions of one argument
+    OP_VECTOR,
+    OP_TRAP9,
+    OP_TRAPB,
+    OP_GETB,
+    OP_GETW,
+    OP_GETL,
+    OP_PCREL,
+    OP_ALLOC,
+    OP_NEG,         // the unary operators
+    OP_NOT,
+    OP_CPL,
+    OP_LOR,         // the binary operators, in the order of BinaryOperators
+    OP_LAND,
+    OP_OR,
+    OP_XOR,
+    OP_AND,
+    OP_EQ,
+    OP_NE,
+    OP_SHL,
+    OP_SHR,
+    OP_LE,
+    OP_GE,
+    OP_LT,
+    OP_GT,
+    OP_ADD,
+    OP_SUB,
+    OP_MUL
+};
+
+// The binary operators, in the order of their opcodes (each one before the operators it starts with), and their
+// precedence.
+static const struct {
+    const char *text;
+    uint8_t precedence;
+} BinaryOperators[] = {
+    {"||", 1}, {"&&", 2}, {"|", 3}, {"^", 4}, {"&", 5}, {"==", 6}, {"!=", 6}, {"<<", 8}, {">>", 8}, {"<=", 7},
+    {">=", 7}, {"<", 7}, {">", 7}, {"+", 9}, {"-", 9}, {"*", 10}
+};
+
+// The functions and the variables of the program usable in expressions.
+static const struct {
+    const char *name;
+    uint8_t op;
+} ScriptFunctions[] = {
+    {"rom_call_addr", OP_ROMCALL}, {"GetAMSVector", OP_VECTOR}, {"GetAMSTrap9Item", OP_TRAP9},
+    {"GetAMSTrapBFunction", OP_TRAPB}, {"GetByte", OP_GETB}, {"GetShort", OP_GETW}, {"GetLong", OP_GETL},
+    {"Get68kPCRelativeValue", OP_PCREL}, {"AllocROMSpace", OP_ALLOC}
+};
+static const char * const ScriptGlobals[] = {
+    "here", "AMS_Major", "AMS_Minor", "CalculatorType", "ROM_base", "jmp_tbl"
+};
+static const NamedROMCall ScriptConstants[] = {
+    NAMED_ROM_CALL(TI89), NAMED_ROM_CALL(TI92P), NAMED_ROM_CALL(V200), NAMED_ROM_CALL(TI89T)
+};
+
+// The state of the compiler, shared memory style.
+static uint8_t *ScriptCode;
+static uint32_t ScriptSize;
+static uint32_t ScriptAllocated;
+static char ScriptVariables[MAX_SCRIPT_VARIABLES][32];
+static uint32_t NbScriptVariables;
+static const char *ScriptPos;
+static const char *ScriptError;
+
+// The scripts given on the command line, compiled.
+#define MAX_SCRIPTS 16
+static char * ScriptFileNames[MAX_SCRIPTS];
+static uint8_t * ScriptBytecodes[MAX_SCRIPTS];
+static uint32_t ScriptBytecodeSizes[MAX_SCRIPTS];
+static uint32_t NbScripts;
+
+
+static void ScriptByte (uint32_t value) {
+    if (ScriptSize == ScriptAllocated) {
+        uint8_t *temp = (uint8_t *)realloc(ScriptCode, ScriptAllocated * 2 + 256);
+        if (temp == NULL) {
+            ScriptError = "not enough memory";
+            return;
+        }
+        ScriptCode = temp;
+        ScriptAllocated = ScriptAllocated * 2 + 256;
+    }
+    ScriptCode[ScriptSize++] = (uint8_t)value;
+}
+
+static void ScriptShort (uint32_t value) {
+    ScriptByte(value >> 8);
+    ScriptByte(value);
+}
+
+static void ScriptLong (uint32_t value) {
+    ScriptShort(value >> 16);
+    ScriptShort(value);
+}
+
+static void SkipScriptSpaces (void) {
+    while (*ScriptPos == ' ' || *ScriptPos == '\t' || *ScriptPos == '\r') {
+        ScriptPos++;
+    }
+}
+
+//! Read an identifier into name (at most size - 1 characters), return its length, 0 if there is none.
+static uint32_t ReadScriptName (char *name, uint32_t size) {
+    uint32_t n = 0;
+
+    SkipScriptSpaces();
+    while (   (*ScriptPos >= 'a' && *ScriptPos <= 'z') || (*ScriptPos >= 'A' && *ScriptPos <= 'Z')
+           || (*ScriptPos >= '0' && *ScriptPos <= '9' && n != 0) || *ScriptPos == '_') {
+        if (n + 1 < size) {
+            name[n] = *ScriptPos;
+        }
+        n++;
+        ScriptPos++;
+    }
+    name[(n < size) ? n : size - 1] = 0;
+    return n;
+}
+
+//! Check that the next character is c, and skip it.
+static void ExpectScriptChar (char c, const char *error) {
+    SkipScriptSpaces();
+    if (*ScriptPos != c) {
+        ScriptError = error;
+    }
+    else {
+        ScriptPos++;
+    }
+}
+
+//! Emit the shortest push of the given value.
+static void CompileScriptConstant (uint32_t value) {
+    if (value <= 0xFF) {
+        ScriptByte(OP_PUSHB);
+        ScriptByte(value);
+    }
+    else if (value <= 0xFFFF) {
+        ScriptByte(OP_PUSHW);
+        ScriptShort(value);
+    }
+    else {
+        ScriptByte(OP_PUSHL);
+        ScriptLong(value);
+    }
+}
+
+static int FindScriptVariable (const char *name) {
+    uint32_t i;
+    for (i = 0; i < NbScriptVariables; i++) {
+        if (!strcmp(ScriptVariables[i], name)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void CompileScriptExpression (uint32_t precedence);
+
+static void CompileScriptPrimary (void) {
+    char name[32];
+    uint32_t i;
+    int var;
+
+    SkipScriptSpaces();
+    if (*ScriptPos >= '0' && *ScriptPos <= '9') {
+        char *end;
+        CompileScriptConstant(strtoul(ScriptPos, &end, 0));
+        ScriptPos = end;
+    }
+    else if (*ScriptPos == '(') {
+        ScriptPos++;
+        CompileScriptExpression(1);
+        ExpectScriptChar(')', "')' expected");
+    }
+    else if (*ScriptPos == '-' || *ScriptPos == '!' || *ScriptPos == '~') {
+        uint8_t op = (*ScriptPos == '-') ? OP_NEG : (*ScriptPos == '!') ? OP_NOT : OP_CPL;
+        ScriptPos++;
+        CompileScriptPrimary();
+        ScriptByte(op);
+    }
+    else if (*ScriptPos == '$') {
+        ScriptPos++;
+        ReadScriptName(name, sizeof(name));
+        if ((var = FindScriptVariable(name)) < 0) {
+            ScriptError = "unknown variable";
+            return;
+        }
+        ScriptByte(OP_VAR);
+        ScriptByte(var);
+    }
+    else if (ReadScriptName(name, sizeof(name)) != 0) {
+        for (i = 0; i < sizeof(ScriptGlobals) / sizeof(ScriptGlobals[0]); i++) {
+            if (!strcmp(ScriptGlobals[i], name)) {
+                ScriptByte(OP_GLOBAL);
+                ScriptByte(i);
+                return;
+            }
+        }
+        for (i = 0; i < sizeof(ScriptConstants) / sizeof(ScriptConstants[0]); i++) {
+            if (!strcmp(ScriptConstants[i].name, name)) {
+                CompileScriptConstant(ScriptConstants[i].idx);
+                return;
+            }
+        }
+        for (i = 0; i < sizeof(ScriptFunctions) / sizeof(ScriptFunctions[0]); i++) {
+            if (!strcmp(ScriptFunctions[i].name, name)) {
+                break;
+            }
+        }
+        if (i == sizeof(ScriptFunctions) / sizeof(ScriptFunctions[0])) {
+            ScriptError = "unknown name";
+            return;
+        }
+        ExpectScriptChar('(', "'(' expected");
+        // ROM_CALLs can be given by name, the index is resolved now.
+        if (ScriptFunctions[i].op == OP_ROMCALL) {
+            const char *start = ScriptPos;
+            uint32_t j;
+            if (ReadScriptName(name, sizeof(name)) != 0) {
+                for (j = 0; j < sizeof(KnownROMCalls) / sizeof(KnownROMCalls[0]); j++) {
+                    if (!strcmp(KnownROMCalls[j].name, name)) {
+                        break;
+                    }
+                }
+                SkipScriptSpaces();
+                if (j < sizeof(KnownROMCalls) / sizeof(KnownROMCalls[0]) && *ScriptPos == ')') {
+                    CompileScriptConstant(KnownROMCalls[j].idx);
+                    ScriptPos++;
+                    ScriptByte(OP_ROMCALL);
+                    return;
+                }
+            }
+            ScriptPos = start;
+        }
+        CompileScriptExpression(1);
+        ExpectScriptChar(')', "')' expected");
+        ScriptByte(ScriptFunctions[i].op);
+    }
+    else {
+        ScriptError = "expression expected";
+    }
+}
+
+//! Compile an expression made of operators of the given precedence or higher, by precedence climbing.
+static void CompileScriptExpression (uint32_t precedence) {
+    uint32_t i;
+
+    CompileScriptPrimary();
+    while (ScriptError == NULL) {
+        SkipScriptSpaces();
+        for (i = 0; i < sizeof(BinaryOperators) / sizeof(BinaryOperators[0]); i++) {
+            if (!strncmp(ScriptPos, BinaryOperators[i].text, strlen(BinaryOperators[i].text))) {
+                break;
+            }
+        }
+        if (i == sizeof(BinaryOperators) / sizeof(BinaryOperators[0]) || BinaryOperators[i].precedence < precedence) {
+            return;
+        }
+        ScriptPos += strlen(BinaryOperators[i].text);
+        CompileScriptExpression(BinaryOperators[i].precedence + 1);
+        ScriptByte(OP_LOR + i);
+    }
+}
+
+static int HexDigitValue (char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+//! Compile a pattern of hexadecimal bytes and "??" wildcards, for find and expect.
+static void CompileScriptPattern (uint8_t op) {
+    uint8_t bytes[MAX_PATTERN_SIZE], mask[MAX_PATTERN_SIZE];
+    uint32_t n = 0, i;
+
+    for (SkipScriptSpaces(); *ScriptPos != 0 && *ScriptPos != '\n' && *ScriptPos != '#'; SkipScriptSpaces()) {
+        if (n == MAX_PATTERN_SIZE) {
+            ScriptError = "pattern too long";
+            return;
+        }
+        if (ScriptPos[0] == '?' && ScriptPos[1] == '?') {
+            bytes[n] = 0;
+            mask[n++] = 0;
+        }
+        else if (HexDigitValue(ScriptPos[0]) >= 0 && HexDigitValue(ScriptPos[1]) >= 0) {
+            bytes[n] = HexDigitValue(ScriptPos[0]) * 16 + HexDigitValue(ScriptPos[1]);
+            mask[n++] = 0xFF;
+        }
+        else {
+            ScriptError = "hexadecimal byte or ?? expected";
+            return;
+        }
+        ScriptPos += 2;
+    }
+    if (n == 0) {
+        ScriptError = "empty pattern";
+        return;
+    }
+    ScriptByte(op);
+    ScriptByte(n);
+    for (i = 0; i < n; i++) {
+        ScriptByte(bytes[i]);
+    }
+    for (i = 0; i < n; i++) {
+        ScriptByte(mask[i]);
+    }
+}
+
+//! Compile the items of a write statement: runs of hexadecimal bytes, and byte/short/long/rel(EXPR).
+static void CompileScriptWrite (void) {
+    static const char * const items[] = {"byte", "short", "long", "rel"};
+    uint8_t bytes[MAX_PATTERN_SIZE];
+    char name[8];
+    const char *start;
+    uint32_t n = 0, i, count = 0;
+
+    for (SkipScriptSpaces(); ScriptError == NULL && *ScriptPos != 0 && *ScriptPos != '\n' && *ScriptPos != '#'; SkipScriptSpaces()) {
+        start = ScriptPos;
+        ReadScriptName(name, sizeof(name));
+        SkipScriptSpaces();
+        for (i = 0; i < sizeof(items) / sizeof(items[0]); i++) {
+            if (!strcmp(items[i], name) && *ScriptPos == '(') {
+                break;
+            }
+        }
+        if (i < sizeof(items) / sizeof(items[0])) {
+            ScriptPos++;
+            CompileScriptExpression(1);
+            ExpectScriptChar(')', "')' expected");
+            ScriptByte(OP_WRITEB + i);
+            count++;
+            continue;
+        }
+        // Bytes, written by a single instruction.
+        ScriptPos = start;
+        for (n = 0; HexDigitValue(ScriptPos[0]) >= 0 && HexDigitValue(ScriptPos[1]) >= 0; ScriptPos += 2) {
+            if (n == MAX_PATTERN_SIZE) {
+                ScriptError = "too many bytes";
+                return;
+            }
+            bytes[n++] = HexDigitValue(ScriptPos[0]) * 16 + HexDigitValue(ScriptPos[1]);
+        }
+        if (n == 0 || HexDigitValue(ScriptPos[0]) >= 0) {
+            ScriptError = "hexadecimal bytes or byte/short/long/rel(expression) expected";
+            return;
+        }
+        ScriptByte(OP_WRITE);
+        ScriptByte(n);
+        for (i = 0; i < n; i++) {
+            ScriptByte(bytes[i]);
+        }
+        count++;
+    }
+    if (count == 0 && ScriptError == NULL) {
+        ScriptError = "nothing to write";
+    }
+}
+
+//! Set the length of the section starting at the given offset of the code, if any.
+static void EndScriptSection (uint32_t section) {
+    uint32_t length;
+
+    if (section == 0) {
+        return;
+    }
+    length = ScriptSize - section - 3;
+    if (length > 0xFFFF) {
+        ScriptError = "section too long";
+        return;
+    }
+    ScriptCode[section + 1] = (uint8_t)(length >> 8);
+    ScriptCode[section + 2] = (uint8_t)length;
+}
+
+//! Compile the given script into ScriptCode / ScriptSize, return 0 on success.
+static int CompileScript (const char *text, const char *filename) {
+    char keyword[16], name[32];
+    uint32_t line = 1, section = 0, start;
+    int var;
+
+    ScriptCode = NULL;
+    ScriptSize = 0;
+    ScriptAllocated = 0;
+    NbScriptVariables = 0;
+    ScriptError = NULL;
+    ScriptPos = text;
+
+    // The code starts with a byte which is never a section, so that a section offset is never 0.
+    ScriptByte(OP_END);
+    while (*ScriptPos != 0 && ScriptError == NULL) {
+        start = ScriptSize;
+        ReadScriptName(keyword, sizeof(keyword));
+        SkipScriptSpaces();
+        if (keyword[0] == 0) {
+            // Blank line or comment.
+        }
+        else if (!strcmp(keyword, "section")) {
+            EndScriptSection(section);
+            section = start;
+            // Any word, such as 1a.
+            for (var = 0; *ScriptPos > ' ' && *ScriptPos != '#' && var + 1 < (int)sizeof(name); var++) {
+                name[var] = *ScriptPos++;
+            }
+            name[var] = 0;
+            if (var == 0) {
+                ScriptError = "section name expected";
+            }
+            ScriptByte(OP_SECTION);
+            ScriptShort(0);
+            for (var = 0; name[var] != 0; var++) {
+                ScriptByte(name[var]);
+            }
+            ScriptByte(0);
+        }
+        else if (section == 0) {
+            ScriptError = "statement outside of a section";
+        }
+        else if (!strcmp(keyword, "require") || !strcmp(keyword, "at")) {
+            CompileScriptExpression(1);
+            ScriptByte(keyword[0] == 'r' ? OP_REQUIRE : OP_AT);
+        }
+        else if (!strcmp(keyword, "find") || !strcmp(keyword, "expect")) {
+            CompileScriptPattern(keyword[0] == 'f' ? OP_FIND : OP_EXPECT);
+        }
+        else if (!strcmp(keyword, "write")) {
+            CompileScriptWrite();
+        }
+        else if (!strcmp(keyword, "let")) {
+            ExpectScriptChar('$', "$variable expected");
+            if (ReadScriptName(name, sizeof(name)) == 0) {
+                ScriptError = "$variable expected";
+            }
+            ExpectScriptChar('=', "'=' expected");
+            CompileScriptExpression(1);
+            if ((var = FindScriptVariable(name)) < 0) {
+                if (NbScriptVariables == MAX_SCRIPT_VARIABLES) {
+                    ScriptError = "too many variables";
+                    break;
+                }
+                strcpy(ScriptVariables[NbScriptVariables], name);
+                var = NbScriptVariables++;
+            }
+            ScriptByte(OP_LET);
+            ScriptByte(var);
+        }
+        else if (!strcmp(keyword, "print")) {
+            ExpectScriptChar('"', "'\"' expected");
+            ScriptByte(OP_PRINT);
+            while (*ScriptPos != '"' && *ScriptPos != '\n' && *ScriptPos != 0) {
+                ScriptByte(*ScriptPos++);
+            }
+            ScriptByte(0);
+            ExpectScriptChar('"', "'\"' expected");
+        }
+        else {
+            ScriptError = "unknown statement";
+        }
+
+        SkipScriptSpaces();
+        if (*ScriptPos == '#') {
+            while (*ScriptPos != '\n' && *ScriptPos != 0) {
+                ScriptPos++;
+            }
+        }
+        if (ScriptError == NULL && *ScriptPos != '\n' && *ScriptPos != 0) {
+            ScriptError = "end of line expected";
+        }
+        if (ScriptError == NULL && *ScriptPos == '\n') {
+            ScriptPos++;
+            line++;
+        }
+    }
+    EndScriptSection(section);
+    ScriptByte(OP_END);
+
+    if (ScriptError != NULL) {
+        printf("\n    ERROR : %s:%" PRIu32 ": %s.\n", filename, line, ScriptError);
+        free(ScriptCode);
+        ScriptCode = NULL;
+        return 1;
+    }
+    return 0;
+}
+
+//! Load a patch script, compiled or not, into ScriptCode / ScriptSize. Return 0 on success.
+static int LoadScript (const char *filename) {
+    FILE *file;
+    char *text;
+    long size;
+    int ret;
+
+    if ((file = fopen(filename, "rb")) == NULL) {
+        printf("\n    ERROR : file '%s' not found.\n", filename);
+        return 2;
+    }
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if ((text = (char *)malloc(size + 1)) == NULL || fread(text, 1, size, file) != (size_t)size) {
+        printf("\n    ERROR : can't read '%s'.\n", filename);
+        free(text);
+        fclose(file);
+        return 1;
+    }
+    fclose(file);
+    text[size] = 0;
+
+    if (size >= SCRIPT_HEADER_SIZE && SameBytes((uint8_t *)text, (const uint8_t *)SCRIPT_MAGIC, 8)) {
+        ScriptSize = ((uint32_t)(uint8_t)text[8] << 24) | ((uint32_t)(uint8_t)text[9] << 16)
+                   | ((uint32_t)(uint8_t)text[10] << 8) | (uint8_t)text[11];
+        if (ScriptSize != (uint32_t)size - SCRIPT_HEADER_SIZE || ScriptSize == 0 || text[size - 1] != OP_END) {
+            printf("\n    ERROR : '%s' is not a valid compiled patch script.\n", filename);
+            free(text);
+            return 1;
+        }
+        ScriptCode = (uint8_t *)malloc(ScriptSize);
+        if (ScriptCode == NULL) {
+            printf("\n    ERROR : not enough memory.\n");
+            free(text);
+            return 1;
+        }
+        memcpy(ScriptCode, text + SCRIPT_HEADER_SIZE, ScriptSize);
+        ret = 0;
+    }
+    else {
+        ret = CompileScript(text, filename);
+    }
+    free(text);
+    return ret;
+}
+
+//! Compile a patch script and save its bytecode.
+static int CompileScriptFile (const char *filename, const char *outfilename) {
+    FILE *file;
+    int ret;
+
+    ret = LoadScript(filename);
+    if (ret) {
+        return ret;
+    }
+    if ((file = fopen(outfilename, "wb")) == NULL) {
+        printf("\n    ERROR : can't create '%s'.\n", outfilename);
+        free(ScriptCode);
+        return 8;
+    }
+    fwrite(SCRIPT_MAGIC, 1, 8, file);
+    WriteFileLong(file, ScriptSize);
+    fwrite(ScriptCode, 1, ScriptSize, file);
+    fclose(file);
+    printf("    Compiled '%s' to %" PRIu32 " bytes of code in '%s'.\n", filename, ScriptSize, outfilename);
+    free(ScriptCode);
+    return 0;
+}
+
+//! Load the scripts given on the command line, before patching, so that mistakes are reported at once.
+static int LoadScripts (void) {
+    uint32_t i;
+    int ret;
+
+    for (i = 0; i < NbScripts; i++) {
+        ret = LoadScript(ScriptFileNames[i]);
+        if (ret) {
+            return ret;
+        }
+        ScriptBytecodes[i] = ScriptCode;
+        ScriptBytecodeSizes[i] = ScriptSize;
+    }
+    return 0;
+}
+
+
+// The image searched by the scripts, loaded once: the writes are staged until the end of the scripts, they do not
+// change it.
+static uint8_t *ScriptImage;
+static uint32_t ScriptImageStart;
+static uint32_t ScriptImageSize;
+
+//! Match the pattern of a find or expect instruction, at the given address.
+static int MatchScriptPattern (uint32_t addr, const uint8_t *bytes, const uint8_t *mask, uint32_t n) {
+    uint32_t i;
+
+    if (addr < ScriptImageStart || addr - ScriptImageStart > ScriptImageSize - n) {
+        return 0;
+    }
+    addr -= ScriptImageStart;
+    for (i = 0; i < n; i++) {
+        if ((ScriptImage[addr + i] & mask[i]) != bytes[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+//! Search for the pattern of a find instruction, from the given address: return the address of the match, or 0.
+static uint32_t FindScriptPattern (uint32_t addr, const uint8_t *bytes, const uint8_t *mask, uint32_t n) {
+    uint32_t first = 0;
+    const uint8_t *p, *end;
+
+    if (addr < ScriptImageStart || addr - ScriptImageStart > ScriptImageSize - n) {
+        return 0;
+    }
+    while (first < n && mask[first] == 0) {
+        first++;
+    }
+    if (first == n) {
+        return addr;
+    }
+    // memchr on the first fixed byte, then check the rest.
+    p = ScriptImage + (addr - ScriptImageStart) + first;
+    end = ScriptImage + ScriptImageSize - (n - first) + 1;
+    while (p < end && (p = (const uint8_t *)memchr(p, bytes[first], end - p)) != NULL) {
+        if (MatchScriptPattern(ScriptImageStart + (p - ScriptImage) - first, bytes, mask, n)) {
+            return ScriptImageStart + (p - ScriptImage) - first;
+        }
+        p++;
+    }
+    return 0;
+}
+
+static uint32_t GetScriptLong (uint32_t absaddr) {
+    if (absaddr >= ScriptImageStart && absaddr - ScriptImageStart < ScriptImageSize - 3) {
+        const uint8_t *p = ScriptImage + absaddr - ScriptImageStart;
+        return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+    }
+    return GetLong(absaddr);
+}
+
+static uint8_t GetScriptByte (uint32_t absaddr) {
+    if (absaddr >= ScriptImageStart && absaddr - ScriptImageStart < ScriptImageSize) {
+        return ScriptImage[absaddr - ScriptImageStart];
+    }
+    return GetByte(absaddr);
+}
+
+static uint16_t GetScriptShort (uint32_t absaddr) {
+    if (absaddr >= ScriptImageStart && absaddr - ScriptImageStart < ScriptImageSize - 1) {
+        const uint8_t *p = ScriptImage + absaddr - ScriptImageStart;
+        return ((uint16_t)p[0] << 8) | p[1];
+    }
+    return GetShort(absaddr);
+}
+
+//! Run a compiled patch script. Return 0 on success, 1 if the code is corrupt.
+static int RunScript (const uint8_t *code, uint32_t size) {
+    uint32_t stack[SCRIPT_STACK_SIZE];
+    uint32_t variables[MAX_SCRIPT_VARIABLES];
+    uint32_t sp = 0, pc = 1, here = ROM_base + UINT32_C(0x12000), sectionend = 0, n, a, b;
+    const char *name = "";
+    uint8_t op;
+
+// Checks against corrupt bytecode, which cost little next to the accesses to the image.
+#define NEED(bytes) if (pc + (bytes) > size) goto corrupt
+#define POP(x) if (sp == 0) goto corrupt; x = stack[--sp]
+#define PUSH(x) if (sp == SCRIPT_STACK_SIZE) goto corrupt; stack[sp++] = (x)
+
+    memset(variables, 0, sizeof(variables));
+    for (;;) {
+        NEED(1);
+        op = code[pc++];
+        switch (op) {
+            case OP_END:
+                return 0;
+            case OP_SECTION:
+                NEED(3);
+                sectionend = pc + 2 + ((code[pc] << 8) | code[pc + 1]);
+                name = (const char *)code + pc + 2;
+                if (sectionend > size || memchr(name, 0, sectionend - pc - 2) == NULL) {
+                    goto corrupt;
+                }
+                pc += 2 + strlen(name) + 1;
+                BeginSection(name);
+                // The writes of a script are always staged, so that they can be dropped.
+                if (CurrentSection < 0) {
+                    printf("Too many sections, skipping section %s !\n", name);
+                    pc = sectionend;
+                }
+                break;
+            case OP_REQUIRE:
+                POP(a);
+                if (a == 0) {
+                    printf("Section %s does not apply to this OS, skipping it\n", name);
+                    pc = sectionend;
+                }
+                break;
+            case OP_AT:
+                POP(here);
+                break;
+            case OP_FIND:
+            case OP_EXPECT:
+                NEED(1);
+                n = code[pc++];
+                NEED(2 * n);
+                if (op == OP_FIND) {
+                    a = FindScriptPattern(here, code + pc, code + pc + n, n);
+                }
+                else {
+                    a = MatchScriptPattern(here, code + pc, code + pc + n, n) ? here : 0;
+                }
+                pc += 2 * n;
+                if (a == 0) {
+                    printf("Unexpected data, skipping section %s, the pattern at %06" PRIX32 " was not %s !\n", name, here, op == OP_FIND ? "found" : "matched");
+                    if (CurrentSection >= 0) {
+                        SectionSkipped[CurrentSection] = 1;
+                    }
+                    pc = sectionend;
+                }
+                here = a;
+                break;
+            case OP_WRITE:
+                NEED(1);
+                n = code[pc++];
+                NEED(n);
+                PutNBytes((uint8_t *)code + pc, n, here);
+                pc += n;
+                here += n;
+                break;
+            case OP_WRITEB:
+                POP(a);
+                PutByte(a, here);
+                here += 1;
+                break;
+            case OP_WRITEW:
+                POP(a);
+                PutShort(a, here);
+                here += 2;
+                break;
+            case OP_WRITEL:
+                POP(a);
+                PutLong(a, here);
+                here += 4;
+                break;
+            case OP_WRITEREL:
+                POP(a);
+                a -= here;
+                if ((int32_t)a < -32768 || (int32_t)a > 32767) {
+                    printf("Unexpected data, skipping section %s, %06" PRIX32 " is out of reach of a 16-bit displacement !\n", name, here + a);
+                    if (CurrentSection >= 0) {
+                        SectionSkipped[CurrentSection] = 1;
+                    }
+                    pc = sectionend;
+                    break;
+                }
+                PutShort(a, here);
+                here += 2;
+                break;
+            case OP_LET:
+                NEED(1);
+                if (code[pc] >= MAX_SCRIPT_VARIABLES) {
+                    goto corrupt;
+                }
+                POP(variables[code[pc]]);
+                pc++;
+                break;
+            case OP_PRINT:
+                if (memchr(code + pc, 0, size - pc) == NULL) {
+                    goto corrupt;
+                }
+                printf("%s at %06" PRIX32 "\n", (const char *)code + pc, here);
+                pc += strlen((const char *)code + pc) + 1;
+                break;
+            case OP_PUSHB:
+                NEED(1);
+                PUSH(code[pc]);
+                pc += 1;
+                break;
+            case OP_PUSHW:
+                NEED(2);
+                PUSH((code[pc] << 8) | code[pc + 1]);
+                pc += 2;
+                break;
+            case OP_PUSHL:
+                NEED(4);
+                PUSH(((uint32_t)code[pc] << 24) | ((uint32_t)code[pc + 1] << 16) | ((uint32_t)code[pc + 2] << 8) | code[pc + 3]);
+                pc += 4;
+                break;
+            case OP_VAR:
+                NEED(1);
+                if (code[pc] >= MAX_SCRIPT_VARIABLES) {
+                    goto corrupt;
+                }
+                PUSH(variables[code[pc]]);
+                pc++;
+                break;
+            case OP_GLOBAL:
+                NEED(1);
+                switch (code[pc++]) {
+                    case 0: a = here; break;
+                    case 1: a = AMS_Major; break;
+                    case 2: a = AMS_Minor; break;
+                    case 3: a = CalculatorType; break;
+                    case 4: a = ROM_base; break;
+                    case 5: a = jmp_tbl; break;
+                    default: goto corrupt;
+                }
+                PUSH(a);
+                break;
+            case OP_ROMCALL:
+            case OP_VECTOR:
+            case OP_TRAP9:
+            case OP_TRAPB:
+            case OP_GETB:
+            case OP_GETW:
+            case OP_GETL:
+            case OP_PCREL:
+            case OP_ALLOC:
+            case OP_NEG:
+            case OP_NOT:
+            case OP_CPL:
+                POP(a);
+                switch (op) {
+                    case OP_ROMCALL: a = GetScriptLong(jmp_tbl + 4 * a); break;
+                    case OP_VECTOR: a = GetScriptLong(ROM_base + UINT32_C(0x12088) + a); break;
+                    case OP_TRAP9: a = GetAMSTrap9Item(a); break;
+                    case OP_TRAPB: a = GetAMSTrapBFunction(a); break;
+                    case OP_GETB: a = GetScriptByte(a); break;
+                    case OP_GETW: a = GetScriptShort(a); break;
+                    case OP_GETL: a = GetScriptLong(a); break;
+                    case OP_PCREL: a = a + (int32_t)(int16_t)GetScriptShort(a); break;
+                    case OP_ALLOC: a = AllocROMSpace(a, 2); break;
+                    case OP_NEG: a = -a; break;
+                    case OP_NOT: a = !a; break;
+                    default: a = ~a; break;
+                }
+                PUSH(a);
+                break;
+            default:
+                if (op < OP_LOR || op > OP_MUL) {
+                    goto corrupt;
+                }
+                POP(b);
+                POP(a);
+                switch (op) {
+                    case OP_LOR: a = a || b; break;
+                    case OP_LAND: a = a && b; break;
+                    case OP_OR: a |= b; break;
+                    case OP_XOR: a ^= b; break;
+                    case OP_AND: a &= b; break;
+                    case OP_EQ: a = a == b; break;
+                    case OP_NE: a = a != b; break;
+                    case OP_LE: a = a <= b; break;
+                    case OP_GE: a = a >= b; break;
+                    case OP_LT: a = a < b; break;
+                    case OP_GT: a = a > b; break;
+                    case OP_SHL: a = (b < 32) ? a << b : 0; break;
+                    case OP_SHR: a = (b < 32) ? a >> b : 0; break;
+                    case OP_ADD: a += b; break;
+                    case OP_SUB: a -= b; break;
+                    default: a *= b; break;
+                }
+                PUSH(a);
+                break;
+        }
+    }
+
+corrupt:
+    printf("\n    ERROR : corrupt patch script code at offset %" PRIu32 ".\n", pc - 1);
+    return 1;
+
+#undef NEED
+#undef POP
+#undef PUSH
+}
+
+//! Run the scripts given on the command line, after the patchset: their writes are checked against those of all the
+//  sections, theirs and the patchset's, and applied together. If a script fails, none of them is applied.
+static int RunScripts (void) {
+    uint32_t i, first = NbSections;
+    int ret = 0;
+
+    ScriptImageStart = ROM_base + UINT32_C(0x12000);
+    ScriptImageSize = BasecodeEnd() - ScriptImageStart;
+    if ((ScriptImage = (uint8_t *)malloc(ScriptImageSize)) == NULL) {
+        printf("\n    ERROR : not enough memory.\n");
+        return 1;
+    }
+    GetNBytes(ScriptImage, ScriptImageSize, ScriptImageStart);
+
+    BeginPhase();
+    for (i = 0; i < NbScripts && !ret; i++) {
+        printf("Running patch script '%s'\n", ScriptFileNames[i]);
+        ret = RunScript(ScriptBytecodes[i], ScriptBytecodeSizes[i]);
+    }
+    // Drop the staged writes of all the scripts.
+    if (ret) {
+        for (i = first; i < NbSections; i++) {
+            SectionSkipped[i] = 1;
+        }
+    }
+    ApplyPhase();
+    EndSections();
+
+    free(ScriptImage);
+    ScriptImage = NULL;
+    return ret;
+}
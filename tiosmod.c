@@ -32,8 +32,32 @@
 #define AMS_HARDCODE_FONTS_FLAG            (0x00000001)
 #define AMS_HARDCODE_ENGLISH_LANGUAGE_STR  "ams-hardcode-english-language"
 #define AMS_HARDCODE_ENGLISH_LANGUAGE_FLAG (0x00000002)
+#define AMS_FAST_XR_STRINGPTR_STR          "ams-fast-xr-stringptr"
+#define AMS_FAST_XR_STRINGPTR_FLAG         (0x00000010)
 #define AMS_REVERT_ZERO_POWER_ZERO_STR     "ams-revert-zero-power-zero"
 #define AMS_REVERT_ZERO_POWER_ZERO_FLAG    (0x00000004)
+#define AMS_REWRITE_INLINE_HEAPDEREF_STR   "ams-rewrite-inline-heapderef"
+#define AMS_REWRITE_INLINE_HEAPDEREF_FLAG  (0x00000008)
+#define AMS_PRESHIFT_FONTS_STR             "ams-preshift-fonts"
+#define AMS_PRESHIFT_FONTS_FLAG            (0x00000020)
+#define AMS_FAST_MEMORY_ROUTINES_STR       "ams-fast-memory-routines"
+#define AMS_FAST_MEMORY_ROUTINES_FLAG      (0x00000040)
+#define AMS_FAST_GRAPHICS_STR              "ams-fast-graphics"
+#define AMS_FAST_GRAPHICS_FLAG             (0x00000080)
+#define AMS_FAST_ESTACK_TRAVERSAL_STR      "ams-fast-estack-traversal"
+#define AMS_FAST_ESTACK_TRAVERSAL_FLAG     (0x00000100)
+#define AMS_FAST_FRAME_LOOKUP_STR          "ams-fast-frame-lookup"
+#define AMS_FAST_FRAME_LOOKUP_FLAG         (0x00000200)
+#define AMS_FAST_SYMFIND_STR               "ams-fast-symfind"
+#define AMS_FAST_SYMFIND_FLAG              (0x00000400)
+#define AMS_FAST_BLOCK_MOVES_STR           "ams-fast-block-moves"
+#define AMS_FAST_BLOCK_MOVES_FLAG          (0x00000800)
+#define AMS_FAST_BOOT_STR                  "ams-fast-boot"
+#define AMS_FAST_BOOT_FLAG                 (0x00001000)
+#define AMS_PROFILE_STR                    "ams-profile"
+#define AMS_PROFILE_FLAG                   (0x00002000)
+#define AMS_COUNT_CALLS_STR                "ams-count-calls"
+#define AMS_COUNT_CALLS_FLAG               (0x00004000)
 
 
 //! Calculator models
@@ -43,17 +67,31 @@ enum {TI89 = 3, TI92P = 1, V200 = 8, TI89T = 9};
 // The indices of ROM_CALLs used by this program
 #define DrawChar                     (0x1A4)
 #define DrawClipChar                 (0x191)
+#define DrawLine                     (0x1A7)
 #define DrawStr                      (0x1A9)
+#define EM_GC                        (0x15D)
 #define EM_GetArchiveMemoryBeginning (0x3CF)
 #define EV_runningApp                (0x45D)
 #define EX_stoBCD                    (0x0C0)
 #define FiftyMsecTick                (0x4FC)
+#define FindSymInFolder              (0x071)
+#define FontGetSys                   (0x18F)
+#define HeapCompress                 (0x095)
 #define HeapDeref                    (0x096)
 #define HeapTable                    (0x441)
 #define memcmp                       (0x270)
+// The other memory routines would clash with the C library.
+#define AMS_memcpy                   (0x26A)
+#define AMS_memmove                  (0x26B)
+#define AMS_memset                   (0x27C)
+#define next_expression_index        (0x10B)
 #define OO_Deref                     (0x3FB)
 #define OO_CondGetAttr               (0x3FA)
+#define OO_GetAttr                   (0x3FF)
+#define PortSet                      (0x1A2)
 #define ReleaseVersion               (0x440)
+#define ScreenClear                  (0x19E)
+#define ScrRectFill                  (0x189)
 #define sf_width                     (0x4D3)
 #define XR_stringPtr                 (0x293)
 #define OSContrastDn                 (0x297)
@@ -64,6 +102,52 @@ enum {TI89 = 3, TI92P = 1, V200 = 8, TI89T = 9};
 #define push_zstr                    (0x48A)
 #define push_exponentiate            (0x595)
 
+// Names of the ROM_CALLs above, for the symbol map and the instrumentation.
+typedef struct {
+    uint32_t idx;
+    const char *name;
+} NamedROMCall;
+
+#define NAMED_ROM_CALL(name) {name, #name}
+
+static const NamedROMCall KnownROMCalls[] = {
+    NAMED_ROM_CALL(DrawChar),
+    NAMED_ROM_CALL(DrawClipChar),
+    NAMED_ROM_CALL(DrawLine),
+    NAMED_ROM_CALL(DrawStr),
+    NAMED_ROM_CALL(EM_GC),
+    NAMED_ROM_CALL(EM_GetArchiveMemoryBeginning),
+    NAMED_ROM_CALL(EV_runningApp),
+    NAMED_ROM_CALL(EX_stoBCD),
+    NAMED_ROM_CALL(FiftyMsecTick),
+    NAMED_ROM_CALL(FindSymInFolder),
+    NAMED_ROM_CALL(FontGetSys),
+    NAMED_ROM_CALL(HeapCompress),
+    NAMED_ROM_CALL(HeapDeref),
+    NAMED_ROM_CALL(HeapTable),
+    NAMED_ROM_CALL(memcmp),
+    {AMS_memcpy, "memcpy"},
+    {AMS_memmove, "memmove"},
+    {AMS_memset, "memset"},
+    NAMED_ROM_CALL(next_expression_index),
+    NAMED_ROM_CALL(OO_Deref),
+    NAMED_ROM_CALL(OO_CondGetAttr),
+    NAMED_ROM_CALL(OO_GetAttr),
+    NAMED_ROM_CALL(PortSet),
+    NAMED_ROM_CALL(ReleaseVersion),
+    NAMED_ROM_CALL(ScreenClear),
+    NAMED_ROM_CALL(ScrRectFill),
+    NAMED_ROM_CALL(sf_width),
+    NAMED_ROM_CALL(XR_stringPtr),
+    NAMED_ROM_CALL(OSContrastDn),
+    NAMED_ROM_CALL(OSContrastUp),
+    NAMED_ROM_CALL(OSRegisterTimer),
+    NAMED_ROM_CALL(OSVFreeTimer),
+    NAMED_ROM_CALL(OSVRegisterTimer),
+    NAMED_ROM_CALL(push_zstr),
+    NAMED_ROM_CALL(push_exponentiate)
+};
+
 
 #define AdditionalSize (4 + 2 + 3 + 64)
 
@@ -92,12 +176,97 @@ static FILE *input;
 static FILE *output;
 static char * OutputFileName;
 static uint32_t OutputFileSize;
-static uint32_t SizeShrunk;
+static uint32_t SizeShrunk; // Wraps around when the basecode grew.
+
+
+// Free ROM space, as [start, end) ranges of absolute addresses, sorted by address.
+#define MAX_FREE_RANGES     (64)
+// Runs of 0xFF shorter than this are considered to be data.
+#define FREE_SPACE_MIN_RUN  (32)
+// Number of bytes left untouched at the beginning of each run, in case the last 0xFF bytes of the preceding data belong to it.
+#define FREE_SPACE_GUARD    (16)
+
+typedef struct {
+    uint32_t start;
+    uint32_t end;
+} FreeRange;
+
+static FreeRange FreeRanges[MAX_FREE_RANGES];
+static uint32_t NbFreeRanges;
+
+// Extents of the output file written to by the patcher, as [start, end) ranges of absolute addresses, sorted by
+// address, and the start addresses of the blocks of free ROM space reserved for new code and data, in reservation order.
+typedef struct {
+    uint32_t start;
+    uint32_t end;
+} PatchedRange;
+
+static PatchedRange *PatchedRanges;
+static uint32_t NbPatchedRanges;
+static uint32_t PatchedRangesAllocated;
+static uint32_t *InjectedBlocks;
+static uint32_t NbInjectedBlocks;
+static uint32_t InjectedBlocksAllocated;
+
+// The symbol map written after patching, if any.
+static char * MapFileName;
+// The flat ROM image written after patching, if any.
+static char * ROMFileName;
+// The undo journal written after patching, and the one used to rebuild the original of the input, if any.
+static char * UndoFileName;
+static char * RepatchFileName;
+
+// Writes of the numbered sections of the patchset, in program order. Within a phase, writes are staged here instead of
+// being applied to the output file, so that every section of the phase reads the pristine image; the phase is applied
+// once the writes of its sections were checked against each other and against the writes of the earlier sections.
+#define MAX_SECTIONS        (64)
+
+typedef struct {
+    uint32_t addr;
+    uint32_t order;
+    uint16_t section;
+    uint8_t  value;
+    uint8_t  staged;
+} SectionWrite;
+
+static SectionWrite *SectionWrites;
+static uint32_t NbSectionWrites;
+static uint32_t SectionWritesAllocated;
+static const char *SectionNames[MAX_SECTIONS];
+static uint8_t SectionSkipped[MAX_SECTIONS];
+static uint32_t NbSections;
+static int32_t CurrentSection = -1;
+static int StagingWrites;
+static uint32_t PhaseStart;
 
 
 // The function called by main() after opening an AMS update file and setting the base internal variables.
 void PatchAMS(void);
 
+// The function called by main() in analysis mode, after opening an AMS update file read-only and setting the base internal variables.
+void AnalyzeAMS(void);
+
+// The classes of input files told apart by IdentifyAMS, which are also the exit codes of the program.
+enum {AMS_PRISTINE = 0, AMS_PATCHED_SAME = 10, AMS_PATCHED_OTHER = 11, AMS_MODIFIED_UNKNOWN = 12};
+
+// The function called before copying the input file, right after SkipLicense: classify the input file from the
+// patch sites it knows, without a full pass over the file.
+int IdentifyAMS(void);
+
+// The lookups of the patchset which patch scripts can use.
+static uint32_t GetAMSTrap9Item (uint32_t idx);
+static uint32_t GetAMSTrapBFunction (uint32_t idx);
+
+// Symbols of a map file: one "address name" pair per line, the address in hexadecimal.
+typedef struct {
+    uint32_t address;
+    char name[48];
+} Symbol;
+
+// The function called by main() in decoding mode, on a dump of the RAM of a calculator running an OS patched with
+// instrumentation, and on the symbols of a map sorted by address (nbsyms is 0 without a map).
+void DecodeAMSRAM(const uint8_t *ram, uint32_t size, const Symbol *syms, uint32_t nbsyms);
+
 
 // Read data at the current file position.
 static uint8_t ReadByte (void) {
@@ -123,19 +292,111 @@ static uint32_t ReadLong (void) {
 }
 
 
+//! Record that the [start, end) range was written to, merging it with the overlapping and adjacent ranges.
+static void NotePatchedRange (uint32_t start, uint32_t end) {
+    uint32_t lo = 0, hi = NbPatchedRanges, mid, i;
+
+    // First range which ends at or after start.
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (PatchedRanges[mid].end < start) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    i = lo;
+    if (i < NbPatchedRanges && PatchedRanges[i].start <= end) {
+        if (start < PatchedRanges[i].start) {
+            PatchedRanges[i].start = start;
+        }
+        if (end > PatchedRanges[i].end) {
+            PatchedRanges[i].end = end;
+        }
+        while (i + 1 < NbPatchedRanges && PatchedRanges[i + 1].start <= PatchedRanges[i].end) {
+            if (PatchedRanges[i + 1].end > PatchedRanges[i].end) {
+                PatchedRanges[i].end = PatchedRanges[i + 1].end;
+            }
+            memmove(&PatchedRanges[i + 1], &PatchedRanges[i + 2], (NbPatchedRanges - i - 2) * sizeof(PatchedRanges[0]));
+            NbPatchedRanges--;
+        }
+        return;
+    }
+    if (NbPatchedRanges == PatchedRangesAllocated) {
+        PatchedRange *temp = (PatchedRange *)realloc(PatchedRanges, (PatchedRangesAllocated ? 2 * PatchedRangesAllocated : 256) * sizeof(PatchedRange));
+        if (temp == NULL) {
+            return;
+        }
+        PatchedRanges = temp;
+        PatchedRangesAllocated = PatchedRangesAllocated ? 2 * PatchedRangesAllocated : 256;
+    }
+    memmove(&PatchedRanges[i + 1], &PatchedRanges[i], (NbPatchedRanges - i) * sizeof(PatchedRanges[0]));
+    PatchedRanges[i].start = start;
+    PatchedRanges[i].end = end;
+    NbPatchedRanges++;
+}
+
+
+//! Record the n bytes about to be written at the current file position by the current section, if any.
+//  Return nonzero when the bytes were staged instead: the file position is then moved past them, as if written.
+static int NoteSectionWrite (const uint8_t *bytes, uint32_t n) {
+    uint32_t addr, i;
+
+    if (CurrentSection < 0) {
+        return 0;
+    }
+    addr = ftell(output) + delta;
+    for (i = 0; i < n; i++) {
+        if (NbSectionWrites == SectionWritesAllocated) {
+            SectionWrite *temp = (SectionWrite *)realloc(SectionWrites, (SectionWritesAllocated ? 2 * SectionWritesAllocated : 4096) * sizeof(SectionWrite));
+            if (temp == NULL) {
+                break;
+            }
+            SectionWrites = temp;
+            SectionWritesAllocated = SectionWritesAllocated ? 2 * SectionWritesAllocated : 4096;
+        }
+        SectionWrites[NbSectionWrites].addr = addr + i;
+        SectionWrites[NbSectionWrites].order = NbSectionWrites;
+        SectionWrites[NbSectionWrites].section = (uint16_t)CurrentSection;
+        SectionWrites[NbSectionWrites].value = bytes[i];
+        SectionWrites[NbSectionWrites].staged = (uint8_t)StagingWrites;
+        NbSectionWrites++;
+    }
+    if (StagingWrites) {
+        fseek(output, n, SEEK_CUR);
+    }
+    return StagingWrites;
+}
+
+
 // Write data at the current file position.
 static void WriteByte (uint8_t byte_in) {
+    if (NoteSectionWrite(&byte_in, 1)) {
+        return;
+    }
+    NotePatchedRange(ftell(output) + delta, ftell(output) + delta + 1);
     fputc (((int)byte_in) & 0xFF, output);
     fflush(output);
 }
 
 static void WriteShort (uint16_t short_in) {
+    uint8_t bytes[2] = {(uint8_t)(short_in >> 8), (uint8_t)short_in};
+    if (NoteSectionWrite(bytes, 2)) {
+        return;
+    }
+    NotePatchedRange(ftell(output) + delta, ftell(output) + delta + 2);
     fputc (((int)(short_in >> 8)) & 0xFF, output);
     fputc (((int)(short_in     )) & 0xFF, output);
     fflush(output);
 }
 
 static void WriteLong (uint32_t long_in) {
+    uint8_t bytes[4] = {(uint8_t)(long_in >> 24), (uint8_t)(long_in >> 16), (uint8_t)(long_in >> 8), (uint8_t)long_in};
+    if (NoteSectionWrite(bytes, 4)) {
+        return;
+    }
+    NotePatchedRange(ftell(output) + delta, ftell(output) + delta + 4);
     fputc (((int)(long_in >> 24)) & 0xFF, output);
     fputc (((int)(long_in >> 16)) & 0xFF, output);
     fputc (((int)(long_in >>  8)) & 0xFF, output);
@@ -251,277 +512,2122 @@ static uint32_t SearchBackwardsLong (uint32_t value) {
 
 
 
+//! Start the numbered section of the patchset with the given name: its writes are recorded until the next section.
+static void BeginSection (const char *name) {
+    if (NbSections == MAX_SECTIONS) {
+        CurrentSection = -1;
+        return;
+    }
+    SectionNames[NbSections] = name;
+    SectionSkipped[NbSections] = 0;
+    CurrentSection = NbSections++;
+}
+
+//! Stop recording writes: the code which follows does not belong to a numbered section.
+static void EndSections (void) {
+    CurrentSection = -1;
+}
+
+//! Start a phase: the writes of the sections which follow are staged until ApplyPhase.
+static void BeginPhase (void) {
+    StagingWrites = 1;
+    PhaseStart = NbSectionWrites;
+}
+
+static int CompareSectionWrites (const void *a, const void *b) {
+    const SectionWrite *w1 = (const SectionWrite *)a;
+    const SectionWrite *w2 = (const SectionWrite *)b;
+    if (w1->addr != w2->addr) {
+        return w1->addr < w2->addr ? -1 : 1;
+    }
+    return w1->order < w2->order ? -1 : (w1->order > w2->order);
+}
+
+//! Check the staged writes of the current phase against each other and against all the writes of the earlier
+//  sections, then apply them in program order. A section which writes other values than an earlier section to the
+//  same bytes is reported and skipped as a whole.
+static void ApplyPhase (void) {
+    SectionWrite *sorted;
+    uint32_t i, j, k;
+
+    StagingWrites = 0;
+    CurrentSection = -1;
+
+    sorted = (SectionWrite *)malloc(NbSectionWrites * sizeof(SectionWrite) + 1);
+    if (sorted == NULL) {
+        printf("\n    ERROR : not enough memory, the writes of the phase were not checked.\n");
+    }
+    else {
+        memcpy(sorted, SectionWrites, NbSectionWrites * sizeof(SectionWrite));
+        qsort(sorted, NbSectionWrites, sizeof(SectionWrite), CompareSectionWrites);
+        for (i = 0; i < NbSectionWrites; i = j) {
+            for (j = i + 1; j < NbSectionWrites && sorted[j].addr == sorted[i].addr; j++) {
+                // Only the staged writes can still be left out.
+                if (!sorted[j].staged || sorted[j].section == sorted[i].section || SectionSkipped[sorted[j].section]) {
+                    continue;
+                }
+                for (k = i; k < j; k++) {
+                    if (   sorted[k].section != sorted[j].section && !SectionSkipped[sorted[k].section]
+                        && sorted[k].value != sorted[j].value) {
+                        printf("Unexpected data, skipping section %s, which overwrites section %s at %06" PRIX32 " !\n",
+                               SectionNames[sorted[j].section], SectionNames[sorted[k].section], sorted[j].addr);
+                        SectionSkipped[sorted[j].section] = 1;
+                        break;
+                    }
+                }
+            }
+        }
+        free(sorted);
+    }
+
+    for (i = PhaseStart; i < NbSectionWrites; i++) {
+        if (SectionWrites[i].staged) {
+            SectionWrites[i].staged = 0;
+            if (!SectionSkipped[SectionWrites[i].section]) {
+                PutByte(SectionWrites[i].value, SectionWrites[i].addr);
+            }
+        }
+    }
+    PhaseStart = NbSectionWrites;
+}
+
+
 //! Get address of given ROM_CALL.
 static uint32_t rom_call_addr (uint32_t idx) {
     return GetLong(jmp_tbl + 4 * idx);
 }
 
-//! Compute checksum.
-static uint32_t ComputeAMSChecksum(uint32_t size, uint32_t start) {
+// MD5 (RFC 1321), for the signature of the basecode.
+typedef struct {
+    uint32_t state[4];
+    uint64_t length;
+    uint8_t buffer[64];
+} MD5Context;
+
+static const uint32_t MD5Sines[64] = {
+    0xD76AA478, 0xE8C7B756, 0x242070DB, 0xC1BDCEEE, 0xF57C0FAF, 0x4787C62A, 0xA8304613, 0xFD469501,
+    0x698098D8, 0x8B44F7AF, 0xFFFF5BB1, 0x895CD7BE, 0x6B901122, 0xFD987193, 0xA679438E, 0x49B40821,
+    0xF61E2562, 0xC040B340, 0x265E5A51, 0xE9B6C7AA, 0xD62F105D, 0x02441453, 0xD8A1E681, 0xE7D3FBC8,
+    0x21E1CDE6, 0xC33707D6, 0xF4D50D87, 0x455A14ED, 0xA9E3E905, 0xFCEFA3F8, 0x676F02D9, 0x8D2A4C8A,
+    0xFFFA3942, 0x8771F681, 0x6D9D6122, 0xFDE5380C, 0xA4BEEA44, 0x4BDECFA9, 0xF6BB4B60, 0xBEBFBC70,
+    0x289B7EC6, 0xEAA127FA, 0xD4EF3085, 0x04881D05, 0xD9D4D039, 0xE6DB99E5, 0x1FA27CF8, 0xC4AC5665,
+    0xF4292244, 0x432AFF97, 0xAB9423A7, 0xFC93A039, 0x655B59C3, 0x8F0CCC92, 0xFFEFF47D, 0x85845DD1,
+    0x6FA87E4F, 0xFE2CE6E0, 0xA3014314, 0x4E0811A1, 0xF7537E82, 0xBD3AF235, 0x2AD7D2BB, 0xEB86D391
+};
+
+static const uint8_t MD5Shifts[16] = {7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21};
+
+static void MD5Init (MD5Context *ctx) {
+    ctx->state[0] = UINT32_C(0x67452301);
+    ctx->state[1] = UINT32_C(0xEFCDAB89);
+    ctx->state[2] = UINT32_C(0x98BADCFE);
+    ctx->state[3] = UINT32_C(0x10325476);
+    ctx->length = 0;
+}
+
+static void MD5Block (MD5Context *ctx, const uint8_t *block) {
+    uint32_t w[16];
+    uint32_t a = ctx->state[0], b = ctx->state[1], c = ctx->state[2], d = ctx->state[3];
+    uint32_t f, g, temp;
+    uint32_t i;
+
+    for (i = 0; i < 16; i++) {
+        w[i] = block[4 * i] | (block[4 * i + 1] << 8) | (block[4 * i + 2] << 16) | ((uint32_t)block[4 * i + 3] << 24);
+    }
+    for (i = 0; i < 64; i++) {
+        switch (i >> 4) {
+            case 0:  f = (b & c) | (~b & d); g = i;                break;
+            case 1:  f = (d & b) | (~d & c); g = (5 * i + 1) & 15; break;
+            case 2:  f = b ^ c ^ d;          g = (3 * i + 5) & 15; break;
+            default: f = c ^ (b | ~d);       g = (7 * i) & 15;     break;
+        }
+        temp = a + f + MD5Sines[i] + w[g];
+        a = d;
+        d = c;
+        c = b;
+        b += (temp << MD5Shifts[(i >> 4) * 4 + (i & 3)]) | (temp >> (32 - MD5Shifts[(i >> 4) * 4 + (i & 3)]));
+    }
+    ctx->state[0] += a;
+    ctx->state[1] += b;
+    ctx->state[2] += c;
+    ctx->state[3] += d;
+}
+
+static void MD5Update (MD5Context *ctx, const uint8_t *data, uint32_t n) {
+    uint32_t used = (uint32_t)(ctx->length & 63);
+
+    ctx->length += n;
+    while (n > 0) {
+        ctx->buffer[used++] = *data++;
+        n--;
+        if (used == 64) {
+            MD5Block(ctx, ctx->buffer);
+            used = 0;
+        }
+    }
+}
+
+static void MD5Final (MD5Context *ctx, uint8_t digest[16]) {
+    uint64_t bits = ctx->length * 8;
+    uint8_t temp[8];
+    uint32_t i;
+
+    temp[0] = 0x80;
+    MD5Update(ctx, temp, 1);
+    temp[0] = 0;
+    while ((ctx->length & 63) != 56) {
+        MD5Update(ctx, temp, 1);
+    }
+    for (i = 0; i < 8; i++) {
+        temp[i] = (uint8_t)(bits >> (8 * i));
+    }
+    MD5Update(ctx, temp, 8);
+    for (i = 0; i < 16; i++) {
+        digest[i] = (uint8_t)(ctx->state[i >> 2] >> (8 * (i & 3)));
+    }
+}
+
+
+//! Compute checksum, and feed the checksummed bytes to md5 unless it is NULL.
+static uint32_t ComputeAMSChecksum(uint32_t size, uint32_t start, MD5Context *md5) {
     uint16_t temp;
     uint32_t temp2 = 0;
+    uint8_t bytes[2];
     Seek(start);
     while (size > 0) {
         temp = ReadShort();
         temp2 += (uint32_t)temp;
         size -= 2;
+        if (md5 != NULL) {
+            bytes[0] = (uint8_t)(temp >> 8);
+            bytes[1] = (uint8_t)temp;
+            MD5Update(md5, bytes, 2);
+        }
     }
     return temp2;
 }
 
 
-//! Find **TIFL** in .xxu file.
-static int FindTIFL (FILE *file) {
-    char *point;
-    point = (char *)malloc(0xA008);
-    if (!point) {
-        printf("\n    ERROR : not enough memory.\n");
-        return 1;
+//! Give back the [start, end) range to the free ROM space pool, merging it with adjacent ranges.
+static void FreeROMSpace (uint32_t start, uint32_t end) {
+    uint32_t i;
+
+    if (start >= end) {
+        return;
     }
-    fseek (file, 0, SEEK_SET);
-    fread (point, 1, 0xA000, file);
-    for (; I < 0xA000; I++) {
-        if (point[I+0] == '*' &&
-            point[I+1] == '*' &&
-            point[I+2] == 'T' &&
-            point[I+3] == 'I' &&
-            point[I+4] == 'F' &&
-            point[I+5] == 'L' &&
-            point[I+6] == '*' &&
-            point[I+7] == '*'
-           ) {
-            free (point);
-            return 0;
+    for (i = 0; i < NbFreeRanges && FreeRanges[i].start < start; i++);
+    if (i > 0 && FreeRanges[i - 1].end == start) {
+        FreeRanges[i - 1].end = end;
+        if (i < NbFreeRanges && FreeRanges[i].start == end) {
+            FreeRanges[i - 1].end = FreeRanges[i].end;
+            memmove(&FreeRanges[i], &FreeRanges[i + 1], (NbFreeRanges - i - 1) * sizeof(FreeRanges[0]));
+            NbFreeRanges--;
         }
     }
-    free (point);
-    return 1;
-}
-
-
-static int SkipLicense(void) {
-    char buffer[30];
-
-    // Find our way into the file, several sanity checks.
-    fread (buffer, 1, sizeof("**TIFL**")-1, input);
-    if (strncmp (buffer, "**TIFL**", sizeof("**TIFL**")-1)) {
-WrongType:
-        printf ("\n    ERROR : wrong input file type.\n"\
-        "    Use .89u, .9xu or .v2u ROM files.\n");
-        fclose(input);
-        return 3;
+    else if (i < NbFreeRanges && FreeRanges[i].start == end) {
+        FreeRanges[i].start = start;
     }
+    else if (NbFreeRanges < MAX_FREE_RANGES) {
+        memmove(&FreeRanges[i + 1], &FreeRanges[i], (NbFreeRanges - i) * sizeof(FreeRanges[0]));
+        FreeRanges[i].start = start;
+        FreeRanges[i].end = end;
+        NbFreeRanges++;
+    }
+}
 
-    fseek (input, 0x11, SEEK_SET);
-    fread (buffer, 1, sizeof("basecode")-1, input);
+//! Find the runs of 0xFF bytes in [start, end) and add them to the free ROM space pool.
+static void ScanFreeROMSpace (uint32_t start, uint32_t end) {
+    uint32_t runstart = 0;
+    uint32_t addr;
 
-    if (!strncmp (buffer, "License", sizeof("License") - 1)) {
-        I = 0x11;
-        if (FindTIFL(input)) {
-            goto WrongType;
+    Seek(start);
+    for (addr = start; addr <= end; addr++) {
+        if (addr < end && ReadByte() == 0xFF) {
+            if (runstart == 0) {
+                runstart = addr;
+            }
         }
-        HEAD = I + 17;
-        fseek (input, I + 17, SEEK_SET);
-        printf("\tINFO: found %" PRIu32 " bytes of license at the beginning of the file\n",I);
-        fread (buffer, 1, sizeof ("basecode")-1, input);
-        if (strncmp (buffer, "basecode", sizeof ("basecode") - 1)) {
-            goto WrongType;
+        else if (runstart != 0) {
+            if (addr - runstart >= FREE_SPACE_MIN_RUN) {
+                FreeROMSpace(runstart + FREE_SPACE_GUARD, addr);
+            }
+            runstart = 0;
         }
     }
-    else {
-        HEAD = 17;
-        if (strncmp (buffer, "basecode", sizeof("basecode") - 1)) {
-            goto WrongType;
+}
+
+//! Reserve size bytes of free ROM space aligned on align bytes (a power of two), return 0 on failure.
+//  The smallest range that fits is chosen, so that large ranges remain available for large blocks.
+//  Callers which reserved more than they eventually used should give the tail back through FreeROMSpace.
+static uint32_t AllocROMSpace (uint32_t size, uint32_t align) {
+    uint32_t i, best = NbFreeRanges;
+    uint32_t aligned, bestaligned = 0;
+    uint32_t start, end;
+
+    for (i = 0; i < NbFreeRanges; i++) {
+        aligned = (FreeRanges[i].start + align - 1) & ~(align - 1);
+        if (aligned + size <= FreeRanges[i].end) {
+            if (   best == NbFreeRanges
+                || FreeRanges[i].end - FreeRanges[i].start < FreeRanges[best].end - FreeRanges[best].start) {
+                best = i;
+                bestaligned = aligned;
+            }
         }
     }
+    if (best == NbFreeRanges) {
+        printf("\n    ERROR : not enough free ROM space for %" PRIu32 " bytes.\n", size);
+        return 0;
+    }
 
-    HEAD += 61;
-    fseek (input, 0x16+HEAD, SEEK_SET);
-    fread (buffer, 1, 29, input);
-    if (strncmp (buffer, "Advanced Mathematics Software", sizeof("Advanced Mathematics Software") - 1)) {
-        goto WrongType;
+    // Remove the range, then give back the alignment padding and the remainder.
+    start = FreeRanges[best].start;
+    end = FreeRanges[best].end;
+    memmove(&FreeRanges[best], &FreeRanges[best + 1], (NbFreeRanges - best - 1) * sizeof(FreeRanges[0]));
+    NbFreeRanges--;
+    FreeROMSpace(start, bestaligned);
+    FreeROMSpace(bestaligned + size, end);
+
+    if (NbInjectedBlocks == InjectedBlocksAllocated) {
+        uint32_t *temp = (uint32_t *)realloc(InjectedBlocks, (InjectedBlocksAllocated ? 2 * InjectedBlocksAllocated : 64) * sizeof(uint32_t));
+        if (temp != NULL) {
+            InjectedBlocks = temp;
+            InjectedBlocksAllocated = InjectedBlocksAllocated ? 2 * InjectedBlocksAllocated : 64;
+        }
+    }
+    if (NbInjectedBlocks < InjectedBlocksAllocated) {
+        InjectedBlocks[NbInjectedBlocks++] = bestaligned;
     }
 
-    fseek (input, 2+ HEAD, SEEK_SET);
-    fread (buffer, 1, 4, input);
-    BasecodeSize =   UINT32_C(0x0000001) * (unsigned char)buffer[3]
-                   + UINT32_C(0x0000100) * (unsigned char)buffer[2]
-                   + UINT32_C(0x0010000) * (unsigned char)buffer[1]
-                   + UINT32_C(0x1000000) * (unsigned char)buffer[0];
-    printf("\tINFO: found AMS of size %" PRIu32 " (0x%" PRIX32 ")\n", BasecodeSize, BasecodeSize);
+    return bestaligned;
+}
 
-    return 0;
+//! Get the number of free ROM bytes left, and the size of the largest free block.
+static uint32_t FreeROMSpaceLeft (uint32_t *largest) {
+    uint32_t i, total = 0;
+
+    *largest = 0;
+    for (i = 0; i < NbFreeRanges; i++) {
+        total += FreeRanges[i].end - FreeRanges[i].start;
+        if (FreeRanges[i].end - FreeRanges[i].start > *largest) {
+            *largest = FreeRanges[i].end - FreeRanges[i].start;
+        }
+    }
+    return total;
 }
 
 
-static int AMSSanityChecks(void) {
-    uint32_t expectedSize;
+// Blocks of data which can be moved elsewhere in ROM.
+#define MAX_MOVABLE_BLOCKS  (64)
+// The basecode is followed by a 4-byte checksum and a 67-byte signature.
+#define BASECODE_TAIL_SIZE  (4 + 67)
+#define FLASH_SECTOR_SIZE   UINT32_C(0x10000)
 
-    // Check calculator type
-    fseek (input, 8+HEAD, SEEK_SET);
-    CalculatorType = fgetc(input);
-    printf("\tINFO: found calculator type %" PRIu8 "\n", CalculatorType);
-    if ((CalculatorType != TI89) && (CalculatorType != TI92P) && (CalculatorType != V200) && (CalculatorType != TI89T)) {
-        printf("\n    ERROR: unknown calculator type, aborting...\n");
-        fclose(input);
-        return 4;
-    }
+typedef struct {
+    uint32_t addr;
+    uint32_t size;
+    uint32_t refs[2];       // Absolute addresses of the longwords pointing to the block, 0 if unused.
+    uint8_t  fixups[2][2];  // {offset of a longword in the block, offset in the block it points to}, {0, 0} if unused.
+} MovableBlock;
 
-    // Get AMS version.
-    fgetc(input);
-    fgetc(input);
-    I = fgetc(input);
-    printf("\tINFO: found AMS version type %" PRIu32 "\n", I);
+//! Compute the FNV-1a hash of n bytes.
+static uint32_t HashBytes (const uint8_t *buffer, uint32_t n) {
+    uint32_t hash = UINT32_C(0x811C9DC5);
+    uint32_t i;
 
-    // Check size.
-    // Starting at 12, TI didn't bother incrementing the version number properly...
-    if (I == 9) {
-        if (CalculatorType == TI89) expectedSize = 0x124772;
-        else if (CalculatorType == TI92P) expectedSize = 0x123F8E;
-        else goto SizeError;
-    }
-    else if (I == 11) {
-        if (CalculatorType == TI89) expectedSize = 0x12E01A;
-        else if (CalculatorType == TI92P) expectedSize = 0x12D96A;
-        else if (CalculatorType == V200) expectedSize = 0x12DBEE;
-        else goto SizeError;
-    }
-    else if (I == 12) {
-        if (CalculatorType == TI89) expectedSize = 0x12E2FE;
-        else if (CalculatorType == TI92P) expectedSize = 0x12DC4E;
-        else if (CalculatorType == V200) expectedSize = 0;
-        else goto SizeError;
-    }
-    else if (I == 13) {
-        if (CalculatorType == TI89T) expectedSize = 0x14565A;
-        else if (CalculatorType == V200) expectedSize = 0x148D3A;
-        else goto SizeError;
-    }
-    else if (I == 14) {
-        if (CalculatorType == TI89T) expectedSize = 0x155C3E;
-        else goto SizeError;
-    }
-    else {
-        printf ("\n    ERROR : unsupported AMS version.\n"
-                "    Use AMS 2.05, 2.08, 2.09, 3.01 or 3.10.\n"
-                "    If you really need another version, please contact the author.\n"
-               );
-        fclose (input);
-        return 5;
+    for (i = 0; i < n; i++) {
+        hash ^= buffer[i];
+        hash *= UINT32_C(0x01000193);
     }
+    return hash;
+}
 
-    // Special case: multiple versions bear the same version number.
-    if (CalculatorType == V200 && I == 12) {
-        if (BasecodeSize != 0x12DECA && BasecodeSize != 0x1393F6) {
-            goto SizeError;
+//! Compare n bytes (memcmp is a ROM_CALL index here).
+static int SameBytes (const uint8_t *buffer, const uint8_t *buffer2, uint32_t n) {
+    while (n-- > 0) {
+        if (*buffer++ != *buffer2++) {
+            return 0;
         }
     }
-    else {
-        if (BasecodeSize != expectedSize) {
-SizeError:
-            printf ("\n    ERROR: unexpected size 0x%" PRIX32 " in file, aborting...\n", BasecodeSize);
-            fclose(input);
-            return 6;
+    return 1;
+}
+
+//! Hash the contents of each block, 0 for blocks which must not be shared: those which contain pointers to themselves,
+//  and those without known absolute references, which are reached relative to their neighbours.
+static void HashBlocks (const MovableBlock *blocks, uint32_t n, uint32_t *hashes) {
+    uint8_t buffer[256];
+    uint32_t i;
+
+    for (i = 0; i < n; i++) {
+        hashes[i] = 0;
+        if (blocks[i].fixups[0][0] == 0 && blocks[i].refs[0] != 0 && blocks[i].size <= sizeof(buffer)) {
+            GetNBytes(buffer, blocks[i].size, blocks[i].addr);
+            hashes[i] = HashBytes(buffer, blocks[i].size) | 1;
         }
     }
-
-    return 0;
 }
 
+//! Get the index of an earlier block with the same contents as block i, or i if there is none.
+static uint32_t FindIdenticalBlock (const MovableBlock *blocks, const uint32_t *hashes, uint32_t i) {
+    uint8_t buffer[256];
+    uint8_t buffer2[256];
+    uint32_t j;
+
+    if (hashes[i] != 0) {
+        for (j = 0; j < i; j++) {
+            if (hashes[j] == hashes[i] && blocks[j].size == blocks[i].size) {
+                GetNBytes(buffer, blocks[i].size, blocks[i].addr);
+                GetNBytes(buffer2, blocks[j].size, blocks[j].addr);
+                if (SameBytes(buffer, buffer2, blocks[i].size)) {
+                    return j;
+                }
+            }
+        }
+    }
+    return i;
+}
 
-static int CreateFillOutputFileAMS(int argc, char *argv[]) {
-    uint32_t i;
+//! Copy blocks [first, n) to dest, update the references to them, return the number of bytes written.
+//  Blocks identical to an earlier block are not copied: the references to them are redirected to the earlier block.
+static uint32_t MoveBlocks (const MovableBlock *blocks, uint32_t first, uint32_t n, uint32_t dest) {
+    uint8_t buffer[256];
+    uint32_t newaddr[MAX_MOVABLE_BLOCKS];
+    uint32_t hashes[MAX_MOVABLE_BLOCKS];
+    uint32_t i, j;
+    uint32_t start = dest;
 
-    OutputFileName = argv[argc - 1];
-    printf ("    Creating output file '%s'...\n", OutputFileName);
-    if ((output = fopen (OutputFileName, "rb")) != NULL) {
-        printf ("\n    ERROR : file '%s' already exists. Refusing to overwrite it.", OutputFileName);
-        fclose(output);
-        fclose(input);
-        return 7;
+    HashBlocks(blocks, n, hashes);
+    for (i = 0; i < n; i++) {
+        newaddr[i] = blocks[i].addr;
+        if (i < first) {
+            continue;
+        }
+        j = FindIdenticalBlock(blocks, hashes, i);
+        if (j != i) {
+            newaddr[i] = newaddr[j];
+        }
+        else {
+            GetNBytes(buffer, blocks[i].size, blocks[i].addr);
+            PutNBytes(buffer, blocks[i].size, dest);
+            for (j = 0; j < 2; j++) {
+                if (blocks[i].fixups[j][0] != 0) {
+                    PutLong(dest + blocks[i].fixups[j][1], dest + blocks[i].fixups[j][0]);
+                }
+            }
+            newaddr[i] = dest;
+            dest += blocks[i].size;
+        }
+        for (j = 0; j < 2; j++) {
+            if (blocks[i].refs[j] != 0) {
+                PutLong(newaddr[i], blocks[i].refs[j]);
+            }
+        }
     }
+    return dest - start;
+}
 
-    if ((output = fopen (OutputFileName, "w+b"))==NULL) {
-        printf ("\n    ERROR : can't create '%s'.\n", OutputFileName);
-        fclose (input);
-        return 8;
-    }
+//! Move the checksum and signature from the end of the basecode to newpos, and update the size fields accordingly.
+//  Moving them up extends the basecode, the new space is filled with 0xFF.
+static void MoveBasecodeTail (uint32_t newpos) {
+    uint8_t buffer[BASECODE_TAIL_SIZE];
+    uint32_t oldpos = ROM_base + UINT32_C(0x12000) + BasecodeSize - SizeShrunk;
+    uint32_t temp;
 
-    OutputFileSize = BasecodeSize + HEAD + AdditionalSize;
-    printf("\tINFO: copying %" PRIu32 " bytes to output file\n", OutputFileSize);
-    fseek (input, 0, SEEK_SET);
-    for (i = 0; i < OutputFileSize; i++) {
-        fputc (fgetc (input), output);
+    GetNBytes(buffer, BASECODE_TAIL_SIZE, oldpos);
+    Seek(oldpos);
+    for (temp = oldpos; temp < newpos; temp++) {
+        WriteByte(0xFF);
     }
+    PutNBytes(buffer, BASECODE_TAIL_SIZE, newpos);
+
+    // Update length of field 8000.
+    SizeShrunk += oldpos - newpos;
+    temp = GetLong(ROM_base + UINT32_C(0x12002));
+    temp -= oldpos - newpos;
+    PutLong(temp, ROM_base + UINT32_C(0x12002));
+    // Update length of field 8070 as well (spotted by RabbitSign).
+    temp -= 126;
+    PutLong(temp, ROM_base + UINT32_C(0x12080));
+}
 
-    fclose(input);
+//! Get the absolute address of the first byte after the basecode, its checksum and its signature.
+static uint32_t BasecodeEnd (void) {
+    return ROM_base + UINT32_C(0x12000) + BasecodeSize - SizeShrunk + BASECODE_TAIL_SIZE;
+}
 
-    return 0;
+//! Get the number of unused bytes between the end of the basecode and the end of its last Flash sector.
+static uint32_t BasecodeSlack (void) {
+    uint32_t end = BasecodeEnd();
+    return ((end + FLASH_SECTOR_SIZE - 1) & ~(FLASH_SECTOR_SIZE - 1)) - end;
 }
 
+//! Extend the basecode by size bytes into the unused end of its last Flash sector, which costs no archive memory.
+//  Return the address of the new space, or 0 if there is not enough room.
+static uint32_t GrowBasecode (uint32_t size) {
+    uint32_t start = BasecodeEnd() - BASECODE_TAIL_SIZE;
 
-static int SetupAMS(int argc, char *argv[]) {
-    uint32_t temp, temp2;
-    int i;
+    if (size > BasecodeSlack()) {
+        return 0;
+    }
+    MoveBasecodeTail(start + size);
+    return start;
+}
 
-    i = SkipLicense();
-    if (i) {
-        return i;
+//! Print how much of each 64 KB Flash sector the basecode uses, and how much of it is free ROM space.
+static void PrintSectorOccupancy (void) {
+    uint32_t sector, start, end, used, freebytes, i;
+    uint32_t basestart = ROM_base + UINT32_C(0x12000);
+    uint32_t baseend = BasecodeEnd();
+
+    printf("\tsector   used    free\n");
+    for (sector = basestart & ~(FLASH_SECTOR_SIZE - 1); sector < baseend; sector += FLASH_SECTOR_SIZE) {
+        start = sector < basestart ? basestart : sector;
+        end = sector + FLASH_SECTOR_SIZE > baseend ? baseend : sector + FLASH_SECTOR_SIZE;
+        used = end - start;
+        freebytes = 0;
+        for (i = 0; i < NbFreeRanges; i++) {
+            if (FreeRanges[i].start < end && FreeRanges[i].end > start) {
+                freebytes +=   (FreeRanges[i].end > end ? end : FreeRanges[i].end)
+                             - (FreeRanges[i].start < start ? start : FreeRanges[i].start);
+            }
+        }
+        printf("\t%06" PRIX32 "   %5" PRIu32 "   %5" PRIu32 "\n", sector, used, freebytes);
     }
+}
 
-    i = AMSSanityChecks();
-    if (i) {
-        return i;
+//! Find the fewest trailing blocks whose relocation makes the basecode fit in one less Flash sector.
+//  Return the index of the first block to move, or n if that cannot be done with these blocks and the free ROM space.
+static uint32_t PlanSectors (const MovableBlock *blocks, uint32_t n, uint32_t *needed) {
+    uint32_t baseend = BasecodeEnd();
+    uint32_t boundary = (baseend - 1) & ~(FLASH_SECTOR_SIZE - 1);
+    uint32_t hashes[MAX_MOVABLE_BLOCKS];
+    uint32_t i, k, largest;
+
+    *needed = 0;
+    if (n == 0 || blocks[n - 1].addr + blocks[n - 1].size != baseend - BASECODE_TAIL_SIZE) {
+        printf("\tINFO: no movable blocks at the end of the basecode.\n");
+        return n;
     }
-    
-    i = CreateFillOutputFileAMS(argc, argv);
-    if (i) {
+    for (k = n; k > 0 && blocks[k - 1].addr + BASECODE_TAIL_SIZE > boundary; k--);
+    if (k == 0) {
+        printf("\tINFO: moving all %" PRIu32 " blocks is not enough, %" PRIu32 " more bytes would need to be moved.\n",
+               n, blocks[0].addr + BASECODE_TAIL_SIZE - boundary);
+        return n;
+    }
+    k--;
+    HashBlocks(blocks, n, hashes);
+    for (i = k; i < n; i++) {
+        if (FindIdenticalBlock(blocks, hashes, i) == i) {
+            *needed += blocks[i].size;
+        }
+    }
+    FreeROMSpaceLeft(&largest);
+    if (*needed > largest) {
+        printf("\tINFO: moving blocks from %06" PRIX32 " on needs %" PRIu32 " bytes of free ROM space, only %" PRIu32 " available.\n",
+               blocks[k].addr, *needed, largest);
+        return n;
+    }
+    printf("\tINFO: moving %" PRIu32 " blocks from %06" PRIX32 " on (%" PRIu32 " bytes of free ROM space) ends the basecode at %06" PRIX32 ",\n"
+           "\t      which gives back %" PRIu32 " KB of archive memory.\n",
+           n - k, blocks[k].addr, *needed, blocks[k].addr + BASECODE_TAIL_SIZE, FLASH_SECTOR_SIZE / 1024);
+    return k;
+}
+
+
+// Absolute references (aligned longwords) to the basecode, sorted by target.
+typedef struct {
+    uint32_t target;
+    uint32_t site;
+} AbsRef;
+
+static AbsRef *AbsRefs;
+static uint32_t NbAbsRefs;
+
+static int CompareAbsRefs (const void *a, const void *b) {
+    const AbsRef *r1 = (const AbsRef *)a;
+    const AbsRef *r2 = (const AbsRef *)b;
+    if (r1->target != r2->target) {
+        return r1->target < r2->target ? -1 : 1;
+    }
+    return r1->site < r2->site ? -1 : (r1->site > r2->site);
+}
+
+//! Read the whole basecode into a newly allocated buffer.
+static uint8_t * ReadBasecode (uint32_t *size) {
+    uint8_t *buffer;
+
+    *size = BasecodeEnd() - ROM_base - UINT32_C(0x12000);
+    buffer = (uint8_t *)malloc(*size);
+    if (!buffer) {
+        printf("\n    ERROR : not enough memory.\n");
+        return NULL;
+    }
+    GetNBytes(buffer, *size, ROM_base + UINT32_C(0x12000));
+    return buffer;
+}
+
+//! Index all aligned longwords of the basecode whose value points into the basecode.
+//  Some of them are bound to be code which merely looks like an address, so this is meant for data analysis.
+static int BuildAbsRefIndex (const uint8_t *basecode, uint32_t size) {
+    uint32_t i, value, allocated = 4096;
+    uint32_t start = ROM_base + UINT32_C(0x12000);
+
+    free(AbsRefs);
+    NbAbsRefs = 0;
+    AbsRefs = (AbsRef *)malloc(allocated * sizeof(AbsRef));
+    if (!AbsRefs) {
+        goto NoMemory;
+    }
+    for (i = 0; i + 4 <= size; i += 2) {
+        value = ((uint32_t)basecode[i] << 24) | ((uint32_t)basecode[i + 1] << 16) | ((uint32_t)basecode[i + 2] << 8) | basecode[i + 3];
+        if (value >= start && value < start + size) {
+            if (NbAbsRefs == allocated) {
+                AbsRef *temp = (AbsRef *)realloc(AbsRefs, 2 * allocated * sizeof(AbsRef));
+                if (!temp) {
+                    goto NoMemory;
+                }
+                AbsRefs = temp;
+                allocated *= 2;
+            }
+            AbsRefs[NbAbsRefs].target = value;
+            AbsRefs[NbAbsRefs].site = start + i;
+            NbAbsRefs++;
+        }
+    }
+    qsort(AbsRefs, NbAbsRefs, sizeof(AbsRef), CompareAbsRefs);
+    return 0;
+
+NoMemory:
+    printf("\n    ERROR : not enough memory.\n");
+    free(AbsRefs);
+    AbsRefs = NULL;
+    NbAbsRefs = 0;
+    return 1;
+}
+
+//! Get the index of the first absolute reference to target or beyond, in O(log n).
+static uint32_t FindAbsRef (uint32_t target) {
+    uint32_t low = 0, high = NbAbsRefs, mid;
+
+    while (low < high) {
+        mid = (low + high) / 2;
+        if (AbsRefs[mid].target < target) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+
+// Small referenced data objects (strings, bitmaps, dialog and menu resources...).
+#define MAX_DATA_OBJECT_SIZE (512)
+
+typedef struct {
+    uint32_t addr;
+    uint32_t size;
+    uint32_t hash;
+    uint32_t nbrefs;
+    uint8_t  isstring;
+} DataObject;
+
+static int CompareDataObjects (const void *a, const void *b) {
+    const DataObject *o1 = (const DataObject *)a;
+    const DataObject *o2 = (const DataObject *)b;
+    if (o1->size != o2->size) {
+        return o1->size < o2->size ? -1 : 1;
+    }
+    if (o1->hash != o2->hash) {
+        return o1->hash < o2->hash ? -1 : 1;
+    }
+    return o1->addr < o2->addr ? -1 : (o1->addr > o2->addr);
+}
+
+//! Find the groups of identical referenced data objects, print them, return the number of bytes which folding them would reclaim.
+//  An object starts at the target of an absolute reference, and ends at the next target, or after the terminating NUL for strings.
+static uint32_t FindDuplicateData (void) {
+    uint8_t *basecode;
+    DataObject *objects;
+    uint32_t size, nbobjects = 0, i, j, k, len, next;
+    uint32_t start = ROM_base + UINT32_C(0x12000);
+    uint32_t reclaimed = 0, groups = 0;
+
+    basecode = ReadBasecode(&size);
+    if (!basecode) {
+        return 0;
+    }
+    if (BuildAbsRefIndex(basecode, size)) {
+        free(basecode);
+        return 0;
+    }
+    objects = (DataObject *)malloc((NbAbsRefs + 1) * sizeof(DataObject));
+    if (!objects) {
+        printf("\n    ERROR : not enough memory.\n");
+        free(basecode);
+        return 0;
+    }
+
+    for (i = 0; i < NbAbsRefs; i = j) {
+        j = FindAbsRef(AbsRefs[i].target + 1);
+        next = (j < NbAbsRefs) ? AbsRefs[j].target : start + size;
+        objects[nbobjects].addr = AbsRefs[i].target;
+        objects[nbobjects].nbrefs = j - i;
+        // Strings: printable characters up to a terminating NUL.
+        for (len = 0; AbsRefs[i].target - start + len < size && len < MAX_DATA_OBJECT_SIZE; len++) {
+            uint8_t c = basecode[AbsRefs[i].target - start + len];
+            if (c == 0 || ((c < 0x20 || c > 0x7E) && c < 0x80)) {
+                break;
+            }
+        }
+        if (len >= 2 && AbsRefs[i].target - start + len < size && basecode[AbsRefs[i].target - start + len] == 0) {
+            // A string which another reference points into is not folded, it shares its tail.
+            if (next <= AbsRefs[i].target + len) {
+                continue;
+            }
+            objects[nbobjects].size = len + 1;
+            objects[nbobjects].isstring = 1;
+        }
+        else {
+            objects[nbobjects].size = next - AbsRefs[i].target;
+            objects[nbobjects].isstring = 0;
+            if (objects[nbobjects].size < 4 || objects[nbobjects].size > MAX_DATA_OBJECT_SIZE) {
+                continue;
+            }
+        }
+        objects[nbobjects].hash = HashBytes(basecode + AbsRefs[i].target - start, objects[nbobjects].size);
+        nbobjects++;
+    }
+
+    qsort(objects, nbobjects, sizeof(DataObject), CompareDataObjects);
+    for (i = 0; i < nbobjects; i = j) {
+        for (j = i + 1; j < nbobjects && objects[j].size == objects[i].size && objects[j].hash == objects[i].hash; j++);
+        k = 0;
+        for (next = i + 1; next < j; next++) {
+            if (SameBytes(basecode + objects[i].addr - start, basecode + objects[next].addr - start, objects[i].size)) {
+                if (k++ == 0) {
+                    groups++;
+                    printf("\t%4" PRIu32 " bytes: %06" PRIX32 " (%" PRIu32 " refs)", objects[i].size, objects[i].addr, objects[i].nbrefs);
+                }
+                printf(", %06" PRIX32 " (%" PRIu32 " refs)", objects[next].addr, objects[next].nbrefs);
+                reclaimed += objects[i].size;
+            }
+        }
+        if (k != 0) {
+            if (objects[i].isstring) {
+                printf(" \"%s\"", (const char *)basecode + objects[i].addr - start);
+            }
+            printf("\n");
+        }
+    }
+    printf("\tINFO: %" PRIu32 " groups of identical data objects, folding them would reclaim %" PRIu32 " bytes.\n", groups, reclaimed);
+
+    free(objects);
+    free(basecode);
+    return reclaimed;
+}
+
+
+// The 68000 instruction decoder and the code cross-reference index.
+#include "m68k.c"
+// The 68000 interpreter used to check and time generated code.
+#include "m68ksim.c"
+
+
+// Sections of TI-68k container files (.89u, .9xu, .v2u, .89k...): a 78-byte header starting with "**TIFL**", then
+// the data. The header holds the name (length at 0x10, up to 8 characters at 0x11), the device type (0x30), the data
+// type (0x31: 0x23 OS, 0x24 FlashApp, 0x20 certificate, 0x3E license) and the little-endian data length (0x4A).
+#define TIFL_HEADER_SIZE    (78)
+#define MAX_TIFL_SECTIONS   (32)
+// Bytes read at a time when scanning damaged files.
+#define TIFL_SCAN_CHUNK     (0x10000)
+
+typedef struct {
+    uint32_t offset;    // Of the header, the data follows it.
+    uint32_t size;      // Of the data.
+    uint8_t  device;
+    uint8_t  type;
+    uint8_t  recovered; // Found by scanning, after damaged or unexpected data.
+    char     name[9];
+} TIFLSection;
+
+//! Find the next "**TIFL**" in [offset, size) of file, return its offset, or size when there is none.
+//  memchr, which C libraries vectorize, skips to the candidates.
+static uint32_t SearchTIFL (FILE *file, uint32_t offset, uint32_t size) {
+    uint8_t *buffer, *p;
+    uint32_t n;
+
+    buffer = (uint8_t *)malloc(TIFL_SCAN_CHUNK + 7);
+    if (!buffer) {
+        printf("\n    ERROR : not enough memory.\n");
+        return size;
+    }
+    while (offset < size) {
+        fseek(file, offset, SEEK_SET);
+        n = fread(buffer, 1, TIFL_SCAN_CHUNK + 7, file);
+        for (p = buffer; (p = (uint8_t *)memchr(p, '*', buffer + n - p)) != NULL; p++) {
+            if (p + 8 <= buffer + n && !strncmp((const char *)p, "**TIFL**", 8)) {
+                n = offset + (p - buffer);
+                free(buffer);
+                return n;
+            }
+        }
+        if (n < TIFL_SCAN_CHUNK + 7) {
+            break;
+        }
+        // The last 7 bytes are read again, with the start of the next chunk.
+        offset += TIFL_SCAN_CHUNK;
+    }
+    free(buffer);
+    return size;
+}
+
+//! Build the table of the sections of a container file from their headers, without reading the data, return the
+//  number of sections. When a header is not where the length of the previous section says, the next one is searched for.
+static uint32_t ReadTIFLSections (FILE *file, TIFLSection *sections, uint32_t max) {
+    uint8_t header[TIFL_HEADER_SIZE];
+    uint32_t size, offset = 0, next, n = 0, i, len;
+    uint8_t recovered = 0;
+    TIFLSection *section;
+
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    while (offset + TIFL_HEADER_SIZE <= size && n < max) {
+        fseek(file, offset, SEEK_SET);
+        if (fread(header, 1, TIFL_HEADER_SIZE, file) != TIFL_HEADER_SIZE) {
+            break;
+        }
+        if (strncmp((const char *)header, "**TIFL**", 8)) {
+            offset = SearchTIFL(file, offset, size);
+            recovered = 1;
+            continue;
+        }
+
+        section = &sections[n++];
+        section->offset = offset;
+        section->size = header[0x4A] | (header[0x4B] << 8) | (header[0x4C] << 16) | ((uint32_t)header[0x4D] << 24);
+        section->device = header[0x30];
+        section->type = header[0x31];
+        section->recovered = recovered;
+        len = header[0x10];
+        if (len == 0 || len > 8) {
+            len = 8;
+        }
+        for (i = 0; i < len && header[0x11 + i] > ' ' && header[0x11 + i] < 0x7F; i++) {
+            section->name[i] = header[0x11 + i];
+        }
+        section->name[i] = 0;
+        recovered = 0;
+
+        next = offset + TIFL_HEADER_SIZE + section->size;
+        if (section->size > size - offset - TIFL_HEADER_SIZE) {
+            // Truncated, or a wrong length: the section ends where the next header, if any, starts.
+            next = SearchTIFL(file, offset + TIFL_HEADER_SIZE, size);
+            section->size = next - offset - TIFL_HEADER_SIZE;
+            recovered = 1;
+        }
+        offset = next;
+    }
+    return n;
+}
+
+
+// TI-Z80 OS upgrades (.8xu) hold Intel HEX records in their TIFL section: type 00 data, 01 end of file, 02 the Flash
+// page of the data records which follow. The addresses of data records are within the 16 KB page, as mapped in the
+// 0x4000-0x7FFF bank (or 0x0000-0x3FFF for page 0). The records are decoded into a flat image of the pages, page p at
+// offset p * Z80_PAGE_SIZE, which becomes the output file with a zero delta: the Get*/Put*/Search* building blocks
+// then work on the addresses given by Z80Address.
+#define Z80_PAGE_SIZE       (0x4000)
+#define Z80_MAX_PAGES       (0x80)
+// A record holds up to 255 data bytes: ":", length, address, type, data and checksum, in hexadecimal.
+#define HEX_LINE_SIZE       (1 + 2 * (1 + 2 + 1 + 255 + 1) + 3)
+
+//! Get the absolute address in the flat image of the given offset of the given Flash page.
+static uint32_t Z80Address (uint32_t page, uint32_t offset) {
+    return page * Z80_PAGE_SIZE + (offset & (Z80_PAGE_SIZE - 1));
+}
+
+static int HexDigit (char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+//! Decode an Intel HEX record into record (length, address high, address low, type, data, checksum), return the
+//  number of data bytes, or -1 if the line is not a valid record.
+static int DecodeHexRecord (const char *line, uint8_t *record) {
+    uint32_t i, n;
+    uint8_t sum = 0;
+    int hi, lo;
+
+    if (line[0] != ':') {
+        return -1;
+    }
+    for (i = 0, n = 5; i < n; i++) {
+        hi = HexDigit(line[1 + 2 * i]);
+        lo = (hi < 0) ? -1 : HexDigit(line[2 + 2 * i]);
+        if (lo < 0) {
+            return -1;
+        }
+        record[i] = (uint8_t)((hi << 4) | lo);
+        sum += record[i];
+        if (i == 0) {
+            n = record[0] + 5;
+        }
+    }
+    return sum == 0 ? record[0] : -1;
+}
+
+//! Decode the Intel HEX records in [start, start + size) of file into a new output file holding the flat image of the
+//  pages, the bytes of no record being 0xFF. Return the number of pages, or 0 on failure.
+static uint32_t LoadHexImage (FILE *file, uint32_t start, uint32_t size) {
+    char line[HEX_LINE_SIZE + 2];
+    uint8_t record[260];
+    uint32_t page = 0, pages = 0, i;
+    int n;
+
+    if ((output = tmpfile()) == NULL) {
+        printf("\n    ERROR : can't create a temporary file.\n");
+        return 0;
+    }
+    delta = 0;
+    fseek(file, start, SEEK_SET);
+    while ((uint32_t)ftell(file) < start + size && fgets(line, sizeof(line), file) != NULL) {
+        if (line[0] != ':') {
+            continue;
+        }
+        n = DecodeHexRecord(line, record);
+        if (n < 0) {
+            printf("\n    ERROR : invalid Intel HEX record at offset %ld.\n", ftell(file) - (long)strlen(line));
+            fclose(output);
+            return 0;
+        }
+        if (record[3] == 0x01) {
+            break;
+        }
+        if (record[3] == 0x02 && n == 2) {
+            page = ((record[4] << 8) | record[5]) % Z80_MAX_PAGES;
+        }
+        else if (record[3] == 0x00) {
+            // A record must not run past the end of its page, the next slot of the image is another page.
+            if ((((record[1] << 8) | record[2]) & (Z80_PAGE_SIZE - 1)) + n > Z80_PAGE_SIZE) {
+                printf("\n    ERROR : Intel HEX record crossing the end of Flash page %02" PRIX32 " at offset %ld.\n", page, ftell(file) - (long)strlen(line));
+                fclose(output);
+                return 0;
+            }
+            // Grow the image page by page.
+            while (pages <= page) {
+                fseek(output, pages * Z80_PAGE_SIZE, SEEK_SET);
+                for (i = 0; i < Z80_PAGE_SIZE; i++) {
+                    fputc(0xFF, output);
+                }
+                pages++;
+            }
+            fseek(output, Z80Address(page, (record[1] << 8) | record[2]), SEEK_SET);
+            fwrite(record + 4, 1, n, output);
+        }
+    }
+    fflush(output);
+    return pages;
+}
+
+//! Write file to dest, with the Intel HEX records in [start, start + size) updated from the flat image in the output
+//  file. Only the data records whose bytes changed are encoded again, with the same address and length; every other
+//  line is copied as is, so that the size of the TIFL section does not change. Return the number of records changed.
+static uint32_t WriteHexImage (FILE *file, uint32_t start, uint32_t size, FILE *dest) {
+    char line[HEX_LINE_SIZE + 2];
+    uint8_t record[260], data[255];
+    uint32_t page = 0, changed = 0, i;
+    uint8_t sum;
+    int n, c;
+
+    fseek(file, 0, SEEK_SET);
+    for (i = 0; i < start && (c = fgetc(file)) != EOF; i++) {
+        fputc(c, dest);
+    }
+    while ((uint32_t)ftell(file) < start + size && fgets(line, sizeof(line), file) != NULL) {
+        n = DecodeHexRecord(line, record);
+        if (n >= 0 && record[3] == 0x02 && n == 2) {
+            page = ((record[4] << 8) | record[5]) % Z80_MAX_PAGES;
+        }
+        else if (n > 0 && record[3] == 0x00) {
+            GetNBytes(data, n, Z80Address(page, (record[1] << 8) | record[2]));
+            if (!SameBytes(data, record + 4, n)) {
+                sum = 0;
+                for (i = 0; i < 4; i++) {
+                    sum += record[i];
+                }
+                for (i = 0; i < (uint32_t)n; i++) {
+                    sum += data[i];
+                    sprintf(line + 9 + 2 * i, "%02X", data[i]);
+                }
+                // Keep the end of the line of the original record.
+                sprintf(line + 9 + 2 * n, "%02X%s", (uint8_t)(0 - sum), line[11 + 2 * n] == '\r' ? "\r\n" : "\n");
+                changed++;
+            }
+        }
+        fputs(line, dest);
+    }
+    while ((c = fgetc(file)) != EOF) {
+        fputc(c, dest);
+    }
+    return changed;
+}
+
+
+static int SkipLicense(void) {
+    TIFLSection sections[MAX_TIFL_SECTIONS];
+    char buffer[30];
+    uint32_t n, i;
+
+    // Find our way into the file, several sanity checks.
+    n = ReadTIFLSections(input, sections, MAX_TIFL_SECTIONS);
+    for (i = 0; i < n && strcmp(sections[i].name, "basecode"); i++);
+    if (n == 0 || sections[0].offset != 0 || i == n) {
+WrongType:
+        printf ("\n    ERROR : wrong input file type.\n"\
+        "    Use .89u, .9xu or .v2u ROM files.\n");
+        fclose(input);
+        return 3;
+    }
+
+    if (i > 0) {
+        I = sections[i].offset;
+        printf("\tINFO: found %" PRIu32 " bytes of license at the beginning of the file\n",I);
+    }
+    HEAD = sections[i].offset + TIFL_HEADER_SIZE;
+    fseek (input, 0x16+HEAD, SEEK_SET);
+    fread (buffer, 1, 29, input);
+    if (strncmp (buffer, "Advanced Mathematics Software", sizeof("Advanced Mathematics Software") - 1)) {
+        goto WrongType;
+    }
+
+    fseek (input, 2+ HEAD, SEEK_SET);
+    fread (buffer, 1, 4, input);
+    BasecodeSize =   UINT32_C(0x0000001) * (unsigned char)buffer[3]
+                   + UINT32_C(0x0000100) * (unsigned char)buffer[2]
+                   + UINT32_C(0x0010000) * (unsigned char)buffer[1]
+                   + UINT32_C(0x1000000) * (unsigned char)buffer[0];
+    printf("\tINFO: found AMS of size %" PRIu32 " (0x%" PRIX32 ")\n", BasecodeSize, BasecodeSize);
+
+    return 0;
+}
+
+
+//! Read data at the given offset of the input file.
+static uint16_t InputShort (uint32_t offset) {
+    uint16_t temp_short;
+    fseek(input, offset, SEEK_SET);
+    temp_short  = fgetc(input) << 8;
+    temp_short |= fgetc(input);
+    return temp_short;
+}
+
+static uint32_t InputLong (uint32_t offset) {
+    uint32_t temp_long;
+    fseek(input, offset, SEEK_SET);
+    temp_long  = fgetc(input) << 24;
+    temp_long |= fgetc(input) << 16;
+    temp_long |= fgetc(input) << 8;
+    temp_long |= fgetc(input);
+    return temp_long;
+}
+
+
+static int AMSSanityChecks(void) {
+    uint32_t expectedSize;
+
+    // Check calculator type
+    fseek (input, 8+HEAD, SEEK_SET);
+    CalculatorType = fgetc(input);
+    printf("\tINFO: found calculator type %" PRIu8 "\n", CalculatorType);
+    if ((CalculatorType != TI89) && (CalculatorType != TI92P) && (CalculatorType != V200) && (CalculatorType != TI89T)) {
+        printf("\n    ERROR: unknown calculator type, aborting...\n");
+        fclose(input);
+        return 4;
+    }
+
+    // Get AMS version.
+    fgetc(input);
+    fgetc(input);
+    I = fgetc(input);
+    printf("\tINFO: found AMS version type %" PRIu32 "\n", I);
+
+    // Check size.
+    // Starting at 12, TI didn't bother incrementing the version number properly...
+    if (I == 9) {
+        if (CalculatorType == TI89) expectedSize = 0x124772;
+        else if (CalculatorType == TI92P) expectedSize = 0x123F8E;
+        else goto SizeError;
+    }
+    else if (I == 11) {
+        if (CalculatorType == TI89) expectedSize = 0x12E01A;
+        else if (CalculatorType == TI92P) expectedSize = 0x12D96A;
+        else if (CalculatorType == V200) expectedSize = 0x12DBEE;
+        else goto SizeError;
+    }
+    else if (I == 12) {
+        if (CalculatorType == TI89) expectedSize = 0x12E2FE;
+        else if (CalculatorType == TI92P) expectedSize = 0x12DC4E;
+        else if (CalculatorType == V200) expectedSize = 0;
+        else goto SizeError;
+    }
+    else if (I == 13) {
+        if (CalculatorType == TI89T) expectedSize = 0x14565A;
+        else if (CalculatorType == V200) expectedSize = 0x148D3A;
+        else goto SizeError;
+    }
+    else if (I == 14) {
+        if (CalculatorType == TI89T) expectedSize = 0x155C3E;
+        else goto SizeError;
+    }
+    else {
+        printf ("\n    ERROR : unsupported AMS version.\n"
+                "    Use AMS 2.05, 2.08, 2.09, 3.01 or 3.10.\n"
+                "    If you really need another version, please contact the author.\n"
+               );
+        fclose (input);
+        return 5;
+    }
+
+    // Special case: multiple versions bear the same version number.
+    if (CalculatorType == V200 && I == 12) {
+        if (BasecodeSize != 0x12DECA && BasecodeSize != 0x1393F6) {
+            goto SizeError;
+        }
+    }
+    else {
+        if (BasecodeSize != expectedSize) {
+SizeError:
+            printf ("\n    ERROR: unexpected size 0x%" PRIX32 " in file, aborting...\n", BasecodeSize);
+            fclose(input);
+            return 6;
+        }
+    }
+
+    return 0;
+}
+
+
+static int CreateFillOutputFileAMS(int argc, char *argv[]) {
+    uint32_t i;
+
+    OutputFileName = argv[argc - 1];
+    printf ("    Creating output file '%s'...\n", OutputFileName);
+    if ((output = fopen (OutputFileName, "rb")) != NULL) {
+        printf ("\n    ERROR : file '%s' already exists. Refusing to overwrite it.", OutputFileName);
+        fclose(output);
+        fclose(input);
+        return 7;
+    }
+
+    if ((output = fopen (OutputFileName, "w+b"))==NULL) {
+        printf ("\n    ERROR : can't create '%s'.\n", OutputFileName);
+        fclose (input);
+        return 8;
+    }
+
+    OutputFileSize = BasecodeSize + HEAD + AdditionalSize;
+    printf("\tINFO: copying %" PRIu32 " bytes to output file\n", OutputFileSize);
+    fseek (input, 0, SEEK_SET);
+    for (i = 0; i < OutputFileSize; i++) {
+        fputc (fgetc (input), output);
+    }
+
+    // The undo journal needs the original bytes.
+    if (UndoFileName == NULL) {
+        fclose(input);
+    }
+
+    return 0;
+}
+
+
+static int SetupAMSVariables(void) {
+    uint32_t temp, temp2;
+
+    // Setup internal variables.
+    fseek(output, HEAD + 0x88 + 0xC8, SEEK_SET);
+    jmp_tbl = ReadLong();
+    ROM_base = jmp_tbl & UINT32_C(0xE00000);
+    delta = ROM_base + UINT32_C(0x12000) - HEAD;
+
+    TIOS_entries = rom_call_addr(-1);
+    Trap9Pointers = 0;
+    TrapBFunctions = 0;
+    AMS_Frame = 0;
+    temp = rom_call_addr(ReleaseVersion);
+    AMS_Major = GetByte(temp) - '0';
+    AMS_Minor = ((GetByte(temp + 2) - '0') * 10) + (GetByte(temp + 3) - '0');
+
+    SizeShrunk = 0;
+    NbPatchedRanges = 0;
+    NbInjectedBlocks = 0;
+    NbSectionWrites = 0;
+    NbSections = 0;
+    CurrentSection = -1;
+    StagingWrites = 0;
+
+    // One last check: the basecode checksum.
+    BasecodeSize = GetLong(ROM_base + UINT32_C(0x12000) + 2) + 2;
+    temp = GetLong(BasecodeSize + ROM_base + UINT32_C(0x12000));
+    temp2 = ComputeAMSChecksum(BasecodeSize, ROM_base + UINT32_C(0x12000), NULL);
+    printf("\tINFO: embedded basecode checksum is %08" PRIX32 ".\n"
+           "\t      computed basecode checksum is %08" PRIX32 ".\n\n", temp, temp2);
+    if (temp != temp2) {
+        printf ("    ERROR : computed checksum does not match the checksum embedded into AMS.\n"
+                "            Refusing to modify the file, please use a pristine copy of AMS.");
+        fclose(output);
+        // The input is still open for the undo journal; when analyzing, it is the output.
+        if (UndoFileName != NULL) {
+            fclose(input);
+        }
+        return 9;
+    }
+
+    // TI left this space unused, and we want to put new code and relocated data there.
+    NbFreeRanges = 0;
+    ScanFreeROMSpace(ROM_base + UINT32_C(0x13000), ROM_base + UINT32_C(0x18000));
+    temp = FreeROMSpaceLeft(&temp2);
+    printf("\tINFO: found %" PRIu32 " bytes of free ROM space in %" PRIu32 " blocks (largest: %" PRIu32 " bytes).\n\n", temp, NbFreeRanges, temp2);
+
+    return 0;
+}
+
+
+static int SetupAMS(int argc, char *argv[]) {
+    int i;
+
+    i = SkipLicense();
+    if (i) {
+        return i;
+    }
+
+    // Patched images also fail the size checks, tell why before.
+    i = IdentifyAMS();
+    if (i != AMS_PRISTINE) {
+        printf("\n    ERROR : '%s' is not a pristine AMS image, refusing to modify it.\n", argv[argc - 2]);
+        fclose(input);
+        return i;
+    }
+
+    i = AMSSanityChecks();
+    if (i) {
+        return i;
+    }
+    
+    i = CreateFillOutputFileAMS(argc, argv);
+    if (i) {
+        return i;
+    }
+
+    return SetupAMSVariables();
+}
+
+
+//! Print the section table of container files.
+static int ListTIFLSections(char *filename) {
+    TIFLSection sections[MAX_TIFL_SECTIONS];
+    FILE *file;
+    uint32_t n, i;
+
+    if ((file = fopen (filename, "rb")) == NULL) {
+        printf ("    ERROR : file '%s' not found.\n", filename);
+        return 2;
+    }
+    n = ReadTIFLSections(file, sections, MAX_TIFL_SECTIONS);
+    fclose(file);
+    printf("    '%s': %" PRIu32 " sections\n", filename, n);
+    for (i = 0; i < n; i++) {
+        printf("\t%-8s device %02" PRIX8 " type %02" PRIX8 " at %08" PRIX32 ", %8" PRIu32 " bytes of data%s\n",
+               sections[i].name, sections[i].device, sections[i].type, sections[i].offset, sections[i].size,
+               sections[i].recovered ? " (found by scanning)" : "");
+    }
+    return n == 0;
+}
+
+//! Print the Flash pages of the TI-Z80 OS upgrade in a container file and, if outname is not NULL, write the
+//  container file again from the pages loaded in the flat image, which checks the loader and the writer: no record is
+//  expected to change.
+static int ListZ80Pages(char *filename, char *outname) {
+    TIFLSection sections[MAX_TIFL_SECTIONS];
+    FILE *file, *dest;
+    uint32_t n, pages, page, addr, used, changed;
+
+    if ((file = fopen (filename, "rb")) == NULL) {
+        printf ("    ERROR : file '%s' not found.\n", filename);
+        return 2;
+    }
+    n = ReadTIFLSections(file, sections, MAX_TIFL_SECTIONS);
+    if (n == 0) {
+        printf ("\n    ERROR : wrong input file type.\n");
+        fclose(file);
+        return 3;
+    }
+    pages = LoadHexImage(file, sections[n - 1].offset + TIFL_HEADER_SIZE, sections[n - 1].size);
+    if (pages == 0) {
+        fclose(file);
+        return 3;
+    }
+    printf("    '%s': %" PRIu32 " Flash pages\n", filename, pages);
+    for (page = 0; page < pages; page++) {
+        used = 0;
+        Seek(Z80Address(page, 0));
+        for (addr = 0; addr < Z80_PAGE_SIZE; addr++) {
+            used += (ReadByte() != 0xFF);
+        }
+        if (used != 0) {
+            printf("\tpage %02" PRIX32 ": %5" PRIu32 " bytes other than 0xFF\n", page, used);
+        }
+    }
+
+    if (outname != NULL) {
+        if ((dest = fopen(outname, "rb")) != NULL) {
+            printf("\n    ERROR : file '%s' already exists. Refusing to overwrite it.", outname);
+            fclose(dest);
+            fclose(file);
+            fclose(output);
+            return 7;
+        }
+        if ((dest = fopen(outname, "wb")) == NULL) {
+            printf("\n    ERROR : can't create '%s'.\n", outname);
+            fclose(file);
+            fclose(output);
+            return 8;
+        }
+        changed = WriteHexImage(file, sections[n - 1].offset + TIFL_HEADER_SIZE, sections[n - 1].size, dest);
+        fclose(dest);
+        printf("    Wrote '%s' from the Flash pages, %" PRIu32 " records encoded anew.\n", outname, changed);
+    }
+    fclose(file);
+    fclose(output);
+    return 0;
+}
+
+//! Classify an AMS update file, return its class.
+static int IdentifyAMSFile(char *filename) {
+    int i;
+
+    if ((input = fopen (filename, "rb")) == NULL) {
+        printf ("    ERROR : file '%s' not found.\n", filename);
+        return 2;
+    }
+    printf("    Identifying '%s'...\n", filename);
+
+    i = SkipLicense();
+    if (i) {
+        return i;
+    }
+
+    i = IdentifyAMS();
+    fclose(input);
+    return i;
+}
+
+
+//! Open an AMS update file for analysis only: the file is used in place of the output file, and never written to.
+static int AnalyzeAMSFile(char *filename) {
+    int i;
+
+    if ((input = fopen (filename, "rb")) == NULL) {
+        printf ("    ERROR : file '%s' not found.\n", filename);
+        return 2;
+    }
+    printf("    Analyzing '%s'...\n", filename);
+
+    i = SkipLicense();
+    if (i) {
+        return i;
+    }
+
+    i = AMSSanityChecks();
+    if (i) {
+        return i;
+    }
+
+    output = input;
+    i = SetupAMSVariables();
+    if (i) {
         return i;
     }
 
+    AnalyzeAMS();
+
+    fclose(input);
+    return 0;
+}
+
+
+static int CompareSymbols (const void *a, const void *b) {
+    const Symbol *s1 = (const Symbol *)a;
+    const Symbol *s2 = (const Symbol *)b;
+    return s1->address < s2->address ? -1 : (s1->address > s2->address);
+}
+
+//! Load a symbol map, sorted by address. Empty lines, and lines starting with ';' or '#', are skipped.
+//  Return NULL on failure.
+static Symbol * LoadSymbolMap (const char *filename, uint32_t *n) {
+    FILE *file;
+    Symbol *syms = NULL, *temp;
+    uint32_t allocated = 0;
+    char line[256];
+
+    *n = 0;
+    if ((file = fopen(filename, "r")) == NULL) {
+        printf("    ERROR : file '%s' not found.\n", filename);
+        return NULL;
+    }
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (line[0] == ';' || line[0] == '#' || line[0] == '\n' || line[0] == '\r') {
+            continue;
+        }
+        if (*n == allocated) {
+            allocated = allocated ? 2 * allocated : 1024;
+            temp = (Symbol *)realloc(syms, allocated * sizeof(Symbol));
+            if (temp == NULL) {
+                printf("\n    ERROR : not enough memory.\n");
+                free(syms);
+                fclose(file);
+                return NULL;
+            }
+            syms = temp;
+        }
+        if (sscanf(line, "%" SCNx32 " %47s", &syms[*n].address, syms[*n].name) == 2) {
+            (*n)++;
+        }
+    }
+    fclose(file);
+    if (*n == 0) {
+        printf("    ERROR : no symbol in '%s'.\n", filename);
+        free(syms);
+        return NULL;
+    }
+    qsort(syms, *n, sizeof(Symbol), CompareSymbols);
+    return syms;
+}
+
+//! Decode the instrumentation data in a dump of the RAM of a calculator, with an optional symbol map.
+static int DecodeRAMFile(char *filename, char *mapname) {
+    Symbol *syms = NULL;
+    uint32_t nbsyms = 0;
+    uint8_t *ram;
+    long size;
+
+    if ((input = fopen (filename, "rb")) == NULL) {
+        printf ("    ERROR : file '%s' not found.\n", filename);
+        return 2;
+    }
+    printf("    Decoding '%s'...\n", filename);
+    fseek(input, 0, SEEK_END);
+    size = ftell(input);
+    fseek(input, 0, SEEK_SET);
+    ram = (uint8_t *)malloc(size > 0 ? (size_t)size : 1);
+    if (ram == NULL || fread(ram, 1, (size_t)size, input) != (size_t)size) {
+        printf("    ERROR : cannot read '%s'.\n", filename);
+        free(ram);
+        fclose(input);
+        return 2;
+    }
+    fclose(input);
+    if (mapname != NULL) {
+        syms = LoadSymbolMap(mapname, &nbsyms);
+        if (syms == NULL) {
+            free(ram);
+            return 2;
+        }
+    }
+    DecodeAMSRAM(ram, (uint32_t)size, syms, nbsyms);
+    free(syms);
+    free(ram);
+    return 0;
+}
+
+
+// Names of the exception vectors, by offset in the vector table.
+static const struct {
+    uint32_t offset;
+    const char *name;
+} VectorNames[] = {
+    {0x04, "Reset"},
+    {0x08, "Bus_Error"},
+    {0x0C, "Address_Error"},
+    {0x10, "Illegal_Instruction"},
+    {0x14, "Zero_Divide"},
+    {0x18, "CHK_Instruction"},
+    {0x1C, "TRAPV_Instruction"},
+    {0x20, "Privilege_Violation"},
+    {0x24, "Trace"},
+    {0x28, "Line_1010_Emulator"},
+    {0x2C, "Line_1111_Emulator"},
+    {0x60, "Spurious_Interrupt"},
+    {0x64, "AUTO_INT_1"},
+    {0x68, "AUTO_INT_2"},
+    {0x6C, "AUTO_INT_3"},
+    {0x70, "AUTO_INT_4"},
+    {0x74, "AUTO_INT_5"},
+    {0x78, "AUTO_INT_6"},
+    {0x7C, "AUTO_INT_7"}
+};
+
+//! Append a symbol to a growable array of symbols, return nonzero on failure.
+static int AddSymbol (Symbol **syms, uint32_t *n, uint32_t *allocated, uint32_t address, const char *name) {
+    if (*n == *allocated) {
+        Symbol *temp = (Symbol *)realloc(*syms, (*allocated ? 2 * *allocated : 2048) * sizeof(Symbol));
+        if (temp == NULL) {
+            return 1;
+        }
+        *syms = temp;
+        *allocated = *allocated ? 2 * *allocated : 2048;
+    }
+    (*syms)[*n].address = address;
+    snprintf((*syms)[*n].name, sizeof((*syms)[*n].name), "%s", name);
+    (*n)++;
+    return 0;
+}
+
+//! Write the symbol map of the patched OS: the whole ROM_CALL table, the exception vectors and trap handlers, the
+//  system tables resolved by the patcher, and a symbol for each block of new code or data. The patched extents follow
+//  as comments. Symbol lines are "address name", the address in hexadecimal, which is what LoadSymbolMap, and most
+//  emulators and debuggers, read; lines starting with ';' are comments.
+static int WriteSymbolMap (const char *filename) {
+    FILE *file;
+    Symbol *syms = NULL, key;
+    uint32_t nbsyms = 0, allocated = 0, nbnamed;
+    uint32_t i, j, addr;
+    char name[48];
+    int err = 0;
+
+    if ((file = fopen(filename, "w")) == NULL) {
+        printf("\n    ERROR : can't create '%s'.\n", filename);
+        return 1;
+    }
+
+    for (i = 0; i < TIOS_entries && !err; i++) {
+        snprintf(name, sizeof(name), "ROM_CALL_%03" PRIX32, i);
+        for (j = 0; j < sizeof(KnownROMCalls) / sizeof(KnownROMCalls[0]); j++) {
+            if (KnownROMCalls[j].idx == i) {
+                snprintf(name, sizeof(name), "%s", KnownROMCalls[j].name);
+                break;
+            }
+        }
+        err = AddSymbol(&syms, &nbsyms, &allocated, rom_call_addr(i), name);
+    }
+    for (i = 0; i < sizeof(VectorNames) / sizeof(VectorNames[0]) && !err; i++) {
+        fseek(output, HEAD + 0x88 + VectorNames[i].offset, SEEK_SET);
+        err = AddSymbol(&syms, &nbsyms, &allocated, ReadLong(), VectorNames[i].name);
+    }
+    for (i = 0; i < 16 && !err; i++) {
+        fseek(output, HEAD + 0x88 + 0x80 + 4 * i, SEEK_SET);
+        snprintf(name, sizeof(name), "TRAP_%" PRIu32, i);
+        err = AddSymbol(&syms, &nbsyms, &allocated, ReadLong(), name);
+    }
+    if (!err) {
+        err = AddSymbol(&syms, &nbsyms, &allocated, jmp_tbl, "jmp_tbl");
+    }
+    // These tables are only known when a change needed them.
+    if (!err && Trap9Pointers != 0) {
+        err = AddSymbol(&syms, &nbsyms, &allocated, Trap9Pointers, "Trap9Pointers");
+    }
+    if (!err && TrapBFunctions != 0) {
+        err = AddSymbol(&syms, &nbsyms, &allocated, TrapBFunctions, "TrapBFunctions");
+    }
+    if (!err && AMS_Frame != 0) {
+        err = AddSymbol(&syms, &nbsyms, &allocated, AMS_Frame, "AMS_Frame");
+    }
+
+    // New code and data, unless a ROM_CALL or vector already names it.
+    nbnamed = nbsyms;
+    if (!err) {
+        qsort(syms, nbnamed, sizeof(Symbol), CompareSymbols);
+    }
+    for (i = 0; i < NbInjectedBlocks && !err; i++) {
+        key.address = InjectedBlocks[i];
+        if (bsearch(&key, syms, nbnamed, sizeof(Symbol), CompareSymbols) == NULL) {
+            snprintf(name, sizeof(name), "injected_%06" PRIX32, InjectedBlocks[i]);
+            err = AddSymbol(&syms, &nbsyms, &allocated, InjectedBlocks[i], name);
+        }
+    }
+    if (err) {
+        printf("\n    ERROR : not enough memory.\n");
+        free(syms);
+        fclose(file);
+        return 1;
+    }
+    qsort(syms, nbsyms, sizeof(Symbol), CompareSymbols);
+
+    fprintf(file, "; Symbol map of '%s', AMS %u.%02u, %" PRIu32 " ROM_CALLs\n", OutputFileName, AMS_Major, AMS_Minor, TIOS_entries);
+    for (i = 0; i < nbsyms; i++) {
+        fprintf(file, "%06" PRIX32 " %s\n", syms[i].address, syms[i].name);
+    }
+    fprintf(file, "; %" PRIu32 " patched extents, as [start, end)\n", NbPatchedRanges);
+    for (i = 0; i < NbPatchedRanges; i++) {
+        addr = PatchedRanges[i].start;
+        fprintf(file, "; %06" PRIX32 "-%06" PRIX32 " %" PRIu32 " bytes\n", addr, PatchedRanges[i].end, PatchedRanges[i].end - addr);
+    }
+    fclose(file);
+
+    printf("\n\tINFO: wrote %" PRIu32 " symbols and %" PRIu32 " patched extents to '%s'.\n", nbsyms, NbPatchedRanges, filename);
+    free(syms);
+    return 0;
+}
+
+
+// RSA signature of the basecode: the MD5 of the checksummed bytes, read as a little-endian number, raised to the
+// private exponent modulo the 512-bit modulus of the OS signing key. The result is stored little-endian after the
+// checksum, in the 67-byte signature field 020D (type, length 0x40, data). The public exponent is 17.
+#define RSA_WORDS           (16)
+#define RSA_PUBLIC_EXPONENT (17)
+#define SIGNATURE_FIELD     (0x020D)
+
+// The signing key, as little-endian arrays of 32-bit words.
+typedef struct {
+    uint32_t n[RSA_WORDS];
+    uint32_t d[RSA_WORDS];
+} SigningKey;
+
+// The key file used to sign the output, if any.
+static char * SignKeyFileName;
+
+//! Compare a and b, two numbers of RSA_WORDS words.
+static int RSACompare (const uint32_t *a, const uint32_t *b) {
+    uint32_t i;
+
+    for (i = RSA_WORDS; i > 0; i--) {
+        if (a[i - 1] != b[i - 1]) {
+            return a[i - 1] < b[i - 1] ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+//! a -= b, return the borrow.
+static uint32_t RSASubtract (uint32_t *a, const uint32_t *b) {
+    uint64_t temp;
+    uint32_t i, borrow = 0;
 
-    // Setup internal variables.
-    fseek(output, HEAD + 0x88 + 0xC8, SEEK_SET);
-    jmp_tbl = ReadLong();
-    ROM_base = jmp_tbl & UINT32_C(0xE00000);
-    delta = ROM_base + UINT32_C(0x12000) - HEAD;
+    for (i = 0; i < RSA_WORDS; i++) {
+        temp = (uint64_t)a[i] - b[i] - borrow;
+        a[i] = (uint32_t)temp;
+        borrow = (uint32_t)(temp >> 32) & 1;
+    }
+    return borrow;
+}
 
-    TIOS_entries = rom_call_addr(-1);
-    Trap9Pointers = 0;
-    TrapBFunctions = 0;
-    AMS_Frame = 0;
-    temp = rom_call_addr(ReleaseVersion);
-    AMS_Major = GetByte(temp) - '0';
-    AMS_Minor = ((GetByte(temp + 2) - '0') * 10) + (GetByte(temp + 3) - '0');
+//! r = a * b / 2^512 mod n (Montgomery multiplication, CIOS), with ninv = -1/n mod 2^32. r may alias a or b.
+static void RSAMontgomeryMultiply (uint32_t *r, const uint32_t *a, const uint32_t *b, const uint32_t *n, uint32_t ninv) {
+    uint32_t t[RSA_WORDS + 2];
+    uint64_t temp;
+    uint32_t i, j, carry, m;
+
+    memset(t, 0, sizeof(t));
+    for (i = 0; i < RSA_WORDS; i++) {
+        carry = 0;
+        for (j = 0; j < RSA_WORDS; j++) {
+            temp = (uint64_t)a[j] * b[i] + t[j] + carry;
+            t[j] = (uint32_t)temp;
+            carry = (uint32_t)(temp >> 32);
+        }
+        temp = (uint64_t)t[RSA_WORDS] + carry;
+        t[RSA_WORDS] = (uint32_t)temp;
+        t[RSA_WORDS + 1] = (uint32_t)(temp >> 32);
+
+        m = t[0] * ninv;
+        temp = (uint64_t)m * n[0] + t[0];
+        carry = (uint32_t)(temp >> 32);
+        for (j = 1; j < RSA_WORDS; j++) {
+            temp = (uint64_t)m * n[j] + t[j] + carry;
+            t[j - 1] = (uint32_t)temp;
+            carry = (uint32_t)(temp >> 32);
+        }
+        temp = (uint64_t)t[RSA_WORDS] + carry;
+        t[RSA_WORDS - 1] = (uint32_t)temp;
+        t[RSA_WORDS] = t[RSA_WORDS + 1] + (uint32_t)(temp >> 32);
+    }
+    if (t[RSA_WORDS] != 0 || RSACompare(t, n) >= 0) {
+        RSASubtract(t, n);
+    }
+    memcpy(r, t, RSA_WORDS * sizeof(uint32_t));
+}
 
-    SizeShrunk = 0;
+//! r = base ^ exp mod n, for an odd n and base < n.
+static void RSAPower (uint32_t *r, const uint32_t *base, const uint32_t *exp, const uint32_t *n) {
+    uint32_t r2[RSA_WORDS], b[RSA_WORDS], one[RSA_WORDS];
+    uint32_t ninv, carry, i, j;
 
-    // One last check: the basecode checksum.
-    BasecodeSize = GetLong(ROM_base + UINT32_C(0x12000) + 2) + 2;
-    temp = GetLong(BasecodeSize + ROM_base + UINT32_C(0x12000));
-    temp2 = ComputeAMSChecksum(BasecodeSize, ROM_base + UINT32_C(0x12000));
-    printf("\tINFO: embedded basecode checksum is %08" PRIX32 ".\n"
-           "\t      computed basecode checksum is %08" PRIX32 ".\n\n", temp, temp2);
-    if (temp != temp2) {
-        printf ("    ERROR : computed checksum does not match the checksum embedded into AMS.\n"
-                "            Refusing to modify the file, please use a pristine copy of AMS.");
-        fclose(output);
-        fclose(input);
-        return 9;
+    // -1/n mod 2^32, by Newton's iteration.
+    ninv = n[0];
+    for (i = 0; i < 4; i++) {
+        ninv *= 2 - n[0] * ninv;
+    }
+    ninv = 0 - ninv;
+
+    // 2^1024 mod n, by doubling.
+    memset(r2, 0, sizeof(r2));
+    r2[0] = 1;
+    for (i = 0; i < 2 * 32 * RSA_WORDS; i++) {
+        carry = r2[RSA_WORDS - 1] >> 31;
+        for (j = RSA_WORDS - 1; j > 0; j--) {
+            r2[j] = (r2[j] << 1) | (r2[j - 1] >> 31);
+        }
+        r2[0] <<= 1;
+        if (carry || RSACompare(r2, n) >= 0) {
+            RSASubtract(r2, n);
+        }
+    }
+
+    memset(one, 0, sizeof(one));
+    one[0] = 1;
+    RSAMontgomeryMultiply(b, base, r2, n, ninv);
+    RSAMontgomeryMultiply(r, one, r2, n, ninv);
+    for (i = 32 * RSA_WORDS; i > 0; i--) {
+        RSAMontgomeryMultiply(r, r, r, n, ninv);
+        if ((exp[(i - 1) >> 5] >> ((i - 1) & 31)) & 1) {
+            RSAMontgomeryMultiply(r, r, b, n, ninv);
+        }
+    }
+    RSAMontgomeryMultiply(r, r, one, n, ninv);
+}
+
+//! Read the next hexadecimal number of a key file into a number of RSA_WORDS words, return the number of digits
+//  read, 0 at the end of the file, or -1 when the number does not fit.
+static int ReadKeyNumber (FILE *file, uint32_t *value) {
+    int c, digits = 0, nibble;
+    uint32_t i;
+
+    memset(value, 0, RSA_WORDS * sizeof(uint32_t));
+    do {
+        c = fgetc(file);
+    } while (c == ' ' || c == '\t' || c == '\r' || c == '\n');
+    if (c == '0') {
+        c = fgetc(file);
+        if (c == 'x' || c == 'X') {
+            c = fgetc(file);
+        }
+        else {
+            digits = 1;
+        }
+    }
+    for (;; c = fgetc(file)) {
+        if (c >= '0' && c <= '9') {
+            nibble = c - '0';
+        }
+        else if (c >= 'A' && c <= 'F') {
+            nibble = c - 'A' + 10;
+        }
+        else if (c >= 'a' && c <= 'f') {
+            nibble = c - 'a' + 10;
+        }
+        else {
+            break;
+        }
+        if (value[RSA_WORDS - 1] >> 28) {
+            return -1;
+        }
+        for (i = RSA_WORDS - 1; i > 0; i--) {
+            value[i] = (value[i] << 4) | (value[i - 1] >> 28);
+        }
+        value[0] = (value[0] << 4) | nibble;
+        digits++;
+    }
+    return digits;
+}
+
+//! Load a signing key: a text file with the modulus n and the private exponent d in hexadecimal, optionally
+//  preceded by the key ID, e.g. 01 for the OS key of the TI-89, 92+ and V200. Return nonzero on failure.
+static int LoadSigningKey (const char *filename, SigningKey *key) {
+    uint32_t numbers[3][RSA_WORDS];
+    FILE *file;
+    int i, ret = 0;
+
+    if ((file = fopen(filename, "r")) == NULL) {
+        printf("\n    ERROR : file '%s' not found.\n", filename);
+        return 1;
+    }
+    for (i = 0; i < 3 && ret >= 0; i++) {
+        ret = ReadKeyNumber(file, numbers[i]);
+        if (ret <= 0) {
+            break;
+        }
+    }
+    fclose(file);
+    if (ret < 0 || i < 2) {
+        printf("\n    ERROR : '%s' is not a signing key.\n", filename);
+        return 1;
+    }
+    memcpy(key->n, numbers[i - 2], sizeof(key->n));
+    memcpy(key->d, numbers[i - 1], sizeof(key->d));
+    if ((key->n[0] & 1) == 0 || key->n[RSA_WORDS - 1] == 0) {
+        printf("\n    ERROR : the modulus of '%s' is not a 512-bit odd number.\n", filename);
+        return 1;
+    }
+    return 0;
+}
+
+//! Sign the basecode hashed in md5 with the key of the given file, into the signature field which follows the checksum.
+static int SignAMS (MD5Context *md5, const char *filename) {
+    SigningKey key;
+    uint32_t hash[RSA_WORDS], signature[RSA_WORDS], check[RSA_WORDS], e[RSA_WORDS];
+    uint8_t digest[16], field[BASECODE_TAIL_SIZE - 4];
+    uint32_t addr = ROM_base + UINT32_C(0x12000) + BasecodeSize - SizeShrunk + 4;
+    uint32_t i;
+
+    MD5Final(md5, digest);
+    if (LoadSigningKey(filename, &key)) {
+        return 1;
+    }
+    if (GetShort(addr) != SIGNATURE_FIELD) {
+        printf("\n    ERROR : no signature field after the checksum, the output was not signed.\n");
+        return 1;
+    }
+
+    memset(hash, 0, sizeof(hash));
+    for (i = 0; i < 16; i++) {
+        hash[i >> 2] |= (uint32_t)digest[i] << (8 * (i & 3));
+    }
+    RSAPower(signature, hash, key.d, key.n);
+
+    // A wrong key pair would produce a signature which the calculator rejects.
+    memset(e, 0, sizeof(e));
+    e[0] = RSA_PUBLIC_EXPONENT;
+    RSAPower(check, signature, e, key.n);
+    if (RSACompare(check, hash) != 0) {
+        printf("\n    ERROR : the exponents of '%s' do not match, the output was not signed.\n", filename);
+        return 1;
     }
 
+    field[0] = SIGNATURE_FIELD >> 8;
+    field[1] = SIGNATURE_FIELD & 0xFF;
+    field[2] = 4 * RSA_WORDS;
+    for (i = 0; i < 4 * RSA_WORDS; i++) {
+        field[3 + i] = (uint8_t)(signature[i >> 2] >> (8 * (i & 3)));
+    }
+    PutNBytes(field, sizeof(field), addr);
+    printf("\n\tINFO: signed the basecode with '%s'.\n", filename);
     return 0;
 }
 
 
-static void FinishAMS(void) {
-    uint32_t temp;
+// Undo journal: what is needed to turn the patched file back into the original one. It is a header followed by
+// extents, all numbers big-endian:
+//     "TIOSUNDO", version (long), patchset description (32 bytes, NUL-padded),
+//     MD5 of the patched file, MD5 of the original file (16 bytes each),
+//     size of the patched file, size of the original file, number of extents (longs),
+//     then for each extent: file offset, length (longs), and the original bytes.
+// The bytes dropped from the end of the file by the shrinking code are the last extent.
+#define UNDO_MAGIC          "TIOSUNDO"
+#define UNDO_VERSION        (1)
+#define UNDO_HEADER_SIZE    (8 + 4 + 32 + 16 + 16 + 4 + 4 + 4)
+
+static void WriteFileLong (FILE *file, uint32_t value) {
+    fputc((int)(value >> 24) & 0xFF, file);
+    fputc((int)(value >> 16) & 0xFF, file);
+    fputc((int)(value >>  8) & 0xFF, file);
+    fputc((int)(value      ) & 0xFF, file);
+}
+
+static uint32_t BufferLong (const uint8_t *buffer) {
+    return ((uint32_t)buffer[0] << 24) | ((uint32_t)buffer[1] << 16) | ((uint32_t)buffer[2] << 8) | buffer[3];
+}
+
+//! Hash the first size bytes of file.
+static void HashFile (FILE *file, uint32_t size, uint8_t digest[16]) {
+    MD5Context md5;
+    uint8_t buffer[4096];
+    uint32_t n;
+
+    MD5Init(&md5);
+    fseek(file, 0, SEEK_SET);
+    while (size > 0) {
+        n = (size < sizeof(buffer)) ? size : sizeof(buffer);
+        n = fread(buffer, 1, n, file);
+        if (n == 0) {
+            break;
+        }
+        MD5Update(&md5, buffer, n);
+        size -= n;
+    }
+    MD5Final(&md5, digest);
+}
+
+//! Write the undo journal of the output file, whose final size is OutputFileSize: the original bytes of the patched
+//  extents, read from the input file, which the output file was copied from. The extents are clipped to the shorter
+//  of both files: the bytes past the end of the original file, when the basecode grew, are dropped by truncating to
+//  the recorded original size, and the bytes past the end of the output file, when it shrank, are saved as one extent.
+static int WriteUndoJournal (const char *filename) {
+    FILE *file;
+    uint8_t digest[16];
+    char desc[32];
+    uint32_t originalsize, limit, start, end, n, i, j;
+
+    if ((file = fopen(filename, "wb")) == NULL) {
+        printf("\n    ERROR : can't create '%s'.\n", filename);
+        return 1;
+    }
+    fseek(input, 0, SEEK_END);
+    originalsize = ftell(input);
+    limit = (originalsize < OutputFileSize) ? originalsize : OutputFileSize;
+
+    // Count the extents, clipped to both files.
+    n = 0;
+    for (i = 0; i < NbPatchedRanges; i++) {
+        if (PatchedRanges[i].start - delta < limit) {
+            n++;
+        }
+    }
+    if (originalsize > OutputFileSize) {
+        n++;
+    }
+
+    fwrite(UNDO_MAGIC, 1, 8, file);
+    WriteFileLong(file, UNDO_VERSION);
+    memset(desc, 0, sizeof(desc));
+    strncpy(desc, PATCHDESC, sizeof(desc) - 1);
+    fwrite(desc, 1, sizeof(desc), file);
+    HashFile(output, OutputFileSize, digest);
+    fwrite(digest, 1, 16, file);
+    HashFile(input, originalsize, digest);
+    fwrite(digest, 1, 16, file);
+    WriteFileLong(file, OutputFileSize);
+    WriteFileLong(file, originalsize);
+    WriteFileLong(file, n);
+
+    for (i = 0; i <= NbPatchedRanges; i++) {
+        if (i < NbPatchedRanges) {
+            start = PatchedRanges[i].start - delta;
+            end = PatchedRanges[i].end - delta;
+            if (start >= limit) {
+                continue;
+            }
+            if (end > limit) {
+                end = limit;
+            }
+        }
+        else if (originalsize > OutputFileSize) {
+            start = OutputFileSize;
+            end = originalsize;
+        }
+        else {
+            break;
+        }
+        WriteFileLong(file, start);
+        WriteFileLong(file, end - start);
+        fseek(input, start, SEEK_SET);
+        for (j = start; j < end; j++) {
+            fputc(fgetc(input), file);
+        }
+    }
+    n = ftell(file);
+    fclose(file);
+
+    printf("\n\tINFO: wrote a %" PRIu32 "-byte undo journal to '%s'.\n", n, filename);
+    return 0;
+}
+
+//! Rebuild the original of a patched file from its undo journal, into dest. The patched file and the result are
+//  checked against the hashes of the journal.
+static int RevertFile (const char *patchedname, const char *undoname, FILE *dest) {
+    FILE *file;
+    MD5Context md5;
+    uint8_t *journal = NULL, *image = NULL;
+    uint8_t digest[16];
+    long journalsize, patchedsize;
+    uint32_t originalsize, n, pos, offset, length, i;
+    int ret = 1;
+
+    if ((file = fopen(undoname, "rb")) == NULL) {
+        printf("    ERROR : file '%s' not found.\n", undoname);
+        return 2;
+    }
+    fseek(file, 0, SEEK_END);
+    journalsize = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (journalsize >= UNDO_HEADER_SIZE && (journal = (uint8_t *)malloc(journalsize)) != NULL) {
+        journalsize = fread(journal, 1, journalsize, file);
+    }
+    fclose(file);
+    if (   journal == NULL || journalsize < UNDO_HEADER_SIZE || !SameBytes(journal, (const uint8_t *)UNDO_MAGIC, 8)
+        || BufferLong(journal + 8) != UNDO_VERSION) {
+        printf("    ERROR : '%s' is not an undo journal.\n", undoname);
+        free(journal);
+        return 3;
+    }
+    printf("    Undoing the changes of %.32s...\n", (const char *)journal + 12);
+
+    if ((file = fopen(patchedname, "rb")) == NULL) {
+        printf("    ERROR : file '%s' not found.\n", patchedname);
+        free(journal);
+        return 2;
+    }
+    fseek(file, 0, SEEK_END);
+    patchedsize = ftell(file);
+    originalsize = BufferLong(journal + 80);
+    if ((uint32_t)patchedsize != BufferLong(journal + 76)) {
+        printf("    ERROR : '%s' is not the file patched along with '%s'.\n", patchedname, undoname);
+        goto End;
+    }
+    HashFile(file, (uint32_t)patchedsize, digest);
+    if (!SameBytes(digest, journal + 44, 16)) {
+        printf("    ERROR : '%s' is not the file patched along with '%s'.\n", patchedname, undoname);
+        goto End;
+    }
+    image = (uint8_t *)malloc(((uint32_t)patchedsize > originalsize) ? (uint32_t)patchedsize : originalsize);
+    if (image == NULL) {
+        printf("\n    ERROR : not enough memory.\n");
+        goto End;
+    }
+    fseek(file, 0, SEEK_SET);
+    if (fread(image, 1, patchedsize, file) != (size_t)patchedsize) {
+        printf("    ERROR : can't read '%s'.\n", patchedname);
+        goto End;
+    }
+
+    n = BufferLong(journal + 84);
+    pos = UNDO_HEADER_SIZE;
+    for (i = 0; i < n; i++) {
+        if (pos + 8 > (uint32_t)journalsize) {
+            break;
+        }
+        offset = BufferLong(journal + pos);
+        length = BufferLong(journal + pos + 4);
+        pos += 8;
+        if (length > (uint32_t)journalsize - pos || offset > originalsize || length > originalsize - offset) {
+            break;
+        }
+        memcpy(image + offset, journal + pos, length);
+        pos += length;
+    }
+    if (i != n) {
+        printf("    ERROR : '%s' is truncated or corrupt.\n", undoname);
+        goto End;
+    }
+
+    MD5Init(&md5);
+    MD5Update(&md5, image, originalsize);
+    MD5Final(&md5, digest);
+    if (!SameBytes(digest, journal + 60, 16)) {
+        printf("    ERROR : the result does not match the original file recorded in '%s'.\n", undoname);
+        goto End;
+    }
+    if (fwrite(image, 1, originalsize, dest) != originalsize) {
+        printf("    ERROR : can't write the original file.\n");
+        goto End;
+    }
+    fflush(dest);
+    printf("\tINFO: restored %" PRIu32 " extents, the original file is %" PRIu32 " bytes long.\n", n, originalsize);
+    ret = 0;
+
+End:
+    fclose(file);
+    free(image);
+    free(journal);
+    return ret;
+}
+
+//! Restore the original of a patched file into a new file.
+static int RevertAMSFile (char *patchedname, char *undoname, char *outname) {
+    FILE *dest;
+    int ret;
+
+    if ((dest = fopen(outname, "rb")) != NULL) {
+        printf("\n    ERROR : file '%s' already exists. Refusing to overwrite it.", outname);
+        fclose(dest);
+        return 7;
+    }
+    if ((dest = fopen(outname, "wb")) == NULL) {
+        printf("\n    ERROR : can't create '%s'.\n", outname);
+        return 8;
+    }
+    ret = RevertFile(patchedname, undoname, dest);
+    fclose(dest);
+    if (ret) {
+        remove(outname);
+    }
+    return ret;
+}
+
+
+//! Get the size of the Flash memory of the calculator, which starts at ROM_base.
+static uint32_t FlashSize (void) {
+    return (CalculatorType == TI89T || CalculatorType == V200) ? UINT32_C(0x400000) : UINT32_C(0x200000);
+}
+
+//! Write a flat image of the Flash memory for emulators: the patched basecode, its checksum and signature at
+//  ROM_base + 0x12000, erased Flash (0xFF) everywhere else, except for a boot sector stub. TI's boot code is not part
+//  of OS upgrades: the stub only holds the initial SSP and PC, taken from the vectors of the basecode, so that
+//  emulators which do not provide boot code of their own can start the OS.
+static int WriteROMImage (const char *filename) {
+    FILE *file;
+    uint32_t size = FlashSize();
+    uint32_t end = BasecodeEnd() - ROM_base;
+    uint32_t addr;
+    int c;
+
+    if ((file = fopen(filename, "rb")) != NULL) {
+        printf("\n    ERROR : file '%s' already exists. Refusing to overwrite it.", filename);
+        fclose(file);
+        return 7;
+    }
+    if ((file = fopen(filename, "wb")) == NULL) {
+        printf("\n    ERROR : can't create '%s'.\n", filename);
+        return 8;
+    }
+    for (addr = 0; addr < 8; addr++) {
+        fseek(output, HEAD + 0x88 + addr, SEEK_SET);
+        fputc(fgetc(output), file);
+    }
+    for (; addr < UINT32_C(0x12000); addr++) {
+        fputc(0xFF, file);
+    }
+    fseek(output, HEAD, SEEK_SET);
+    for (; addr < end && (c = fgetc(output)) != EOF; addr++) {
+        fputc(c, file);
+    }
+    for (; addr < size; addr++) {
+        fputc(0xFF, file);
+    }
+    fclose(file);
+
+    printf("\n\tINFO: wrote a %" PRIu32 " KB ROM image for calculator type %" PRIu8 " to '%s'.\n", size >> 10, CalculatorType, filename);
+    return 0;
+}
+
+
+//! Finish the output file: checksum, signature, side outputs, size and undo journal. Return 0 on success. On a failure
+//  to sign, the output file is deleted; on a failure to write the ROM image, the output file is kept, since it is
+//  complete, but the error is returned.
+static int FinishAMS(void) {
+    MD5Context md5;
+    uint32_t temp, temp2;
+    int ret = 0;
+
+    temp = FreeROMSpaceLeft(&temp2);
+    printf("\n\tINFO: %" PRIu32 " bytes of free ROM space left (largest block: %" PRIu32 " bytes).\n", temp, temp2);
 
-    // Update basecode checksum.
-    temp = ComputeAMSChecksum(BasecodeSize - SizeShrunk, ROM_base + UINT32_C(0x12000));
+    // Update basecode checksum, hashing the basecode in the same pass when signing.
+    MD5Init(&md5);
+    temp = ComputeAMSChecksum(BasecodeSize - SizeShrunk, ROM_base + UINT32_C(0x12000), (SignKeyFileName != NULL) ? &md5 : NULL);
     printf("\n\tINFO: new basecode checksum is %08" PRIX32 ".\n", temp);
     PutLong(temp, BasecodeSize - SizeShrunk + ROM_base + UINT32_C(0x12000));
 
+    if (SignKeyFileName != NULL) {
+        if (SignAMS(&md5, SignKeyFileName)) {
+            // An unsigned OS would be rejected by the calculator, or mistaken for a signed one.
+            printf("\n    ERROR : signing failed, deleting '%s'.\n", OutputFileName);
+            fclose(output);
+            remove(OutputFileName);
+            return 1;
+        }
+    }
+
+    if (MapFileName != NULL) {
+        WriteSymbolMap(MapFileName);
+    }
+
+    if (ROMFileName != NULL) {
+        ret = WriteROMImage(ROMFileName);
+    }
+
     printf ("\n    Fix successful.\n");
 
     OutputFileSize -= SizeShrunk;
@@ -536,6 +2642,11 @@ static void FinishAMS(void) {
         PutLong(temp, ROM_base + UINT32_C(0x12000) - 4); // Slightly dirty.
     }
 
+    if (UndoFileName != NULL) {
+        WriteUndoJournal(UndoFileName);
+        fclose(input);
+    }
+
     // Truncate file if necessary.
     if (SizeShrunk != 0) {
         int fd;
@@ -553,11 +2664,28 @@ static void FinishAMS(void) {
         else {
             printf("ERROR truncating file, OS will probably be invalid\n");
         }
-        fclose(output);
     }
+    fclose(output);
+
+    // Check the undo journal on the final file: RevertFile compares the result with the hash of the input file.
+    if (UndoFileName != NULL) {
+        FILE *temp3 = tmpfile();
+        printf("\n    Checking the undo journal...\n");
+        if (temp3 == NULL || RevertFile(OutputFileName, UndoFileName, temp3) != 0) {
+            printf("\n    ERROR : '%s' does not revert '%s', don't rely on it.\n", UndoFileName, OutputFileName);
+        }
+        if (temp3 != NULL) {
+            fclose(temp3);
+        }
+    }
+    return ret;
 }
 
 
+// The compiler and interpreter of patch scripts.
+#include "patchvm.c"
+
+
 //! Where all the fun begins...
 int main (int argc, char *argv[])
 {
@@ -565,11 +2693,76 @@ int main (int argc, char *argv[])
 
     printf ("\n- TIOS Modder v0.2.7 by Lionel Debroux & RANDY Compton (portions from TI-68k Flash Apps Installer v0.3 by Olivier Armand & Lionel Debroux) -\n");
     printf ("- Using patchset: " PATCHDESC "\n\n");
+    if ((argc >= 3) && (!strcmp(argv[1], "--analyze"))) {
+        int ret = 0;
+        for (i = 2; i < argc; i++) {
+            if (AnalyzeAMSFile(argv[i])) {
+                ret = 1;
+            }
+            printf("\n");
+        }
+        return ret;
+    }
+    if ((argc >= 3) && (!strcmp(argv[1], "--sections"))) {
+        int ret = 0;
+        for (i = 2; i < argc; i++) {
+            if (ListTIFLSections(argv[i])) {
+                ret = 1;
+            }
+        }
+        return ret;
+    }
+    if ((argc == 3 || argc == 4) && (!strcmp(argv[1], "--z80-pages"))) {
+        return ListZ80Pages(argv[2], (argc == 4) ? argv[3] : NULL);
+    }
+    if ((argc >= 3) && (!strcmp(argv[1], "--identify"))) {
+        // For batch jobs, which will usually pass a single file: the largest class or error code of the files.
+        int ret = 0, temp;
+        for (i = 2; i < argc; i++) {
+            temp = IdentifyAMSFile(argv[i]);
+            if (temp > ret) {
+                ret = temp;
+            }
+            printf("\n");
+        }
+        return ret;
+    }
+    if ((argc == 5) && (!strcmp(argv[1], "--revert"))) {
+        return RevertAMSFile(argv[2], argv[3], argv[4]);
+    }
+    if ((argc == 4) && (!strcmp(argv[1], "--compile-script"))) {
+        return CompileScriptFile(argv[2], argv[3]);
+    }
+    if ((argc == 3 || argc == 4) && (!strcmp(argv[1], "--decode-ram"))) {
+        return DecodeRAMFile(argv[2], (argc == 4) ? argv[3] : NULL);
+    }
     if ((argc < 3) || (!strcmp(argv[1], "-h")) || (!strcmp(argv[1], "--help"))) {
         printf ("    Usage : tiosmod [+/-options] base.xxu patched_base.xxu\n"
+                "            tiosmod --analyze base.xxu [base2.xxu...]\n"
+                "            tiosmod --identify base.xxu [base2.xxu...]\n"
+                "            tiosmod --sections file.xxu|file.89k [file2...]\n"
+                "            tiosmod --z80-pages file.8xu [copy.8xu]\n"
+                "            tiosmod [+/-options] [--map out.sym] [--sign key] [--undo out.undo]\n"
+                "                    [--rom out.rom] [--script patch.tps ...] base.xxu patched_base.xxu\n"
+                "            tiosmod [+/-options] [...] --repatch old.undo old_patched.xxu patched_base.xxu\n"
+                "            tiosmod --revert patched_base.xxu patched_base.undo base.xxu\n"
+                "            tiosmod --compile-script patch.tps patch.tpb\n"
+                "            tiosmod --decode-ram ram.bin [map.sym]\n"
                 "    options: * " AMS_HARDCODE_FONTS_STR " (defaults to enabled)\n"
                 "             * " AMS_HARDCODE_ENGLISH_LANGUAGE_STR " (defaults to disabled)\n"
+                "             * " AMS_FAST_XR_STRINGPTR_STR " (defaults to disabled)\n"
                 "             * " AMS_REVERT_ZERO_POWER_ZERO_STR " (defaults to disabled)\n"
+                "             * " AMS_REWRITE_INLINE_HEAPDEREF_STR " (defaults to disabled)\n"
+                "             * " AMS_PRESHIFT_FONTS_STR " (defaults to disabled)\n"
+                "             * " AMS_FAST_MEMORY_ROUTINES_STR " (defaults to disabled)\n"
+                "             * " AMS_FAST_GRAPHICS_STR " (defaults to disabled)\n"
+                "             * " AMS_FAST_ESTACK_TRAVERSAL_STR " (defaults to disabled)\n"
+                "             * " AMS_FAST_FRAME_LOOKUP_STR " (defaults to disabled)\n"
+                "             * " AMS_FAST_SYMFIND_STR " (defaults to disabled)\n"
+                "             * " AMS_FAST_BLOCK_MOVES_STR " (defaults to disabled)\n"
+                "             * " AMS_FAST_BOOT_STR " (defaults to disabled)\n"
+                "             * " AMS_PROFILE_STR " (defaults to disabled)\n"
+                "             * " AMS_COUNT_CALLS_STR " (defaults to disabled)\n"
                 "    (prefix name option with '+' to force enable it, with '-' to force disable it)\n"
                );
         return 1;
@@ -587,7 +2780,37 @@ int main (int argc, char *argv[])
 
     // Adjust the list of enabled changes according to the program's parameters.
     for (i = 1; i < argc - 2; i++) {
-        if (!strcmp(argv[i]+1, AMS_HARDCODE_FONTS_STR)) {
+        if (!strcmp(argv[i], "--map")) {
+            if (i + 1 < argc - 2) {
+                MapFileName = argv[++i];
+            }
+        }
+        else if (!strcmp(argv[i], "--sign")) {
+            if (i + 1 < argc - 2) {
+                SignKeyFileName = argv[++i];
+            }
+        }
+        else if (!strcmp(argv[i], "--rom")) {
+            if (i + 1 < argc - 2) {
+                ROMFileName = argv[++i];
+            }
+        }
+        else if (!strcmp(argv[i], "--script")) {
+            if (i + 1 < argc - 2 && NbScripts < MAX_SCRIPTS) {
+                ScriptFileNames[NbScripts++] = argv[++i];
+            }
+        }
+        else if (!strcmp(argv[i], "--undo")) {
+            if (i + 1 < argc - 2) {
+                UndoFileName = argv[++i];
+            }
+        }
+        else if (!strcmp(argv[i], "--repatch")) {
+            if (i + 1 < argc - 2) {
+                RepatchFileName = argv[++i];
+            }
+        }
+        else if (!strcmp(argv[i]+1, AMS_HARDCODE_FONTS_STR)) {
             if (argv[i][0] == '-') {
                 enabled_changes &= ~AMS_HARDCODE_FONTS_FLAG;
             }
@@ -597,11 +2820,94 @@ int main (int argc, char *argv[])
                 enabled_changes |= AMS_HARDCODE_ENGLISH_LANGUAGE_FLAG;
             }
         }
+        else if (!strcmp(argv[i]+1, AMS_FAST_XR_STRINGPTR_STR)) {
+            if (argv[i][0] == '+') {
+                enabled_changes |= AMS_FAST_XR_STRINGPTR_FLAG;
+            }
+        }
         else if (!strcmp(argv[i]+1, AMS_REVERT_ZERO_POWER_ZERO_STR)) {
             if (argv[i][0] == '+') {
                 enabled_changes |= AMS_REVERT_ZERO_POWER_ZERO_FLAG;
             }
         }
+        else if (!strcmp(argv[i]+1, AMS_REWRITE_INLINE_HEAPDEREF_STR)) {
+            if (argv[i][0] == '+') {
+                enabled_changes |= AMS_REWRITE_INLINE_HEAPDEREF_FLAG;
+            }
+        }
+        else if (!strcmp(argv[i]+1, AMS_PRESHIFT_FONTS_STR)) {
+            if (argv[i][0] == '+') {
+                enabled_changes |= AMS_PRESHIFT_FONTS_FLAG;
+            }
+        }
+        else if (!strcmp(argv[i]+1, AMS_FAST_MEMORY_ROUTINES_STR)) {
+            if (argv[i][0] == '+') {
+                enabled_changes |= AMS_FAST_MEMORY_ROUTINES_FLAG;
+            }
+        }
+        else if (!strcmp(argv[i]+1, AMS_FAST_GRAPHICS_STR)) {
+            if (argv[i][0] == '+') {
+                enabled_changes |= AMS_FAST_GRAPHICS_FLAG;
+            }
+        }
+        else if (!strcmp(argv[i]+1, AMS_FAST_ESTACK_TRAVERSAL_STR)) {
+            if (argv[i][0] == '+') {
+                enabled_changes |= AMS_FAST_ESTACK_TRAVERSAL_FLAG;
+            }
+        }
+        else if (!strcmp(argv[i]+1, AMS_FAST_FRAME_LOOKUP_STR)) {
+            if (argv[i][0] == '+') {
+                enabled_changes |= AMS_FAST_FRAME_LOOKUP_FLAG;
+            }
+        }
+        else if (!strcmp(argv[i]+1, AMS_FAST_SYMFIND_STR)) {
+            if (argv[i][0] == '+') {
+                enabled_changes |= AMS_FAST_SYMFIND_FLAG;
+            }
+        }
+        else if (!strcmp(argv[i]+1, AMS_FAST_BLOCK_MOVES_STR)) {
+            if (argv[i][0] == '+') {
+                enabled_changes |= AMS_FAST_BLOCK_MOVES_FLAG;
+            }
+        }
+        else if (!strcmp(argv[i]+1, AMS_FAST_BOOT_STR)) {
+            if (argv[i][0] == '+') {
+                enabled_changes |= AMS_FAST_BOOT_FLAG;
+            }
+        }
+        else if (!strcmp(argv[i]+1, AMS_PROFILE_STR)) {
+            if (argv[i][0] == '+') {
+                enabled_changes |= AMS_PROFILE_FLAG;
+            }
+        }
+        else if (!strcmp(argv[i]+1, AMS_COUNT_CALLS_STR)) {
+            if (argv[i][0] == '+') {
+                enabled_changes |= AMS_COUNT_CALLS_FLAG;
+            }
+        }
+    }
+
+
+    // Start from the original of an image patched by an earlier patchset, rebuilt from its undo journal.
+    if (RepatchFileName != NULL) {
+        fclose(input);
+        if ((input = tmpfile()) == NULL) {
+            printf("\n    ERROR : can't create a temporary file.\n");
+            return 8;
+        }
+        i = RevertFile(argv[argc - 2], RepatchFileName, input);
+        if (i) {
+            fclose(input);
+            return i;
+        }
+        fseek(input, 0, SEEK_SET);
+    }
+
+
+    // Compile the patch scripts before touching the output file.
+    i = LoadScripts();
+    if (i) {
+        return i;
     }
 
 
@@ -615,9 +2921,18 @@ int main (int argc, char *argv[])
     // Fiddle with AMS :-)
     PatchAMS();
 
+    if (NbScripts != 0) {
+        i = RunScripts();
+        if (i) {
+            // Some writes may not have been staged, and the checksum is stale: don't leave a broken OS behind.
+            printf("\n    ERROR : the patch scripts failed, deleting '%s'.\n", OutputFileName);
+            fclose(output);
+            remove(OutputFileName);
+            return i;
+        }
+    }
+
 
     // Cleanup and return.
-    FinishAMS();
-
-    return 0;
+    return FinishAMS();
 }